@@ -2,7 +2,7 @@
 
 namespace mongo {
 
-    const char * curNs = "in client mode";
+    MONGO_TLS const char * curNs = "in client mode";
     //    Database* database = 0;
 
     void dbexit(int returnCode, const char *whyMsg ) {
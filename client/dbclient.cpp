@@ -501,13 +501,18 @@ namespace mongo {
         say( toSend );
     }
 
-    void DBClientBase::update( const string & ns , Query query , BSONObj obj , bool upsert ) {
+    void DBClientBase::update( const string & ns , Query query , BSONObj obj , bool upsert , bool multi ) {
 
         BufBuilder b;
         b.append( (int)0 ); // reserverd
         b.append( ns );
 
-        b.append( (int)upsert );
+        int flags = 0;
+        if ( upsert )
+            flags |= 1;
+        if ( multi )
+            flags |= 2;
+        b.append( flags );
 
         query.obj.appendSelfToBufBuilder( b );
         obj.appendSelfToBufBuilder( b );
@@ -518,10 +523,12 @@ namespace mongo {
         say( toSend );
     }
 
-    bool DBClientBase::ensureIndex( const string &ns , BSONObj keys , const string & name ) {
+    bool DBClientBase::ensureIndex( const string &ns , BSONObj keys , const string & name , bool background ) {
         BSONObjBuilder toSave;
         toSave.append( "ns" , ns );
         toSave.append( "key" , keys );
+        if ( background )
+            toSave.appendBool( "background" , true );
 
         string cacheKey(ns);
         cacheKey += "--";
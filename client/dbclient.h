@@ -150,6 +150,12 @@ namespace mongo {
 		/** if true, safe to call next() */
         bool more();
 
+        /** true if next() will return an object we already have, without asking the server
+            for more.  objects from the same reply stay valid until more() fetches another. */
+        bool moreInCurrentBatch() const {
+            return pos < nReturned;
+        }
+
         /** next
 		   @return next object in the result cursor.
            on an error at the remote server, you will get back:
@@ -254,7 +260,7 @@ namespace mongo {
 
         virtual void remove( const string &ns , Query query, bool justOne = 0 ) = 0;
 
-        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 ) = 0;
+        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 , bool multi = 0 ) = 0;
 
         virtual ~DBClientInterface() { }
     };
@@ -530,18 +536,22 @@ namespace mongo {
         
         /**
            updates objects matching query
+           @param multi update every matching object rather than just the first.  obj must
+             consist of $ modifiers.  getLastError's "n" reports how many were updated.
          */
-        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 );
+        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 , bool multi = 0 );
 
         /** Create an index if it does not already exist.
             ensureIndex calls are remembered so it is safe/fast to call this function many 
             times in your code.
            @param name if not isn't specified, it will be created from the keys (recommended)
            @param keys the "key pattern" for the index.  e.g., { name : 1 }
+           @param background build the index without holding the database lock for the whole
+             build.  the index is not used by queries until it is complete.
            @return whether or not sent message to db.
              should be true on first call, false on subsequent unless resetIndexCache was called
          */
-        virtual bool ensureIndex( const string &ns , BSONObj keys , const string &name = "" );
+        virtual bool ensureIndex( const string &ns , BSONObj keys , const string &name = "" , bool background = false );
 
         /**
            clears the index cache, so the subsequent call to ensureIndex for any index will go to the server
@@ -714,8 +724,8 @@ namespace mongo {
         }
 
         /** update */
-        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 ) {
-            return checkMaster().update(ns, query, obj, upsert);
+        virtual void update( const string &ns , Query query , BSONObj obj , bool upsert = 0 , bool multi = 0 ) {
+            return checkMaster().update(ns, query, obj, upsert, multi);
         }
         
         string toString();
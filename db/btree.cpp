@@ -21,6 +21,7 @@
 #include "pdfile.h"
 #include "../util/unittest.h"
 #include "json.h"
+#include <cmath>
 
 namespace mongo {
 
@@ -31,6 +32,11 @@ namespace mongo {
             recordLoc(k.recordLoc), key(bb.data+k.keyDataOfs())
     { }
 
+    KeyNode::KeyNode(const _KeyNode &k, const BSONObj &_key) :
+            prevChildBucket(k.prevChildBucket),
+            recordLoc(k.recordLoc), key(_key)
+    { }
+
     const int KeyMax = BucketSize / 10;
 
     extern int otherTraceLevel;
@@ -120,7 +126,7 @@ namespace mongo {
             for ( int i = 0; i < n-1; i++ ) {
                 BSONObj k1 = keyNode(i).key;
                 BSONObj k2 = keyNode(i+1).key;
-                int z = k1.woCompare(k2, order); //OK
+                int z = keyCompare(k1, k2, order); //OK
                 if ( z > 0 ) {
                     out() << "ERROR: btree key order corrupt.  Keys:" << endl;
                     if ( ++nDumped < 5 ) {
@@ -147,7 +153,7 @@ namespace mongo {
             if ( n > 1 ) {
                 BSONObj k1 = keyNode(0).key;
                 BSONObj k2 = keyNode(n-1).key;
-                int z = k1.woCompare(k2, order);
+                int z = keyCompare(k1, k2, order);
                 //wassert( z <= 0 );
                 if ( z > 0 ) {
                     problem() << "btree keys out of order" << '\n';
@@ -194,6 +200,26 @@ namespace mongo {
     void BucketBasics::_delKeyAtPos(int keypos) {
         assert( keypos >= 0 && keypos <= n );
         assert( childForPos(keypos).isNull() );
+        if ( compressed() ) {
+            /* the keys after keypos were encoded against it, so re-encode the bucket.  that
+               can come out larger (restart points move); if so just leave the key unused. */
+            vector<BSONObj> keys;
+            decodeKeys(keys);
+            keys.erase(keys.begin() + keypos);
+            char temp[BucketSize];
+            vector<short> ofs;
+            int top = layoutCompressedKeys(keys, temp, ofs);
+            if ( top < 0 ) {
+                markUnused(keypos);
+                return;
+            }
+            n--;
+            assert( n > 0 || nextChild.isNull() );
+            for ( int j = keypos; j < n; j++ )
+                k(j) = k(j+1);
+            installCompressedKeys(temp, top, ofs);
+            return;
+        }
         n--;
         assert( n > 0 || nextChild.isNull() );
         for ( int j = keypos; j < n; j++ )
@@ -202,24 +228,193 @@ namespace mongo {
         setNotPacked();
     }
 
+    inline void BucketBasics::_unalloc(int bytes) {
+        topSize -= bytes;
+        emptySize += bytes;
+    }
+
+    /* compressed buckets -- see the format notes in btree.h */
+
+    /* buf holds the previous key; turns it into the one h describes.  returns its size. */
+    static inline int applyKeyDelta(char *buf, const CompressedKeyHeader *h) {
+        const char *lit = (const char *) (h + 1);
+        char *body = buf + 4;
+        memcpy(body + h->prefixLen, lit, h->gapLen);
+        memcpy(body + h->prefixLen + h->gapLen + h->matchLen, lit + h->gapLen, h->suffixLen);
+        int size = 4 + h->prefixLen + h->gapLen + h->matchLen + h->suffixLen;
+        *((int *) buf) = size;
+        return size;
+    }
+
+    BSONObj BucketBasics::decodeKey(int i) const {
+        int r = i - i % RestartInterval;
+        const char *full = data + k(r).keyDataOfs();
+        if ( r == i )
+            return BSONObj(full);
+
+        char buf[BucketSize];
+        int size = *((const int *) full);
+        memcpy(buf, full, size);
+        for ( int j = r + 1; j <= i; j++ )
+            size = applyKeyDelta(buf, (const CompressedKeyHeader *) (data + k(j).keyDataOfs()));
+        char *p = (char *) malloc(size);
+        memcpy(p, buf, size);
+        return BSONObj(p, true);
+    }
+
+    void BucketBasics::decodeKeys(vector<BSONObj>& keys) const {
+        keys.clear();
+        keys.reserve(n + 1);
+        char buf[BucketSize];
+        for ( int i = 0; i < n; i++ ) {
+            const char *p = data + k(i).keyDataOfs();
+            if ( i % RestartInterval == 0 ) {
+                keys.push_back(BSONObj(p));
+                memcpy(buf, p, *((const int *) p));
+                continue;
+            }
+            int size = applyKeyDelta(buf, (const CompressedKeyHeader *) p);
+            char *o = (char *) malloc(size);
+            memcpy(o, buf, size);
+            keys.push_back(BSONObj(o, true));
+        }
+    }
+
+    int BucketBasics::storedKeySize(int i) const {
+        const char *p = data + k(i).keyDataOfs();
+        if ( i % RestartInterval == 0 )
+            return *((const int *) p);
+        const CompressedKeyHeader *h = (const CompressedKeyHeader *) p;
+        return sizeof(CompressedKeyHeader) + h->gapLen + h->suffixLen;
+    }
+
+    /* store key in a compressed bucket, prev being the key before it.  returns the number of
+       bytes needed; nothing is written if dest is 0. */
+    static int encodeKey(char *dest, bool restart, const BSONObj& key, const BSONObj& prev) {
+        if ( restart ) {
+            if ( dest )
+                memcpy(dest, key.objdata(), key.objsize());
+            return key.objsize();
+        }
+        const char *a = key.objdata() + 4;
+        const char *b = prev.objdata() + 4;
+        int la = key.objsize() - 4;
+        int lim = min(la, prev.objsize() - 4);
+        int p = 0;
+        while ( p < lim && a[p] == b[p] )
+            p++;
+        /* the gap that saves the most */
+        int gap = 0, match = 0;
+        for ( int g = 1; g <= CompressedKeyHeader::MaxGap && p + g < lim; g++ ) {
+            int m = 0;
+            while ( p + g + m < lim && m < 0xffff && a[p+g+m] == b[p+g+m] )
+                m++;
+            if ( m - g > match - gap ) {
+                gap = g;
+                match = m;
+            }
+        }
+        int suffix = la - p - gap - match;
+        if ( dest ) {
+            CompressedKeyHeader *h = (CompressedKeyHeader *) dest;
+            h->prefixLen = (unsigned short) p;
+            h->gapLen = (unsigned char) gap;
+            h->matchLen = (unsigned short) match;
+            h->suffixLen = (unsigned short) suffix;
+            char *lit = dest + sizeof(CompressedKeyHeader);
+            memcpy(lit, a + p, gap);
+            memcpy(lit + gap, a + p + gap + match, suffix);
+        }
+        return sizeof(CompressedKeyHeader) + gap + suffix;
+    }
+
+    int BucketBasics::layoutCompressedKeys(const vector<BSONObj>& keys, char *temp, vector<short>& ofs) const {
+        int top = totalDataSize();
+        int nodes = keys.size() * sizeof(_KeyNode);
+        ofs.resize(keys.size());
+        for ( unsigned i = 0; i < keys.size(); i++ ) {
+            const BSONObj& prev = i ? keys[i-1] : keys[i];
+            top -= encodeKey(0, i % RestartInterval == 0, keys[i], prev);
+            if ( top < nodes )
+                return -1;
+            encodeKey(temp + top, i % RestartInterval == 0, keys[i], prev);
+            ofs[i] = (short) top;
+        }
+        return top;
+    }
+
+    void BucketBasics::installCompressedKeys(const char *temp, int top, const vector<short>& ofs) {
+        assert( (int) ofs.size() == n );
+        int tdz = totalDataSize();
+        memcpy(data + top, temp + top, tdz - top);
+        for ( int i = 0; i < n; i++ )
+            k(i).setKeyDataOfsSavingUse(ofs[i]);
+        topSize = tdz - top;
+        emptySize = top - n * sizeof(_KeyNode);
+        assert( emptySize >= 0 );
+        setPacked();
+    }
+
     /* add a key.  must be > all existing.  be careful to set next ptr right. */
-    void BucketBasics::pushBack(const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order, DiskLoc prevChild) {
-        int bytesNeeded = key.objsize() + sizeof(_KeyNode);
-        assert( bytesNeeded <= emptySize );
-        assert( n == 0 || keyNode(n-1).key.woCompare(key, order) <= 0 );
+    bool BucketBasics::_pushBack(const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order, DiskLoc prevChild) {
+        BSONObj prev = n ? keyNode(n-1).key : BSONObj();
+        int sz = compressed() ? encodeKey(0, n % RestartInterval == 0, key, prev) : key.objsize();
+        int bytesNeeded = sz + sizeof(_KeyNode);
+        if ( bytesNeeded > emptySize )
+            return false;
+        assert( n == 0 || keyCompare(prev, key, order) <= 0 );
         emptySize -= sizeof(_KeyNode);
-        _KeyNode& kn = k(n++);
+        int i = n++;
+        _KeyNode& kn = k(i);
         kn.prevChildBucket = prevChild;
         kn.recordLoc = recordLoc;
-        kn.setKeyDataOfs( (short) _alloc(key.objsize()) );
+        kn.setKeyDataOfs( (short) _alloc(sz) );
         char *p = dataAt(kn.keyDataOfs());
-        memcpy(p, key.objdata(), key.objsize());
+        if ( compressed() )
+            encodeKey(p, i % RestartInterval == 0, key, prev);
+        else
+            memcpy(p, key.objdata(), key.objsize());
+        return true;
+    }
+
+    /* only for a bucket filled by pushBack(): the last key's data is then the last allocated */
+    void BucketBasics::popBack(DiskLoc& recLoc, BSONObj& key) {
+        massert( "n==0 in btree popBack()", n > 0 );
+        massert( "rchild not null in btree popBack()", nextChild.isNull() );
+        KeyNode kn = keyNode(n-1);
+        recLoc = kn.recordLoc;
+        key = kn.key;
+        nextChild = kn.prevChildBucket;
+        int sz = compressed() ? storedKeySize(n-1) : key.objsize();
+        n--;
+        emptySize += sizeof(_KeyNode);
+        _unalloc(sz);
     }
 
     /* insert a key in a bucket with no complexity -- no splits required */
     bool BucketBasics::basicInsert(const DiskLoc& thisLoc, int keypos, const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order) {
         modified(thisLoc);
         assert( keypos >= 0 && keypos <= n );
+        if ( compressed() ) {
+            if ( keypos == n ) // common when inserting in ascending order
+                return _pushBack(recordLoc, key, order, DiskLoc());
+            vector<BSONObj> keys;
+            decodeKeys(keys);
+            keys.insert(keys.begin() + keypos, key);
+            char temp[BucketSize];
+            vector<short> ofs;
+            int top = layoutCompressedKeys(keys, temp, ofs);
+            if ( top < 0 )
+                return false;
+            for ( int j = n; j > keypos; j-- ) // make room
+                k(j) = k(j-1);
+            n++;
+            _KeyNode& kn = k(keypos);
+            kn.prevChildBucket.Null();
+            kn.recordLoc = recordLoc;
+            installCompressedKeys(temp, top, ofs);
+            return true;
+        }
         int bytesNeeded = key.objsize() + sizeof(_KeyNode);
         if ( bytesNeeded > emptySize ) {
             pack( order );
@@ -246,6 +441,18 @@ namespace mongo {
         if ( flags & Packed )
             return;
 
+        if ( compressed() ) {
+            vector<BSONObj> keys;
+            decodeKeys(keys);
+            char temp[BucketSize];
+            vector<short> ofs;
+            int top = layoutCompressedKeys(keys, temp, ofs);
+            assert( top >= 0 );
+            installCompressedKeys(temp, top, ofs);
+            assertValid( order );
+            return;
+        }
+
         int tdz = totalDataSize();
         char temp[BucketSize];
         int ofs = tdz;
@@ -298,7 +505,7 @@ namespace mongo {
     bool BtreeBucket::exists(const IndexDetails& idx, DiskLoc thisLoc, BSONObj& key, BSONObj order) { 
         int pos;
         bool found;
-        DiskLoc b = locate(idx, thisLoc, key, order, pos, found, minDiskLoc);
+        DiskLoc b = _locate(idx, thisLoc, key, order, pos, found, minDiskLoc);
 
         // skip unused keys
         while ( 1 ) {
@@ -306,8 +513,11 @@ namespace mongo {
                 break;
             BtreeBucket *bucket = b.btree();
             _KeyNode& kn = bucket->k(pos);
-            if ( kn.isUsed() )
+            if ( kn.isUsed() ) {
+                if ( bucket->normalized() ) // 3 and 3.0 are equal, though stored differently
+                    return NormalizedKey::compare(bucket->keyAt(pos), key) == 0;
                 return bucket->keyAt(pos).woEqual(key);
+            }
             b = bucket->advance(b, pos, 1, "BtreeBucket::exists");
         }
         return false;
@@ -328,6 +538,8 @@ namespace mongo {
     */
 	char foo;
     bool BtreeBucket::find(const IndexDetails& idx, BSONObj& key, DiskLoc recordLoc, const BSONObj &order, int& pos, bool assertIfDup) {
+        if ( compressed() )
+            return findCompressed(idx, key, recordLoc, order, pos, assertIfDup);
 #if defined(_EXPERIMENT1)
 		{
 			char *z = (char *) this;
@@ -346,29 +558,7 @@ namespace mongo {
         int h=n-1;
         while ( l <= h ) {
             int m = (l+h)/2;
-            KeyNode M = keyNode(m);
-            int x = key.woCompare(M.key, order);
-            if ( x == 0 ) { 
-                if( assertIfDup ) {
-                    if( k(m).isUnused() ) { 
-                        // ok that key is there if unused.  but we need to check that there aren't other 
-                        // entries for the key then.  as it is very rare that we get here, we don't put any 
-                        // coding effort in here to make this particularly fast
-                        if( !dupsChecked ) { 
-                            dupsChecked = true;
-                            if( idx.head.btree()->exists(idx, idx.head, key, order) )
-                                uasserted("E11000 duplicate key error");
-                        }
-                    }
-                    else
-                        uasserted("E11000 duplicate key error");
-                }
-
-                // dup keys allowed.  use recordLoc as if it is part of the key
-                DiskLoc unusedRL = M.recordLoc;
-                unusedRL.GETOFS() &= ~1; // so we can test equality without the used bit messing us up
-                x = recordLoc.compare(unusedRL);
-            }
+            int x = keyCmp(idx, key, recordLoc, order, m, keyNode(m).key, assertIfDup, dupsChecked);
             if ( x < 0 ) // key < M.key
                 h = m-1;
             else if ( x > 0 )
@@ -383,12 +573,86 @@ namespace mongo {
         pos = l;
         if ( pos != n ) {
             BSONObj keyatpos = keyNode(pos).key;
-            wassert( key.woCompare(keyatpos, order) <= 0 );
+            wassert( keyCompare(key, keyatpos, order) <= 0 );
             if ( pos > 0 ) {
-                wassert( keyNode(pos-1).key.woCompare(key, order) <= 0 );
+                wassert( keyCompare(keyNode(pos-1).key, key, order) <= 0 );
+            }
+        }
+
+        return false;
+    }
+
+    int BtreeBucket::keyCmp(const IndexDetails& idx, BSONObj& key, const DiskLoc& recordLoc, const BSONObj &order,
+                            int m, const BSONObj& mKey, bool assertIfDup, bool& dupsChecked) {
+        int x = keyCompare(key, mKey, order);
+        if ( x == 0 ) { 
+            if( assertIfDup ) {
+                if( k(m).isUnused() ) { 
+                    // ok that key is there if unused.  but we need to check that there aren't other 
+                    // entries for the key then.  as it is very rare that we get here, we don't put any 
+                    // coding effort in here to make this particularly fast
+                    if( !dupsChecked ) { 
+                        dupsChecked = true;
+                        if( idx.head.btree()->exists(idx, idx.head, key, order) )
+                            uasserted("E11000 duplicate key error");
+                    }
+                }
+                else
+                    uasserted("E11000 duplicate key error");
+            }
+
+            // dup keys allowed.  use recordLoc as if it is part of the key
+            DiskLoc unusedRL = k(m).recordLoc;
+            unusedRL.GETOFS() &= ~1; // so we can test equality without the used bit messing us up
+            x = recordLoc.compare(unusedRL);
+        }
+        return x;
+    }
+
+    /* find() for a compressed bucket: binary search the restart keys, which need no decoding,
+       then walk forward through that block decoding as we go. */
+    bool BtreeBucket::findCompressed(const IndexDetails& idx, BSONObj& key, DiskLoc recordLoc, const BSONObj &order, int& pos, bool assertIfDup) {
+        bool dupsChecked = false;
+        int l = 0;
+        int h = (n + RestartInterval - 1) / RestartInterval - 1;
+        int block = -1; // last restart key <= key
+        while ( l <= h ) {
+            int m = (l+h)/2;
+            int r = m * RestartInterval;
+            int x = keyCmp(idx, key, recordLoc, order, r, BSONObj(data + k(r).keyDataOfs()), assertIfDup, dupsChecked);
+            if ( x < 0 )
+                h = m-1;
+            else if ( x > 0 ) {
+                block = r;
+                l = m+1;
             }
+            else {
+                pos = r;
+                return true;
+            }
+        }
+        if ( block < 0 ) {
+            pos = 0;
+            return false;
         }
 
+        char buf[BucketSize];
+        const char *restart = data + k(block).keyDataOfs();
+        memcpy(buf, restart, *((const int *) restart));
+        int end = min(n, block + RestartInterval);
+        for ( int i = block + 1; i < end; i++ ) {
+            applyKeyDelta(buf, (const CompressedKeyHeader *) (data + k(i).keyDataOfs()));
+            int x = keyCmp(idx, key, recordLoc, order, i, BSONObj(buf), assertIfDup, dupsChecked);
+            if ( x == 0 ) {
+                pos = i;
+                return true;
+            }
+            if ( x < 0 ) {
+                pos = i;
+                return false;
+            }
+        }
+        pos = end;
         return false;
     }
 
@@ -467,9 +731,11 @@ found:
             return false;
         }
 
+        BSONObj order = id.keyPattern();
+        BSONObj k = storedKey(key, order);
         int pos;
         bool found;
-        DiskLoc loc = locate(id, thisLoc, key, id.keyPattern(), pos, found, recordLoc, 1);
+        DiskLoc loc = _locate(id, thisLoc, k, order, pos, found, recordLoc, 1);
         if ( found ) {
             loc.btree()->delKeyAtPos(loc, id, pos);
             return true;
@@ -477,6 +743,17 @@ found:
         return false;
     }
 
+    bool BtreeBucket::hasKey(const IndexDetails& idx, const DiskLoc& thisLoc, BSONObj& key, const DiskLoc& recordLoc) {
+        if ( key.objsize() > KeyMax )
+            return false;
+        BSONObj order = idx.keyPattern();
+        BSONObj k = storedKey(key, order);
+        int pos;
+        bool found;
+        DiskLoc loc = _locate(idx, thisLoc, k, order, pos, found, recordLoc, 1);
+        return found && loc.btree()->k(pos).isUsed();
+    }
+
     BtreeBucket* BtreeBucket::allocTemp() {
         BtreeBucket *b = (BtreeBucket*) malloc(BucketSize);
         b->init();
@@ -571,6 +848,7 @@ found:
         int mid = n / 2;
 
         BtreeBucket *r = allocTemp();
+        r->setFormat(*this);
         DiskLoc rLoc;
 
         if ( split_debug )
@@ -600,10 +878,11 @@ found:
             if ( parent.isNull() ) {
                 // make a new parent if we were the root
                 BtreeBucket *p = allocTemp();
+                p->setFormat(*this);
                 p->pushBack(middle.recordLoc, middle.key, order, thisLoc);
                 p->nextChild = rLoc;
                 p->assertValid( order );
-                parent = idx.head = btreeStore->insert(idx.indexNamespace().c_str(), p, p->Size(), true);
+                parent = *writing(&idx.head) = btreeStore->insert(idx.indexNamespace().c_str(), p, p->Size(), true);
                 if ( split_debug )
                     out() << "    we were root, making new root:" << hex << parent.getOfs() << dec << endl;
                 free(p);
@@ -639,14 +918,22 @@ found:
             out() << "     split end " << hex << thisLoc.getOfs() << dec << endl;
     }
 
-    /* start a new index off, empty */
-    DiskLoc BtreeBucket::addHead(IndexDetails& id) {
+    DiskLoc BtreeBucket::addBucket(IndexDetails& id) {
         BtreeBucket *p = allocTemp();
+        if ( id.version() >= 1 )
+            p->setCompressed();
+        if ( id.normalizedKeys() )
+            p->setNormalized();
         DiskLoc loc = btreeStore->insert(id.indexNamespace().c_str(), p, p->Size(), true);
         free(p);
         return loc;
     }
 
+    /* start a new index off, empty */
+    DiskLoc BtreeBucket::addHead(IndexDetails& id) {
+        return addBucket(id);
+    }
+
     DiskLoc BtreeBucket::getHead(const DiskLoc& thisLoc) {
         DiskLoc p = thisLoc;
         while ( !p.btree()->isHead() )
@@ -704,6 +991,11 @@ found:
     }
 
     DiskLoc BtreeBucket::locate(const IndexDetails& idx, const DiskLoc& thisLoc, BSONObj& key, const BSONObj &order, int& pos, bool& found, DiskLoc recordLoc, int direction) {
+        BSONObj k = storedKey(key, order);
+        return _locate(idx, thisLoc, k, order, pos, found, recordLoc, direction);
+    }
+
+    DiskLoc BtreeBucket::_locate(const IndexDetails& idx, const DiskLoc& thisLoc, BSONObj& key, const BSONObj &order, int& pos, bool& found, DiskLoc recordLoc, int direction) {
         int p;
         found = find(idx, key, recordLoc, order, p, /*assertIfDup*/ false);
         if ( found ) {
@@ -714,7 +1006,7 @@ found:
         DiskLoc child = childForPos(p);
 
         if ( !child.isNull() ) {
-            DiskLoc l = child.btree()->locate(idx, child, key, order, pos, found, recordLoc, direction);
+            DiskLoc l = child.btree()->_locate(idx, child, key, order, pos, found, recordLoc, direction);
             if ( !l.isNull() )
                 return l;
         }
@@ -796,14 +1088,22 @@ found:
                             BSONObj& key, const BSONObj &order, bool dupsAllowed,
                             IndexDetails& idx, bool toplevel)
     {
+        BSONObj k = key;
         if ( toplevel ) {
             if ( key.objsize() > KeyMax ) {
                 problem() << "Btree::insert: key too large to index, skipping " << idx.indexNamespace().c_str() << ' ' << key.toString() << '\n';
                 return 3;
             }
+            if ( normalized() ) {
+                k = NormalizedKey::encode(key, order);
+                if ( k.objsize() > KeyMax ) {
+                    problem() << "Btree::insert: normalized key too large to index, skipping " << idx.indexNamespace().c_str() << ' ' << key.toString() << '\n';
+                    return 3;
+                }
+            }
         }
 
-        int x = _insert(thisLoc, recordLoc, key, order, dupsAllowed, DiskLoc(), DiskLoc(), idx);
+        int x = _insert(thisLoc, recordLoc, k, order, dupsAllowed, DiskLoc(), DiskLoc(), idx);
         assertValid( order );
 
         return x;
@@ -813,6 +1113,64 @@ found:
         _shape(0, ss);
     }
 
+    bool BtreeBucket::sampleKeys(const DiskLoc& thisLoc, const BSONObj& order, unsigned max,
+                                 vector<BSONObj>& keys, long long& nKeys) {
+        vector<DiskLoc> level(1, thisLoc);
+        long long nRead = 0, nBuckets = 0;
+        int levels = 0;
+        while ( 1 ) {
+            long long n = 0;
+            for ( unsigned i = 0; i < level.size(); i++ )
+                n += level[i].btree()->n;
+            if ( levels > 0 && nRead + n > max )
+                break;
+            nRead += n;
+            nBuckets += level.size();
+            levels++;
+            vector<DiskLoc> next;
+            for ( unsigned i = 0; i < level.size(); i++ ) {
+                BtreeBucket *b = level[i].btree();
+                for ( int j = 0; j <= b->n; j++ ) {
+                    DiskLoc c = b->childForPos(j);
+                    if ( !c.isNull() )
+                        next.push_back(c);
+                }
+            }
+            level.swap(next);
+            if ( level.empty() )
+                break;
+        }
+
+        _sampleKeys(levels, order, keys);
+        if ( level.empty() ) {
+            nKeys = keys.size();
+            return true;
+        }
+
+        /* each subtree below is taken to be as deep as its leftmost path, with buckets as
+           full as the ones read: f children apiece gives f^depth - 1 keys. */
+        int depth = 0;
+        for ( DiskLoc c = level[0]; !c.isNull(); c = c.btree()->childForPos(0) )
+            depth++;
+        double fanout = double( nRead + nBuckets ) / nBuckets;
+        nKeys = nRead + (long long) ( level.size() * ( pow( fanout, depth ) - 1 ) );
+        return false;
+    }
+
+    void BtreeBucket::_sampleKeys(int levels, const BSONObj& order, vector<BSONObj>& keys) {
+        for ( int i = 0; i <= n; i++ ) {
+            if ( levels > 1 ) {
+                DiskLoc c = childForPos(i);
+                if ( !c.isNull() )
+                    c.btree()->_sampleKeys(levels - 1, order, keys);
+            }
+            if ( i < n && k(i).isUsed() ) {
+                BSONObj key = keyNode(i).key;
+                keys.push_back( normalized() ? NormalizedKey::decode(key, order) : key.getOwned() );
+            }
+        }
+    }
+
 } // namespace mongo
 
 #include "db.h"
@@ -877,4 +1235,108 @@ namespace mongo {
         BtreeBucket::a_test( nsdetails("test.foo")->indexes[0] );
     }
 
+    /* - BtreeBuilder --------------------------------------------------- */
+
+    /* while building, buckets at the same level are chained through their parent pointer;
+       buildNextLevel() sets the real parents. */
+    static DiskLoc& tempNext(BtreeBucket *b) {
+        return b->parent;
+    }
+
+    BtreeBuilder::BtreeBuilder(bool _dupsAllowed, IndexDetails& _idx) :
+        dupsAllowed(_dupsAllowed), idx(_idx), n(0), order( idx.keyPattern() ), committed(false) {
+        first = cur = idx.head;
+        b = cur.btreemod();
+        assert( b->n == 0 && b->isHead() );
+    }
+
+    void BtreeBuilder::newBucket() {
+        DiskLoc L = BtreeBucket::addBucket(idx);
+        tempNext(b) = L;
+        cur = L;
+        b = cur.btreemod();
+    }
+
+    void BtreeBuilder::addKey(BSONObj& _key, DiskLoc loc) {
+        BSONObj key = b->storedKey(_key, order);
+        if ( key.objsize() > KeyMax ) {
+            problem() << "ERROR: key too large len:" << key.objsize() << " max:" << KeyMax << ' ' << idx.indexNamespace() << endl;
+            return;
+        }
+
+        if ( !dupsAllowed ) {
+            if ( n > 0 ) {
+                int cmp = b->keyCompare(keyLast, key, order);
+                massert( "bad key order in BtreeBuilder", cmp <= 0 );
+                if ( cmp == 0 )
+                    uasserted("E11000 duplicate key error");
+            }
+            keyLast = key;
+        }
+
+        if ( !b->_pushBack(loc, key, order, DiskLoc()) ) {
+            // bucket is full
+            newBucket();
+            b->pushBack(loc, key, order, DiskLoc());
+        }
+        n++;
+    }
+
+    void BtreeBuilder::buildNextLevel(DiskLoc loc) {
+        int levels = 1;
+        while ( 1 ) {
+            if ( tempNext(loc.btree()).isNull() ) {
+                // only 1 bucket at this level.  we are done.
+                *writing(&idx.head) = loc;
+                break;
+            }
+            levels++;
+
+            DiskLoc upLoc = BtreeBucket::addBucket(idx);
+            DiskLoc upStart = upLoc;
+            BtreeBucket *up = upLoc.btreemod();
+
+            DiskLoc xloc = loc;
+            while ( !xloc.isNull() ) {
+                BtreeBucket *x = xloc.btreemod();
+                BSONObj k;
+                DiskLoc r;
+                x->popBack(r, k);
+                bool keepX = ( x->n != 0 );
+                DiskLoc keepLoc = keepX ? xloc : x->nextChild;
+
+                if ( !up->_pushBack(r, k, order, keepLoc) ) {
+                    // current bucket full
+                    DiskLoc L = BtreeBucket::addBucket(idx);
+                    tempNext(up) = L;
+                    upLoc = L;
+                    up = upLoc.btreemod();
+                    up->pushBack(r, k, order, keepLoc);
+                }
+
+                DiskLoc nextLoc = tempNext(x); // get next in chain at current level
+                if ( keepX ) {
+                    x->parent = upLoc;
+                }
+                else {
+                    if ( !x->nextChild.isNull() )
+                        x->nextChild.btreemod()->parent = upLoc;
+                    /* as in delBucket(), we zap the bucket rather than reuse it */
+                    memset((void *) x, 0, BucketSize);
+                }
+                xloc = nextLoc;
+            }
+
+            loc = upStart;
+        }
+        if ( levels > 1 )
+            log(2) << "btree levels: " << levels << endl;
+    }
+
+    void BtreeBuilder::commit() {
+        assert( !committed );
+        buildNextLevel(first);
+        committed = true;
+    }
+
 }
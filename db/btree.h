@@ -21,6 +21,7 @@
 #include "../stdafx.h"
 #include "jsobj.h"
 #include "storage.h"
+#include "normkey.h"
 #include "pdfile.h"
 
 namespace mongo {
@@ -69,6 +70,7 @@ namespace mongo {
     class KeyNode {
     public:
         KeyNode(const BucketBasics& bb, const _KeyNode &k);
+        KeyNode(const _KeyNode &k, const BSONObj &_key);
         const DiskLoc& prevChildBucket;
         const DiskLoc& recordLoc;
         BSONObj key;
@@ -76,9 +78,35 @@ namespace mongo {
 
 #pragma pack(1)
 
-    /* this class is all about the storage management */
+    /* this class is all about the storage management
+
+       Buckets of a version 1 index ({v:1} in the index spec) are prefix compressed, and have
+       the Compressed flag set.  Key i is stored as:
+         i % RestartInterval == 0: the plain BSON key, so that binary search over these
+                                   "restart" keys needs no decoding.
+         otherwise:                CompressedKeyHeader followed by gapLen + suffixLen bytes.
+                                   Relative to key i-1 (both without the 4 byte BSON size),
+                                   the key is: prefixLen bytes of key i-1, then gapLen bytes
+                                   from the record, then the next matchLen bytes of key i-1
+                                   (at the same offsets), then suffixLen bytes from the record.
+       The gap is there for the length word of string values: similar strings of different
+       lengths differ in a byte or two right before their common prefix.
+       A key is thus decoded from the nearest restart key at or before it, which is at most
+       RestartInterval-1 steps.  Inserting or removing a key other than at the end changes
+       how its neighbors (and the keys that shift across a restart boundary) are stored, so
+       those rewrite all the keys of the bucket.
+    */
+    struct CompressedKeyHeader {
+        enum { MaxGap = 8 };
+        unsigned short prefixLen;
+        unsigned char gapLen;
+        unsigned short matchLen;
+        unsigned short suffixLen;
+    };
+
     class BucketBasics {
         friend class KeyNode;
+        friend class BtreeBuilder;
     public:
         void dumpTree(DiskLoc thisLoc, const BSONObj &order);
         bool isHead() { return parent.isNull(); }
@@ -92,9 +120,40 @@ namespace mongo {
         }
         KeyNode keyNode(int i) const {
             assert( i < n );
+            if ( compressed() )
+                return KeyNode(k(i), decodeKey(i));
             return KeyNode(*this, k(i));
         }
 
+        enum { RestartInterval = 16 };
+        bool compressed() const { return ( flags & Compressed ) != 0; }
+        void setCompressed() { flags |= Compressed; }
+
+        /* keys are stored as NormalizedKeys rather than BSON.  the btree works on them as
+           stored; they are converted where keys come in (bt_insert, unindex, locate...) and
+           where a BtreeCursor hands them out. */
+        bool normalized() const { return ( flags & Normalized ) != 0; }
+        void setNormalized() { flags |= Normalized; }
+        int keyCompare(const BSONObj& l, const BSONObj& r, const BSONObj& order) const {
+            return normalized() ? NormalizedKey::compare(l, r) : l.woCompare(r, order);
+        }
+        /* a new bucket for the same index as b */
+        void setFormat(const BucketBasics& b) { flags |= b.flags & ( Compressed | Normalized ); }
+        /* key i of a compressed bucket.  restart keys point into the bucket, others are
+           decoded into a new buffer. */
+        BSONObj decodeKey(int i) const;
+        /* all keys of a compressed bucket, in order */
+        void decodeKeys(vector<BSONObj>& keys) const;
+        /* bytes key i takes in the data area of a compressed bucket */
+        int storedKeySize(int i) const;
+        /* lays keys out for a compressed bucket, key 0 at the top, in temp (which mirrors our
+           data area).  returns the start of the lowest key, or -1 if they don't fit along
+           with keys.size() _KeyNodes. */
+        int layoutCompressedKeys(const vector<BSONObj>& keys, char *temp, vector<short>& ofs) const;
+        /* copies what layoutCompressedKeys() produced into the bucket.  the _KeyNodes must
+           already be in place. */
+        void installCompressedKeys(const char *temp, int top, const vector<short>& ofs);
+
         char * dataAt(short ofs) {
             return data + ofs;
         }
@@ -105,14 +164,22 @@ namespace mongo {
            keypos is where to insert -- inserted after that key #.  so keypos=0 is the leftmost one.
         */
         bool basicInsert(const DiskLoc& thisLoc, int keypos, const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order);
-        void pushBack(const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order, DiskLoc prevChild);
+        /* returns false if there is no room */
+        bool _pushBack(const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order, DiskLoc prevChild);
+        void pushBack(const DiskLoc& recordLoc, BSONObj& key, const BSONObj &order, DiskLoc prevChild) {
+            bool ok = _pushBack( recordLoc , key , order , prevChild );
+            assert(ok);
+        }
+        /* remove the last key.  its left child becomes nextChild.  key points into our data
+           buffer, which is left as is. */
+        void popBack(DiskLoc& recLoc, BSONObj& key);
         void _delKeyAtPos(int keypos); // low level version that doesn't deal with child ptrs.
 
         /* !Packed means there is deleted fragment space within the bucket.
            We "repack" when we run out of space before considering the node
            to be full.
            */
-        enum Flags { Packed=1 };
+        enum Flags { Packed=1, Compressed=2, Normalized=4 };
 
         DiskLoc childForPos(int p) {
             return p == n ? nextChild : k(p).prevChildBucket;
@@ -123,6 +190,7 @@ namespace mongo {
         void setNotPacked();
         void setPacked();
         int _alloc(int bytes);
+        void _unalloc(int bytes);
         void truncateTo(int N, const BSONObj &order);
         void markUnused(int keypos);
     public:
@@ -163,9 +231,11 @@ namespace mongo {
     public:
         void dump();
 
+        /* key as stored, see storedKey() */
         bool exists(const IndexDetails& idx, DiskLoc thisLoc, BSONObj& key, BSONObj order);
 
         static DiskLoc addHead(IndexDetails&); /* start a new index off, empty */
+        static DiskLoc addBucket(IndexDetails&); /* a new, empty bucket */
 
         int bt_insert(DiskLoc thisLoc, DiskLoc recordLoc,
                    BSONObj& key, const BSONObj &order, bool dupsAllowed,
@@ -173,6 +243,9 @@ namespace mongo {
 
         bool unindex(const DiskLoc& thisLoc, IndexDetails& id, BSONObj& key, const DiskLoc& recordLoc);
 
+        /* true if key:recordLoc is in the index (and in use, not just a marker) */
+        bool hasKey(const IndexDetails& idx, const DiskLoc& thisLoc, BSONObj& key, const DiskLoc& recordLoc);
+
         /* locate may return an "unused" key that is just a marker.  so be careful.
              looks for a key:recordloc pair.
         */
@@ -186,6 +259,18 @@ namespace mongo {
         /* get tree shape */
         void shape(stringstream&);
 
+        /* the keys, in order and decoded, of the levels nearest the root: as many whole levels
+           as have at most max keys between them (at least the root).  nKeys is set to the number
+           of keys in the tree -- counted if the levels read reach the leaves, in which case
+           true is returned, otherwise extrapolated from the shape of the levels read. */
+        bool sampleKeys(const DiskLoc& thisLoc, const BSONObj& order, unsigned max,
+                        vector<BSONObj>& keys, long long& nKeys);
+
+        /* key in the form this index stores it.  order is the key pattern. */
+        BSONObj storedKey(const BSONObj& key, const BSONObj& order) const {
+            return normalized() ? NormalizedKey::encode(key, order) : key;
+        }
+
         static void a_test(IndexDetails&);
     private:
         void fixParentPtrs(const DiskLoc& thisLoc);
@@ -194,6 +279,9 @@ namespace mongo {
         BSONObj keyAt(int keyOfs) {
             return keyOfs >= n ? BSONObj() : keyNode(keyOfs).key;
         }
+        /* locate() for a key as stored */
+        DiskLoc _locate(const IndexDetails& , const DiskLoc& thisLoc, BSONObj& key, const BSONObj &order,
+                        int& pos, bool& found, DiskLoc recordLoc, int direction=1);
         static BtreeBucket* allocTemp(); /* caller must release with free() */
         void insertHere(DiskLoc thisLoc, int keypos,
                         DiskLoc recordLoc, BSONObj& key, const BSONObj &order,
@@ -202,7 +290,46 @@ namespace mongo {
                     BSONObj& key, const BSONObj &order, bool dupsAllowed,
                     DiskLoc lChild, DiskLoc rChild, IndexDetails&);
         bool find(const IndexDetails& idx, BSONObj& key, DiskLoc recordLoc, const BSONObj &order, int& pos, bool assertIfDup);
+        bool findCompressed(const IndexDetails& idx, BSONObj& key, DiskLoc recordLoc, const BSONObj &order, int& pos, bool assertIfDup);
+        /* compares key:recordLoc to key m of this bucket, which is mKey.  see find() */
+        int keyCmp(const IndexDetails& idx, BSONObj& key, const DiskLoc& recordLoc, const BSONObj &order,
+                   int m, const BSONObj& mKey, bool assertIfDup, bool& dupsChecked);
         static void findLargestKey(const DiskLoc& thisLoc, DiskLoc& largestLoc, int& largestKey);
+        void _sampleKeys(int levels, const BSONObj& order, vector<BSONObj>& keys);
+    };
+
+    /* builds a btree bottom up from keys added in ascending (key, recordLoc) order -- for
+       building an index over existing data (see addExistingToIndex()).  Leaf buckets are
+       filled completely, left to right, then each level above is made of the last key of
+       every bucket below it.  Compared to bt_insert()ing every key there are no splits, and
+       buckets end up full rather than half full.
+    */
+    class BtreeBuilder : boost::noncopyable {
+    public:
+        /* idx.head must be an empty bucket, which becomes our first leaf */
+        BtreeBuilder(bool dupsAllowed, IndexDetails& idx);
+
+        /* keys must be added in order.  uasserts on a duplicate key if !dupsAllowed */
+        void addKey(BSONObj& key, DiskLoc loc);
+
+        /* builds the upper levels and sets idx.head.  call once, after all keys are added */
+        void commit();
+
+        unsigned long long getn() const { return n; }
+
+    private:
+        void newBucket();
+        void buildNextLevel(DiskLoc);
+
+        bool dupsAllowed;
+        IndexDetails& idx;
+        unsigned long long n;
+        BSONObj keyLast;
+        BSONObj order;
+        DiskLoc first;
+        DiskLoc cur;
+        BtreeBucket *b;
+        bool committed;
     };
 
     class BtreeCursor : public Cursor {
@@ -211,6 +338,9 @@ namespace mongo {
         BSONObj endKey;
     public:
         BtreeCursor( const IndexDetails&, const BSONObj &startKey, const BSONObj &endKey, int direction );
+        /* scans each ( startKey, endKey ) range of bounds in turn, jumping over the keys
+           in between with a fresh locate(). */
+        BtreeCursor( const IndexDetails&, const BoundList &bounds, int direction );
         virtual bool ok() {
             return !bucket.isNull();
         }
@@ -233,13 +363,20 @@ namespace mongo {
             return bucket.btree()->keyNode(keyOfs);
         }
         virtual BSONObj currKey() const {
-            return currKeyNode().key;
+            assert( !bucket.isNull() );
+            BtreeBucket *b = bucket.btree();
+            BSONObj k = b->keyNode(keyOfs).key;
+            return b->normalized() ? NormalizedKey::decode(k, order) : k;
         }
 
         virtual BSONObj indexKeyPattern() {
             return indexDetails.keyPattern();
         }
 
+        const IndexDetails& getIndexDetails() const {
+            return indexDetails;
+        }
+
         virtual void aboutToDeleteBucket(const DiskLoc& b) {
             if ( bucket == b )
                 keyOfs = -1;
@@ -260,6 +397,7 @@ namespace mongo {
         virtual string toString() {
             string s = string("BtreeCursor ") + indexDetails.indexName();
             if ( direction < 0 ) s += " reverse";
+            if ( bounds_.size() > 1 ) s += " multi";
             return s;
         }
 
@@ -271,12 +409,18 @@ namespace mongo {
         }
         
     private:
+        void init();
+
+        /* Position at the start of bounds_[ boundIndex_ ]. */
+        void startBound();
+
         /* Our btrees may (rarely) have "unused" keys when items are deleted.
            Skip past them.
         */
         void skipUnusedKeys();
 
-        /* Check if the current key is beyond endKey. */
+        /* Check if the current key is beyond the end of the current range, moving on to
+           the next range if there is one. */
         void checkEnd();
 
         const IndexDetails& indexDetails;
@@ -284,8 +428,11 @@ namespace mongo {
         DiskLoc bucket;
         int keyOfs;
         int direction; // 1=fwd,-1=reverse
+        BSONObj storedEndKey; // end of the current range, as the index stores keys
         BSONObj keyAtKeyOfs; // so we can tell if things moved around on us between the query and the getMore call
         DiskLoc locAtKeyOfs;
+        BoundList bounds_;
+        unsigned boundIndex_; // range of bounds_ being scanned
     };
 
 #pragma pack()
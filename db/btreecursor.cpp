@@ -33,8 +33,25 @@ namespace mongo {
     endKey( _endKey ),
     indexDetails( _id ),
     order( _id.keyPattern() ),
-    direction( _direction ) {
-        bool found;
+    direction( _direction ),
+    boundIndex_( 0 ) {
+        bounds_.push_back( make_pair( startKey, endKey ) );
+        init();
+    }
+
+    BtreeCursor::BtreeCursor( const IndexDetails &_id, const BoundList &_bounds, int _direction ) :
+    startKey( _bounds.front().first ),
+    endKey( _bounds.back().second ),
+    indexDetails( _id ),
+    order( _id.keyPattern() ),
+    direction( _direction ),
+    bounds_( _bounds ),
+    boundIndex_( 0 ) {
+        init();
+    }
+
+    void BtreeCursor::init() {
+        assert( !bounds_.empty() );
         if ( otherTraceLevel >= 12 ) {
             if ( otherTraceLevel >= 200 ) {
                 out() << "::BtreeCursor() qtl>200.  validating entire index." << endl;
@@ -46,13 +63,20 @@ namespace mongo {
             }
         }
 
-        bucket = indexDetails.head.btree()->
-        locate(indexDetails, indexDetails.head, startKey, order, keyOfs, found, direction > 0 ? minDiskLoc : maxDiskLoc, direction);
+        startBound();
         
         skipUnusedKeys();
         
         checkEnd();         
     }
+
+    void BtreeCursor::startBound() {
+        bool found;
+        BSONObj start = bounds_[ boundIndex_ ].first;
+        storedEndKey = indexDetails.head.btree()->storedKey(bounds_[ boundIndex_ ].second, order);
+        bucket = indexDetails.head.btree()->
+        locate(indexDetails, indexDetails.head, start, order, keyOfs, found, direction > 0 ? minDiskLoc : maxDiskLoc, direction);
+    }
     
     /* skip unused keys. */
     void BtreeCursor::skipUnusedKeys() {
@@ -78,13 +102,28 @@ namespace mongo {
         return i > 0 ? 1 : -1;
     }
 
-    // Check if the current key is beyond endKey.
+    // Check if the current key is beyond the end of the current range.  If so, move on to
+    // the next range: often the current key already falls inside it (the ranges were close
+    // together), otherwise locate() its start rather than walking the keys in between.
     void BtreeCursor::checkEnd() {
-        if ( bucket.isNull() )
-            return;
-        int cmp = sgn( endKey.woCompare( currKey(), order ) );
-        if ( cmp != 0 && cmp != direction )
-            bucket = DiskLoc();
+        while ( !bucket.isNull() ) {
+            BtreeBucket *b = bucket.btree();
+            int cmp = sgn( b->keyCompare( storedEndKey, b->keyNode( keyOfs ).key, order ) );
+            if ( cmp == 0 || cmp == direction )
+                return;
+            if ( ++boundIndex_ >= bounds_.size() ) {
+                bucket = DiskLoc();
+                return;
+            }
+            BSONObj storedStartKey = b->storedKey( bounds_[ boundIndex_ ].first, order );
+            cmp = sgn( b->keyCompare( b->keyNode( keyOfs ).key, storedStartKey, order ) );
+            if ( cmp == 0 || cmp == direction ) {
+                storedEndKey = b->storedKey( bounds_[ boundIndex_ ].second, order );
+                continue;
+            }
+            startBound();
+            skipUnusedKeys();
+        }
     }
 
     bool BtreeCursor::advance() {
@@ -144,7 +183,7 @@ namespace mongo {
         bool found;
 
         /* TODO: Switch to keep indexdetails and do idx.head! */
-        bucket = indexDetails.head.btree()->locate(indexDetails, indexDetails.head, keyAtKeyOfs, order, keyOfs, found, locAtKeyOfs, direction);
+        bucket = indexDetails.head.btree()->_locate(indexDetails, indexDetails.head, keyAtKeyOfs, order, keyOfs, found, locAtKeyOfs, direction);
         RARELY log() << "  key seems to have moved in the index, refinding. found:" << found << endl;
         if ( found )
             skipUnusedKeys();
@@ -32,6 +32,8 @@
 namespace mongo {
 
     CCById clientCursorsById;
+    CCById savedCursorsById;
+    boost::mutex ClientCursor::ccmutex;
 
     /* ------------------------------------------- */
 
@@ -42,6 +44,11 @@ namespace mongo {
     }
 
     void ClientCursor::setLastLoc(DiskLoc L) {
+        boostlock lk(ccmutex);
+        _setLastLoc(L);
+    }
+
+    void ClientCursor::_setLastLoc(DiskLoc L) {
         if ( L == _lastLoc )
             return;
 
@@ -100,7 +107,7 @@ namespace mongo {
         if ( j == stop )
             return;
 
-        assert( dbMutexInfo.isLocked() );
+        assert( dbMutexInfo.haveWriteLock() );
         vector<ClientCursor*> toAdvance;
 
         while ( 1 ) {
@@ -135,10 +142,16 @@ namespace mongo {
         }
     }
 
+    ClientCursor::ClientCursor(bool saved) : pinned_(false), saved_(saved), cursorid( allocCursorId() ), pos(0) {
+        boostlock lk(ccmutex);
+        ( saved_ ? savedCursorsById : clientCursorsById ).insert( make_pair(cursorid, this) );
+    }
+
     ClientCursor::~ClientCursor() {
         assert( pos != -2 );
-        setLastLoc( DiskLoc() ); // removes us from bylocation multimap
-        clientCursorsById.erase(cursorid);
+        boostlock lk(ccmutex);
+        _setLastLoc( DiskLoc() ); // removes us from bylocation multimap
+        ( saved_ ? savedCursorsById : clientCursorsById ).erase(cursorid);
         // defensive:
         (CursorId&) cursorid = -1;
         pos = -2;
@@ -159,14 +172,43 @@ namespace mongo {
         c->noteLocation();
     }
 
+    MONGO_TLS int OpScope::depth_ = 0;
+
+    SavedCursor::~SavedCursor() {
+        if ( id_ )
+            delete ClientCursor::findSaved(id_);
+    }
+
+    void SavedCursor::save(const char *ns, auto_ptr<Cursor>& c) {
+        assert( id_ == 0 );
+        ClientCursor *cc = new ClientCursor(/*saved*/true);
+        cc->ns = ns;
+        cc->c = c;
+        cc->updateLocation();
+        id_ = cc->cursorid;
+    }
+
+    auto_ptr<Cursor> SavedCursor::restore() {
+        auto_ptr<Cursor> c;
+        ClientCursor *cc = ClientCursor::findSaved(id_);
+        id_ = 0;
+        if ( cc == 0 )
+            return c;
+        c = cc->c;
+        delete cc;
+        c->checkLocation();
+        return c;
+    }
+
     int ctmLast = 0; // so we don't have to do find() which is a little slow very often.
     long long ClientCursor::allocCursorId() {
+        boostlock lk(ccmutex);
         long long x;
         int ctm = (int) curTimeMillis();
         while ( 1 ) {
             x = (((long long)rand()) << 32);
             x = x | ctm | 0x80000000; // OR to make sure not zero
-            if ( ctm != ctmLast || ClientCursor::find(x, false) == 0 )
+            if ( ctm != ctmLast || ( clientCursorsById.count(x) == 0 && savedCursorsById.count(x) == 0 ) )
                 break;
         }
         ctmLast = ctm;
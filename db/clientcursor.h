@@ -33,14 +33,25 @@ namespace mongo {
     class ClientCursor;
     typedef map<CursorId, ClientCursor*> CCById;
     extern CCById clientCursorsById;
+    extern CCById savedCursorsById; // see SavedCursor
 
     class ClientCursor {
         DiskLoc _lastLoc; // use getter and setter not this.
+        bool pinned_; // see pin().  guarded by ccmutex
+        const bool saved_; // registered in savedCursorsById, not clientCursorsById
+        void _setLastLoc(DiskLoc);
         static CursorId allocCursorId();
     public:
-        ClientCursor() : cursorid( allocCursorId() ), pos(0) {
-            clientCursorsById.insert( make_pair(cursorid, this) );
-        }
+        /* guards clientCursorsById, savedCursorsById and the by location map.  queries and getMores running
+           concurrently under a shared dbMutex create, move and delete cursors.  the code
+           paths that invalidate cursors run with dbMutex held exclusively and do not take
+           this.
+        */
+        static boost::mutex ccmutex;
+
+        /* saved: held by a SavedCursor.  such a cursor is kept up to date by deletes and
+           drops like any other, but getMore, killCursors and usesWhere don't see it. */
+        ClientCursor(bool saved = false);
         ~ClientCursor();
         const CursorId cursorid;
         string ns;
@@ -51,7 +62,7 @@ namespace mongo {
             return _lastLoc;
         }
         void setLastLoc(DiskLoc);
-        auto_ptr< set<string> > filter; // which fields query wants returned
+        auto_ptr< FieldsToReturn > filter; // which fields query wants returned
         Message originalMessage; // this is effectively an auto ptr for data the matcher points to.
 
         /* Get rid of cursors for namespaces that begin with nsprefix.
@@ -68,7 +79,35 @@ namespace mongo {
             return false;
         }
 
+        /* find id and mark it in use until unpin().  getMore runs under a shared dbMutex, so
+           without this two getMores on one cursor could advance it at once, or one could
+           delete it while the other still has it.  a second user is refused. */
+        static ClientCursor* pin(CursorId id) {
+            boostlock lk(ccmutex);
+            CCById::iterator it = clientCursorsById.find(id);
+            if ( it == clientCursorsById.end() )
+                return 0;
+            ClientCursor *cc = it->second;
+            uassert( "cursor in use by another getMore", !cc->pinned_ );
+            cc->pinned_ = true;
+            return cc;
+        }
+        void unpin() {
+            boostlock lk(ccmutex);
+            pinned_ = false;
+        }
+
+        /* true if cursor id's matcher uses $where.  ok with dbMutex shared: the cursor can't be
+           deleted while we hold ccmutex. */
+        static bool usesWhere(CursorId id) {
+            boostlock lk(ccmutex);
+            CCById::iterator it = clientCursorsById.find(id);
+            return it != clientCursorsById.end() && it->second->matcher.get() &&
+                   it->second->matcher->hasWhere();
+        }
+
         static ClientCursor* find(CursorId id, bool warn = true) {
+            boostlock lk(ccmutex);
             CCById::iterator it = clientCursorsById.find(id);
             if ( it == clientCursorsById.end() ) {
                 if ( warn )
@@ -78,6 +117,12 @@ namespace mongo {
             return it->second;
         }
 
+        static ClientCursor* findSaved(CursorId id) {
+            boostlock lk(ccmutex);
+            CCById::iterator it = savedCursorsById.find(id);
+            return it == savedCursorsById.end() ? 0 : it->second;
+        }
+
         /* call when cursor's location changes so that we can update the
            cursorsbylocation map.  if you are locked and internally iterating, only
            need to call when you are ready to "unlock".
@@ -87,4 +132,60 @@ namespace mongo {
         void cleanupByLocation(DiskLoc loc);
     };
 
+    /* tells a long running operation when to yield dbMutex: every Hits calls to ping(), or
+       sooner once Micros have passed since the last yield.
+    */
+    class YieldTracker {
+    public:
+        enum { Hits = 1024, CheckTimeEvery = 16, Micros = 10000 };
+        YieldTracker() : n_(0) { }
+        bool ping() {
+            ++n_;
+            if ( n_ >= Hits || ( n_ % CheckTimeEvery == 0 && t_.micros() >= Micros ) ) {
+                reset();
+                return true;
+            }
+            return false;
+        }
+        void reset() {
+            n_ = 0;
+            t_.reset();
+        }
+    private:
+        int n_;
+        Timer t_;
+    };
+
+    /* marks an operation being run for a client.  only the outermost one may yield dbMutex:
+       one nested inside another -- run by eval, or through a DBDirectClient -- must not
+       release a lock its caller is counting on.
+    */
+    class OpScope : boost::noncopyable {
+    public:
+        OpScope() { depth_++; }
+        ~OpScope() { depth_--; }
+        /* true if the current thread is running a client's operation, not a nested one */
+        static bool mayYield() { return depth_ == 1; }
+    private:
+        static MONGO_TLS int depth_;
+    };
+
+    /* keeps a cursor registered as a (saved) ClientCursor while dbMutex is released, so that
+       deletes and drops made meanwhile are applied to it -- see aboutToDelete() and
+       invalidate().  clients can't reach it by id.
+    */
+    class SavedCursor : boost::noncopyable {
+    public:
+        SavedCursor() : id_(0) { }
+        ~SavedCursor();
+        /* takes ownership of c until restore() */
+        void save(const char *ns, auto_ptr<Cursor>& c);
+        /* returns the cursor at its saved position.  empty if the cursor was invalidated or
+           ran off the end of the collection while we were unlocked.
+        */
+        auto_ptr<Cursor> restore();
+    private:
+        CursorId id_;
+    };
+
 } // namespace mongo
@@ -32,6 +32,13 @@ namespace mongo {
         (*commands)[name] = this;
     }
 
+    Command* Command::findCommand(const string& name) {
+        map<string,Command*>::iterator i = commands->find(name);
+        if ( i == commands->end() )
+            return 0;
+        return i->second;
+    }
+
     void Command::help( stringstream& help ) const {
         help << "no help defined";
     }
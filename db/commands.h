@@ -72,8 +72,15 @@ namespace mongo {
         */
         virtual bool requiresAuth() { return true; }
 
+        /* Return true if the command never writes, so that it may run with dbMutex held in
+           shared mode, concurrently with queries.  See concurrency.h.
+        */
+        virtual bool readOnly() { return false; }
+
         Command(const char *_name);
         virtual ~Command() {}
+
+        static Command* findCommand(const string& name);
     };
 
     bool runCommandAgainstRegistered(const char *ns, BSONObj& jsobj, BSONObjBuilder& anObjBuilder);
@@ -1,15 +1,260 @@
 /* concurrency.h
 
    mongod concurrency rules & notes will be placed here.
+
+   dbMutex is a reader/writer lock.  Operations that modify data (inserts, updates, deletes,
+   commands, replication) take it exclusively via dblock.  Queries, getMores and counts
+   that we can tell up front will not write anything take it shared via readlock -- see
+   receivedReadOnly() in instance.cpp.  Lock and queue time are recorded in dbMutexInfo,
+   both in total and per database.
+
+   Database, curNs, the ClientCursor maps, NamespaceDetailsTransient and Top are all process
+   global today, so an exclusive hold is still exclusive across every database; the per
+   database numbers tell you which database is responsible for the time spent in the lock.
+
+   Per database write locks are not done: a writer still excludes every database.
+
+   Rules for code that may run under a shared lock:
+     - database and curNs are thread local.
+     - nothing on disk may be modified.  That includes opening a database or a namespace
+       index for the first time, profiling, and anything that calls logOp().
+     - ClientCursor::ccmutex guards clientCursorsById and the by location map.  Paths that
+       invalidate cursors (aboutToDelete, invalidate, ...) only run exclusively and so do
+       not take it.
+     - NamespaceDetailsTransient::qcMutex guards the transient map and the query plan cache.
+     - Database::getFile() serializes opening of data files.
+     - JavaScript ($where) is not thread safe, so queries using it run exclusively.
 */
 
 #pragma once
 
+#include <boost/thread/condition.hpp>
+#include <boost/thread/tss.hpp>
+
 namespace mongo {
 
-inline void requireInWriteLock() { 
-    assert( dbMutexInfo.isLocked() );
-}
+    /* reader/writer lock.  Writers have priority: once a writer is waiting, new readers
+       queue up behind it so that a stream of queries cannot starve an insert.
+
+       Built on boost::mutex and boost::condition as shared_mutex is not available in
+       all the boost versions we build against.
+    */
+    class RWLock : boost::noncopyable {
+        boost::mutex m_;
+        boost::condition canRead_;
+        boost::condition canWrite_;
+        int readers_;        // # of shared holders
+        int writersWaiting_;
+        bool writer_;        // held exclusively
+    public:
+        RWLock() : readers_(0), writersWaiting_(0), writer_(false) { }
+
+        void lock() {
+            boostlock lk(m_);
+            writersWaiting_++;
+            while ( writer_ || readers_ )
+                canWrite_.wait(lk);
+            writersWaiting_--;
+            writer_ = true;
+        }
+        void unlock() {
+            boostlock lk(m_);
+            assert( writer_ );
+            writer_ = false;
+            if ( writersWaiting_ )
+                canWrite_.notify_one();
+            else
+                canRead_.notify_all();
+        }
+        void lock_shared() {
+            boostlock lk(m_);
+            while ( writer_ || writersWaiting_ )
+                canRead_.wait(lk);
+            readers_++;
+        }
+        /* lock() / lock_shared() if that needn't wait; false otherwise */
+        bool try_lock() {
+            boostlock lk(m_);
+            if ( writer_ || readers_ || writersWaiting_ )
+                return false;
+            writer_ = true;
+            return true;
+        }
+        bool try_lock_shared() {
+            boostlock lk(m_);
+            if ( writer_ || writersWaiting_ )
+                return false;
+            readers_++;
+            return true;
+        }
+        void unlock_shared() {
+            boostlock lk(m_);
+            assert( readers_ > 0 );
+            if ( --readers_ == 0 && writersWaiting_ )
+                canWrite_.notify_one();
+        }
+
+        /* for diagnostics only -- the answer may be stale by the time you look at it */
+        int nReaders() const { return readers_; }
+        bool writeLocked() const { return writer_; }
+    };
+
+    /* lock / queue time accounting for dbMutex.  all times in microseconds.
+
+       timeLocked is wall time during which the lock was held in either mode.  Per database
+       numbers are charged per holder, so with concurrent readers their sum may exceed it.
+    */
+    class MutexInfo {
+    public:
+        struct DbStats {
+            DbStats() : timeLocked(0), timeQueued(0), nLocks(0) { }
+            unsigned long long timeLocked, timeQueued;
+            long long nLocks;
+        };
+
+    private:
+        /* what the current thread holds */
+        struct Holder {
+            Holder() : mode(0), since(0), queued(0), cur(0) { }
+            int mode;                 // 1 exclusive, -1 shared, 0 not held
+            unsigned long long since; // when we started charging cur
+            unsigned long long queued;// queue time, not yet charged to a database
+            DbStats *cur;             // database we are charging lock time to
+        };
+        boost::thread_specific_ptr<Holder> holder_;
+        Holder& holder() {
+            Holder *h = holder_.get();
+            if ( h == 0 ) {
+                h = new Holder();
+                holder_.reset(h);
+            }
+            return *h;
+        }
+
+        boost::mutex m_; // guards everything below
+        unsigned long long start, heldSince, timeLocked, timeQueued;
+        int locked;      // exclusive holders, 0 or 1
+        int readers;     // shared holders
+        map<string,DbStats> byDb_;
+
+        void charge(Holder& h, unsigned long long now) {
+            if ( h.cur == 0 )
+                return;
+            h.cur->timeLocked += now - h.since;
+            h.since = now;
+        }
+        void _entered(int mode, unsigned long long queued) {
+            Holder& h = holder();
+            assert( h.mode == 0 );
+            unsigned long long now = curTimeMicros64();
+            boostlock lk(m_);
+            if ( locked == 0 && readers == 0 )
+                heldSince = now;
+            if ( mode > 0 ) {
+                locked++;
+                assert( locked == 1 );
+            }
+            else {
+                readers++;
+            }
+            timeQueued += queued;
+            h.mode = mode;
+            h.since = now;
+            h.queued = queued;
+            h.cur = 0;
+        }
+        void _leaving(int mode) {
+            Holder& h = holder();
+            assert( h.mode == mode );
+            unsigned long long now = curTimeMicros64();
+            boostlock lk(m_);
+            if ( mode > 0 ) {
+                locked--;
+                assert( locked == 0 );
+            }
+            else {
+                readers--;
+                assert( readers >= 0 );
+            }
+            if ( locked == 0 && readers == 0 )
+                timeLocked += now - heldSince;
+            charge(h, now);
+            h.mode = 0;
+            h.cur = 0;
+        }
+
+    public:
+        MutexInfo() : heldSince(0), timeLocked(0), timeQueued(0), locked(0), readers(0) {
+            start = curTimeMicros64();
+        }
+
+        /* queued: how long we waited to get the lock */
+        void entered(unsigned long long queued = 0) { _entered(1, queued); }
+        void leaving() { _leaving(1); }
+        void enteredShared(unsigned long long queued = 0) { _entered(-1, queued); }
+        void leavingShared() { _leaving(-1); }
+
+        /* true if anyone holds the lock, in either mode */
+        int isLocked() const {
+            return locked || readers;
+        }
+        /* the current thread holds the lock (in either mode / exclusively) */
+        bool haveLock() {
+            Holder *h = holder_.get();
+            return h && h->mode != 0;
+        }
+        bool haveWriteLock() {
+            Holder *h = holder_.get();
+            return h && h->mode > 0;
+        }
+        int nReaders() const {
+            return readers;
+        }
+
+        /* called from setClient(): lock time from here on is charged to database 'name'.
+           the first database used during a hold is also charged with the time spent queued
+           for the lock.
+        */
+        void usingDatabase(const string& name) {
+            Holder& h = holder();
+            if ( h.mode == 0 )
+                return;
+            unsigned long long now = curTimeMicros64();
+            boostlock lk(m_);
+            charge(h, now);
+            DbStats *s = &byDb_[name];
+            if ( s != h.cur ) {
+                h.cur = s;
+                h.since = now;
+                s->nLocks++;
+                s->timeQueued += h.queued;
+                h.queued = 0;
+            }
+        }
+
+        void timingInfo(unsigned long long &s, unsigned long long &tl) {
+            boostlock lk(m_);
+            s = start;
+            tl = timeLocked;
+            if ( locked || readers )
+                tl += curTimeMicros64() - heldSince;
+        }
+        void timingInfo(unsigned long long &s, unsigned long long &tl, unsigned long long &tq) {
+            timingInfo(s, tl);
+            tq = timeQueued;
+        }
+        /* snapshot of the per database numbers */
+        void dbTimingInfo(map<string,DbStats>& out) {
+            boostlock lk(m_);
+            out = byDb_;
+        }
+    };
+
+    extern RWLock &dbMutex;
+    extern MutexInfo dbMutexInfo;
 
-}
+    inline void requireInWriteLock() {
+        assert( dbMutexInfo.haveWriteLock() );
+    }
 
+} // namespace mongo
@@ -15,6 +15,7 @@ namespace mongo {
             ns[0] = '?'; // just in case not set later
             *query = 0;
             killCurrentOp = 0;
+            yields = 0;
         }
 
         bool active;
@@ -24,9 +25,11 @@ namespace mongo {
         char ns[Namespace::MaxNsLen+1];
         char query[128];
         char zero;
+        int yields; // # of times we released dbMutex so others could run
 
         CurOp() { 
             opNum = 0; 
+            yields = 0;
             ns[sizeof(ns)-1] = 0;
             query[sizeof(query)-1] = 0;
         }
@@ -61,7 +64,9 @@ namespace mongo {
                 b.append("op", op);
             b.append("ns", ns);
             b.append("query", query);
+            b.append("numYields", yields);
             b.append("inLock",  dbMutexInfo.isLocked());
+            b.append("readers", dbMutexInfo.nReaders());
             return b.obj();
         }
     } currentOp;
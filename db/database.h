@@ -46,6 +46,8 @@ namespace mongo {
             if ( !newDb )
                 namespaceIndex.init();            
             profile = 0;
+            // never reallocated, see getFile()
+            files.reserve( DiskLoc::MaxFiles );
             profileName = name + ".system.profile";
         }
         ~Database() {
@@ -71,15 +73,19 @@ namespace mongo {
                 if ( n > 100 )
                     out() << "getFile(): n=" << n << "?" << endl;
             }
+            /* readers holding dbMutex shared may get here concurrently.  files has room for
+               MaxFiles so it is never reallocated, and a slot, once set, never changes: the
+               common case needs no locking.  a slot is only set after a barrier (below), so a
+               file seen here has been completely opened.
+            */
+            if ( n < (int) files.size() && files[n] )
+                return files[n];
+            boostlock lk(filesMutex);
             while ( n >= (int) files.size() )
                 files.push_back(0);
             MongoDataFile* p = files[n];
             if ( p == 0 ) {
-                stringstream ss;
-                ss << name << '.' << n;
-                boost::filesystem::path fullName;
-                fullName = boost::filesystem::path(path) / ss.str();
-                string fullNameString = fullName.string();
+                string fullNameString = fileName( n );
                 p = new MongoDataFile(n);
                 int minSize = 0;
                 if ( n != 0 && files[ n - 1 ] )
@@ -93,11 +99,21 @@ namespace mongo {
                     delete p;
                     throw;
                 }
+                memoryBarrier(); // p is opened before an unlocked reader can see it
                 files[n] = p;
+                p->preallocateNext( fileName( n + 1 ) );
             }
             return p;
         }
 
+        string fileName( int n ) const {
+            stringstream ss;
+            ss << name << '.' << n;
+            boost::filesystem::path fullName;
+            fullName = boost::filesystem::path(path) / ss.str();
+            return fullName.string();
+        }
+
         MongoDataFile* addAFile( int sizeNeeded = 0 ) {
             int n = (int) files.size();
             return getFile( n, sizeNeeded );
@@ -124,6 +140,7 @@ namespace mongo {
         void finishInit(); // ugly...
 
         vector<MongoDataFile*> files;
+        boost::mutex filesMutex; // guards opening of files
         string name; // "alleyinsider"
         string path;
         NamespaceIndex namespaceIndex;
@@ -132,6 +149,6 @@ namespace mongo {
 
     };
 
-    extern Database *database;
+    extern MONGO_TLS Database *database;
 
 } // namespace mongo
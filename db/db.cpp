@@ -32,7 +32,7 @@
 
 namespace mongo {
 
-    extern bool quiet, quota, cpu;
+    extern bool quiet, quota, prealloc, cpu;
     bool useJNI = true;
 
     /* only off if --nocursors which is for debugging. */
@@ -181,6 +181,7 @@ namespace mongo {
 
         MessagingPort& dbMsgPort = *grab;
         grab = 0;
+        MessagingPort::serving(&dbMsgPort);
 
         try {
 
@@ -197,6 +198,7 @@ namespace mongo {
                 }
 
                 le->nPrev++;
+                le->nPrevObjects++;
 
                 DbResponse dbresponse;
                 if ( !assembleResponse( m, dbresponse ) ) {
@@ -341,6 +343,10 @@ namespace mongo {
         massert( ss.str().c_str(), boost::filesystem::exists( dbpath ) );
         
         acquirePathLock();
+
+        /* before any data file is opened */
+        journal.startup();
+        FileFlusher::start();
         
         clearTmpFiles();
         clearTmpCollections();
@@ -525,6 +531,8 @@ int main(int argc, char* argv[], char *envp[] )
             }
             else if ( s == "--quota" )
                 quota = true;
+            else if ( s == "--noprealloc" )
+                prealloc = false;
             else if ( s == "--objcheck" )
                 objcheck = true;
             else if( s == "--only" ) 
@@ -545,6 +553,18 @@ int main(int argc, char* argv[], char *envp[] )
                 useCursors = false;
             else if ( s == "--nohints" )
                 useHints = false;
+            else if ( s == "--journal" )
+                journaling = true;
+            else if ( s == "--syncdelay" ) {
+                int x = atoi( argv[ ++i ] );
+                uassert("bad arg", x >= 0);
+                FileFlusher::syncDelay = x;
+            }
+            else if ( s == "--journalCommitInterval" ) {
+                int x = atoi( argv[ ++i ] );
+                uassert("bad arg", x > 0 && x <= 1000);
+                journalCommitInterval = x;
+            }
             else if ( s == "--oplogSize" ) {
                 long x = strtol( argv[ ++i ], 0, 10 );
                 uassert("bad arg", x > 0);
@@ -590,9 +610,13 @@ usage:
     out() << " -v+                       increase verbose level -v = --verbose\n";
     out() << " --objcheck                inspect client data for validity on receipt\n";
     out() << " --quota                   enable db quota management\n";
+    out() << " --noprealloc              don't create the next data file ahead of time\n";
     out() << " --appsrvpath <path>       root directory for the babble app server\n";
     out() << " --nocursors               diagnostic/debugging option\n";
     out() << " --nohints                 ignore query hints\n";
+    out() << " --syncdelay <secs>        flush data files to disk every <secs> seconds, default 60, 0=never\n";
+    out() << " --journal                 write ahead journal, for recovery after a crash\n";
+    out() << " --journalCommitInterval <ms>  how often to commit the journal, default 10\n";
     out() << " --nojni" << endl;
     out() << " --oplog<n>                0=off 1=W 2=R 3=both 7=W+some reads" << endl;
     out() << " --oplogSize <size_in_MB>  custom size if creating new replication operation log" << endl;
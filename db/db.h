@@ -19,64 +19,48 @@
 #include "../stdafx.h"
 #include "../util/message.h"
 #include "../util/top.h"
+#include "concurrency.h"
 
 namespace mongo {
 
     void jniCallback(Message& m, Message& out);
 
-    class MutexInfo {
-        unsigned long long start, enter, timeLocked; // all in microseconds
-        int locked;
-
-    public:
-        MutexInfo() : locked(0) {
-            start = curTimeMicros64();
-        }
-        void entered() {
-            enter = curTimeMicros64();
-            locked++;
-            assert( locked == 1 );
-        }
-        void leaving() {
-            locked--;
-            assert( locked == 0 );
-            timeLocked += curTimeMicros64() - enter;
-        }
-        int isLocked() const {
-            return locked;
-        }
-        void timingInfo(unsigned long long &s, unsigned long long &tl) {
-            s = start;
-            tl = timeLocked;
-        }
-    };
-
-    extern boost::mutex &dbMutex;
-    extern MutexInfo dbMutexInfo;
-
-    struct lock {
-        boostlock bl_;
-        MutexInfo& info_;
-        lock( boost::mutex &mutex, MutexInfo &info ) :
-                bl_( mutex ),
-                info_( info ) {
-            info_.entered();
-        }
-        ~lock() {
-            info_.leaving();
-        }
-    };
-
     void dbunlocking();
 
-    struct dblock : public lock {
-        dblock() :
-                lock( dbMutex, dbMutexInfo ) {
+    /* exclusive hold of dbMutex.  before waiting for it, replies held back for pipelining
+       are sent (see flushHeldReplies()). */
+    struct dblock : boost::noncopyable {
+        dblock() {
+            unsigned long long t = curTimeMicros64();
+            if ( !dbMutex.try_lock() ) {
+                flushHeldReplies();
+                dbMutex.lock();
+            }
+            dbMutexInfo.entered( curTimeMicros64() - t );
         }
         ~dblock() { 
             /* todo: this should be inlined */
             dbunlocking();
             Top::clientStop();
+            dbMutexInfo.leaving();
+            dbMutex.unlock();
+        }
+    };
+
+    /* shared hold of dbMutex.  see concurrency.h for what you may do while holding it. */
+    struct readlock : boost::noncopyable {
+        readlock() {
+            unsigned long long t = curTimeMicros64();
+            if ( !dbMutex.try_lock_shared() ) {
+                flushHeldReplies();
+                dbMutex.lock_shared();
+            }
+            dbMutexInfo.enteredShared( curTimeMicros64() - t );
+        }
+        ~readlock() {
+            Top::clientStop();
+            dbMutexInfo.leavingShared();
+            dbMutex.unlock_shared();
         }
     };
 
@@ -114,8 +98,8 @@ namespace mongo {
 
 // tempish...move to TLS or pass all the way down as a parm
     extern map<string,Database*> databases;
-    extern Database *database;
-    extern const char *curNs;
+    extern MONGO_TLS Database *database;
+    extern MONGO_TLS const char *curNs;
     extern bool master;
 
     inline string getKey( const char *ns, const char *path ) {
@@ -129,7 +113,7 @@ namespace mongo {
         /* we must be in critical section at this point as these are global
            variables.
         */
-        assert( dbMutexInfo.isLocked() );
+        assert( dbMutexInfo.haveLock() );
         Top::clientStart( ns );
         
         curNs = ns;
@@ -137,6 +121,7 @@ namespace mongo {
         map<string,Database*>::iterator it = databases.find(key);
         if ( it != databases.end() ) {
             database = it->second;
+            dbMutexInfo.usingDatabase( database->name );
             return false;
         }
 
@@ -149,12 +134,16 @@ namespace mongo {
 //    if( !master )
 //        log() << "first operation for database " << key << endl;
 
+        /* opening a database may create files, so a shared lock isn't enough */
+        assert( dbMutexInfo.haveWriteLock() );
+
         char cl[256];
         nsToClient(ns, cl);
         bool justCreated;
         Database *c = new Database(cl, justCreated, path);
         databases[key] = c;
         database = c;
+        dbMutexInfo.usingDatabase( database->name );
         database->finishInit();
 
         return justCreated;
@@ -164,6 +153,11 @@ namespace mongo {
 // does not delete the files on disk
     void closeClient( const char *cl, const char *path = dbpath );
 
+    /* true if the database for ns is already open.  ok to call with a shared lock. */
+    inline bool databaseOpen(const char *ns, const char *path=dbpath) {
+        return databases.count( getKey( ns, path ) ) != 0;
+    }
+
     /* remove database from the databases map */
     inline void eraseDatabase( const char *ns, const char *path=dbpath ) {
         string key = getKey( ns, path );
@@ -180,31 +174,49 @@ namespace mongo {
         return jc;
     }
 
+    /* scoped release of dbMutex, in whichever mode we hold it */
     struct dbtemprelease {
         string clientname;
         string clientpath;
-        dbtemprelease() {
+        bool shared;
+        dbtemprelease() : shared( !dbMutexInfo.haveWriteLock() ) {
             if ( database ) {
                 clientname = database->name;
                 clientpath = database->path;
             }
             Top::clientStop();
-            dbMutexInfo.leaving();
-#if BOOST_VERSION >= 103500
-            dbMutex.unlock();
-#else
-            boost::detail::thread::lock_ops<boost::mutex>::unlock(dbMutex);
-#endif
+            if ( !shared && journaling )
+                journal.unlocking();
+            if ( shared ) {
+                dbMutexInfo.leavingShared();
+                dbMutex.unlock_shared();
+            }
+            else {
+                dbMutexInfo.leaving();
+                dbMutex.unlock();
+            }
+            /* we are in a long operation, or about to wait.  a send error closed the
+               connection; that ends it after this operation, not in the middle of it. */
+            try {
+                flushHeldReplies();
+            }
+            catch ( SocketException& ) {
+            }
         }
         ~dbtemprelease() {
-#if BOOST_VERSION >= 103500
-            dbMutex.lock();
-#else
-            boost::detail::thread::lock_ops<boost::mutex>::lock(dbMutex);
-#endif
-            dbMutexInfo.entered();
+            unsigned long long t = curTimeMicros64();
+            if ( shared ) {
+                dbMutex.lock_shared();
+                dbMutexInfo.enteredShared( curTimeMicros64() - t );
+            }
+            else {
+                dbMutex.lock();
+                dbMutexInfo.entered( curTimeMicros64() - t );
+            }
             if ( clientname.empty() )
                 database = 0;
+            else if ( shared && !databaseOpen(clientname.c_str(), clientpath.c_str()) )
+                database = 0; // closed while we were unlocked; reopening needs the write lock
             else
                 setClient(clientname.c_str(), clientpath.c_str());
         }
@@ -213,4 +225,3 @@ namespace mongo {
 } // namespace mongo
 
 #include "dbinfo.h"
-#include "concurrency.h"
@@ -44,8 +44,10 @@ namespace mongo {
     void flushOpLog( stringstream &ss );
 
     void clean(const char *ns, NamespaceDetails *d) {
+        writing(d);
         for ( int i = 0; i < Buckets; i++ )
             d->deletedList[i].Null();
+        NamespaceDetailsTransient::get(ns).freeSpace().reset();
     }
 
     /* { validate: "collectionnamewithoutthedbpart" [, scandata: <bool>] } */
@@ -262,6 +264,9 @@ namespace mongo {
             LastError *le = lastError.get();
             assert( le );
             le->nPrev--; // we don't count as an operation
+            le->nPrevObjects--;
+            /* n: how many records the previous update or delete touched */
+            result.append("n", le->nPrevObjects == 1 ? (int) le->nObjects : 0);
             if ( le->nPrev != 1 || !le->haveError() ) {
                 result.appendNull("err");
                 return true;
@@ -301,6 +306,7 @@ namespace mongo {
             LastError *le = lastError.get();
             assert( le );
             le->nPrev--; // we don't count as an operation
+            le->nPrevObjects--;
             if ( !le->haveError() ) {
                 result.appendNull("err");
                 result.append("nPrev", 1);
@@ -389,15 +395,29 @@ namespace mongo {
             started = time(0);
         }
         bool run(const char *ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool fromRepl) {
-            unsigned long long last, start, timeLocked;
-            dbMutexInfo.timingInfo(start, timeLocked);
+            unsigned long long last, start, timeLocked, timeQueued;
+            dbMutexInfo.timingInfo(start, timeLocked, timeQueued);
             last = curTimeMicros64();
             double tt = (double) last-start;
             double tl = (double) timeLocked;
             result.append("totalTime", tt);
             result.append("lockTime", tl);
+            result.append("queueTime", (double) timeQueued);
             result.append("ratio", tl/tt);
             result.append("uptime",(double) (time(0)-started));
+
+            map<string,MutexInfo::DbStats> byDb;
+            dbMutexInfo.dbTimingInfo(byDb);
+            BSONObjBuilder dbs;
+            for ( map<string,MutexInfo::DbStats>::iterator i = byDb.begin(); i != byDb.end(); ++i ) {
+                BSONObjBuilder b;
+                b.append("lockTime", (double) i->second.timeLocked);
+                b.append("queueTime", (double) i->second.timeQueued);
+                b.append("locks", (double) i->second.nLocks);
+                b.append("ratio", i->second.timeLocked/tt);
+                dbs.append(i->first.c_str(), b.done());
+            }
+            result.append("databases", dbs.done());
             return true;
         }
         time_t started;
@@ -427,6 +447,57 @@ namespace mongo {
         time_t started;
     } cmdMemInfo;
 
+    /* how long flushing the data files to disk takes.  see FileFlusher. */
+    class CmdFlushInfo : public Command {
+    public:
+        virtual bool slaveOk() {
+            return true;
+        }
+        CmdFlushInfo() : Command("flushinfo") { }
+        bool run(const char *ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool fromRepl) {
+            FileFlusher::Stats s = FileFlusher::stats();
+            result.append("syncDelay", FileFlusher::syncDelay);
+            result.append("flushes", (double) s.flushes);
+            result.append("totalMs", (double) s.totalMillis);
+            result.append("averageMs", s.flushes ? (double) s.totalMillis / s.flushes : 0.0);
+            result.append("lastMs", s.lastMillis);
+            result.append("lastBytes", (double) s.lastBytes);
+            result.append("lastFinished", (double) s.lastFinished);
+            result.append("dirtyEstimate", (double) FileFlusher::dirtyEstimate());
+            if ( journaling ) {
+                Journal::Stats j = journal.stats();
+                BSONObjBuilder b;
+                b.append("commits", (double) j.commits);
+                b.append("bytes", (double) j.bytes);
+                b.append("averageCommitMs", j.commits ? j.commitMicros / 1000.0 / j.commits : 0.0);
+                b.append("checkpoints", (double) j.checkpoints);
+                b.append("unwritten", (double) j.unwritten);
+                result.append("journal", b.done());
+            }
+            return true;
+        }
+    } cmdFlushInfo;
+
+    /* how well record allocation is doing.  see FreeSpaceMap. */
+    class CmdAllocInfo : public Command {
+    public:
+        virtual bool slaveOk() {
+            return true;
+        }
+        CmdAllocInfo() : Command("allocinfo") { }
+        bool run(const char *ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool fromRepl) {
+            const FreeSpaceMap::Stats &s = FreeSpaceMap::stats;
+            result.append("allocs", (double) s.allocs);
+            result.append("examined", (double) s.examined);
+            result.append("avgExamined", s.allocs ? (double) s.examined / s.allocs : 0.0);
+            result.append("nearby", (double) s.nearby);
+            result.append("bytesWasted", (double) s.bytesWasted);
+            result.append("mapBuilds", (double) s.builds);
+            result.append("mapBuildWalked", (double) s.walked);
+            return true;
+        }
+    } cmdAllocInfo;
+
     /* just to check if the db has asserted */
     class CmdAssertInfo : public Command {
     public:
@@ -552,6 +623,53 @@ namespace mongo {
         }
     } cmdtraceall;
 
+    /* { compact : "collectionname" [, maxFill : <fraction, default .5>] }
+       moves the records of extents that are less than maxFill full into free space elsewhere in
+       the collection, and gives the extents emptied back to the database for reuse.  unlike
+       repairDatabase this works on a live server: it yields the lock every so often.
+    */
+    class CmdCompact : public Command {
+    public:
+        CmdCompact() : Command("compact") { }
+        virtual bool logTheOp() {
+            return false;
+        }
+        virtual bool slaveOk() {
+            return true;
+        }
+        virtual bool adminOnly() {
+            return false;
+        }
+        virtual bool run(const char *_ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool) {
+            string ns = database->name + '.' + cmdObj.findElement(name).valuestr();
+            double maxFill = 0.5;
+            BSONElement e = cmdObj.findElement("maxFill");
+            if ( e.isNumber() )
+                maxFill = e.number();
+            if ( maxFill <= 0 || maxFill > 1 ) {
+                errmsg = "maxFill must be greater than 0 and at most 1";
+                return false;
+            }
+            if ( !quiet )
+                log() << "CMD: compact " << ns << endl;
+            if ( nsdetails(ns.c_str()) == 0 ) {
+                errmsg = "ns not found";
+                return false;
+            }
+            Timer t;
+            CompactStats stats;
+            compactCollection(ns.c_str(), maxFill, stats);
+            result.append("ns", ns.c_str());
+            result.append("extentsFreed", stats.nExtentsFreed);
+            result.append("bytesReclaimed", (double) stats.bytesFreed);
+            result.append("moved", (double) stats.nMoved);
+            result.append("skipped", stats.nSkipped);
+            result.append("yields", stats.nYields);
+            result.append("millis", t.millis());
+            return true;
+        }
+    } cmdCompact;
+
     /* select count(*) */
     class CmdCount : public Command {
     public:
@@ -568,6 +686,9 @@ namespace mongo {
         virtual bool adminOnly() {
             return false;
         }
+        virtual bool readOnly() {
+            return true;
+        }
         virtual bool run(const char *_ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool) {
             string ns = database->name + '.' + cmdObj.findElement(name).valuestr();
             string err;
@@ -585,6 +706,34 @@ namespace mongo {
         }
     } cmdCount;
 
+    /* { collstats : "collectionname" }
+       sizes of a collection.  read only, so runs with a shared lock.
+    */
+    class CmdCollStats : public Command {
+    public:
+        CmdCollStats() : Command("collstats") { }
+        virtual bool slaveOk() {
+            return true;
+        }
+        virtual bool readOnly() {
+            return true;
+        }
+        virtual bool run(const char *_ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool) {
+            string ns = database->name + '.' + cmdObj.findElement(name).valuestr();
+            NamespaceDetails *d = nsdetails(ns.c_str());
+            if ( !d ) {
+                errmsg = "ns not found";
+                return false;
+            }
+            result.append("ns", ns.c_str());
+            result.append("count", (double) d->nrecords);
+            result.append("size", (double) d->datasize);
+            result.append("nindexes", d->nIndexes);
+            result.appendBool("capped", d->capped != 0);
+            return true;
+        }
+    } cmdCollStats;
+
     /* create collection */
     class CmdCreate : public Command {
     public:
@@ -628,6 +777,8 @@ namespace mongo {
                 BSONElement f = jsobj.findElement("index");
                 if ( !f.eoo() ) {
 
+                    BackgroundIndexBuild::assertNoneInProgForNs(toDeleteNs.c_str());
+
                     d->aboutToDeleteAnIndex();
 
                     /* there may be pointers pointing at keys in the btree(s).  kill them. */
@@ -643,7 +794,7 @@ namespace mongo {
                             if( d->nIndexes ) { 
                                 for ( int i = 0; i < d->nIndexes; i++ )
                                     d->indexes[i].kill();
-                                d->nIndexes = 0;
+                                writing(d)->nIndexes = 0;
                             }
                         }
                         else {
@@ -659,9 +810,10 @@ namespace mongo {
                                 */
                                 d->indexes[x].kill();
 
-                                d->nIndexes--;
+                                writing(d)->nIndexes--;
                                 for ( int i = x; i < d->nIndexes; i++ )
                                     d->indexes[i] = d->indexes[i+1];
+                                d->removedIndexBits(x);
                             } else {
                                 log() << "deleteIndexes: " << idxName << " not found" << endl;
                                 errmsg = "index not found";
@@ -49,6 +49,7 @@ namespace mongo {
     };
 
     inline void Database::finishInit() {
+        namespaceIndex.checkMigrateAll();
         DBInfo i(name.c_str());
     }
 
@@ -150,7 +150,7 @@ namespace mongo {
         int ntoreturn;
         int queryOptions;
         BSONObj query;
-        auto_ptr< set<string> > fields;
+        auto_ptr< FieldsToReturn > fields;
 
         /* parses the message into the above fields */
         QueryMessage(DbMessage& d) {
@@ -158,10 +158,8 @@ namespace mongo {
             ntoskip = d.pullInt();
             ntoreturn = d.pullInt();
             query = d.nextJsObj();
-            if ( d.moreJSObjs() ) {
-                fields = auto_ptr< set<string> >(new set<string>());
-                d.nextJsObj().getFieldNames(*fields);
-            }
+            if ( d.moreJSObjs() )
+                fields = auto_ptr< FieldsToReturn >(new FieldsToReturn(d.nextJsObj()));
             queryOptions = d.msg().data->dataAsInt();
         }
     };
@@ -0,0 +1,175 @@
+// extsort.cpp
+
+/**
+*    Copyright (C) 2008 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "extsort.h"
+#include "pdfile.h"
+#include <algorithm>
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+
+namespace mongo {
+
+    static unsigned long long extSortCount = 0;
+    static boost::mutex extSortMutex; // sorts for queries may run concurrently, under a shared lock
+
+    BSONObjExternalSorter::BSONObjExternalSorter( const BSONObj &order, long maxFileSize ) :
+        cmp_( order ), maxFileSize_( maxFileSize ), curSize_( 0 ), sorted_( false ), nAdded_( 0 ) {
+        stringstream ss;
+        /* the "tmp" prefix gets it cleaned up by clearTmpFiles() should we crash */
+        {
+            boostlock lk( extSortMutex );
+            ss << "tmpSort_" << time( 0 ) << '_' << extSortCount++;
+        }
+        root_ = ( boost::filesystem::path( dbpath ) / ss.str() ).string();
+    }
+
+    BSONObjExternalSorter::~BSONObjExternalSorter() {
+        if ( !files_.empty() )
+            BOOST_CHECK_EXCEPTION( boost::filesystem::remove_all( root_ ) );
+    }
+
+    void BSONObjExternalSorter::add( const BSONObj &o, const DiskLoc &loc ) {
+        assert( !sorted_ );
+        cur_.push_back( make_pair( o.getOwned(), loc ) );
+        curSize_ += o.objsize() + sizeof( Data );
+        nAdded_++;
+        if ( curSize_ > maxFileSize_ )
+            finishRun();
+    }
+
+    /* sort what we have in memory and write it out as a run */
+    void BSONObjExternalSorter::finishRun() {
+        if ( cur_.empty() )
+            return;
+        std::sort( cur_.begin(), cur_.end(), cmp_ );
+
+        if ( files_.empty() )
+            boost::filesystem::create_directories( root_ );
+        stringstream ss;
+        ss << root_ << "/run." << files_.size();
+        string file = ss.str();
+        log(1) << "external sort: writing " << cur_.size() << " objects to " << file << endl;
+
+        ofstream out( file.c_str(), ios_base::out | ios_base::binary );
+        massert( "can't open file for external sort", out.good() );
+        for ( vector<Data>::iterator i = cur_.begin(); i != cur_.end(); ++i ) {
+            out.write( i->first.objdata(), i->first.objsize() );
+            out.write( (const char *) &i->second, sizeof( DiskLoc ) );
+        }
+        out.close();
+        massert( "error writing external sort file", !out.fail() );
+        files_.push_back( file );
+
+        cur_.clear();
+        curSize_ = 0;
+    }
+
+    void BSONObjExternalSorter::sort() {
+        assert( !sorted_ );
+        sorted_ = true;
+        if ( files_.empty() ) {
+            std::sort( cur_.begin(), cur_.end(), cmp_ );
+            return;
+        }
+        finishRun();
+    }
+
+    BSONObjExternalSorter::FileIterator::FileIterator( const string &file ) :
+        in_( file.c_str(), ios_base::in | ios_base::binary ) {
+        massert( "can't open external sort file", in_.good() );
+        advance();
+    }
+
+    /* sets more_ according to whether another object follows */
+    void BSONObjExternalSorter::FileIterator::advance() {
+        more_ = in_.peek() != char_traits<char>::eof();
+    }
+
+    BSONObjExternalSorter::Data BSONObjExternalSorter::FileIterator::next() {
+        assert( more() );
+        int size;
+        in_.read( (char *) &size, sizeof( size ) );
+        massert( "bad object in external sort file", in_.good() && size >= 5 );
+        char *data = (char *) malloc( size );
+        memcpy( data, &size, sizeof( size ) );
+        in_.read( data + sizeof( size ), size - sizeof( size ) );
+        DiskLoc loc;
+        in_.read( (char *) &loc, sizeof( DiskLoc ) );
+        if ( in_.fail() ) {
+            free( data );
+            massert( "truncated external sort file", false );
+        }
+        BSONObj o( data, true );
+        advance();
+        return make_pair( o, loc );
+    }
+
+    class BSONObjExternalSorter::InMemoryIterator : public Iterator {
+    public:
+        InMemoryIterator( const vector<Data> &v ) : i_( v.begin() ), end_( v.end() ) { }
+        virtual bool more() { return i_ != end_; }
+        virtual Data next() { return *i_++; }
+    private:
+        vector<Data>::const_iterator i_, end_;
+    };
+
+    /* merges the runs.  there are few of them (one per maxFileSize of input), so we just
+       look at the head of each to find the smallest. */
+    class BSONObjExternalSorter::MergeIterator : public Iterator {
+    public:
+        MergeIterator( const vector<string> &files, const Cmp &cmp ) : cmp_( cmp ) {
+            for ( vector<string>::const_iterator i = files.begin(); i != files.end(); ++i ) {
+                shared_ptr<FileIterator> f( new FileIterator( *i ) );
+                if ( !f->more() )
+                    continue;
+                runs_.push_back( f );
+                heads_.push_back( f->next() );
+            }
+        }
+        virtual bool more() { return !runs_.empty(); }
+        virtual Data next() {
+            assert( more() );
+            unsigned min = 0;
+            for ( unsigned i = 1; i < heads_.size(); i++ )
+                if ( cmp_.compare( heads_[ i ], heads_[ min ] ) < 0 )
+                    min = i;
+            Data d = heads_[ min ];
+            if ( runs_[ min ]->more() ) {
+                heads_[ min ] = runs_[ min ]->next();
+            }
+            else {
+                runs_.erase( runs_.begin() + min );
+                heads_.erase( heads_.begin() + min );
+            }
+            return d;
+        }
+    private:
+        Cmp cmp_;
+        vector< shared_ptr<FileIterator> > runs_;
+        vector<Data> heads_;
+    };
+
+    auto_ptr<BSONObjExternalSorter::Iterator> BSONObjExternalSorter::iterator() {
+        assert( sorted_ );
+        if ( files_.empty() )
+            return auto_ptr<Iterator>( new InMemoryIterator( cur_ ) );
+        return auto_ptr<Iterator>( new MergeIterator( files_, cmp_ ) );
+    }
+
+} // namespace mongo
@@ -0,0 +1,105 @@
+// extsort.h
+
+/**
+*    Copyright (C) 2008 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../stdafx.h"
+#include "jsobj.h"
+#include "storage.h"
+#include <fstream>
+
+namespace mongo {
+
+    /* sorts (BSONObj, DiskLoc) pairs by the object, then by the DiskLoc, in bounded memory.
+
+       Pairs are buffered and sorted in memory.  Whenever the buffer grows past maxFileSize
+       it is written out as a sorted run to a temp directory under dbpath, and the runs are
+       merged when iterating.  The temp directory is removed by the destructor (and by
+       clearTmpFiles() at startup if we crash).
+
+       usage: add() everything, sort(), then iterator().
+    */
+    class BSONObjExternalSorter : boost::noncopyable {
+    public:
+        typedef pair<BSONObj,DiskLoc> Data;
+
+        /* order: as for BSONObj::woCompare(), e.g. an index key pattern */
+        BSONObjExternalSorter( const BSONObj &order = BSONObj(), long maxFileSize = 1024 * 1024 * 100 );
+        ~BSONObjExternalSorter();
+
+        void add( const BSONObj &o, const DiskLoc &loc );
+        /* call once all objects have been added */
+        void sort();
+
+        class Iterator : boost::noncopyable {
+        public:
+            virtual ~Iterator() { }
+            virtual bool more() = 0;
+            /* the object returned is valid until the iterator is destroyed */
+            virtual Data next() = 0;
+        };
+        auto_ptr<Iterator> iterator();
+
+        int numFiles() const { return files_.size(); }
+        long long numAdded() const { return nAdded_; }
+
+    private:
+        class Cmp {
+        public:
+            Cmp( const BSONObj &order ) : order_( order ) { }
+            int compare( const Data &l, const Data &r ) const {
+                int x = l.first.woCompare( r.first, order_ );
+                return x ? x : l.second.compare( r.second );
+            }
+            bool operator()( const Data &l, const Data &r ) const {
+                return compare( l, r ) < 0;
+            }
+        private:
+            BSONObj order_;
+        };
+
+        /* a sorted run on disk.  read with plain file i/o rather than mapped: sorts run under
+           the shared lock, and opening or closing a MemoryMappedFile there would race with the
+           mmap bookkeeping and the background flusher. */
+        class FileIterator : boost::noncopyable {
+        public:
+            FileIterator( const string &file );
+            bool more() const { return more_; }
+            Data next();
+        private:
+            void advance();
+            ifstream in_;
+            bool more_;
+        };
+
+        class InMemoryIterator;
+        class MergeIterator;
+
+        void finishRun();
+
+        Cmp cmp_;
+        long maxFileSize_;
+        vector<Data> cur_;
+        long curSize_;
+        bool sorted_;
+        long long nAdded_;
+        string root_;
+        vector<string> files_;
+    };
+
+} // namespace mongo
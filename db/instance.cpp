@@ -28,6 +28,7 @@
 #include "security.h"
 #include "json.h"
 #include "reccache.h"
+#include "commands.h"
 #include "../s/d_logic.h"
 
 namespace mongo {
@@ -36,12 +37,13 @@ namespace mongo {
 #define LOGSOME if( ++nloggedsome < 1000 || nloggedsome % 100 == 0 )
 
     bool quota = false;
+    bool prealloc = true; // create the next data file in the background
     bool slave = false;
     bool master = false; // true means keep an op log
     extern int curOp;
     bool autoresync = false;
     
-    boost::mutex &dbMutex( *(new boost::mutex) );
+    RWLock &dbMutex( *(new RWLock) );
     MutexInfo dbMutexInfo;
 //int dbLocked = 0;
 
@@ -103,8 +105,82 @@ namespace mongo {
         replyToQuery(0, m, dbresponse, obj);
     }
     
+    /* true if the query is known not to write anything.  $where runs javascript, which
+       isn't thread safe; commands must declare themselves readOnly(). */
+    static bool readOnlyQuery( QueryMessage& q ) {
+        BSONObj query = q.query;
+        if ( strstr(q.ns, ".$cmd") ) {
+            BSONElement e = query.firstElement();
+            if ( e.type() == Object && string("query") == e.fieldName() )
+                query = e.embeddedObject();
+            Command *c = Command::findCommand( query.firstElement().fieldName() );
+            if ( c == 0 || !c->readOnly() )
+                return false;
+        }
+        if ( query.hasElement("$where") )
+            return false;
+        BSONObj inner = query.getObjectField("query");
+        return !inner.hasElement("$where");
+    }
+
+    /* queries, getMores and read only commands run with dbMutex held in shared mode, when
+       we can tell up front that they will not write anything.  returns false if the
+       message must be handled under the exclusive lock instead.
+    */
+    static bool receivedReadOnly( Message &m, DbResponse &dbresponse ) {
+        int op = m.data->operation();
+        if ( op != dbQuery && op != dbGetMore )
+            return false;
+        if ( opLogging )
+            return false; // OPREAD writes to the op log
+
+        const char *ns = m.data->_data + 4;
+        readlock lk;
+        if ( !databaseOpen(ns) )
+            return false;
+        if ( op == dbQuery ) {
+            DbMessage d(m);
+            QueryMessage q(d);
+            if ( !readOnlyQuery(q) )
+                return false;
+        }
+        else {
+            DbMessage d(m);
+            d.pullInt();
+            if ( ClientCursor::usesWhere( d.pullInt64() ) )
+                return false;
+        }
+        setClient(ns);
+        if ( !database->namespaceIndex.initialized() || database->profile )
+            return false;
+
+        stringstream ss;
+        char buf[64];
+        time_t_to_String(time(0), buf);
+        buf[20] = 0; // don't want the year
+        ss << buf;
+
+        Timer t;
+        if ( op == dbQuery ) {
+            receivedQuery(dbresponse, m, ss, false);
+        }
+        else {
+            ss << "getmore ";
+            receivedGetMore(dbresponse, m, ss);
+        }
+        int ms = t.millis();
+        if ( ms > 100 ) {
+            ss << ' ' << ms << "ms";
+            out() << ss.str().c_str() << endl;
+        }
+        database = 0;
+        return true;
+    }
+
     // Returns false when request includes 'end'
     bool assembleResponse( Message &m, DbResponse &dbresponse ) {
+        OpScope op;
+
         // before we lock...
         if ( m.data->operation() == dbQuery ) {
             const char *ns = m.data->_data + 4;
@@ -127,6 +203,9 @@ namespace mongo {
             return true;
         }
 
+        if ( receivedReadOnly( m, dbresponse ) )
+            return true;
+
         dblock lk;
         
         stringstream ss;
@@ -281,6 +360,8 @@ namespace mongo {
        path - db directory
     */
     void closeClient( const char *cl, const char *path ) {
+        BackgroundIndexBuild::assertNoneInProgForDb(cl);
+
         if ( string("local") != cl ) {
             DBInfo i(cl);
             i.dbDropped();
@@ -314,7 +395,9 @@ namespace mongo {
 
         assert( toupdate.objsize() < m.data->dataLen() );
         assert( query.objsize() + toupdate.objsize() < m.data->dataLen() );
-        updateObjects(ns, toupdate, query, flags & 1, ss);
+        bool upsert = flags & 1;
+        bool multi = flags & 2;
+        recordObjects( updateObjects(ns, toupdate, query, upsert, ss, multi) );
     }
 
     void receivedDelete(Message& m) {
@@ -327,7 +410,7 @@ namespace mongo {
         assert( d.moreJSObjs() );
         BSONObj pattern = d.nextJsObj();
         BSONObj deletedId = BSONObj();
-        deleteObjects(ns, pattern, justOne, &deletedId);
+        recordObjects( deleteObjects(ns, pattern, justOne, &deletedId) );
         if ( justOne ) {
             if ( deletedId.isEmpty() ) {
                 problem() << "deleted object without id, not logging" << endl;
@@ -358,7 +441,8 @@ namespace mongo {
             }
 
             setClient( q.ns );
-            strncpy(currentOp.ns, q.ns, Namespace::MaxNsLen);
+            if ( dbMutexInfo.haveWriteLock() )
+                strncpy(currentOp.ns, q.ns, Namespace::MaxNsLen);
             msgdata = runQuery(m, ss ).release();
         }
         catch ( AssertionException& e ) {
@@ -441,12 +525,23 @@ namespace mongo {
 		setClient(ns);
 		ss << ns;
 		
-        while ( d.moreJSObjs() ) {
-            BSONObj js = d.nextJsObj();
-
-            theDataFileMgr.insert(ns, js);
-            logOp("i", ns, js);
+        vector<BSONObj> objs;
+        while ( d.moreJSObjs() )
+            objs.push_back( d.nextJsObj() );
+        if ( objs.size() == 1 ) {
+            theDataFileMgr.insert(ns, objs[0]);
+            logOp("i", ns, objs[0]);
+            return;
         }
+        try {
+            theDataFileMgr.insertBatch(ns, objs);
+        }
+        catch ( ... ) {
+            logInserts(ns, objs); // the ones that made it in
+            throw;
+        }
+        logInserts(ns, objs);
+        ss << " batch:" << objs.size();
     }
 
     extern int callDepth;
@@ -482,6 +577,7 @@ namespace mongo {
         Database *clientOld = database;
 
         JniMessagingPort jmp(out);
+        OpScope op;
         callDepth++;
         int curOpOld = curOp;
 
@@ -628,6 +724,8 @@ namespace mongo {
         /* must do this before unmapping mem or you may get a seg fault */
         closeAllSockets();
 
+        journal.shutdown();
+
         stringstream ss3;
         MemoryMappedFile::closeAllFiles( ss3 );
         rawOut( ss3.str() );
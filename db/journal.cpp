@@ -0,0 +1,496 @@
+// journal.cpp
+
+/**
+*    Copyright (C) 2009 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "journal.h"
+#include "db.h"
+#include "../util/mmap.h"
+#include "../util/md5.hpp"
+
+namespace mongo {
+
+    bool journaling = false;
+    int journalCommitInterval = 10;
+
+    Journal journal;
+
+    Journal::Journal() : file_(0), fileNo_(0), fileLen_(0), seq_(0),
+        lastCheckpoint_(0), failed_(false) {
+    }
+
+    Journal::~Journal() {
+        delete file_;
+    }
+
+    string Journal::path(int n) const {
+        stringstream ss;
+        ss << "j._" << n;
+        return ( boost::filesystem::path( dbpath ) / "journal" / ss.str() ).string();
+    }
+
+    /* commitMutex_ held (or not needed yet) */
+    void Journal::openFile(int n) {
+        string name = path( n );
+        File *f = new File();
+        f->open( name.c_str() );
+        massert( "couldn't open journal file " + name, f->is_open() );
+        delete file_;
+        file_ = f;
+        fileNo_ = n;
+        fileLen_ = 0;
+    }
+
+    static void append(vector< char >& b, const void *p, int len) {
+        const char *c = (const char *) p;
+        b.insert( b.end(), c, c + len );
+    }
+
+    /* the name we journal f's changes under: relative to dbpath if it is in there */
+    static string journalName(const MemoryMappedFile *f) {
+        const string& name = f->filename();
+        string dir = dbpath;
+        if ( name.compare( 0, dir.size(), dir ) != 0 )
+            return name;
+        size_t i = dir.size();
+        while ( i < name.size() && ( name[i] == '/' || name[i] == '\\' ) )
+            i++;
+        return name.substr( i );
+    }
+
+    void Journal::unlocking() {
+        if ( noted_.empty() )
+            return;
+
+        /* merge overlapping and adjacent ranges */
+        sort( noted_.begin(), noted_.end() );
+        vector< pair< const char *, unsigned > > ranges;
+        for ( vector< pair< const char *, unsigned > >::iterator i = noted_.begin(); i != noted_.end(); ++i ) {
+            if ( !ranges.empty() && i->first <= ranges.back().first + ranges.back().second ) {
+                const char *end = max( ranges.back().first + ranges.back().second, i->first + i->second );
+                ranges.back().second = end - ranges.back().first;
+            }
+            else {
+                ranges.push_back( *i );
+            }
+        }
+        noted_.clear();
+
+        try {
+            /* the first entry from each hold names its file, so b can go after anything */
+            vector< char > b;
+            const MemoryMappedFile *last = 0;
+            for ( vector< pair< const char *, unsigned > >::iterator i = ranges.begin(); i != ranges.end(); ++i ) {
+                const char *p = i->first;
+                int left = i->second;
+                while ( left > 0 ) {
+                    /* a merged range can run on into the next file's view */
+                    MemoryMappedFile *f = MemoryMappedFile::find( p );
+                    if ( f == 0 ) {
+                        DEV out() << "journal: noted range is not in a mapped file" << endl;
+                        break;
+                    }
+                    const char *base = (const char *) f->viewOfs();
+                    int n = min( left, (int) ( base + f->length() - p ) );
+                    Entry e;
+                    e.len = n;
+                    e.ofs = p - base;
+                    e.fileNameLen = 0;
+                    string name;
+                    if ( f != last ) {
+                        name = journalName( f );
+                        e.fileNameLen = name.size();
+                        last = f;
+                    }
+                    append( b, &e, sizeof( e ) );
+                    append( b, name.c_str(), e.fileNameLen );
+                    append( b, p, n );
+                    p += n;
+                    left -= n;
+                    if ( b.size() > MaxBuffered ) {
+                        /* too much for one section.  commit what we have, so the files can't be
+                           left with more than the rest of this hold's changes missing. */
+                        buffer( b );
+                        b.clear();
+                        last = 0;
+                        commit();
+                    }
+                }
+            }
+            buffer( b );
+
+            bool full;
+            {
+                boostlock lk( bufMutex_ );
+                full = buf_.size() > MaxBuffered;
+            }
+            if ( full )
+                commit(); // the commit thread is falling behind
+        }
+        catch ( std::exception& e ) {
+            /* we are called from ~dblock, so must not throw.  what we didn't buffer can't get
+               to the data files now, so we have to stop. */
+            problem() << "journal: " << e.what() << endl;
+            failed_ = true;
+        }
+    }
+
+    void Journal::buffer(const vector< char >& entries) {
+        if ( entries.empty() )
+            return;
+        boostlock lk( bufMutex_ );
+        if ( buf_.empty() )
+            buf_.resize( sizeof( Section ) ); // filled in by _commit()
+        buf_.insert( buf_.end(), entries.begin(), entries.end() );
+    }
+
+    void Journal::commit() {
+        boostlock lk( commitMutex_ );
+        _commit();
+    }
+
+    /* commitMutex_ held */
+    void Journal::_commit() {
+        vector< char > b;
+        {
+            boostlock lk( bufMutex_ );
+            b.swap( buf_ );
+        }
+        if ( b.empty() || failed_ || file_ == 0 )
+            return;
+
+        Timer t;
+        Section *s = (Section *) &b[0];
+        s->magic = SectionMagic;
+        s->len = b.size() - sizeof( Section );
+        s->seq = ++seq_;
+        unsigned len = s->len;
+        md5digest d;
+        md5( &b[0], b.size(), d );
+        append( b, d, sizeof( d ) );
+
+        file_->write( fileLen_, &b[0], b.size() );
+        file_->fsync();
+        if ( file_->bad() ) {
+            failed_ = true;
+            problem() << "journal: write to " << path( fileNo_ ) << " failed" << endl;
+            return;
+        }
+        fileLen_ += b.size();
+
+        /* now that it can be redone, it can go to the data files */
+        apply( &b[ sizeof( Section ) ], &b[ sizeof( Section ) + len ], writeBack_ );
+        for ( DataFiles::iterator i = writeBack_.begin(); i != writeBack_.end(); ++i ) {
+            if ( i->second.get() && i->second->bad() ) {
+                failed_ = true;
+                problem() << "journal: write to " << i->first << " failed" << endl;
+            }
+        }
+
+        stats_.commits++;
+        stats_.bytes += b.size();
+        stats_.commitMicros += t.micros();
+    }
+
+    bool Journal::checkpointDue() {
+        boostlock lk( commitMutex_ );
+        return fileLen_ > CheckpointSize ||
+            ( fileLen_ > 0 && time( 0 ) - lastCheckpoint_ > CheckpointSecs );
+    }
+
+    void Journal::checkpoint() {
+        int old;
+        if ( dbMutexInfo.haveWriteLock() )
+            old = switchFiles();
+        else {
+            dblock lk;
+            old = switchFiles();
+        }
+        if ( old < 0 )
+            return;
+
+        /* everything in the old journal files has been written to the data files.  once
+           that is on disk we don't need them. */
+        boostlock lk( checkpointMutex_ );
+        syncDataFiles();
+        if ( failed_ )
+            return;
+        for ( int i = old; i >= 0; i-- ) {
+            string name = path( i );
+            if ( !boost::filesystem::exists( name ) )
+                break;
+            boost::filesystem::remove( name );
+        }
+    }
+
+    /* dbMutex held exclusively.  commits everything changed so far and starts a new journal
+       file for what comes after.  returns the number of the last old file, -1 on failure. */
+    int Journal::switchFiles() {
+        unlocking(); // if we are in the middle of an operation, what it has done so far
+        rescueUnwritten();
+        boostlock lk( commitMutex_ );
+        _commit();
+        if ( failed_ )
+            return -1;
+        /* the files now hold what the views do, so the copied pages can go */
+        MemoryMappedFile::remapPrivateViews();
+        int old = fileNo_;
+        openFile( fileNo_ + 1 );
+        lastCheckpoint_ = time( 0 );
+        stats_.checkpoints++;
+        return old;
+    }
+
+    /* dbMutex held exclusively.  a change made without writing() is in a view but will never
+       reach its file, and the remap would throw it away.  look for such changes in every page
+       copied since the last remap -- the only pages the remap drops that could differ from
+       the files -- and journal what we find like any other change. */
+    void Journal::rescueUnwritten() {
+        commit(); // so the files have everything that was noted
+        vector< pair< char *, unsigned > > diffs;
+        MemoryMappedFile::findUnwrittenChanges( diffs );
+        if ( diffs.empty() )
+            return;
+        MemoryMappedFile *f = MemoryMappedFile::find( diffs[0].first );
+        problem() << "journal: " << diffs.size() << " change(s) made without writing(), first in "
+                  << ( f ? f->filename() : string( "?" ) ) << ", journaling them now" << endl;
+        for ( vector< pair< char *, unsigned > >::iterator i = diffs.begin(); i != diffs.end(); ++i )
+            note( i->first, i->second );
+        unlocking();
+        boostlock lk( commitMutex_ );
+        stats_.unwritten += diffs.size();
+    }
+
+    void Journal::syncDataFiles() {
+        vector< pair< string, shared_ptr< File > > > files;
+        {
+            boostlock lk( commitMutex_ );
+            for ( DataFiles::iterator i = writeBack_.begin(); i != writeBack_.end(); ++i )
+                if ( i->second.get() )
+                    files.push_back( *i );
+        }
+        /* not under commitMutex_, so commits go on meanwhile */
+        for ( vector< pair< string, shared_ptr< File > > >::iterator i = files.begin(); i != files.end(); ++i ) {
+            i->second->fsync();
+            if ( i->second->bad() ) {
+                failed_ = true;
+                problem() << "journal: error syncing " << i->first << endl;
+            }
+        }
+    }
+
+    Journal::Stats Journal::stats() {
+        boostlock lk( commitMutex_ );
+        return stats_;
+    }
+
+    /* f is being closed.  what was changed in it has to get to the file while we can still
+       read the view, and be synced, as checkpoints only sync the files in writeBack_. */
+    void Journal::closing(MemoryMappedFile *f) {
+        if ( !journaling )
+            return;
+        if ( dbMutexInfo.haveWriteLock() )
+            journal.unlocking();
+        boostlock lk( journal.commitMutex_ );
+        journal._commit();
+        DataFiles::iterator i = journal.writeBack_.find( journalName( f ) );
+        if ( i == journal.writeBack_.end() )
+            return;
+        if ( i->second.get() ) {
+            i->second->fsync();
+            if ( i->second->bad() ) {
+                journal.failed_ = true;
+                problem() << "journal: error syncing " << i->first << endl;
+            }
+        }
+        journal.writeBack_.erase( i );
+    }
+
+    /* msync does nothing for copy-on-write views; the data files are synced by checkpoints */
+    static void flusherCheckpoint() {
+        journal.checkpoint();
+    }
+
+    void journalThread() {
+        while ( 1 ) {
+            sleepmillis( journalCommitInterval );
+            try {
+                journal.commit();
+                if ( journal.checkpointDue() )
+                    journal.checkpoint();
+            }
+            catch ( std::exception& e ) {
+                problem() << "exception in journal thread: " << e.what() << endl;
+            }
+            if ( journal.failed() ) {
+                problem() << "journal: can't write the journal, terminating" << endl;
+                dbexit( 14, "journal failure" );
+            }
+        }
+    }
+
+    void Journal::startup() {
+        boost::filesystem::path dir = boost::filesystem::path( dbpath ) / "journal";
+        if ( boost::filesystem::exists( dir ) )
+            replay();
+        if ( !journaling )
+            return;
+        open();
+        MemoryMappedFile::copyOnWrite = true;
+        MemoryMappedFile::closing = closing;
+        FileFlusher::checkpoint = flusherCheckpoint;
+        log() << "journal: committing every " << journalCommitInterval << "ms to " << dir.string() << endl;
+        boost::thread t( journalThread );
+    }
+
+    void Journal::open() {
+        boost::filesystem::create_directory( boost::filesystem::path( dbpath ) / "journal" );
+        boostlock lk( commitMutex_ );
+        openFile( 0 );
+        lastCheckpoint_ = time( 0 );
+    }
+
+    void Journal::shutdown() {
+        if ( !journaling )
+            return;
+        journaling = false;
+        commit();
+        if ( failed_ )
+            return; // leave what did get committed for the next startup
+        syncDataFiles();
+        if ( failed_ )
+            return;
+        boostlock lk( commitMutex_ );
+        delete file_;
+        file_ = 0;
+        for ( int i = fileNo_; i >= 0; i-- ) {
+            string name = path( i );
+            if ( boost::filesystem::exists( name ) )
+                boost::filesystem::remove( name );
+        }
+    }
+
+    /* --- recovery ---------------------------------------------------------- */
+
+    void Journal::replay() {
+        vector< pair< int, string > > files;
+        boost::filesystem::path dir = boost::filesystem::path( dbpath ) / "journal";
+        for ( boost::filesystem::directory_iterator i( dir ); i != boost::filesystem::directory_iterator(); ++i ) {
+            string leaf = i->leaf();
+            if ( leaf.compare( 0, 3, "j._" ) == 0 )
+                files.push_back( make_pair( atoi( leaf.c_str() + 3 ), i->string() ) );
+        }
+        if ( files.empty() )
+            return;
+        sort( files.begin(), files.end() );
+
+        log() << "journal: recovering from " << files.size() << " journal file(s)" << endl;
+        Timer t;
+        DataFiles dataFiles;
+        long long nSections = 0, nBytes = 0;
+        for ( vector< pair< int, string > >::iterator i = files.begin(); i != files.end(); ++i ) {
+            /* a section cut short is where we crashed, nothing after it was committed */
+            if ( !replayFile( i->second, dataFiles, nSections, nBytes ) )
+                break;
+        }
+        for ( DataFiles::iterator i = dataFiles.begin(); i != dataFiles.end(); ++i ) {
+            if ( i->second.get() ) {
+                i->second->fsync();
+                massert( "journal: error writing " + i->first, !i->second->bad() );
+            }
+        }
+        for ( vector< pair< int, string > >::iterator i = files.begin(); i != files.end(); ++i )
+            boost::filesystem::remove( i->second );
+        log() << "journal: replayed " << nSections << " sections, " << nBytes / 1024 << "KB in "
+              << t.millis() << "ms" << endl;
+    }
+
+    bool Journal::replayFile(const string& name, DataFiles& dataFiles, long long& nSections, long long& nBytes) {
+        File f;
+        f.open( name.c_str() );
+        massert( "couldn't open journal file " + name, f.is_open() );
+        fileofs len = f.len();
+        fileofs pos = 0;
+        vector< char > b;
+        while ( pos < len ) {
+            Section s;
+            if ( pos + sizeof( Section ) > len )
+                break;
+            f.read( pos, (char *) &s, sizeof( s ) );
+            if ( s.magic != SectionMagic || pos + sizeof( Section ) + s.len + sizeof( md5digest ) > len )
+                break;
+            b.resize( sizeof( Section ) + s.len + sizeof( md5digest ) );
+            f.read( pos, &b[0], b.size() );
+            md5digest d;
+            md5( &b[0], sizeof( Section ) + s.len, d );
+            if ( memcmp( d, &b[ sizeof( Section ) + s.len ], sizeof( d ) ) != 0 )
+                break;
+            apply( &b[ sizeof( Section ) ], &b[ sizeof( Section ) + s.len ], dataFiles );
+            pos += b.size();
+            nSections++;
+            nBytes += s.len;
+        }
+        if ( pos < len ) {
+            log() << "journal: ignoring incomplete section at " << pos << " in " << name << endl;
+            return false;
+        }
+        return true;
+    }
+
+    /* write the entries in [p, end) to the data files they name.  for recovery, and for
+       each commit to writeBack_ */
+    void Journal::apply(const char *p, const char *end, DataFiles& dataFiles) {
+        File *df = 0;
+        bool named = false;
+        while ( p < end ) {
+            Entry e;
+            massert( "journal: bad entry", p + sizeof( e ) <= end );
+            memcpy( &e, p, sizeof( e ) );
+            p += sizeof( e );
+            massert( "journal: bad entry", e.len >= 0 && e.fileNameLen >= 0 &&
+                     p + e.fileNameLen + e.len <= end );
+            if ( e.fileNameLen ) {
+                string name( p, e.fileNameLen );
+                p += e.fileNameLen;
+                DataFiles::iterator i = dataFiles.find( name );
+                if ( i == dataFiles.end() ) {
+                    shared_ptr< File > f;
+                    boost::filesystem::path fp( name );
+                    if ( !fp.is_complete() )
+                        fp = boost::filesystem::path( dbpath ) / name;
+                    if ( boost::filesystem::exists( fp ) ) {
+                        f.reset( new File() );
+                        f->open( fp.string().c_str() );
+                        massert( "journal: couldn't open " + fp.string(), f->is_open() );
+                    }
+                    else {
+                        /* it was dropped after these changes were made */
+                        log() << "journal: skipping changes to missing file " << fp.string() << endl;
+                    }
+                    i = dataFiles.insert( make_pair( name, f ) ).first;
+                }
+                df = i->second.get();
+                named = true;
+            }
+            massert( "journal: entry without a file", named );
+            if ( df )
+                df->write( e.ofs, p, e.len );
+            p += e.len;
+        }
+    }
+
+} // namespace mongo
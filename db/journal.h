@@ -0,0 +1,176 @@
+// journal.h
+
+/**
+*    Copyright (C) 2009 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* write ahead journal for the data files (--journal).
+
+   Code that changes a data file in place says so with writing(p, len) while it holds dbMutex
+   exclusively.  When the lock is released the current contents of the noted ranges are
+   copied into the journal's buffer, so the buffer only holds states between operations.
+   Every journalCommitInterval ms a background thread appends what has been buffered to
+   <dbpath>/journal/j._<n> as one section and fsyncs it (group commit).
+
+   While journaling the data files are mapped copy-on-write (MemoryMappedFile::copyOnWrite),
+   so nothing we change in a view reaches the file by itself.  Once a section is on disk in the
+   journal, its entries are written to the data files with plain writes.  The files therefore
+   only ever hold the state as of some commit, never part of an operation.  A change made
+   without writing() isn't journaled until the next checkpoint finds it, so a crash before
+   then loses it.
+
+   At startup, before any data file is opened, the sections found in the journal are written
+   to the data files; a section that was cut short by the crash is ignored.  To keep that
+   short, every so often we start a new journal file, sync the data files and remove the old
+   journal files (a checkpoint).  The checkpoint also remaps the views, with dbMutex held
+   exclusively, to give back the memory of the pages copied since the last one.  Before it
+   does, it compares each of those pages with the file, so nothing changed without writing()
+   is thrown away.
+
+   A single lock hold that changes more than MaxBuffered bytes is committed in several
+   sections, so only that much of a very large operation is atomic.
+*/
+
+#pragma once
+
+#include "../stdafx.h"
+#include "../util/file.h"
+#include "../util/mmap.h"
+
+namespace mongo {
+
+    extern bool journaling;             // --journal
+    extern int journalCommitInterval;   // ms, --journalCommitInterval
+
+    class Journal : boost::noncopyable {
+    public:
+        enum {
+            MaxBuffered = 48 * 1024 * 1024,   // commit from the writer rather than buffer more
+            CheckpointSize = 128 * 1024 * 1024, // journal file size at which we checkpoint
+            CheckpointSecs = 60
+        };
+
+        Journal();
+        ~Journal();
+
+        /* [p, p+len) of a mapped file is being changed.  dbMutex must be held exclusively;
+           the change itself may come before or after this call, as long as it is within
+           the same hold. */
+        void note(const void *p, unsigned len) {
+            noted_.push_back( make_pair( (const char *) p, len ) );
+        }
+
+        /* copy the ranges noted during this hold into the commit buffer.  called by
+           dbunlocking(). */
+        void unlocking();
+
+        /* replay whatever a previous run left in <dbpath>/journal, then start the commit
+           thread. */
+        void startup();
+
+        /* write the committed sections in <dbpath>/journal to the data files, then remove
+           the journal files.  startup() does this before any data file is opened. */
+        void replay();
+
+        /* start writing <dbpath>/journal/j._0.  startup() does this when journaling; on its
+           own (as in the tests) it doesn't change how files are mapped or start the thread. */
+        void open();
+
+        /* write and fsync what has been buffered so far */
+        void commit();
+
+        /* start a new journal file, sync the data files and remove the old journal files.
+           takes dbMutex exclusively if the caller doesn't have it. */
+        void checkpoint();
+
+        /* for the commit thread: time for a checkpoint? */
+        bool checkpointDue();
+
+        /* at exit: commit, sync the data files, and remove the journal */
+        void shutdown();
+
+        /* a write to the journal failed.  we can't go on making changes we can't recover. */
+        bool failed() const {
+            return failed_;
+        }
+
+        struct Stats {
+            Stats() : commits(), bytes(), checkpoints(), unwritten(), commitMicros() { }
+            long long commits, bytes, checkpoints;
+            long long unwritten; // changes found at checkpoints that writing() wasn't told about
+            unsigned long long commitMicros;
+        };
+        Stats stats();
+
+    private:
+        struct Section {
+            unsigned magic;
+            unsigned len;             // of the entries that follow
+            unsigned long long seq;
+        };
+        /* followed by fileNameLen bytes of file name, then len bytes of data */
+        struct Entry {
+            int len;
+            int ofs;
+            int fileNameLen;          // 0: same file as the previous entry in the section
+        };
+        enum { SectionMagic = 0x6c6e726a };
+
+        typedef map< string, shared_ptr< File > > DataFiles;
+
+        static void closing(MemoryMappedFile *f);
+
+        string path(int n) const;
+        void openFile(int n);
+        void buffer(const vector< char >& entries);
+        void _commit();
+        int switchFiles();
+        void rescueUnwritten();
+        void syncDataFiles();
+        bool replayFile(const string& name, DataFiles& dataFiles, long long& nSections, long long& nBytes);
+        void apply(const char *p, const char *end, DataFiles& dataFiles);
+
+        vector< pair< const char *, unsigned > > noted_; // only touched with dbMutex held exclusively
+
+        boost::mutex bufMutex_;       // guards buf_
+        vector< char > buf_;          // Section header, then entries
+
+        boost::mutex commitMutex_;    // serializes writes to the journal file; guards below
+        DataFiles writeBack_;         // where committed entries are written, by journal name
+        File *file_;
+        int fileNo_;
+        long long fileLen_;
+        unsigned long long seq_;
+        time_t lastCheckpoint_;
+        Stats stats_;
+        volatile bool failed_;
+
+        boost::mutex checkpointMutex_; // never held while waiting for dbMutex
+    };
+
+    extern Journal journal;
+
+    /* p, a pointer into a data file, is about to be (or was just) written.  returns p. */
+    inline void* writing(void *p, unsigned len) {
+        FileFlusher::noteDirty(len);
+        if ( journaling )
+            journal.note(p, len);
+        return p;
+    }
+    template< class T > inline T* writing(T *p) {
+        return (T*) writing((void *) p, sizeof(T));
+    }
+
+} // namespace mongo
@@ -905,36 +905,55 @@ namespace mongo {
         return n;
     }
 
+    FieldsToReturn::FieldsToReturn(const BSONObj& spec) {
+        BSONObjIterator i(spec);
+        while ( i.more() ) {
+            BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
+            if ( pos_.count(e.fieldName()) )
+                continue;
+            pos_[e.fieldName()] = names_.size();
+            names_.push_back(e.fieldName());
+        }
+    }
+
     /* note: addFields always adds _id even if not specified
        returns n added not counting _id unless requested.
     */
-    int BSONObj::addFields(BSONObj& from, set<string>& fields) {
+    int BSONObj::addFields(BSONObj& from, const FieldsToReturn& fields) {
         assert( isEmpty() && !isOwned() ); /* partial implementation for now... */
 
-        BSONObjBuilder b;
-
+        /* one pass over from, then out in fields' order */
         int N = fields.size();
+        vector<BSONElement> found(N);
+        BSONElement id;
         int n = 0;
         BSONObjIterator i(from);
-        bool gotId = false;
         while ( i.more() ) {
             BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
             const char *fname = e.fieldName();
-            if ( fields.count(fname) ) {
-                b.append(e);
+            bool isId = strcmp(fname, "_id")==0;
+            if ( isId )
+                id = e;
+            int p = fields.pos(fname);
+            if ( p >= 0 && found[p].eoo() ) {
+                found[p] = e;
                 ++n;
-                gotId = gotId || strcmp(fname, "_id")==0;
-                if ( n == N && gotId )
-                    break;
-            } else if ( strcmp(fname, "_id")==0 ) {
-                b.append(e);
-                gotId = true;
-                if ( n == N && gotId )
-                    break;
             }
+            if ( n == N && !id.eoo() )
+                break;
         }
 
         if ( n ) {
+            BSONObjBuilder b;
+            if ( !id.eoo() )
+                b.append(id);
+            for ( int j = 0; j < N; j++ )
+                if ( !found[j].eoo() && strcmp(found[j].fieldName(), "_id") != 0 )
+                    b.append(found[j]);
             int len;
             init( b.decouple(len), true );
         }
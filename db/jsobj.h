@@ -37,6 +37,7 @@ namespace mongo {
     class Record;
     class BSONObjBuilder;
     class BSONObjBuilderValueStream;
+    class FieldsToReturn;
 
 #pragma pack(1)
 
@@ -529,8 +530,9 @@ namespace mongo {
         /** Properly formatted JSON string. */
         string jsonString( JsonStringFormat format = Strict ) const;
 
-        /** note: addFields always adds _id even if not specified */
-        int addFields(BSONObj& from, set<string>& fields); /* returns n added */
+        /** note: addFields always adds _id even if not specified.  _id comes first, then the
+            fields in the order they were asked for. */
+        int addFields(BSONObj& from, const FieldsToReturn& fields); /* returns n added */
 
         /** returns # of top level fields in the object
            note: iterates to count the fields
@@ -744,6 +746,26 @@ namespace mongo {
 
     typedef set< BSONObj, BSONObjCmpDefaultOrder > BSONObjSetDefaultOrder;
 
+    /** the top level fields a query wants returned, in the order its field spec lists them.
+        results are built in this order whatever plan produced them -- see addFields().
+    */
+    class FieldsToReturn {
+    public:
+        FieldsToReturn(const BSONObj& spec);
+        bool empty() const { return names_.empty(); }
+        unsigned size() const { return names_.size(); }
+        const string& operator[](unsigned i) const { return names_[i]; }
+        /** index of name in the spec, -1 if not wanted */
+        int pos(const char *name) const {
+            map<string, int>::const_iterator i = pos_.find(name);
+            return i == pos_.end() ? -1 : i->second;
+        }
+        bool has(const char *name) const { return pos(name) >= 0; }
+    private:
+        vector<string> names_;
+        map<string, int> pos_;
+    };
+
 /** Use BSON macro to build a BSONObj from a stream 
     e.g., 
        BSON( "name" << "joe" << "age" << 33 )
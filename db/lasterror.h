@@ -25,10 +25,16 @@ namespace mongo {
     struct LastError {
         string msg;
         int nPrev;
+        long long nObjects; // records touched by the last update or delete
+        int nPrevObjects;   // ops since nObjects was recorded, counted like nPrev
         void raiseError(const char *_msg) {
             msg = _msg;
             nPrev = 1;
         }
+        void recordObjects(long long n) {
+            nObjects = n;
+            nPrevObjects = 1;
+        }
         bool haveError() const {
             return !msg.empty();
         }
@@ -37,6 +43,8 @@ namespace mongo {
         }
         LastError() {
             nPrev = 0;
+            nObjects = 0;
+            nPrevObjects = 0;
         }
     };
 
@@ -51,4 +59,10 @@ namespace mongo {
         le->raiseError(msg);
     }
 
+    inline void recordObjects(long long n) {
+        LastError *le = lastError.get();
+        if ( le )
+            le->recordObjects(n);
+    }
+
 } // namespace mongo
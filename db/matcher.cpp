@@ -101,13 +101,6 @@ namespace mongo {
 
     };
 
-    JSMatcher::~JSMatcher() {
-        for ( int i = 0; i < nBuilders; i++ )
-            delete builders[i];
-        delete in;
-        delete where;
-    }
-
 } // namespace mongo
 
 #include "pdfile.h"
@@ -128,12 +121,127 @@ namespace mongo {
     }
     
     
+    /* A JSMatcher's basics and regexes compiled into a flat list of instructions.  Each
+       instruction reads a slot: a top level field of the object or, when matching index keys,
+       a position in the key.  One forward pass over the object fills in every slot, then the
+       instructions run in turn.  Dotted field paths are split up front, $in values are kept
+       sorted for a binary search, and numeric constants are pulled out so numbers compare
+       without the type dispatch of valuesMatch().
+
+       Answers are the same as JSMatcher's own evaluation (matchesDotted() and friends), which
+       remains for queries compile() turns down and is the reference for the subtler cases --
+       arrays, dotted paths through arrays, missing fields.
+    */
+    class MatchProgram : boost::noncopyable {
+    public:
+        /* 0 if m can't be compiled: a field in the query isn't part of the index key m was
+           constrained to (JSMatcher asserts on that as it matches), or there is nothing to do */
+        static MatchProgram *compile(const JSMatcher& m);
+
+        bool matches(const BSONObj& obj, bool *deep);
+
+    private:
+        struct Instr {
+            const BasicMatcher *basic; // 0 for a regex
+            RegexMatcher *regex;
+            int slot;                  // -1 for a dotted regex, which is looked up as before
+            vector<string> path;       // field names below the slot's, for a record
+            bool numeric;              // basic->toMatch is a number, which is in number
+            double number;
+            bool missingOk;            // the field may be missing: we are looking for null
+            vector<BSONElement> in;    // the $in values, sorted with element_lt
+        };
+
+        MatchProgram(bool keys) : keys_(keys) { }
+        int slotFor(const char *fieldName);
+        /* JSMatcher::valuesMatch() */
+        bool test(const Instr& i, const BSONElement& l) const;
+        /* JSMatcher::matchesDotted(), from depth on in i.path.  e is the field path[depth] of obj. */
+        int evalPath(const Instr& i, unsigned depth, const BSONElement& e, const BSONObj& obj,
+                     bool isArr, bool *deep) const;
+
+        bool keys_;               // matching index keys, slots are key positions
+        vector<string> names_;    // field name of each slot, for records
+        vector<Instr> program_;
+        vector<BSONElement> slots_;
+    };
+
+    MatchProgram *MatchProgram::compile(const JSMatcher& m) {
+        if ( m.n == 0 && m.nRegex == 0 )
+            return 0;
+        auto_ptr<MatchProgram> p( new MatchProgram( !m.constrainIndexKey_.isEmpty() ) );
+        if ( p->keys_ ) {
+            BSONObjIterator i( m.constrainIndexKey_ );
+            while ( i.more() ) {
+                BSONElement e = i.next();
+                if ( e.eoo() )
+                    break;
+                p->names_.push_back( e.fieldName() );
+            }
+        }
+        for ( int b = 0; b < m.n; b++ ) {
+            const BasicMatcher& bm = m.basics[b];
+            Instr i;
+            i.basic = &bm;
+            i.regex = 0;
+            const char *fieldName = bm.toMatch.fieldName();
+            if ( p->keys_ ) {
+                i.path.push_back( fieldName );
+            }
+            else {
+                const char *q = fieldName;
+                for ( const char *d = strchr(q, '.'); d; q = d + 1, d = strchr(q, '.') )
+                    i.path.push_back( string(q, d - q) );
+                i.path.push_back( q );
+            }
+            i.slot = p->slotFor( p->keys_ ? fieldName : i.path[0].c_str() );
+            if ( i.slot < 0 )
+                return 0;
+            i.numeric = bm.toMatch.isNumber() && bm.compareOp != JSMatcher::opIN;
+            i.number = bm.toMatch.number();
+            i.missingOk = ( bm.toMatch.type() == jstNULL || bm.toMatch.type() == Undefined ) &&
+                bm.compareOp != JSMatcher::NE;
+            if ( bm.compareOp == JSMatcher::opIN )
+                i.in.assign( bm.in->begin(), bm.in->end() );
+            p->program_.push_back( i );
+        }
+        for ( int r = 0; r < m.nRegex; r++ ) {
+            RegexMatcher *rm = m.regexs[r].get();
+            Instr i;
+            i.basic = 0;
+            i.regex = rm;
+            i.numeric = false;
+            i.number = 0;
+            i.missingOk = false;
+            if ( p->keys_ ) {
+                i.slot = p->slotFor( rm->fieldName );
+                if ( i.slot < 0 )
+                    return 0;
+            }
+            else {
+                i.slot = strchr( rm->fieldName, '.' ) ? -1 : p->slotFor( rm->fieldName );
+            }
+            p->program_.push_back( i );
+        }
+        p->slots_.resize( p->names_.size() );
+        return p.release();
+    }
+
+    int MatchProgram::slotFor(const char *fieldName) {
+        for ( unsigned i = 0; i < names_.size(); i++ )
+            if ( names_[i] == fieldName )
+                return i;
+        if ( keys_ )
+            return -1;
+        names_.push_back( fieldName );
+        return names_.size() - 1;
+    }
+
     /* _jsobj          - the query pattern
     */
-    JSMatcher::JSMatcher(const BSONObj &_jsobj, const BSONObj &constrainIndexKey) :
-            in(0), where(0), jsobj(_jsobj), constrainIndexKey_(constrainIndexKey), nRegex(0)
+    JSMatcher::JSMatcher(const BSONObj &_jsobj, const BSONObj &constrainIndexKey, bool compile) :
+            where(0), jsobj(_jsobj), constrainIndexKey_(constrainIndexKey), nRegex(0)
     {
-        nBuilders = 0;
         BSONObjIterator i(jsobj);
         n = 0;
         while ( i.more() ) {
@@ -163,28 +271,24 @@ namespace mongo {
             }
 
             if ( e.type() == RegEx ) {
-                if ( nRegex >= 4 ) {
-                    out() << "ERROR: too many regexes in query" << endl;
+                pcrecpp::RE_Options options;
+                options.set_utf8(true);
+                const char *flags = e.regexFlags();
+                while ( flags && *flags ) {
+                    if ( *flags == 'i' )
+                        options.set_caseless(true);
+                    else if ( *flags == 'm' )
+                        options.set_multiline(true);
+                    else if ( *flags == 'x' )
+                        options.set_extended(true);
+                    flags++;
                 }
-                else {
-                    pcrecpp::RE_Options options;
-                    options.set_utf8(true);
-                    const char *flags = e.regexFlags();
-                    while ( flags && *flags ) {
-                        if ( *flags == 'i' )
-                            options.set_caseless(true);
-                        else if ( *flags == 'm' )
-                            options.set_multiline(true);
-                        else if ( *flags == 'x' )
-                            options.set_extended(true);
-                        flags++;
-                    }
-                    RegexMatcher& rm = regexs[nRegex];
-                    rm.re = new pcrecpp::RE(e.regex(), options);
-                    rm.fieldName = e.fieldName();
+                shared_ptr< RegexMatcher > rm( new RegexMatcher() );
+                rm->re = new pcrecpp::RE(e.regex(), options);
+                rm->fieldName = e.fieldName();
+                regexs.push_back(rm);
 
-                    nRegex++;
-                }
+                nRegex++;
                 continue;
             }
 
@@ -221,9 +325,8 @@ namespace mongo {
                             else
                                 uassert("invalid $operator", false);
                             if ( op ) {
-                                uassert("too many items to match in query", nBuilders < 8);
-                                BSONObjBuilder *b = new BSONObjBuilder();
-                                builders[nBuilders++] = b;
+                                shared_ptr< BSONObjBuilder > b( new BSONObjBuilder() );
+                                builders.push_back(b);
                                 b->appendAs(fe, e.fieldName());
                                 addBasic(b->done().firstElement(), op);
                                 ok = true;
@@ -232,9 +335,8 @@ namespace mongo {
                         else if ( fn[2] == 'e' ) {
                             if ( fn[1] == 'n' && fn[3] == 0 ) {
                                 // $ne
-                                uassert("too many items to match in query", nBuilders < 8);
-                                BSONObjBuilder *b = new BSONObjBuilder();
-                                builders[nBuilders++] = b;
+                                shared_ptr< BSONObjBuilder > b( new BSONObjBuilder() );
+                                builders.push_back(b);
                                 b->appendAs(fe, e.fieldName());
                                 addBasic(b->done().firstElement(), NE);
                                 ok = true;
@@ -244,8 +346,7 @@ namespace mongo {
                         }
                         else if ( fn[1] == 'i' && fn[2] == 'n' && fn[3] == 0 && fe.type() == Array ) {
                             // $in
-                            uassert( "only 1 $in statement per query supported", in == 0 ); // todo...
-                            in = new set<BSONElement,element_lt>();
+                            shared_ptr< set<BSONElement,element_lt> > in( new set<BSONElement,element_lt>() );
                             BSONObjIterator i(fe.embeddedObject());
                             if ( i.more() ) {
                                 while ( 1 ) {
@@ -256,6 +357,7 @@ namespace mongo {
                                 }
                             }
                             addBasic(e, opIN); // e not actually used at the moment for $in
+                            basics.back().in = in;
                             ok = true;
                         }
                         else
@@ -273,9 +375,18 @@ namespace mongo {
             // normal, simple case e.g. { a : "foo" }
             addBasic(e, Equality);
         }
+
+        if ( compile )
+            program.reset( MatchProgram::compile(*this) );
     }
 
-    inline int JSMatcher::valuesMatch(const BSONElement& l, const BSONElement& r, int op) {
+    JSMatcher::~JSMatcher() {
+        delete where;
+    }
+
+    inline int JSMatcher::valuesMatch(const BSONElement& l, const BasicMatcher& bm) {
+        const BSONElement& r = bm.toMatch;
+        int op = bm.compareOp;
         if ( op == 0 )
             return l.valuesEqual(r);
 
@@ -285,7 +396,7 @@ namespace mongo {
 
         if ( op == opIN ) {
             // { $in : [1,2,3] }
-            int c = in->count(l);
+            int c = bm.in->count(l);
             return c;
         }
 
@@ -302,9 +413,8 @@ namespace mongo {
     /* Check if a particular field matches.
 
        fieldName - field to match "a.b" if we are reaching into an embedded object.
-       toMatch   - element we want to match.
        obj       - database object to check against
-       compareOp - Equality, LT, GT, etc.
+       bm        - the element we want to match and how: Equality, LT, GT, etc.
        deep      - out param.  set to true/false if we scanned an array
        isArr     -
 
@@ -319,7 +429,7 @@ namespace mongo {
         0 missing element
         1 match
     */
-    int JSMatcher::matchesDotted(const char *fieldName, const BSONElement& toMatch, const BSONObj& obj, int compareOp, bool *deep, bool isArr) {
+    int JSMatcher::matchesDotted(const char *fieldName, const BasicMatcher& bm, const BSONObj& obj, bool *deep, bool isArr) {
         BSONElement e;
         if ( !constrainIndexKey_.isEmpty() ) {
             e = obj.getFieldUsingIndexNames(fieldName, constrainIndexKey_);
@@ -336,20 +446,20 @@ namespace mongo {
                     return -1;
 
                 BSONObj eo = e.embeddedObject();
-                return matchesDotted(p+1, toMatch, eo, compareOp, deep, e.type() == Array);
+                return matchesDotted(p+1, bm, eo, deep, e.type() == Array);
             } else {
                 e = obj.getField(fieldName);
             }
         }
         
-        if ( valuesMatch(e, toMatch, compareOp) ) {
+        if ( valuesMatch(e, bm) ) {
             return 1;
         }
         else if ( e.type() == Array ) {
             BSONObjIterator ai(e.embeddedObject());
             while ( ai.more() ) {
                 BSONElement z = ai.next();
-                if ( valuesMatch( z, toMatch, compareOp) ) {
+                if ( valuesMatch( z, bm ) ) {
                     if ( deep )
                         *deep = true;
                     return 1;
@@ -362,7 +472,7 @@ namespace mongo {
                 BSONElement z = ai.next();
                 if ( z.type() == Object ) {
                     BSONObj eo = z.embeddedObject();
-                    int cmp = matchesDotted(fieldName, toMatch, eo, compareOp, deep);
+                    int cmp = matchesDotted(fieldName, bm, eo, deep);
                     if ( cmp > 0 ) {
                         if ( deep ) *deep = true;
                         return 1;
@@ -413,6 +523,122 @@ namespace mongo {
         return false;
     }
 
+    inline bool MatchProgram::test(const Instr& i, const BSONElement& l) const {
+        int op = i.basic->compareOp;
+        if ( op == JSMatcher::Equality || op == JSMatcher::NE ) {
+            bool eq = i.numeric ? l.isNumber() && l.number() == i.number : l.valuesEqual(i.basic->toMatch);
+            return op == JSMatcher::Equality ? eq : !eq;
+        }
+        if ( op == JSMatcher::opIN )
+            return binary_search( i.in.begin(), i.in.end(), l, element_lt() );
+
+        int c;
+        if ( i.numeric ) {
+            if ( !l.isNumber() )
+                return false;
+            double x = l.number() - i.number;
+            c = x < 0 ? -1 : ( x == 0 ? 0 : 1 );
+        }
+        else {
+            const BSONElement& r = i.basic->toMatch;
+            if ( !( l.isNumber() && r.isNumber() ) && ( l.type() != r.type() ) )
+                return false;
+            c = compareElementValues(l, r);
+            if ( c < -1 ) c = -1;
+            if ( c > 1 ) c = 1;
+        }
+        return ( op & ( 1 << ( c + 1 ) ) ) != 0;
+    }
+
+    int MatchProgram::evalPath(const Instr& i, unsigned depth, const BSONElement& e, const BSONObj& obj,
+                               bool isArr, bool *deep) const {
+        if ( depth + 1 < i.path.size() ) {
+            if ( e.eoo() )
+                return 0;
+            if ( e.type() != Object && e.type() != Array )
+                return -1;
+            BSONObj eo = e.embeddedObject();
+            return evalPath(i, depth + 1, eo.getField(i.path[depth + 1].c_str()), eo, e.type() == Array, deep);
+        }
+
+        if ( test(i, e) )
+            return 1;
+        if ( e.type() == Array ) {
+            BSONObjIterator ai(e.embeddedObject());
+            while ( ai.more() ) {
+                BSONElement z = ai.next();
+                if ( test(i, z) ) {
+                    if ( deep )
+                        *deep = true;
+                    return 1;
+                }
+            }
+        }
+        else if ( isArr ) {
+            BSONObjIterator ai(obj);
+            while ( ai.more() ) {
+                BSONElement z = ai.next();
+                if ( z.type() == Object ) {
+                    BSONObj eo = z.embeddedObject();
+                    if ( evalPath(i, depth, eo.getField(i.path[depth].c_str()), eo, false, deep) > 0 ) {
+                        if ( deep )
+                            *deep = true;
+                        return 1;
+                    }
+                }
+            }
+        }
+        else if ( e.eoo() ) {
+            return 0;
+        }
+        return -1;
+    }
+
+    bool MatchProgram::matches(const BSONObj& obj, bool *deep) {
+        // the forward pass.  like getField(), a record's slot takes the first field of its name.
+        unsigned nSlots = slots_.size();
+        for ( unsigned s = 0; s < nSlots; s++ )
+            slots_[s] = BSONElement();
+        unsigned nFilled = 0;
+        unsigned pos = 0;
+        BSONObjIterator j(obj);
+        while ( nFilled < nSlots && j.more() ) {
+            BSONElement e = j.next();
+            if ( e.eoo() )
+                break;
+            if ( keys_ ) {
+                slots_[pos++] = e;
+                nFilled++;
+                continue;
+            }
+            const char *name = e.fieldName();
+            for ( unsigned s = 0; s < nSlots; s++ ) {
+                if ( slots_[s].eoo() && names_[s].c_str()[0] == name[0] && strcmp(names_[s].c_str(), name) == 0 ) {
+                    slots_[s] = e;
+                    nFilled++;
+                    break;
+                }
+            }
+        }
+
+        for ( vector<Instr>::const_iterator i = program_.begin(); i != program_.end(); ++i ) {
+            if ( i->regex ) {
+                BSONElement e = i->slot >= 0 ? slots_[i->slot] : obj.getFieldDotted(i->regex->fieldName);
+                if ( e.eoo() || !regexMatches(*i->regex, e, deep) )
+                    return false;
+                continue;
+            }
+            const BSONElement& e = slots_[i->slot];
+            if ( keys_ )
+                assert( !e.eoo() );
+            // -1=mismatch. 0=missing element. 1=match
+            int cmp = evalPath(*i, 0, e, obj, false, deep);
+            if ( cmp < 0 || ( cmp == 0 && !i->missingOk ) )
+                return false;
+        }
+        return true;
+    }
+
     /* See if an object matches the query.
        deep - return true when means we looked into arrays for a match
     */
@@ -420,6 +646,12 @@ namespace mongo {
         if ( deep )
             *deep = false;
 
+        if ( program.get() ) {
+            if ( !program->matches(jsobj, deep) )
+                return false;
+            return where ? whereMatches(jsobj) : true;
+        }
+
         /* assuming there is usually only one thing to match.  if more this
         could be slow sometimes. */
 
@@ -428,7 +660,7 @@ namespace mongo {
             BasicMatcher& bm = basics[i];
             BSONElement& m = bm.toMatch;
             // -1=mismatch. 0=missing element. 1=match
-            int cmp = matchesDotted(m.fieldName(), m, jsobj, bm.compareOp, deep);
+            int cmp = matchesDotted(m.fieldName(), bm, jsobj, deep);
             if ( cmp < 0 )
                 return false;
             if ( cmp == 0 ) {
@@ -444,7 +676,7 @@ namespace mongo {
         }
 
         for ( int r = 0; r < nRegex; r++ ) {
-            RegexMatcher& rm = regexs[r];
+            RegexMatcher& rm = *regexs[r];
             BSONElement e;
             if ( !constrainIndexKey_.isEmpty() )
                 e = jsobj.getFieldUsingIndexNames(rm.fieldName, constrainIndexKey_);
@@ -456,38 +688,42 @@ namespace mongo {
                 return false;
         }
 
-        if ( where ) {
-            if ( where->func == 0 ) {
-                uassert("$where compile error", false);
-                return false; // didn't compile
-            }
+        if ( where )
+            return whereMatches(jsobj);
+
+        return true;
+    }
+
+    /* the $where clause, which needs the whole object */
+    bool JSMatcher::whereMatches(const BSONObj& jsobj) {
+        if ( where->func == 0 ) {
+            uassert("$where compile error", false);
+            return false; // didn't compile
+        }
 #if !defined(NOJNI)
 
-            /**if( 1 || jsobj.objsize() < 200 || where->fullObject ) */
-            {
-                if ( where->jsScope ) {
-                    JavaJS->scopeInit( where->scope , where->jsScope );
-                }
-                JavaJS->scopeSetThis( where->scope, const_cast< BSONObj * >( &jsobj ) );
-                JavaJS->scopeSetObject( where->scope, "obj", const_cast< BSONObj * >( &jsobj ) );
+        /**if( 1 || jsobj.objsize() < 200 || where->fullObject ) */
+        {
+            if ( where->jsScope ) {
+                JavaJS->scopeInit( where->scope , where->jsScope );
             }
-            /*else {
-            BSONObjBuilder b;
-            where->buildSubset(jsobj, b);
-            BSONObj temp = b.done();
-            JavaJS->scopeSetObject(where->scope, "obj", &temp);
-            }*/
-            if ( JavaJS->invoke(where->scope, where->func) ) {
-                uassert("error in invocation of $where function", false);
-                return false;
-            }
-            return JavaJS->scopeGetBoolean(where->scope, "return") != 0;
-#else
+            JavaJS->scopeSetThis( where->scope, const_cast< BSONObj * >( &jsobj ) );
+            JavaJS->scopeSetObject( where->scope, "obj", const_cast< BSONObj * >( &jsobj ) );
+        }
+        /*else {
+        BSONObjBuilder b;
+        where->buildSubset(jsobj, b);
+        BSONObj temp = b.done();
+        JavaJS->scopeSetObject(where->scope, "obj", &temp);
+        }*/
+        if ( JavaJS->invoke(where->scope, where->func) ) {
+            uassert("error in invocation of $where function", false);
             return false;
-#endif
         }
-
-        return true;
+        return JavaJS->scopeGetBoolean(where->scope, "return") != 0;
+#else
+        return false;
+#endif
     }
 
     struct JSObj1 js1;
@@ -37,15 +37,29 @@ namespace mongo {
         }
     };
 
+    /* orders elements by type, then value -- for $in */
+    struct element_lt
+    {
+        bool operator()(const BSONElement& l, const BSONElement& r) const
+        {
+            int x = (int) l.type() - (int) r.type();
+            if ( x < 0 ) return true;
+            if ( x > 0 ) return false;
+            return compareElementValues(l,r) < 0;
+        }
+    };
+
     class BasicMatcher {
     public:
         BSONElement toMatch;
         int compareOp;
+        shared_ptr< set<BSONElement,element_lt> > in; // the values, for opIN
     };
 
 // SQL where clause equivalent
     class Where;
     class DiskLoc;
+    class MatchProgram;
 
     /* Match BSON objects against a query pattern.
 
@@ -63,21 +77,10 @@ namespace mongo {
        TODO: we should rewrite the matcher to be more an AST style.
     */
     class JSMatcher : boost::noncopyable {
+        friend class MatchProgram;
         int matchesDotted(
-            const char *fieldName,
-            const BSONElement& toMatch, const BSONObj& obj,
-            int compareOp, bool *deep, bool isArr = false);
-
-        struct element_lt
-        {
-            bool operator()(const BSONElement& l, const BSONElement& r) const
-            {
-                int x = (int) l.type() - (int) r.type();
-                if ( x < 0 ) return true;
-                if ( x > 0 ) return false;
-                return compareElementValues(l,r) < 0;
-            }
-        };
+            const char *fieldName, const BasicMatcher& bm,
+            const BSONObj& obj, bool *deep, bool isArr = false);
     public:
         enum {
             Equality = 0,
@@ -95,7 +98,9 @@ namespace mongo {
 
         // Only specify constrainIndexKey if matches() will be called with
         // index keys having empty string field names.
-        JSMatcher(const BSONObj &pattern, const BSONObj &constrainIndexKey = BSONObj());
+        // compile: evaluate the query through a MatchProgram, unless it can't be compiled
+        // (see MatchProgram::compile()).
+        JSMatcher(const BSONObj &pattern, const BSONObj &constrainIndexKey = BSONObj(), bool compile = true);
 
         ~JSMatcher();
 
@@ -108,6 +113,8 @@ namespace mongo {
         }
 
         bool trivial() const { return n == 0 && nRegex == 0 && where == 0; }
+        bool hasWhere() const { return where != 0; }
+        bool compiled() const { return program.get() != 0; }
     private:
         void addBasic(const BSONElement &e, int c) {
             // TODO May want to selectively ignore these element types based on op type.
@@ -120,9 +127,9 @@ namespace mongo {
             n++;
         }
 
-        int valuesMatch(const BSONElement& l, const BSONElement& r, int op);
+        int valuesMatch(const BSONElement& l, const BasicMatcher& bm);
+        bool whereMatches(const BSONObj& jsobj);
 
-        set<BSONElement,element_lt> *in; // set if query uses $in
         Where *where;                    // set if query uses $where
         BSONObj jsobj;                  // the query pattern.  e.g., { name: "joe" }
         BSONObj constrainIndexKey_;
@@ -130,12 +137,13 @@ namespace mongo {
         vector<BasicMatcher> basics;
         int n;                           // # of basicmatcher items
 
-        RegexMatcher regexs[4];
+        vector< shared_ptr< RegexMatcher > > regexs;
         int nRegex;
 
         // so we delete the mem when we're done:
-        BSONObjBuilder *builders[8];
-        int nBuilders;
+        vector< shared_ptr< BSONObjBuilder > > builders;
+
+        auto_ptr< MatchProgram > program;
     };
     
     // If match succeeds on index key, then attempt to match full record.
@@ -144,6 +152,9 @@ namespace mongo {
         KeyValJSMatcher(const BSONObj &pattern, const BSONObj &indexKeyPattern);
         bool matches(const BSONObj &j, bool *deep = 0);
         bool matches(const BSONObj &key, const DiskLoc &recLoc, bool *deep = 0);
+        bool hasWhere() const { return recordMatcher_.hasWhere(); }
+        /* true if matches( key, recLoc ) never needs to look at the record */
+        bool keyMatch() const { return recordMatcher_.trivial(); }
     private:
         JSMatcher keyMatcher_;
         JSMatcher recordMatcher_;
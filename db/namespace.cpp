@@ -73,7 +73,9 @@ namespace mongo {
         ht = new HashTable<Namespace,NamespaceDetails>(p, LEN, "namespace index");
     }
 
-    void NamespaceDetails::addDeletedRec(DeletedRecord *d, DiskLoc dloc) {
+    void NamespaceDetails::addDeletedRec(const char *ns, DeletedRecord *d, DiskLoc dloc) {
+        writing(this);
+        writing(d, Record::HeaderSize + 4);
         {
             // defensive code: try to make us notice if we reference a deleted record
             (unsigned&) (((Record *) d)->data) = 0xeeeeeeee;
@@ -89,7 +91,7 @@ namespace mongo {
                 else {
                     DiskLoc i = deletedList[ 0 ];
                     for (; !i.drec()->nextDeleted.isNull(); i = i.drec()->nextDeleted );
-                    i.drec()->nextDeleted = dloc;
+                    writing(i.drec())->nextDeleted = dloc;
                 }
             } else {
                 d->nextDeleted = firstDeletedInCapExtent();
@@ -101,15 +103,19 @@ namespace mongo {
             DiskLoc oldHead = list;
             list = dloc;
             d->nextDeleted = oldHead;
+            FreeSpaceMap& m = NamespaceDetailsTransient::get(ns).freeSpace();
+            if ( m.built() )
+                m.pushed(b, dloc, d->lengthWithHeaders, oldHead);
         }
     }
 
     /*
        lenToAlloc is WITH header
     */
-    DiskLoc NamespaceDetails::alloc(const char *ns, int lenToAlloc, DiskLoc& extentLoc) {
+    DiskLoc NamespaceDetails::alloc(const char *ns, int lenToAlloc, DiskLoc& extentLoc, const DiskLoc& near) {
         lenToAlloc = (lenToAlloc + 3) & 0xfffffffc;
-        DiskLoc loc = _alloc(ns, lenToAlloc);
+        writing(this);
+        DiskLoc loc = _alloc(ns, lenToAlloc, near);
         if ( loc.isNull() )
             return loc;
 
@@ -127,20 +133,21 @@ namespace mongo {
         if ( capped == 0 ) {
             if ( left < 24 || left < (lenToAlloc >> 3) ) {
                 // you get the whole thing.
+                FreeSpaceMap::stats.bytesWasted += left;
                 return loc;
             }
         }
 
         /* split off some for further use. */
-        r->lengthWithHeaders = lenToAlloc;
+        writing(r)->lengthWithHeaders = lenToAlloc;
         DiskLoc newDelLoc = loc;
         newDelLoc.inc(lenToAlloc);
-        DeletedRecord *newDel = newDelLoc.drec();
+        DeletedRecord *newDel = writing(newDelLoc.drec());
         newDel->extentOfs = r->extentOfs;
         newDel->lengthWithHeaders = left;
         newDel->nextDeleted.Null();
 
-        addDeletedRec(newDel, newDelLoc);
+        addDeletedRec(ns, newDel, newDelLoc);
 
         return loc;
     }
@@ -148,77 +155,114 @@ namespace mongo {
     /* for non-capped collections.
        returned item is out of the deleted list upon return
     */
-    DiskLoc NamespaceDetails::__stdAlloc(int len) {
-        DiskLoc *prev;
-        DiskLoc *bestprev = 0;
-        DiskLoc bestmatch;
-        int bestmatchlen = 0x7fffffff;
-        int b = bucket(len);
-        DiskLoc cur = deletedList[b];
-        prev = &deletedList[b];
-        int extra = 5; // look for a better fit, a little.
-        int chain = 0;
-        while ( 1 ) {
-            {
-                int a = cur.a();
-                if ( a < -1 || a >= 100000 ) {
-                    problem() << "~~ Assertion - cur out of range in _alloc() " << cur.toString() <<
-                    " a:" << a << " b:" << b << " chain:" << chain << '\n';
-                    sayDbContext();
-                    if ( cur == *prev )
-                        prev->Null();
-                    cur.Null();
-                }
+    DiskLoc NamespaceDetails::__stdAlloc(const char *ns, int len, const DiskLoc& near) {
+        FreeSpaceMap& m = NamespaceDetailsTransient::get(ns).freeSpace();
+        if ( !m.built() )
+            m.build(this);
+        DiskLoc loc = m.find(len, near);
+        if ( loc.isNull() )
+            return loc; // out of space. alloc a new extent.
+        m.unlink(this, loc);
+        return loc;
+    }
+
+    FreeSpaceMap::Stats FreeSpaceMap::stats;
+
+    void FreeSpaceMap::reset() {
+        built_ = false;
+        byLoc_.clear();
+        bySize_.clear();
+    }
+
+    void FreeSpaceMap::build(NamespaceDetails *d) {
+        reset();
+        stats.builds++;
+        for ( int b = 0; b < Buckets; b++ ) {
+            DiskLoc prev;
+            for ( DiskLoc cur = d->deletedList[b]; !cur.isNull(); cur = cur.drec()->nextDeleted ) {
+                Node &n = byLoc_[cur];
+                n.len = cur.drec()->lengthWithHeaders;
+                n.bucket = b;
+                n.prev = prev;
+                bySize_.insert( make_pair(n.len, cur) );
+                prev = cur;
+                stats.walked++;
             }
-            if ( cur.isNull() ) {
-                // move to next bucket.  if we were doing "extra", just break
-                if ( bestmatchlen < 0x7fffffff )
-                    break;
-                b++;
-                if ( b > MaxBucket ) {
-                    // out of space. alloc a new extent.
-                    return DiskLoc();
-                }
-                cur = deletedList[b];
-                prev = &deletedList[b];
+        }
+        built_ = true;
+    }
+
+    void FreeSpaceMap::pushed(int b, const DiskLoc& dloc, int len, const DiskLoc& oldHead) {
+        if ( !oldHead.isNull() )
+            byLoc_[oldHead].prev = dloc;
+        Node &n = byLoc_[dloc];
+        n.len = len;
+        n.bucket = b;
+        n.prev = DiskLoc();
+        bySize_.insert( make_pair(len, dloc) );
+    }
+
+    DiskLoc FreeSpaceMap::find(int len, const DiskLoc& near) {
+        set< pair< int, DiskLoc > >::iterator i = bySize_.lower_bound( make_pair(len, DiskLoc()) );
+        if ( i == bySize_.end() )
+            return DiskLoc();
+        stats.allocs++;
+        stats.examined++;
+        if ( near.isNull() )
+            return i->second;
+
+        /* anything up to an eighth bigger than the best fit fits about as well -- alloc()
+           would hand that much over rather than split it */
+        int fits = i->first + ( i->first >> 3 );
+        DiskLoc best = i->second;
+        int bestDist = 0x7fffffff;
+        for ( int n = 0; i != bySize_.end() && i->first <= fits && n < 16; ++i, ++n ) {
+            stats.examined++;
+            if ( i->second.a() != near.a() )
                 continue;
-            }
-            DeletedRecord *r = cur.drec();
-            if ( r->lengthWithHeaders >= len &&
-                    r->lengthWithHeaders < bestmatchlen ) {
-                bestmatchlen = r->lengthWithHeaders;
-                bestmatch = cur;
-                bestprev = prev;
-            }
-            if ( bestmatchlen < 0x7fffffff && --extra <= 0 )
-                break;
-            if ( ++chain > 30 && b < MaxBucket ) {
-                // too slow, force move to next bucket to grab a big chunk
-                //b++;
-                chain = 0;
-                cur.Null();
-            }
-            else {
-                /*this defensive check only made sense for the mmap storage engine: 
-                  if ( r->nextDeleted.getOfs() == 0 ) {
-                    problem() << "~~ Assertion - bad nextDeleted " << r->nextDeleted.toString() <<
-                    " b:" << b << " chain:" << chain << ", fixing.\n";
-                    r->nextDeleted.Null();
-                }*/
-                cur = r->nextDeleted;
-                prev = &r->nextDeleted;
+            int dist = i->second.getOfs() - near.getOfs();
+            if ( dist < 0 )
+                dist = -dist;
+            if ( dist < bestDist ) {
+                bestDist = dist;
+                best = i->second;
             }
         }
+        if ( bestDist != 0x7fffffff )
+            stats.nearby++;
+        return best;
+    }
 
-        /* unlink ourself from the deleted list */
-        {
-            DeletedRecord *bmr = bestmatch.drec();
-            *bestprev = bmr->nextDeleted;
-            bmr->nextDeleted.setInvalid(); // defensive.
-            assert(bmr->extentOfs < bestmatch.getOfs());
+    void FreeSpaceMap::unlink(NamespaceDetails *d, const DiskLoc& dloc) {
+        map< DiskLoc, Node >::iterator i = byLoc_.find(dloc);
+        assert( i != byLoc_.end() );
+        Node n = i->second;
+        DeletedRecord *r = writing(dloc.drec());
+        massert( "free space map out of sync with deleted lists", r->lengthWithHeaders == n.len );
+        DiskLoc next = r->nextDeleted;
+        if ( n.prev.isNull() ) {
+            assert( d->deletedList[n.bucket] == dloc );
+            *writing(&d->deletedList[n.bucket]) = next;
+        }
+        else {
+            writing(n.prev.drec())->nextDeleted = next;
         }
+        if ( !next.isNull() )
+            byLoc_[next].prev = n.prev;
+        r->nextDeleted.setInvalid(); // defensive.
+        assert( r->extentOfs < dloc.getOfs() );
+        byLoc_.erase(i);
+        bySize_.erase( make_pair(n.len, dloc) );
+    }
 
-        return bestmatch;
+    void FreeSpaceMap::unlinkRange(NamespaceDetails *d, const DiskLoc& from, const DiskLoc& to, vector<DiskLoc>& out) {
+        vector<DiskLoc> found;
+        for ( map< DiskLoc, Node >::iterator i = byLoc_.lower_bound(from); i != byLoc_.end() && i->first < to; ++i )
+            found.push_back(i->first);
+        for ( vector<DiskLoc>::iterator i = found.begin(); i != found.end(); ++i ) {
+            unlink(d, *i);
+            out.push_back(*i);
+        }
     }
 
     void NamespaceDetails::dumpDeleted(set<DiskLoc> *extents) {
@@ -249,6 +293,7 @@ namespace mongo {
     */
     void NamespaceDetails::compact() {
         assert(capped);
+        writing(this);
 
         list<DiskLoc> drecs;
 
@@ -268,23 +313,23 @@ namespace mongo {
             j++;
             if ( j == drecs.end() ) {
                 DEBUGGING out() << "TEMP: compact adddelrec\n";
-                addDeletedRec(a.drec(), a);
+                addDeletedRec(0, a.drec(), a);
                 break;
             }
             DiskLoc b = *j;
             while ( a.a() == b.a() && a.getOfs() + a.drec()->lengthWithHeaders == b.getOfs() ) {
                 // a & b are adjacent.  merge.
-                a.drec()->lengthWithHeaders += b.drec()->lengthWithHeaders;
+                writing(a.drec())->lengthWithHeaders += b.drec()->lengthWithHeaders;
                 j++;
                 if ( j == drecs.end() ) {
                     DEBUGGING out() << "temp: compact adddelrec2\n";
-                    addDeletedRec(a.drec(), a);
+                    addDeletedRec(0, a.drec(), a);
                     return;
                 }
                 b = *j;
             }
             DEBUGGING out() << "temp: compact adddelrec3\n";
-            addDeletedRec(a.drec(), a);
+            addDeletedRec(0, a.drec(), a);
             a = b;
         }
     }
@@ -311,7 +356,7 @@ namespace mongo {
         if ( deletedList[ 1 ].isNull() )
             return deletedList[ 0 ];
         else
-            return deletedList[ 1 ].drec()->nextDeleted;
+            return writing(deletedList[ 1 ].drec())->nextDeleted; // callers may assign to it
     }
 
     bool NamespaceDetails::inCapExtent( const DiskLoc &dl ) const {
@@ -381,17 +426,27 @@ namespace mongo {
             if ( prev.isNull() )
                 deletedList[ 0 ] = ret.drec()->nextDeleted;
             else
-                prev.drec()->nextDeleted = ret.drec()->nextDeleted;
-            ret.drec()->nextDeleted.setInvalid(); // defensive.
+                writing(prev.drec())->nextDeleted = ret.drec()->nextDeleted;
+            writing(ret.drec())->nextDeleted.setInvalid(); // defensive.
             assert( ret.drec()->extentOfs < ret.getOfs() );
         }
 
         return ret;
     }
 
+    void NamespaceIndex::checkMigrateAll() {
+        if ( !ht )
+            return;
+        requireInWriteLock();
+        for ( int i = 0; i < ht->n; i++ )
+            if ( ht->nodes[i].inUse() )
+                ht->nodes[i].value.checkMigrate();
+    }
+
     void NamespaceDetails::checkMigrate() {
         // migrate old NamespaceDetails format
         if ( capped && capExtent.a() == 0 && capExtent.getOfs() == 0 ) {
+            writing(this);
             capFirstNewRecord = DiskLoc();
             capFirstNewRecord.setInvalid();
             // put all the DeletedRecords in deletedList[ 0 ]
@@ -401,7 +456,7 @@ namespace mongo {
                     continue;
                 DiskLoc last = first;
                 for (; !last.drec()->nextDeleted.isNull(); last = last.drec()->nextDeleted );
-                last.drec()->nextDeleted = deletedList[ 0 ];
+                writing(last.drec())->nextDeleted = deletedList[ 0 ];
                 deletedList[ 0 ] = first;
                 deletedList[ i ] = DiskLoc();
             }
@@ -413,9 +468,9 @@ namespace mongo {
     }
 
     /* alloc with capped table handling. */
-    DiskLoc NamespaceDetails::_alloc(const char *ns, int len) {
+    DiskLoc NamespaceDetails::_alloc(const char *ns, int len, const DiskLoc& near) {
         if ( !capped )
-            return __stdAlloc(len);
+            return __stdAlloc(ns, len, near);
 
         // capped.
 
@@ -484,6 +539,7 @@ namespace mongo {
     void NamespaceDetails::addingIndex(const char *thisns, IndexDetails& details) {
         assert( nsdetails(thisns) == this );
         assert( &details == &indexes[nIndexes] );
+        writing(this);
         nIndexes++;
         NamespaceDetailsTransient::get(thisns).addedIndex();
     }
@@ -504,14 +560,20 @@ namespace mongo {
     /* ------------------------------------------------------------------------- */
 
     map< string, shared_ptr< NamespaceDetailsTransient > > NamespaceDetailsTransient::map_;
+    boost::mutex NamespaceDetailsTransient::qcMutex;
     typedef map< string, shared_ptr< NamespaceDetailsTransient > >::iterator ouriter;
 
     void NamespaceDetailsTransient::reset() {
         clearQueryCache();
+        {
+            boostlock lk( qcMutex );
+            indexStats_.clear();
+        }
         haveIndexKeys = false;
     }
     
     NamespaceDetailsTransient& NamespaceDetailsTransient::get(const char *ns) {
+        boostlock lk( qcMutex );
         shared_ptr< NamespaceDetailsTransient > &t = map_[ ns ];
         if ( t.get() == 0 )
             t.reset( new NamespaceDetailsTransient(ns) );
@@ -519,6 +581,7 @@ namespace mongo {
     }
 
     void NamespaceDetailsTransient::drop(const char *prefix) {
+        boostlock lk( qcMutex );
         vector< string > found;
         for( ouriter i = map_.begin(); i != map_.end(); ++i )
             if ( strncmp( i->first.c_str(), prefix, strlen( prefix ) ) == 0 )
@@ -536,6 +599,45 @@ namespace mongo {
             d->indexes[i].keyPattern().getFieldNames(allIndexKeys);
 //        allIndexKeys.insert(fields.begin(),fields.end());
         }
+        /* an update must not modify a field in place if it is in an index being built */
+        IndexDetails *building = BackgroundIndexBuild::indexBeingBuilt(ns.c_str(), d);
+        if ( building )
+            building->keyPattern().getFieldNames(allIndexKeys);
+    }
+
+    /* ------------------------------------------------------------------------- */
+
+    set<string> BackgroundIndexBuild::nss_;
+
+    BackgroundIndexBuild::BackgroundIndexBuild(const char *ns) : ns_(ns) {
+        requireInWriteLock();
+        assertNoneInProgForNs(ns);
+        nss_.insert(ns_);
+        /* indexKeys() must now include the new index */
+        NamespaceDetailsTransient::get(ns).addedIndex();
+    }
+
+    BackgroundIndexBuild::~BackgroundIndexBuild() {
+        nss_.erase(ns_);
+        NamespaceDetailsTransient::get(ns_.c_str()).addedIndex();
+    }
+
+    bool BackgroundIndexBuild::inProgForDb(const char *db) {
+        string prefix = string(db) + '.';
+        for ( set<string>::iterator i = nss_.begin(); i != nss_.end(); ++i )
+            if ( strncmp(i->c_str(), prefix.c_str(), prefix.size()) == 0 )
+                return true;
+        return false;
+    }
+
+    void BackgroundIndexBuild::assertNoneInProgForNs(const char *ns) {
+        uassert("operation not allowed while a background index build is in progress on the collection",
+                !inProgForNs(ns));
+    }
+
+    void BackgroundIndexBuild::assertNoneInProgForDb(const char *db) {
+        uassert("operation not allowed while a background index build is in progress on the database",
+                !inProgForDb(db));
     }
     
     void NamespaceDetailsTransient::startLog( int logSizeMb ) {
@@ -26,6 +26,7 @@
 
 #include "../util/hashtab.h"
 #include "../util/mmap.h"
+#include "journal.h"
 
 namespace mongo {
 
@@ -152,8 +153,9 @@ namespace mongo {
            can index them.  Note that the set is multiple elements
            only when it's a "multikey" array.
            keys will be left empty if key not found in the object.
+           *multiKey, if given, is set to true when the keys came from an array.
         */
-        void getKeysFromObject( const BSONObj& obj, BSONObjSetDefaultOrder& keys) const;
+        void getKeysFromObject( const BSONObj& obj, BSONObjSetDefaultOrder& keys, bool *multiKey = 0 ) const;
 
         /* get the key pattern for this object.
            e.g., { lastname:1, firstname:1 }
@@ -180,6 +182,21 @@ namespace mongo {
             return io.getStringField("name");
         }
 
+        /* on disk format of the btree, the "v" field of the index spec.  0 if not specified.
+             0 - keys stored as is
+             1 - keys prefix compressed (see BucketBasics)
+        */
+        enum { MaxVersion = 1 };
+        int version() const {
+            BSONElement e = info.obj().getField("v");
+            return e.isNumber() ? (int) e.number() : 0;
+        }
+
+        /* keys stored as NormalizedKeys, { normalizedKeys : true } in the index spec */
+        bool normalizedKeys() const {
+            return info.obj().getBoolField("normalizedKeys");
+        }
+
         /* returns true if this is the _id index. */
         bool isIdIndex() const { 
             BSONObjIterator i(keyPattern());
@@ -221,6 +238,8 @@ namespace mongo {
             capFirstNewRecord = DiskLoc();
             // Signal that we are on first allocation iteration through extents.
             capFirstNewRecord.setInvalid();
+            multiKeyIndexBits = 0;
+            multiKeyKnownBits = 0;
             // For capped case, signal that we are doing initial extent allocation.
             if ( capped )
                 deletedList[ 1 ].setInvalid();
@@ -240,7 +259,9 @@ namespace mongo {
         int flags;
         DiskLoc capExtent;
         DiskLoc capFirstNewRecord;
-        char reserved[108];
+        unsigned long long multiKeyIndexBits; // bit i set: index i has keys from an array
+        unsigned long long multiKeyKnownBits; // bit i set: multiKeyIndexBits is kept for index i
+        char reserved[92];
 
         enum {
             Flag_HaveIdIndex = 1 << 0, // set when we have _id index (ONLY if ensureIdIndex was called -- 0 if that has never been called)
@@ -251,11 +272,11 @@ namespace mongo {
         void addingIndex(const char *thisns, IndexDetails& details);
 
         void aboutToDeleteAnIndex() {
-            flags &= ~Flag_HaveIdIndex;
+            *writing(&flags) &= ~Flag_HaveIdIndex;
         }
 
         void cappedDisallowDelete() {
-            flags |= Flag_CappedDisallowDelete;
+            *writing(&flags) |= Flag_CappedDisallowDelete;
         }
         
         /* returns index of the first index in which the field is present. -1 if not present. */
@@ -264,12 +285,12 @@ namespace mongo {
         void paddingFits() {
             double x = paddingFactor - 0.01;
             if ( x >= 1.0 )
-                paddingFactor = x;
+                *writing(&paddingFactor) = x;
         }
         void paddingTooSmall() {
             double x = paddingFactor + 0.6;
             if ( x <= 2.0 )
-                paddingFactor = x;
+                *writing(&paddingFactor) = x;
         }
 
         //returns offset in indexes[]
@@ -281,6 +302,42 @@ namespace mongo {
             return -1;
         }
 
+        /* index number of idx, which may be the index being built in the background at
+           indexes[nIndexes] */
+        int idxNo(const IndexDetails& idx) const {
+            int i = &idx - indexes;
+            assert( i >= 0 && i <= nIndexes && i < MaxIndexes );
+            return i;
+        }
+
+        /* true if index i may hold, for some document, a key per element of an array rather
+           than the value of the field -- so a key doesn't tell what the document holds.
+           Indexes built before we kept track are assumed to be multikey.
+        */
+        bool isMultikey(int i) const {
+            unsigned long long x = 1ULL << i;
+            return ( multiKeyIndexBits & x ) || !( multiKeyKnownBits & x );
+        }
+        void setIndexIsMultikey(int i) {
+            unsigned long long x = 1ULL << i;
+            if ( !( multiKeyIndexBits & x ) )
+                *writing(&multiKeyIndexBits) |= x;
+        }
+        /* call for a new index's slot before any keys are added to it */
+        void clearIndexIsMultikey(int i) {
+            unsigned long long x = 1ULL << i;
+            writing(&multiKeyIndexBits, 2 * sizeof(unsigned long long)); // and multiKeyKnownBits
+            multiKeyIndexBits &= ~x;
+            multiKeyKnownBits |= x;
+        }
+        /* index i was removed and the ones after it moved down a slot */
+        void removedIndexBits(int i) {
+            unsigned long long below = ( 1ULL << i ) - 1;
+            writing(&multiKeyIndexBits, 2 * sizeof(unsigned long long));
+            multiKeyIndexBits = ( multiKeyIndexBits & below ) | ( ( multiKeyIndexBits >> 1 ) & ~below );
+            multiKeyKnownBits = ( multiKeyKnownBits & below ) | ( ( multiKeyKnownBits >> 1 ) & ~below );
+        }
+
         int findIdIndex() {
             for( int i = 0; i < nIndexes; i++ ) {
                 if( indexes[i].isIdIndex() )
@@ -297,11 +354,12 @@ namespace mongo {
             return Buckets-1;
         }
 
-        /* allocate a new record.  lenToAlloc includes headers. */
-        DiskLoc alloc(const char *ns, int lenToAlloc, DiskLoc& extentLoc);
+        /* allocate a new record.  lenToAlloc includes headers.  near is a hint: if the new
+           record replaces one that was at near, we try to place it close by. */
+        DiskLoc alloc(const char *ns, int lenToAlloc, DiskLoc& extentLoc, const DiskLoc& near = DiskLoc());
 
-        /* add a given record to the deleted chains for this NS */
-        void addDeletedRec(DeletedRecord *d, DiskLoc dloc);
+        /* add a given record to the deleted chains for this NS.  ns may be 0 if capped. */
+        void addDeletedRec(const char *ns, DeletedRecord *d, DiskLoc dloc);
 
         void dumpDeleted(set<DiskLoc> *extents = 0);
 
@@ -328,9 +386,9 @@ namespace mongo {
         }
         void advanceCapExtent( const char *ns );
         void maybeComplain( const char *ns, int len ) const;
-        DiskLoc __stdAlloc(int len);
+        DiskLoc __stdAlloc(const char *ns, int len, const DiskLoc& near);
         DiskLoc __capAlloc(int len);
-        DiskLoc _alloc(const char *ns, int len);
+        DiskLoc _alloc(const char *ns, int len, const DiskLoc& near);
         void compact();
 
         DiskLoc &firstDeletedInCapExtent();
@@ -339,6 +397,62 @@ namespace mongo {
 
 #pragma pack()
 
+    /* An in memory index over the deleted lists of a (non capped) collection, so that finding a
+       free record that fits doesn't mean walking the lists.  Free records are kept ordered by
+       size; each also remembers its predecessor in its on disk list so it can be unlinked
+       without a walk.  The on disk lists are unchanged -- they are still the truth, and the
+       map is rebuilt from them the first time it is needed after the server starts.
+
+       Anything that changes deletedList other than addDeletedRec() and alloc() must call
+       reset().  Only touched with dbMutex held exclusively.
+    */
+    class FreeSpaceMap : boost::noncopyable {
+    public:
+        FreeSpaceMap() : built_(false) { }
+
+        bool built() const { return built_; }
+        void build(NamespaceDetails *d);
+        void reset();
+
+        /* dloc, len bytes, was just pushed on the front of deletedList[b] */
+        void pushed(int b, const DiskLoc& dloc, int len, const DiskLoc& oldHead);
+
+        /* the smallest free record of at least len bytes.  among those that fit about as
+           well, prefers one in the same file and closest to near.  null if none fits. */
+        DiskLoc find(int len, const DiskLoc& near);
+
+        /* take dloc out of d's deleted lists */
+        void unlink(NamespaceDetails *d, const DiskLoc& dloc);
+        /* take every free record in [from, to) out of d's deleted lists, adding them to out */
+        void unlinkRange(NamespaceDetails *d, const DiskLoc& from, const DiskLoc& to, vector<DiskLoc>& out);
+
+        int nFree() const { return byLoc_.size(); }
+
+        /* process wide, for the allocinfo command */
+        struct Stats {
+            Stats() : allocs(), examined(), nearby(), bytesWasted(), builds(), walked() { }
+            long long allocs;      // records allocated through a map
+            long long examined;    // candidates looked at by find()
+            long long nearby;      // allocations placed near the record they replace
+            long long bytesWasted; // left over space handed out with a record as too small to split
+            long long builds;      // maps built from the on disk lists
+            long long walked;      // deleted records walked building them
+        };
+        static Stats stats;
+
+    private:
+        struct Node {
+            int len;
+            int bucket;
+            DiskLoc prev; // null if first in deletedList[bucket]
+        };
+        bool built_;
+        map< DiskLoc, Node > byLoc_;
+        set< pair< int, DiskLoc > > bySize_;
+    };
+
+    class IndexStats;
+
     /* these are things we know / compute about a namespace that are transient -- things
        we don't actually store in the .ns file.  so mainly caching of frequently used
        information.
@@ -354,10 +468,13 @@ namespace mongo {
         void computeIndexKeys();
         int writeCount_;
         map< QueryPattern, pair< BSONObj, long long > > queryCache_;
+        long long nWrites_; // since we were made; for telling how stale indexStats_ are
+        map< string, pair< shared_ptr< IndexStats >, long long > > indexStats_; // by index name, with nWrites_ when taken
         string logNS_;
         bool logValid_;
+        FreeSpaceMap freeSpace_;
     public:
-        NamespaceDetailsTransient(const char *_ns) : ns(_ns), haveIndexKeys(), writeCount_(), logValid_() {
+        NamespaceDetailsTransient(const char *_ns) : ns(_ns), haveIndexKeys(), writeCount_(), nWrites_(), logValid_() {
             haveIndexKeys=false; /*lazy load them*/
         }
 
@@ -374,42 +491,103 @@ namespace mongo {
 
         void addedIndex() { reset(); }
         void deletedIndex() { reset(); }
-        void registerWriteOp() {
+        /* after this many writes to a collection of nrecords, what we have cached about its
+           data is out of date: a tenth of the collection, but at least 100. */
+        static long long staleAfter( long long nrecords ) {
+            return nrecords / 10 > 100 ? nrecords / 10 : 100;
+        }
+        /* nrecords is the collection's size after the write */
+        void registerWriteOp( long long nrecords ) {
+            boostlock lk( qcMutex );
+            ++nWrites_;
             if ( queryCache_.empty() )
                 return;
-            if ( ++writeCount_ >= 100 )
-                clearQueryCache();
+            if ( ++writeCount_ >= staleAfter( nrecords ) ) {
+                queryCache_.clear();
+                writeCount_ = 0;
+            }
         }
         void clearQueryCache() {
+            boostlock lk( qcMutex );
             queryCache_.clear();
             writeCount_ = 0;
         }
+        /* the query cache is read and written by queries, which may run concurrently
+           under a shared dbMutex. */
         BSONObj indexForPattern( const QueryPattern &pattern ) {
+            boostlock lk( qcMutex );
             return queryCache_[ pattern ].first;
         }
         long long nScannedForPattern( const QueryPattern &pattern ) {
+            boostlock lk( qcMutex );
             return queryCache_[ pattern ].second;
         }
         void registerIndexForPattern( const QueryPattern &pattern, const BSONObj &indexKey, long long nScanned ) {
+            boostlock lk( qcMutex );
             queryCache_[ pattern ] = make_pair( indexKey, nScanned );
         }
+        /* the statistics last registered for the index named name, or an empty pointer if
+           there are none or the collection (now nrecords) has changed too much since. */
+        shared_ptr< IndexStats > indexStats( const string &name, long long nrecords ) {
+            boostlock lk( qcMutex );
+            map< string, pair< shared_ptr< IndexStats >, long long > >::iterator i = indexStats_.find( name );
+            if ( i == indexStats_.end() || nWrites_ - i->second.second >= staleAfter( nrecords ) )
+                return shared_ptr< IndexStats >();
+            return i->second.first;
+        }
+        void registerIndexStats( const string &name, const shared_ptr< IndexStats > &stats ) {
+            boostlock lk( qcMutex );
+            indexStats_[ name ] = make_pair( stats, nWrites_ );
+        }
         
         void startLog( int logSizeMb = 128 );
         void invalidateLog();
         bool validateCompleteLog();
         string logNS() const { return logNS_; }
         bool logValid() const { return logValid_; }
+
+        FreeSpaceMap& freeSpace() { return freeSpace_; }
         
     private:
         void reset();
         void dropLog();
         static std::map< string, shared_ptr< NamespaceDetailsTransient > > map_;
+        static boost::mutex qcMutex; // guards map_ and all query caches
     public:
         static NamespaceDetailsTransient& get(const char *ns);
         // Drop cached information on all namespaces beginning with the specified prefix.
         static void drop(const char *prefix);
     };
 
+    /* Collections with an index being built in the background.  While a build is in progress
+       the new index lives at indexes[nIndexes]: inserts, updates and deletes maintain it, but
+       it is not counted in nIndexes so the query optimizer doesn't use it until it is complete.
+       Only touched with dbMutex held exclusively.
+    */
+    class BackgroundIndexBuild : boost::noncopyable {
+    public:
+        BackgroundIndexBuild(const char *ns);
+        ~BackgroundIndexBuild();
+
+        static bool inProgForNs(const char *ns) {
+            return !nss_.empty() && nss_.count(ns) != 0;
+        }
+        static bool inProgForDb(const char *db);
+
+        /* the index under construction for ns, or 0 if there is none */
+        static IndexDetails* indexBeingBuilt(const char *ns, NamespaceDetails *d) {
+            return inProgForNs(ns) ? &d->indexes[d->nIndexes] : 0;
+        }
+
+        /* uasserts -- for operations that would pull the collection (or database) out
+           from under a build. */
+        static void assertNoneInProgForNs(const char *ns);
+        static void assertNoneInProgForDb(const char *db);
+    private:
+        string ns_;
+        static set<string> nss_;
+    };
+
     /* NamespaceIndex is the ".ns" file you see in the data directory.  It is the "system catalog"
        if you will: at least the core parts.  (Additional info in system.* collections.)
     */
@@ -425,12 +603,16 @@ namespace mongo {
         bool exists() const;
         
         void init();
+        bool initialized() const { return ht != 0; }
 
         void add(const char *ns, DiskLoc& loc, bool capped) {
             init();
             Namespace n(ns);
             NamespaceDetails details( loc, capped );
             ht->put(n, details);
+            writing(ht->node(n));
+            /* the deleted lists start out empty -- forget any from a dropped namespace of the same name */
+            NamespaceDetailsTransient::get(ns).freeSpace().reset();
         }
 
         /* just for diagnostics */
@@ -444,16 +626,21 @@ namespace mongo {
             if ( !ht )
                 return 0;
             Namespace n(ns);
-            NamespaceDetails *d = ht->get(n);
-            if ( d )
-                d->checkMigrate();
-            return d;
+            return ht->get(n);
         }
 
+        /* migrate namespaces in old formats.  this writes, so it is done once when the
+           database is opened (with dbMutex held exclusively) rather than from details(),
+           which readers call with a shared lock. */
+        void checkMigrateAll();
+
         void kill(const char *ns) {
             if ( !ht )
                 return;
             Namespace n(ns);
+            HashTable<Namespace,NamespaceDetails>::Node *node = ht->node(n);
+            if ( node )
+                writing(node);
             ht->kill(n);
         }
 
@@ -0,0 +1,310 @@
+// normkey.cpp
+
+/**
+*    Copyright (C) 2008 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "normkey.h"
+
+namespace mongo {
+
+    /* ints and doubles compare as numbers, see BSONElement::woCompare().  0 is left free
+       to end embedded objects, which sort before any further field. */
+    static inline char typeByte(int t) {
+        if ( t == NumberInt )
+            t = NumberDouble;
+        return (char) (t + 2);
+    }
+
+    static void appendBigEndian(BufBuilder& b, unsigned long long v, int bytes) {
+        for ( int i = bytes - 1; i >= 0; i-- )
+            b.append((char) (v >> (8 * i)));
+    }
+
+    /* strings compare with strcmp(), so only the part before any embedded null is
+       comparable.  the rest, if any, goes in the trailer. */
+    static void appendString(BufBuilder& b, BufBuilder& trailer, const char *s, int len) {
+        int pre = strlen(s);
+        b.append(s, pre + 1);
+        if ( pre == len ) {
+            trailer.append('s');
+            return;
+        }
+        trailer.append('t');
+        trailer.append(len - pre);
+        trailer.append(s + pre, len - pre);
+    }
+
+    static void encodeObject(BufBuilder& b, BufBuilder& trailer, const BSONObj& o);
+
+    static void encodeValue(BufBuilder& b, BufBuilder& trailer, const BSONElement& e) {
+        switch ( e.type() ) {
+        case MinKey:
+        case MaxKey:
+        case Undefined:
+        case jstNULL:
+            break;
+        case Bool:
+            b.append(*e.value());
+            break;
+        case Date:
+        case Timestamp:
+            appendBigEndian(b, e.date(), 8);
+            break;
+        case NumberInt:
+        case NumberDouble: {
+            double d = e.number();
+            unsigned long long bits;
+            memcpy(&bits, &d, 8);
+            char code = e.type() == NumberInt ? 'i' : 'd';
+            if ( d == 0 ) {
+                if ( bits )
+                    code = 'z';
+                bits = 0;
+            }
+            /* flip negatives entirely and positives' sign bit, which orders them as unsigned */
+            bits = ( bits >> 63 ) ? ~bits : bits | ( 1ULL << 63 );
+            appendBigEndian(b, bits, 8);
+            trailer.append(code);
+            break;
+        }
+        case jstOID:
+            b.append(e.value(), 12);
+            break;
+        case String:
+        case Code:
+        case Symbol:
+            appendString(b, trailer, e.valuestr(), e.valuestrsize() - 1);
+            break;
+        case Object:
+        case Array:
+            encodeObject(b, trailer, e.embeddedObject());
+            break;
+        case BinData:
+        case DBRef:
+            /* compared by size, then bytes */
+            appendBigEndian(b, e.valuesize(), 4);
+            b.append(e.value(), e.valuesize());
+            break;
+        case RegEx:
+            b.append(e.regex());
+            b.append(e.regexFlags());
+            break;
+        default:
+            massert( "type not supported in normalized index keys", false );
+        }
+    }
+
+    static void encodeObject(BufBuilder& b, BufBuilder& trailer, const BSONObj& o) {
+        BSONObjIterator i(o);
+        while ( 1 ) {
+            BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
+            b.append(typeByte(e.type()));
+            b.append(e.fieldName());
+            encodeValue(b, trailer, e);
+        }
+        b.append((char) 0);
+    }
+
+    BSONObj NormalizedKey::encode(const BSONObj& key, const BSONObj& keyPattern) {
+        BufBuilder b(128);
+        BufBuilder trailer(16);
+        b.skip(4);
+        BSONObjIterator i(key);
+        BSONObjIterator k(keyPattern);
+        while ( 1 ) {
+            BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
+            BSONElement o = k.more() ? k.next() : BSONElement();
+            int start = b.len();
+            b.append(typeByte(e.type()));
+            encodeValue(b, trailer, e);
+            if ( o.number() < 0 ) {
+                char *p = b.buf();
+                for ( int j = start; j < b.len(); j++ )
+                    p[j] = ~p[j];
+            }
+        }
+        massert( "normalized index key too large", trailer.len() <= 0xffff );
+        b.append(trailer.buf(), trailer.len());
+        b.append((unsigned short) trailer.len());
+        *((int *) b.buf()) = b.len();
+        BSONObj r(b.buf(), true);
+        b.decouple();
+        return r;
+    }
+
+    /* reads the comparable bytes, undoing the complement of descending fields */
+    class NormalizedKeyReader {
+    public:
+        NormalizedKeyReader(const char *p, const char *trailer) :
+            p_((const unsigned char *) p), mask_(0), trailer_(trailer) { }
+        void setDescending(bool d) { mask_ = d ? 0xff : 0; }
+        const char *pos() const { return (const char *) p_; }
+        unsigned char peek() const { return *p_ ^ mask_; }
+        unsigned char byte() { return *p_++ ^ mask_; }
+        char trailer() { return *trailer_++; }
+        void trailerBytes(BufBuilder& b, int n) {
+            b.append(trailer_, n);
+            trailer_ += n;
+        }
+        int trailerInt() {
+            int x;
+            memcpy(&x, trailer_, 4);
+            trailer_ += 4;
+            return x;
+        }
+        unsigned long long bigEndian(int bytes) {
+            unsigned long long v = 0;
+            for ( int i = 0; i < bytes; i++ )
+                v = ( v << 8 ) | byte();
+            return v;
+        }
+        void bytes(BufBuilder& b, int n) {
+            if ( mask_ == 0 ) {
+                b.append(p_, n);
+                p_ += n;
+                return;
+            }
+            for ( int i = 0; i < n; i++ )
+                b.append((char) byte());
+        }
+        void cstring(BufBuilder& b) {
+            char c;
+            do {
+                c = byte();
+                b.append(c);
+            } while ( c );
+        }
+        /* a string, see appendString() */
+        void string(BufBuilder& b) {
+            char c;
+            while ( ( c = byte() ) != 0 )
+                b.append(c);
+            if ( trailer() == 't' )
+                trailerBytes(b, trailerInt());
+        }
+    private:
+        const unsigned char *p_;
+        unsigned char mask_;
+        const char *trailer_;
+    };
+
+    static void decodeObject(NormalizedKeyReader& r, BufBuilder& b);
+
+    static void decodeElement(NormalizedKeyReader& r, BufBuilder& b, bool topLevel) {
+        int type = (int) r.byte() - 2;
+        char code = 0;
+        if ( type == NumberDouble ) {
+            code = r.trailer();
+            if ( code == 'i' )
+                type = NumberInt;
+        }
+        b.append((char) type);
+        if ( topLevel )
+            b.append("");
+        else
+            r.cstring(b);
+
+        switch ( type ) {
+        case MinKey:
+        case MaxKey:
+        case Undefined:
+        case jstNULL:
+            break;
+        case Bool:
+            b.append((char) r.byte());
+            break;
+        case Date:
+        case Timestamp:
+            b.append(r.bigEndian(8));
+            break;
+        case NumberInt:
+        case NumberDouble: {
+            unsigned long long bits = r.bigEndian(8);
+            bits = ( bits >> 63 ) ? bits & ~( 1ULL << 63 ) : ~bits;
+            if ( code == 'z' )
+                bits = 1ULL << 63;
+            double d;
+            memcpy(&d, &bits, 8);
+            if ( type == NumberInt )
+                b.append((int) d);
+            else
+                b.append(d);
+            break;
+        }
+        case jstOID:
+            r.bytes(b, 12);
+            break;
+        case String:
+        case Code:
+        case Symbol: {
+            int start = b.len();
+            b.skip(4);
+            r.string(b);
+            b.append((char) 0);
+            *((int *) (b.buf() + start)) = b.len() - start - 4;
+            break;
+        }
+        case Object:
+        case Array:
+            decodeObject(r, b);
+            break;
+        case BinData:
+        case DBRef:
+            r.bytes(b, (int) r.bigEndian(4));
+            break;
+        case RegEx:
+            r.cstring(b);
+            r.cstring(b);
+            break;
+        default:
+            massert( "bad type in normalized index key", false );
+        }
+    }
+
+    static void decodeObject(NormalizedKeyReader& r, BufBuilder& b) {
+        int start = b.len();
+        b.skip(4);
+        while ( r.peek() != 0 )
+            decodeElement(r, b, false);
+        r.byte();
+        b.append((char) EOO);
+        *((int *) (b.buf() + start)) = b.len() - start;
+    }
+
+    BSONObj NormalizedKey::decode(const BSONObj& nkey, const BSONObj& keyPattern) {
+        const char *end = nkey.objdata() + 4 + cmpLen(nkey);
+        NormalizedKeyReader r(nkey.objdata() + 4, end);
+        BufBuilder b(128);
+        b.skip(4);
+        BSONObjIterator k(keyPattern);
+        while ( r.pos() < end ) {
+            BSONElement o = k.more() ? k.next() : BSONElement();
+            r.setDescending(o.number() < 0);
+            decodeElement(r, b, true);
+        }
+        b.append((char) EOO);
+        *((int *) b.buf()) = b.len();
+        BSONObj res(b.buf(), true);
+        b.decouple();
+        return res;
+    }
+
+} // namespace mongo
@@ -0,0 +1,62 @@
+// normkey.h
+
+/**
+*    Copyright (C) 2008 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../stdafx.h"
+#include "jsobj.h"
+
+namespace mongo {
+
+    /* Index keys encoded so that memcmp() of two encodings orders them as
+       key.woCompare(other, keyPattern) would -- used by indexes created with
+       { normalizedKeys : true } in their spec.
+
+       Format:
+         int32 size              (as a BSONObj, so the btree can size and copy these as usual)
+         comparable bytes        per key field: a type byte, then the value in a memcmp
+                                 ordered form; all bytes complemented for descending fields
+         trailer                 what the comparable bytes lose, for each number and string
+                                 in order: whether a number was an int, a double or -0.0, and
+                                 the rest of a string after an embedded null
+         uint16 trailer length
+
+       Field names of the key are not stored (they are always "" in index keys), so decode()
+       gives them back as "".
+    */
+    class NormalizedKey {
+    public:
+        static BSONObj encode(const BSONObj& key, const BSONObj& keyPattern);
+        static BSONObj decode(const BSONObj& nkey, const BSONObj& keyPattern);
+
+        static int compare(const BSONObj& l, const BSONObj& r) {
+            int ll = cmpLen(l);
+            int rl = cmpLen(r);
+            int x = memcmp(l.objdata() + 4, r.objdata() + 4, ll < rl ? ll : rl);
+            return x ? x : ll - rl;
+        }
+
+    private:
+        static int cmpLen(const BSONObj& nkey) {
+            const char *p = nkey.objdata();
+            int size = nkey.objsize();
+            return size - 4 - 2 - *((const unsigned short *) (p + size - 2));
+        }
+    };
+
+} // namespace mongo
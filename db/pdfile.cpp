@@ -28,6 +28,7 @@ _ disallow system* manipulations from the database.
 #include "pdfile.h"
 #include "db.h"
 #include "../util/mmap.h"
+#include "../util/file.h"
 #include "../util/hashtab.h"
 #include "btree.h"
 #include <algorithm>
@@ -37,18 +38,21 @@ _ disallow system* manipulations from the database.
 #include "dbhelpers.h"
 #include "namespace.h"
 #include "queryutil.h"
+#include "clientcursor.h"
+#include "curop.h"
+#include "extsort.h"
 
 namespace mongo {
 
-    extern bool quota;
+    extern bool quota, prealloc;
     extern int port;
 
     const char *dbpath = "/data/db/";
 
     DataFileMgr theDataFileMgr;
     map<string,Database*> databases;
-    Database *database;
-    const char *curNs = "";
+    MONGO_TLS Database *database;
+    MONGO_TLS const char *curNs = "";
     int MAGIC = 0x1000;
     int curOp = -2;
     int callDepth = 0;
@@ -152,7 +156,7 @@ namespace mongo {
         assert(d);
 
         if ( mx > 0 )
-            d->max = mx;
+            writing(d)->max = mx;
 
         return true;
     }
@@ -194,6 +198,41 @@ namespace mongo {
         return size;
     }
 
+    int MongoDataFile::sizeFor( const char *filename, int minSize ) const {
+        int size = defaultSize( filename );
+        while ( size < minSize ) {
+            if ( size < maxSize() / 2 )
+                size *= 2;
+            else {
+                size = maxSize();
+                break;
+            }
+        }
+        if ( size > maxSize() )
+            size = maxSize();
+        return size;
+    }
+
+    void MongoDataFile::preallocateNext( const string& nextName ) {
+        if ( !prealloc || ( quota && fileNo + 1 > 8 ) )
+            return;
+        MongoDataFile next( fileNo + 1 );
+        theFileAllocator.requestAllocation( nextName, next.sizeFor( nextName.c_str(), header->fileLength ) );
+    }
+
+    /* true if filename is shorter than size and was never initialized as a data file: the
+       FileAllocator made it ahead of time, sized before anyone knew what it would have to hold */
+    static bool preallocatedTooShort( const char *filename, int size ) {
+        if ( !boost::filesystem::exists( filename ) ||
+             boost::filesystem::file_size( filename ) >= (boost::uintmax_t) size )
+            return false;
+        File f;
+        f.open( filename );
+        int version = 0;
+        f.read( 0, (char *) &version, sizeof( version ) );
+        return !f.bad() && version == 0;
+    }
+
     void MongoDataFile::open( const char *filename, int minSize ) {
         {
             /* check quotas
@@ -213,28 +252,25 @@ namespace mongo {
             }
         }
 
-        int size = defaultSize( filename );
-        while ( size < minSize ) {
-            if ( size < maxSize() / 2 )
-                size *= 2;
-            else {
-                size = maxSize();
-                break;
-            }
-        }
-        if ( size > maxSize() )
-            size = maxSize();
+        int size = sizeFor( filename, minSize );
 
         assert( ( size >= 64*1024*1024 ) || ( strstr( filename, "_hudsonSmall" ) ) );
         assert( size % 4096 == 0 );
 
+        /* usually already done in the background.  if not, mmf.map() would zero it in
+           small writes. */
+        theFileAllocator.allocateAsap( filename, size );
+        if ( preallocatedTooShort( filename, size ) )
+            FileAllocator::grow( filename, size );
+
         header = (MDFHeader *) mmf.map(filename, size);
         if( sizeof(char *) == 4 ) 
             uassert("can't map file memory - mongo requires 64 bit build for larger datasets", header);
         else
             uassert("can't map file memory", header);
-        // If opening an existing file, this is a no-op.
-        header->init(fileNo, size);
+        // If opening an existing file, this is a no-op.  map() maps an existing file at its
+        // real length, so that is the length to record.
+        header->init(fileNo, mmf.length());
     }
 
     void addNewExtentToNamespace(const char *ns, Extent *e, DiskLoc eloc, DiskLoc emptyLoc, bool capped) { 
@@ -244,19 +280,19 @@ namespace mongo {
         if ( details ) {
 assert( !details->lastExtent.isNull() );
             assert( !details->firstExtent.isNull() );
-            e->xprev = details->lastExtent;
-            details->lastExtent.ext()->xnext = eloc;
+            writing(e)->xprev = details->lastExtent;
+            writing(details->lastExtent.ext())->xnext = eloc;
 assert( !eloc.isNull() );
-            details->lastExtent = eloc;
+            writing(details)->lastExtent = eloc;
         }
         else {
             ni->add(ns, eloc, capped);
-            details = ni->details(ns);
+            details = writing(ni->details(ns));
         }
 
         details->lastExtentSize = e->length;
         DEBUGGING out() << "temp: newextent adddelrec " << ns << endl;
-        details->addDeletedRec(emptyLoc.drec(), emptyLoc);
+        details->addDeletedRec(ns, emptyLoc.drec(), emptyLoc);
     }
 
     Extent* MongoDataFile::createExtent(const char *ns, int approxSize, bool newCapped, int loops) {
@@ -275,6 +311,7 @@ assert( !eloc.isNull() );
             return database->addAFile()->createExtent(ns, approxSize, newCapped, loops+1);
         }
         int offset = header->unused.getOfs();
+        writing(&header->unused, sizeof(DiskLoc) + sizeof(int)); // unused, unusedLength
         header->unused.setOfs( fileNo, offset + ExtentSize );
         header->unusedLength -= ExtentSize;
         loc.setOfs(fileNo, offset);
@@ -330,9 +367,10 @@ assert( !eloc.isNull() );
                 Extent *e = best;
                 // remove from the free list
                 if( !e->xprev.isNull() )
-                    e->xprev.ext()->xnext = e->xnext;
+                    writing(e->xprev.ext())->xnext = e->xnext;
                 if( !e->xnext.isNull() )
-                    e->xnext.ext()->xprev = e->xprev;
+                    writing(e->xnext.ext())->xprev = e->xprev;
+                writing(f);
                 if( f->firstExtent == e->myLoc )
                     f->firstExtent = e->xnext;
                 if( f->lastExtent == e->myLoc )
@@ -354,6 +392,7 @@ assert( !eloc.isNull() );
     DiskLoc Extent::reuse(const char *nsname) { 
         log(3) << "reset extent was:" << ns.buf << " now:" << nsname << '\n';
         massert( "Extent::reset bad magic value", magic == 0x41424344 );
+        writing(this);
         xnext.Null();
         xprev.Null();
         ns = nsname;
@@ -367,6 +406,7 @@ assert( !eloc.isNull() );
         DeletedRecord *empty1 = (DeletedRecord *) extentData;
         DeletedRecord *empty = (DeletedRecord *) getRecord(emptyLoc);
         assert( empty == empty1 );
+        writing(empty);
         memset(empty, delRecLength, 1);
 
         empty->lengthWithHeaders = delRecLength;
@@ -378,6 +418,7 @@ assert( !eloc.isNull() );
 
     /* assumes already zeroed -- insufficient for block 'reuse' perhaps */
     DiskLoc Extent::init(const char *nsname, int _length, int _fileNo, int _offset) {
+        writing(this);
         magic = 0x41424344;
         myLoc.setOfs(_fileNo, _offset);
         xnext.Null();
@@ -393,6 +434,7 @@ assert( !eloc.isNull() );
         DeletedRecord *empty1 = (DeletedRecord *) extentData;
         DeletedRecord *empty = (DeletedRecord *) getRecord(emptyLoc);
         assert( empty == empty1 );
+        writing(empty);
         empty->lengthWithHeaders = _length - (extentData - (char *) this);
         empty->extentOfs = myLoc.getOfs();
         return emptyLoc;
@@ -522,10 +564,36 @@ assert( !eloc.isNull() );
 
     void aboutToDelete(const DiskLoc& dl);
 
+    /* put the extents firstExt..lastExt, linked through xnext, on the database's free list
+       for reuse by allocExtent() */
+    static void freeExtents(const DiskLoc& firstExt, const DiskLoc& lastExt) {
+        string s = database->name + ".$freelist";
+        NamespaceDetails *freeExtents = nsdetails(s.c_str());
+        if( freeExtents == 0 ) { 
+            string err;
+            _userCreateNS(s.c_str(), BSONObj(), err);
+            freeExtents = nsdetails(s.c_str());
+            massert("can't create .$freelist", freeExtents);
+        }
+        writing(freeExtents);
+        if( freeExtents->firstExtent.isNull() ) { 
+            freeExtents->firstExtent = firstExt;
+            freeExtents->lastExtent = lastExt;
+        }
+        else { 
+            DiskLoc a = freeExtents->firstExtent;
+            assert( a.ext()->xprev.isNull() );
+            writing(a.ext())->xprev = lastExt;
+            writing(lastExt.ext())->xnext = a;
+            freeExtents->firstExtent = firstExt;
+        }
+    }
+
     /* drop a collection/namespace */
     void dropNS(const string& nsToDrop) {
         NamespaceDetails* d = nsdetails(nsToDrop.c_str());
         uassert( "ns not found", d );
+        BackgroundIndexBuild::assertNoneInProgForNs(nsToDrop.c_str());
 
         uassert( "can't drop system ns", strstr(nsToDrop.c_str(), ".system.") == 0 );
         {
@@ -538,28 +606,10 @@ assert( !eloc.isNull() );
 
         // free extents
         if( !d->firstExtent.isNull() ) {
-            string s = database->name + ".$freelist";
-            NamespaceDetails *freeExtents = nsdetails(s.c_str());
-            if( freeExtents == 0 ) { 
-                string err;
-                _userCreateNS(s.c_str(), BSONObj(), err);
-                freeExtents = nsdetails(s.c_str());
-                massert("can't create .$freelist", freeExtents);
-            }
-            if( freeExtents->firstExtent.isNull() ) { 
-                freeExtents->firstExtent = d->firstExtent;
-                freeExtents->lastExtent = d->lastExtent;
-            }
-            else { 
-                DiskLoc a = freeExtents->firstExtent;
-                assert( a.ext()->xprev.isNull() );
-                a.ext()->xprev = d->lastExtent;
-                d->lastExtent.ext()->xnext = a;
-                freeExtents->firstExtent = d->firstExtent;
-
-                d->firstExtent.setInvalid();
-                d->lastExtent.setInvalid();
-            }
+            freeExtents(d->firstExtent, d->lastExtent);
+            writing(d);
+            d->firstExtent.setInvalid();
+            d->lastExtent.setInvalid();
         }
 
         // remove from the catalog hashtable
@@ -581,6 +631,7 @@ assert( !eloc.isNull() );
         BSONObj cond = b.done(); // e.g.: { name: "ts_1", ns: "foo.coll" }
 
         btreeStore->drop(ns.c_str());
+        writing(this);
         head.setInvalid();
         info.setInvalid();
 
@@ -597,7 +648,7 @@ assert( !eloc.isNull() );
        only when it's a "multikey" array.
        Keys will be left empty if key not found in the object.
     */
-    void IndexDetails::getKeysFromObject( const BSONObj& obj, BSONObjSetDefaultOrder& keys) const {
+    void IndexDetails::getKeysFromObject( const BSONObj& obj, BSONObjSetDefaultOrder& keys, bool *multiKey ) const {
         BSONObj keyPattern = info.obj().getObjectField("key"); // e.g., keyPattern == { ts : 1 }
         if ( keyPattern.objsize() == 0 ) {
             out() << keyPattern.toString() << endl;
@@ -637,6 +688,8 @@ assert( !eloc.isNull() );
             keys.insert(o);
             return;
         }
+        if ( multiKey )
+            *multiKey = true;
         BSONObj arr = arrayElt.embeddedObject();
         BSONObjIterator arrIter(arr);
         while ( arrIter.more() ) {
@@ -669,7 +722,9 @@ assert( !eloc.isNull() );
 
     int nUnindexes = 0;
 
-    void _unindexRecord(const char *ns, IndexDetails& id, BSONObj& obj, const DiskLoc& dl) {
+    /* logMissing: false for an index being built in the background, which won't have keys
+       for records its scan hasn't reached yet. */
+    void _unindexRecord(const char *ns, IndexDetails& id, BSONObj& obj, const DiskLoc& dl, bool logMissing = true) {
         BSONObjSetDefaultOrder keys;
         id.getKeysFromObject(obj, keys);
         for ( BSONObjSetDefaultOrder::iterator i=keys.begin(); i != keys.end(); i++ ) {
@@ -693,7 +748,7 @@ assert( !eloc.isNull() );
                 sayDbContext();
             }
 
-            if ( !ok ) {
+            if ( !ok && logMissing ) {
                 out() << "unindex failed (key too big?) " << id.indexNamespace() << '\n';
             }
         }
@@ -701,29 +756,29 @@ assert( !eloc.isNull() );
 
     /* unindex all keys in all indexes for this record. */
     void  unindexRecord(const char *ns, NamespaceDetails *d, Record *todelete, const DiskLoc& dl) {
-        if ( d->nIndexes == 0 ) return;
+        IndexDetails *building = BackgroundIndexBuild::indexBeingBuilt(ns, d);
+        if ( d->nIndexes == 0 && building == 0 ) return;
         BSONObj obj(todelete);
         for ( int i = 0; i < d->nIndexes; i++ ) {
             _unindexRecord(ns, d->indexes[i], obj, dl);
         }
+        if ( building )
+            _unindexRecord(ns, *building, obj, dl, false);
     }
 
-    /* deletes a record, just the pdfile portion -- no index cleanup, no cursor cleanup, etc. 
-       caller must check if capped
-    */
-    void DataFileMgr::_deleteRecord(NamespaceDetails *d, const char *ns, Record *todelete, const DiskLoc& dl)
-    {
+    /* take a record out of its extent's record chain */
+    static void unlinkRecord(Record *todelete, const DiskLoc& dl) {
         /* remove ourself from the record next/prev chain */
         {
             if ( todelete->prevOfs != DiskLoc::NullOfs )
-                todelete->getPrev(dl).rec()->nextOfs = todelete->nextOfs;
+                writing(todelete->getPrev(dl).rec())->nextOfs = todelete->nextOfs;
             if ( todelete->nextOfs != DiskLoc::NullOfs )
-                todelete->getNext(dl).rec()->prevOfs = todelete->prevOfs;
+                writing(todelete->getNext(dl).rec())->prevOfs = todelete->prevOfs;
         }
 
         /* remove ourself from extent pointers */
         {
-            Extent *e = todelete->myExtent(dl);
+            Extent *e = writing(todelete->myExtent(dl));
             if ( e->firstRecord == dl ) {
                 if ( todelete->nextOfs == DiskLoc::NullOfs )
                     e->firstRecord.Null();
@@ -737,9 +792,36 @@ assert( !eloc.isNull() );
                     e->lastRecord.setOfs(dl.a(), todelete->prevOfs);
             }
         }
+    }
+
+    /* append a new record to its extent's record chain */
+    static void linkRecord(Record *r, const DiskLoc& loc) {
+        Extent *e = writing(r->myExtent(loc));
+        writing(r);
+        if ( e->lastRecord.isNull() ) {
+            e->firstRecord = e->lastRecord = loc;
+            r->prevOfs = r->nextOfs = DiskLoc::NullOfs;
+        }
+        else {
+
+            Record *oldlast = writing(e->lastRecord.rec());
+            r->prevOfs = e->lastRecord.getOfs();
+            r->nextOfs = DiskLoc::NullOfs;
+            oldlast->nextOfs = loc.getOfs();
+            e->lastRecord = loc;
+        }
+    }
+
+    /* deletes a record, just the pdfile portion -- no index cleanup, no cursor cleanup, etc. 
+       caller must check if capped
+    */
+    void DataFileMgr::_deleteRecord(NamespaceDetails *d, const char *ns, Record *todelete, const DiskLoc& dl)
+    {
+        unlinkRecord(todelete, dl);
 
         /* add to the free list */
         {
+            writing(d);
             d->nrecords--;
             d->datasize -= todelete->netLength();
             /* temp: if in system.indexes, don't reuse, and zero out: we want to be
@@ -748,11 +830,11 @@ assert( !eloc.isNull() );
                      a lot of problems.
             */
             if ( strstr(ns, ".system.indexes") ) {
-                memset(todelete, 0, todelete->lengthWithHeaders);
+                memset(writing(todelete, todelete->lengthWithHeaders), 0, todelete->lengthWithHeaders);
             }
             else {
-                DEV memset(todelete->data, 0, todelete->netLength()); // attempt to notice invalid reuse.
-                d->addDeletedRec((DeletedRecord*)todelete, dl);
+                DEV memset(writing(todelete->data, todelete->netLength()), 0, todelete->netLength()); // attempt to notice invalid reuse.
+                d->addDeletedRec(ns, (DeletedRecord*)todelete, dl);
             }
         }
     }
@@ -773,7 +855,7 @@ assert( !eloc.isNull() );
         unindexRecord(ns, d, todelete, dl);
 
         _deleteRecord(d, ns, todelete, dl);
-        NamespaceDetailsTransient::get( ns ).registerWriteOp();
+        NamespaceDetailsTransient::get( ns ).registerWriteOp( d->nrecords );
     }
 
     void setDifference(BSONObjSetDefaultOrder &l, BSONObjSetDefaultOrder &r, vector<BSONObj*> &diff) {
@@ -792,12 +874,70 @@ assert( !eloc.isNull() );
         }
     }
 
+    /* top level fields whose values differ between l and r, including those only one has.
+       fields usually keep their order across an update, so walk the two together and only
+       search r by name once they fall out of step.
+    */
+    void fieldsChanged(const BSONObj &l, const BSONObj &r, set<string> &changed) {
+        BSONObjIterator i(l);
+        BSONObjIterator j(r);
+        while ( 1 ) {
+            BSONElement a = i.next();
+            BSONElement b = j.next();
+            if ( a.eoo() || b.eoo() ) {
+                for ( ; !a.eoo(); a = i.next() )
+                    changed.insert( a.fieldName() );
+                for ( ; !b.eoo(); b = j.next() )
+                    changed.insert( b.fieldName() );
+                return;
+            }
+            if ( strcmp( a.fieldName(), b.fieldName() ) != 0 )
+                break;
+            if ( a.size() != b.size() || memcmp( a.rawdata(), b.rawdata(), a.size() ) != 0 )
+                changed.insert( a.fieldName() );
+        }
+        /* out of step: compare by name */
+        BSONObjIterator k(l);
+        while ( k.more() ) {
+            BSONElement a = k.next();
+            if ( a.eoo() )
+                break;
+            BSONElement b = r.getField( a.fieldName() );
+            if ( b.eoo() || a.size() != b.size() || memcmp( a.rawdata(), b.rawdata(), a.size() ) != 0 )
+                changed.insert( a.fieldName() );
+        }
+        BSONObjIterator m(r);
+        while ( m.more() ) {
+            BSONElement b = m.next();
+            if ( b.eoo() )
+                break;
+            if ( l.getField( b.fieldName() ).eoo() )
+                changed.insert( b.fieldName() );
+        }
+    }
+
+    /* does any field of the index's key pattern fall under one of the changed top level fields? */
+    static bool keyMayChange(const BSONObj &keyPattern, const set<string> &changed) {
+        BSONObjIterator i(keyPattern);
+        while ( i.more() ) {
+            BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
+            const char *f = e.fieldName();
+            const char *dot = strchr(f, '.');
+            if ( changed.count( dot ? string(f, dot - f) : string(f) ) )
+                return true;
+        }
+        return false;
+    }
+
     /** Note: as written so far, if the object shrinks a lot, we don't free up space. 
     */
-    void DataFileMgr::update(
+    DiskLoc DataFileMgr::update(
         const char *ns,
         Record *toupdate, const DiskLoc& dl,
-        const char *buf, int len, stringstream& ss)
+        const char *buf, int len, stringstream& ss,
+        const set<string> *changedFields)
     {
         dassert( toupdate == dl.rec() );
 
@@ -839,34 +979,52 @@ assert( !eloc.isNull() );
 
             if ( d && d->capped ) {
                 ss << " failing a growing update on a capped ns " << ns << endl;
-                return;
+                return dl;
             }
 
             d->paddingTooSmall();
             if ( database->profile )
                 ss << " moved ";
             deleteRecord(ns, toupdate, dl);
-            insert(ns, buf, len, false, idOld);
-            return;
+            return insert(ns, buf, len, false, idOld, dl);
         }
 
-        NamespaceDetailsTransient::get( ns ).registerWriteOp();
+        NamespaceDetailsTransient::get( ns ).registerWriteOp( d->nrecords );
         d->paddingFits();
 
         /* has any index keys changed? */
         {
             NamespaceDetails *d = nsdetails(ns);
-            if ( d->nIndexes ) {
+            /* an index being built in the background is at indexes[nIndexes] */
+            int nIndexes = d->nIndexes;
+            if ( BackgroundIndexBuild::inProgForNs(ns) )
+                nIndexes++;
+            if ( nIndexes ) {
                 BSONObj newObj(buf);
                 BSONObj oldObj = dl.obj();
-                for ( int i = 0; i < d->nIndexes; i++ ) {
+                set<string> diff;
+                if ( changedFields == 0 ) {
+                    fieldsChanged(oldObj, newObj, diff);
+                    if ( addID )
+                        diff.erase("_id"); // we keep the old one
+                    changedFields = &diff;
+                }
+                int nSkipped = 0;
+                for ( int i = 0; i < nIndexes; i++ ) {
                     IndexDetails& idx = d->indexes[i];
                     BSONObj idxKey = idx.info.obj().getObjectField("key");
+                    if ( !keyMayChange(idxKey, *changedFields) ) {
+                        nSkipped++;
+                        continue;
+                    }
 
                     BSONObjSetDefaultOrder oldkeys;
                     BSONObjSetDefaultOrder newkeys;
+                    bool multiKey = false;
                     idx.getKeysFromObject(oldObj, oldkeys);
-                    idx.getKeysFromObject(newObj, newkeys);
+                    idx.getKeysFromObject(newObj, newkeys, &multiKey);
+                    if ( multiKey )
+                        d->setIndexIsMultikey(i);
                     vector<BSONObj*> removed;
                     setDifference(oldkeys, newkeys, removed);
                     string idxns = idx.indexNamespace();
@@ -898,10 +1056,13 @@ assert( !eloc.isNull() );
                         ss << '\n' << added.size() << " key updates ";
 
                 }
+                if ( database->profile && nSkipped )
+                    ss << ' ' << nSkipped << " indexes untouched ";
             }
         }
 
         //	update in place
+        writing(toupdate, toupdate->lengthWithHeaders);
         if ( addID ) {
             ((int&)*toupdate->data) = *((int*) buf) + idOld.size();
             memcpy(toupdate->data+4, idOld.rawdata(), idOld.size());
@@ -909,6 +1070,7 @@ assert( !eloc.isNull() );
         } else {
             memcpy(toupdate->data, buf, len);
         }
+        return dl;
     }
 
     int followupExtentSize(int len, int lastExtentLen) {
@@ -923,9 +1085,12 @@ assert( !eloc.isNull() );
     int deb=0;
 
    /* add keys to indexes for a new record */
-    inline void  _indexRecord(IndexDetails& idx, BSONObj& obj, DiskLoc newRecordLoc, bool dupsAllowed) {
+    inline void  _indexRecord(NamespaceDetails *d, IndexDetails& idx, BSONObj& obj, DiskLoc newRecordLoc, bool dupsAllowed) {
         BSONObjSetDefaultOrder keys;
-        idx.getKeysFromObject(obj, keys);
+        bool multiKey = false;
+        idx.getKeysFromObject(obj, keys, &multiKey);
+        if ( multiKey )
+            d->setIndexIsMultikey(d->idxNo(idx));
         BSONObj order = idx.keyPattern();
         for ( BSONObjSetDefaultOrder::iterator i=keys.begin(); i != keys.end(); i++ ) {
             assert( !newRecordLoc.isNull() );
@@ -943,29 +1108,63 @@ assert( !eloc.isNull() );
         }
     }
 
-    /* note there are faster ways to build an index in bulk, that can be
-       done eventually */
+    /* build an index over the existing records of ns: extract and sort all the keys, then
+       build the btree bottom up with BtreeBuilder.  idx.head must be an empty bucket.
+    */
     void addExistingToIndex(const char *ns, IndexDetails& idx) {
         bool dupsAllowed = !idx.isIdIndex();
+        BSONObj order = idx.keyPattern();
 
         Timer t;
         Nullstream& l = log();
-        l << "building new index on " << idx.keyPattern() << " for " << ns << "...";
+        l << "building new index on " << order << " for " << ns << "...";
         l.flush();
         int err = 0;
         int n = 0;
+
+        /* phase 1: extract the keys and sort them */
+        NamespaceDetails *d = nsdetails(ns);
+        int idxNo = d->idxNo(idx);
+        BSONObjExternalSorter sorter(order);
         auto_ptr<Cursor> c = theDataFileMgr.findAll(ns);
         while ( c->ok() ) {
             BSONObj js = c->current();
-            try { 
-                _indexRecord(idx, js, c->currLoc(),dupsAllowed);
-            } catch( AssertionException&  ) { 
+            try {
+                BSONObjSetDefaultOrder keys;
+                bool multiKey = false;
+                idx.getKeysFromObject(js, keys, &multiKey);
+                if ( multiKey )
+                    d->setIndexIsMultikey(idxNo);
+                for ( BSONObjSetDefaultOrder::iterator i = keys.begin(); i != keys.end(); i++ )
+                    sorter.add(*i, c->currLoc());
+            } catch( AssertionException& ) {
                 err++;
             }
             c->advance();
             n++;
-        };
-        l << "done for " << n << " records";
+        }
+        sorter.sort();
+        l << " sorted " << sorter.numAdded() << " keys";
+        if ( sorter.numFiles() )
+            l << " (" << sorter.numFiles() << " runs on disk)";
+        l << ' ' << t.millis() << "ms";
+
+        /* phase 2: build the btree */
+        {
+            BtreeBuilder btBuilder(dupsAllowed, idx);
+            auto_ptr<BSONObjExternalSorter::Iterator> i = sorter.iterator();
+            while ( i->more() ) {
+                BSONObjExternalSorter::Data d = i->next();
+                try {
+                    btBuilder.addKey(d.first, d.second);
+                } catch( AssertionException& ) {
+                    err++;
+                }
+            }
+            btBuilder.commit();
+        }
+
+        l << " done for " << n << " records " << t.millis() << "ms";
         if( err )
             l << ' ' << err << " (dupkey) errors during indexing";
         l << endl;
@@ -979,8 +1178,70 @@ assert( !eloc.isNull() );
         }
     }
 
+    /* builds idx, which must be d->indexes[d->nIndexes], with a table scan that releases
+       dbMutex every so often so other operations can run.  Writes made while we are unlocked
+       maintain idx themselves (see BackgroundIndexBuild), so when the scan reaches a record
+       that was inserted or updated meanwhile its keys may already be present; we skip those.
+       The caller makes the index visible by calling addingIndex() once we return.
+    */
+    void buildIndexInBackground(const char *ns, NamespaceDetails *d, IndexDetails& idx) {
+        assert( &idx == &d->indexes[d->nIndexes] );
+        massert( "can't build the _id index in the background", !idx.isIdIndex() );
+
+        Timer t;
+        log() << "building new index on " << idx.keyPattern() << " for " << ns << " in the background" << endl;
+
+        BackgroundIndexBuild inProg(ns);
+        BSONObj order = idx.keyPattern();
+        int idxNo = d->idxNo(idx);
+        int err = 0;
+        int n = 0;
+        int nYields = 0;
+        YieldTracker yt;
+        auto_ptr<Cursor> c = theDataFileMgr.findAll(ns);
+        while ( c->ok() ) {
+            BSONObj js = c->current();
+            DiskLoc loc = c->currLoc();
+            BSONObjSetDefaultOrder keys;
+            bool multiKey = false;
+            idx.getKeysFromObject(js, keys, &multiKey);
+            if ( multiKey )
+                nsdetails(ns)->setIndexIsMultikey(idxNo);
+            for ( BSONObjSetDefaultOrder::iterator i = keys.begin(); i != keys.end(); i++ ) {
+                BSONObj& key = (BSONObj&) *i;
+                try {
+                    if ( !idx.head.btree()->hasKey(idx, idx.head, key, loc) )
+                        idx.head.btree()->bt_insert(idx.head, loc, key, order, /*dupsAllowed*/true, idx);
+                } catch( AssertionException& ) {
+                    err++;
+                }
+            }
+            c->advance();
+            n++;
+
+            if ( c->ok() && yt.ping() && dbMutexInfo.haveWriteLock() && OpScope::mayYield() ) {
+                SavedCursor saved;
+                saved.save(ns, c);
+                currentOp.yields++;
+                nYields++;
+                {
+                    dbtemprelease unlock;
+                    boost::thread::yield();
+                }
+                c = saved.restore();
+                if ( c.get() == 0 )
+                    break; // the rest of the collection was deleted while we were unlocked
+            }
+        }
+
+        log() << "background index build done for " << n << " records " << t.millis() / 1000.0 << "secs "
+              << nYields << " yields" << endl;
+        if ( err )
+            log() << "  " << err << " errors during background index build on " << ns << endl;
+    }
+
     /* add keys to indexes for a new record */
-    void  indexRecord(NamespaceDetails *d, const void *buf, int len, DiskLoc newRecordLoc) {
+    void  indexRecord(const char *ns, NamespaceDetails *d, const void *buf, int len, DiskLoc newRecordLoc) {
         BSONObj obj((const char *)buf);
 
         /* we index _id first so that on a dup key error for it we don't have to roll back 
@@ -988,12 +1249,16 @@ assert( !eloc.isNull() );
         */
         int id = d->findIdIndex();
         if( id >= 0 )
-            _indexRecord(d->indexes[id], obj, newRecordLoc, /*dupsAllowed*/false);
+            _indexRecord(d, d->indexes[id], obj, newRecordLoc, /*dupsAllowed*/false);
 
         for ( int i = 0; i < d->nIndexes; i++ ) {
             if( i != id ) 
-                _indexRecord(d->indexes[i], obj, newRecordLoc, /*dupsAllowed*/true);
+                _indexRecord(d, d->indexes[i], obj, newRecordLoc, /*dupsAllowed*/true);
         }
+
+        IndexDetails *building = BackgroundIndexBuild::indexBeingBuilt(ns, d);
+        if ( building )
+            _indexRecord(d, *building, obj, newRecordLoc, /*dupsAllowed*/true);
     }
 
     extern BSONObj id_obj;
@@ -1003,7 +1268,7 @@ assert( !eloc.isNull() );
         if ( d == 0 || (d->flags & NamespaceDetails::Flag_HaveIdIndex) )
             return;
 
-        d->flags |= NamespaceDetails::Flag_HaveIdIndex;
+        writing(d)->flags |= NamespaceDetails::Flag_HaveIdIndex;
 
         string system_indexes = database->name + ".system.indexes";
 
@@ -1051,8 +1316,9 @@ assert( !eloc.isNull() );
         return loc;
     }
     
-    DiskLoc DataFileMgr::insert(const char *ns, const void *obuf, int len, bool god, const BSONElement &writeId) {
+    DiskLoc DataFileMgr::insert(const char *ns, const void *obuf, int len, bool god, const BSONElement &writeId, const DiskLoc& near) {
         bool addIndex = false;
+        bool background = false;
         const char *sys = strstr(ns, "system.");
         if ( sys ) {
             uassert("attempt to insert in reserved database name 'system'", sys != ns);
@@ -1130,6 +1396,14 @@ assert( !eloc.isNull() );
                 //out() << "INFO: index:" << name << " already exists for:" << tabletoidxns << endl;
                 return DiskLoc();
             }
+            /* the slot at indexes[nIndexes] is in use until the current build finishes */
+            BackgroundIndexBuild::assertNoneInProgForNs(tabletoidxns.c_str());
+            background = io.getBoolField("background");
+            {
+                BSONElement v = io.getField("v");
+                uassert( "index version must be a number", v.eoo() || v.isNumber() );
+                uassert( "unsupported index version", v.eoo() || ( v.number() >= 0 && v.number() <= IndexDetails::MaxVersion ) );
+            }
             //indexFullNS = tabletoidxns;
             //indexFullNS += ".$";
             //indexFullNS += name; // database.table.$index -- note this doesn't contain jsobjs, it contains BtreeBuckets.
@@ -1161,16 +1435,16 @@ assert( !eloc.isNull() );
         if ( lenWHdr == 0 ) {
             // old datafiles, backward compatible here.
             assert( d->paddingFactor == 0 );
-            d->paddingFactor = 1.0;
+            writing(d)->paddingFactor = 1.0;
             lenWHdr = len + Record::HeaderSize;
         }
-        DiskLoc loc = d->alloc(ns, lenWHdr, extentLoc);
+        DiskLoc loc = d->alloc(ns, lenWHdr, extentLoc, near);
         if ( loc.isNull() ) {
             // out of space
             if ( d->capped == 0 ) { // size capped doesn't grow
                 DEV log() << "allocating new extent for " << ns << " padding:" << d->paddingFactor << endl;
                 database->newestFile()->allocExtent(ns, followupExtentSize(len, d->lastExtentSize));
-                loc = d->alloc(ns, lenWHdr, extentLoc);
+                loc = d->alloc(ns, lenWHdr, extentLoc, near);
             }
             if ( loc.isNull() ) {
                 log() << "out of space in datafile " << ns << " capped:" << d->capped << endl;
@@ -1190,39 +1464,46 @@ assert( !eloc.isNull() );
         else {
             memcpy(r->data, obuf, len);
         }
-        Extent *e = r->myExtent(loc);
-        if ( e->lastRecord.isNull() ) {
-            e->firstRecord = e->lastRecord = loc;
-            r->prevOfs = r->nextOfs = DiskLoc::NullOfs;
-        }
-        else {
-
-            Record *oldlast = e->lastRecord.rec();
-            r->prevOfs = e->lastRecord.getOfs();
-            r->nextOfs = DiskLoc::NullOfs;
-            oldlast->nextOfs = loc.getOfs();
-            e->lastRecord = loc;
-        }
+        writing(r->data, *((int *) r->data));
+        linkRecord(r, loc);
 
+        writing(d);
         d->nrecords++;
         d->datasize += r->netLength();
 
         if ( !god )
-            NamespaceDetailsTransient::get( ns ).registerWriteOp();
+            NamespaceDetailsTransient::get( ns ).registerWriteOp( d->nrecords );
         
         if ( tableToIndex ) {
             IndexDetails& idxinfo = tableToIndex->indexes[tableToIndex->nIndexes];
-            idxinfo.info = loc;
-            idxinfo.head = BtreeBucket::addHead(idxinfo);
-            tableToIndex->addingIndex(tabletoidxns.c_str(), idxinfo);
-            /* todo: index existing records here */
-            addExistingToIndex(tabletoidxns.c_str(), idxinfo);
+            tableToIndex->clearIndexIsMultikey(tableToIndex->nIndexes);
+            *writing(&idxinfo.info) = loc;
+            *writing(&idxinfo.head) = BtreeBucket::addHead(idxinfo);
+            if ( background && idxinfo.isIdIndex() ) {
+                log() << "info: building _id index in the foreground for " << tabletoidxns << endl;
+                background = false;
+            }
+            if ( background ) {
+                try {
+                    buildIndexInBackground(tabletoidxns.c_str(), tableToIndex, idxinfo);
+                } catch( ... ) {
+                    log() << "background index build failed, dropping it " << idxinfo.indexNamespace() << endl;
+                    idxinfo.kill();
+                    throw;
+                }
+                tableToIndex->addingIndex(tabletoidxns.c_str(), idxinfo);
+            }
+            else {
+                tableToIndex->addingIndex(tabletoidxns.c_str(), idxinfo);
+                /* todo: index existing records here */
+                addExistingToIndex(tabletoidxns.c_str(), idxinfo);
+            }
         }
 
         /* add this record to our indexes */
-        if ( d->nIndexes ) {
+        if ( d->nIndexes || BackgroundIndexBuild::inProgForNs(ns) ) {
             try { 
-                indexRecord(d, r->data/*buf*/, len, loc);
+                indexRecord(ns, d, r->data/*buf*/, len, loc);
             } 
             catch( AssertionException& e ) { 
                 // should be a dup key error on _id index
@@ -1244,6 +1525,182 @@ assert( !eloc.isNull() );
         return loc;
     }
 
+    struct KeyAndLoc {
+        BSONObj key;
+        DiskLoc loc;
+    };
+
+    class KeyAndLocLess {
+    public:
+        KeyAndLocLess( const BSONObj &order ) : order_( order ) {}
+        bool operator()( const KeyAndLoc &l, const KeyAndLoc &r ) const {
+            int c = l.key.woCompare( r.key, order_ );
+            return c < 0 || ( c == 0 && l.loc < r.loc );
+        }
+    private:
+        BSONObj order_;
+    };
+
+    /* add a batch's keys to one index, in key order, so that consecutive bt_insert calls
+       mostly walk down to the same bucket and find it already in memory. */
+    static void indexBatch(NamespaceDetails *d, IndexDetails& idx, const vector<BSONObj>& objs, const vector<DiskLoc>& locs) {
+        vector<KeyAndLoc> keys;
+        bool multiKey = false;
+        for ( unsigned i = 0; i < objs.size(); i++ ) {
+            BSONObjSetDefaultOrder k;
+            idx.getKeysFromObject(objs[i], k, &multiKey);
+            for ( BSONObjSetDefaultOrder::iterator j = k.begin(); j != k.end(); j++ ) {
+                KeyAndLoc kl;
+                kl.key = *j;
+                kl.loc = locs[i];
+                keys.push_back( kl );
+            }
+        }
+        if ( multiKey )
+            d->setIndexIsMultikey(d->idxNo(idx));
+        BSONObj order = idx.keyPattern();
+        sort( keys.begin(), keys.end(), KeyAndLocLess( order ) );
+        for ( vector<KeyAndLoc>::iterator i = keys.begin(); i != keys.end(); i++ ) {
+            try {
+                idx.head.btree()->bt_insert(idx.head, i->loc, i->key, order, /*dupsAllowed*/true, idx);
+            }
+            catch (AssertionException& ) {
+                problem() << " caught assertion indexBatch " << idx.indexNamespace() << endl;
+            }
+        }
+    }
+
+    /* the indexes other than _id (and any being built in the background) for a batch */
+    static void indexBatchSecondary(const char *ns, NamespaceDetails *d, const vector<BSONObj>& objs, const vector<DiskLoc>& locs) {
+        int id = d->findIdIndex();
+        for ( int i = 0; i < d->nIndexes; i++ ) {
+            if ( i != id )
+                indexBatch(d, d->indexes[i], objs, locs);
+        }
+        IndexDetails *building = BackgroundIndexBuild::indexBeingBuilt(ns, d);
+        if ( building )
+            indexBatch(d, *building, objs, locs);
+    }
+
+    void DataFileMgr::insertBatch(const char *ns, vector<BSONObj>& objs) {
+        unsigned done = 0; // objects committed so far; objs is cut back to these on any exception
+        try {
+            _insertBatch(ns, objs, done);
+        }
+        catch ( ... ) {
+            objs.resize(done);
+            throw;
+        }
+    }
+
+    void DataFileMgr::_insertBatch(const char *ns, vector<BSONObj>& objs, unsigned& done) {
+        NamespaceDetails *d = nsdetails(ns);
+        if ( d == 0 && !objs.empty() ) {
+            /* the first insert creates the collection */
+            insert(ns, objs[0]);
+            done = 1;
+            d = nsdetails(ns);
+        }
+        if ( d == 0 || d->capped || strstr(ns, "system.") || strstr(ns, "local.") ) {
+            for ( ; done < objs.size(); done++ )
+                insert(ns, objs[done]);
+        }
+        if ( done == objs.size() )
+            return;
+
+        /* sizes, with the _id we will add and padding */
+        unsigned n = objs.size() - done;
+        vector<int> lens(n), lenWHdrs(n);
+        vector<bool> addIDs(n);
+        int total = 0;
+        for ( unsigned i = 0; i < n; i++ ) {
+            BSONObj io = objs[done + i];
+            int len = io.objsize();
+            addIDs[i] = !io.hasField("_id");
+            if ( addIDs[i] )
+                len += idToInsert.size();
+            BSONElementManipulator::lookForTimestamps( io );
+            d->paddingFits();
+            int lenWHdr = (int) ((len + Record::HeaderSize) * d->paddingFactor);
+            if ( lenWHdr < len + Record::HeaderSize )
+                lenWHdr = len + Record::HeaderSize;
+            lenWHdr = (lenWHdr + 3) & 0xfffffffc;
+            lens[i] = len;
+            lenWHdrs[i] = lenWHdr;
+            total += lenWHdr;
+        }
+
+        /* one allocation for the batch, split into records below */
+        DiskLoc extentLoc;
+        DiskLoc region = d->alloc(ns, total, extentLoc);
+        if ( region.isNull() ) {
+            database->newestFile()->allocExtent(ns, followupExtentSize(total, d->lastExtentSize));
+            region = d->alloc(ns, total, extentLoc);
+            massert( "couldn't allocate space for insert batch", !region.isNull() );
+        }
+        int regionLen = region.rec()->lengthWithHeaders;
+        int extentOfs = region.rec()->extentOfs;
+
+        vector<BSONObj> batch;
+        vector<DiskLoc> locs;
+        DiskLoc loc = region;
+        NamespaceDetailsTransient& ndt = NamespaceDetailsTransient::get( ns );
+        for ( unsigned i = 0; i < n; i++ ) {
+            Record *r = loc.rec();
+            r->lengthWithHeaders = lenWHdrs[i];
+            if ( i == n - 1 )
+                r->lengthWithHeaders += regionLen - total; // alloc may have given us more than we asked for
+            r->extentOfs = extentOfs;
+            const char *obuf = objs[done + i].objdata();
+            if ( addIDs[i] ) {
+                idToInsert_.oid.init();
+                ((int&)*r->data) = *((int*) obuf) + idToInsert.size();
+                memcpy(r->data+4, idToInsert.rawdata(), idToInsert.size());
+                memcpy(r->data+4+idToInsert.size(), obuf+4, lens[i]-idToInsert.size()-4);
+            }
+            else {
+                memcpy(r->data, obuf, lens[i]);
+            }
+            writing(r->data, *((int *) r->data));
+            linkRecord(r, loc);
+            writing(d);
+            d->nrecords++;
+            d->datasize += r->netLength();
+            ndt.registerWriteOp( d->nrecords );
+            batch.push_back( BSONObj( r ) );
+            locs.push_back( loc );
+            loc.inc( lenWHdrs[i] );
+        }
+
+        if ( d->nIndexes || BackgroundIndexBuild::inProgForNs(ns) ) {
+            /* _id in order first, so a duplicate stops the batch where a single insert would */
+            int id = d->findIdIndex();
+            unsigned i = 0;
+            try {
+                if ( id >= 0 ) {
+                    for ( ; i < n; i++ )
+                        _indexRecord(d, d->indexes[id], batch[i], locs[i], /*dupsAllowed*/false);
+                }
+            }
+            catch ( AssertionException& ) {
+                for ( unsigned j = n; j > i; j-- )
+                    _deleteRecord(d, ns, locs[j - 1].rec(), locs[j - 1]);
+                batch.resize(i);
+                locs.resize(i);
+                indexBatchSecondary(ns, d, batch, locs);
+                for ( unsigned j = 0; j < i; j++ )
+                    objs[done + j] = batch[j];
+                done += i;
+                throw;
+            }
+            indexBatchSecondary(ns, d, batch, locs);
+        }
+
+        for ( unsigned i = 0; i < n; i++ )
+            objs[done + i] = batch[i];
+        done += n;
+    }
+
     /* special version of insert for transaction logging -- streamlined a bit.
        assumes ns is capped and no indexes
     */
@@ -1260,23 +1717,157 @@ assert( !eloc.isNull() );
 
         Record *r = loc.rec();
         assert( r->lengthWithHeaders >= lenWHdr );
+        writing(r, lenWHdr); // the caller fills in the data
+        linkRecord(r, loc);
 
-        Extent *e = r->myExtent(loc);
-        if ( e->lastRecord.isNull() ) {
-            e->firstRecord = e->lastRecord = loc;
-            r->prevOfs = r->nextOfs = DiskLoc::NullOfs;
-        }
-        else {
-            Record *oldlast = e->lastRecord.rec();
-            r->prevOfs = e->lastRecord.getOfs();
-            r->nextOfs = DiskLoc::NullOfs;
-            oldlast->nextOfs = loc.getOfs();
-            e->lastRecord = loc;
+        writing(d)->nrecords++;
+
+        return r;
+    }
+
+    /* ---- compact ----------------------------------------------------------- */
+
+    /* moves the record at dl to space from the free lists, as a delete followed by an insert
+       would, except that the old space is not put on the free lists -- the caller is emptying
+       its extent.  returns false if no free record is big enough.
+    */
+    static bool compactMove(const char *ns, NamespaceDetails *d, const DiskLoc& dl) {
+        Record *old = dl.rec();
+        BSONObj o(old); // the old record is left alone until we are done with o
+        int lenWHdr = (int) ( ( o.objsize() + Record::HeaderSize ) * d->paddingFactor );
+        DiskLoc extentLoc;
+        DiskLoc loc = d->alloc(ns, lenWHdr, extentLoc);
+        if ( loc.isNull() )
+            return false;
+
+        Record *r = loc.rec();
+        memcpy(writing(r->data, o.objsize()), o.objdata(), o.objsize());
+        linkRecord(r, loc);
+
+        aboutToDelete(dl);
+        unindexRecord(ns, d, old, dl);
+        indexRecord(ns, d, r->data, o.objsize(), loc);
+        unlinkRecord(old, dl);
+
+        writing(d)->datasize += r->netLength() - old->netLength();
+        NamespaceDetailsTransient::get( ns ).registerWriteOp( d->nrecords );
+        return true;
+    }
+
+    static bool hasExtent(NamespaceDetails *d, const DiskLoc& ext) {
+        for ( DiskLoc i = d->firstExtent; !i.isNull(); i = i.ext()->xnext )
+            if ( i == ext )
+                return true;
+        return false;
+    }
+
+    static void holdFreeSpace(const char *ns, NamespaceDetails *d, const DiskLoc& from, const DiskLoc& to, vector<DiskLoc>& held) {
+        FreeSpaceMap& m = NamespaceDetailsTransient::get(ns).freeSpace();
+        if ( !m.built() )
+            m.build(d);
+        m.unlinkRange(d, from, to, held);
+    }
+
+    enum CompactResult { CompactDone, CompactNoRoom, CompactGone };
+
+    /* moves every record out of extent ext, then gives ext back to the database */
+    static CompactResult compactExtent(const char *ns, const DiskLoc& ext, YieldTracker& yt, CompactStats& stats) {
+        NamespaceDetails *d = nsdetails(ns);
+        Extent *e = ext.ext();
+        DiskLoc end(ext.a(), ext.getOfs() + e->length);
+
+        /* ext's free space, and the space of each record as we move it, is kept out of the free
+           lists so nothing is moved (or inserted) into ext */
+        vector<DiskLoc> held;
+        holdFreeSpace(ns, d, ext, end, held);
+
+        while ( !e->firstRecord.isNull() ) {
+            DiskLoc dl = e->firstRecord;
+            if ( !compactMove(ns, d, dl) ) {
+                for ( vector<DiskLoc>::iterator i = held.begin(); i != held.end(); ++i )
+                    d->addDeletedRec(ns, i->drec(), *i);
+                return CompactNoRoom;
+            }
+            held.push_back(dl);
+            stats.nMoved++;
+
+            if ( yt.ping() && dbMutexInfo.haveWriteLock() && OpScope::mayYield() ) {
+                currentOp.yields++;
+                stats.nYields++;
+                {
+                    dbtemprelease unlock;
+                    boost::thread::yield();
+                }
+                d = nsdetails(ns);
+                if ( d == 0 || !hasExtent(d, ext) )
+                    return CompactGone;
+                e = ext.ext();
+                /* records of ext deleted meanwhile went on the free lists */
+                holdFreeSpace(ns, d, ext, end, held);
+            }
         }
 
-        d->nrecords++;
+        /* ext is empty: take it out of the collection */
+        writing(d);
+        if ( e->xprev.isNull() )
+            d->firstExtent = e->xnext;
+        else
+            writing(e->xprev.ext())->xnext = e->xnext;
+        if ( e->xnext.isNull() )
+            d->lastExtent = e->xprev;
+        else
+            writing(e->xnext.ext())->xprev = e->xprev;
+        writing(e);
+        e->xnext.Null();
+        e->xprev.Null();
+        freeExtents(ext, ext);
+
+        stats.nExtentsFreed++;
+        stats.bytesFreed += e->length;
+        return CompactDone;
+    }
 
-        return r;
+    void compactCollection(const char *ns, double maxFill, CompactStats& stats) {
+        NamespaceDetails *d = nsdetails(ns);
+        uassert( "ns not found", d );
+        uassert( "can't compact a capped collection", !d->capped );
+        /* IndexDetails point at the records of system.indexes */
+        uassert( "can't compact a system collection", strstr(ns, ".system.") == 0 );
+        BackgroundIndexBuild::assertNoneInProgForNs(ns);
+
+        /* the sparse extents, emptiest first */
+        vector< pair< double, DiskLoc > > sparse;
+        for ( DiskLoc i = d->firstExtent; !i.isNull(); i = i.ext()->xnext ) {
+            Extent *e = i.ext();
+            long long used = 0;
+            for ( DiskLoc r = e->firstRecord; !r.isNull(); ) {
+                Record *rec = r.rec();
+                used += rec->lengthWithHeaders;
+                if ( rec->nextOfs == DiskLoc::NullOfs )
+                    break;
+                r.setOfs(r.a(), rec->nextOfs);
+            }
+            double fill = (double) used / e->length;
+            if ( fill < maxFill )
+                sparse.push_back( make_pair(fill, i) );
+        }
+        sort(sparse.begin(), sparse.end());
+
+        YieldTracker yt;
+        for ( vector< pair< double, DiskLoc > >::iterator i = sparse.begin(); i != sparse.end(); ++i ) {
+            d = nsdetails(ns);
+            if ( d == 0 || d->firstExtent == d->lastExtent )
+                break; // gone, or down to one extent, which we keep
+            if ( !hasExtent(d, i->second) )
+                continue; // emptied by someone else while we yielded
+            CompactResult res = compactExtent(ns, i->second, yt, stats);
+            if ( res == CompactGone )
+                break;
+            if ( res == CompactNoRoom ) {
+                stats.nSkipped++;
+                continue;
+            }
+        }
     }
 
     void DataFileMgr::init(const char *dir) {
@@ -1313,6 +1904,8 @@ namespace mongo {
 
 // back up original database files to 'temp' dir
     void _renameForBackup( const char *database, const Path &reservedPath ) {
+        if ( journaling )
+            journal.checkpoint(); // so nothing journaled gets replayed onto the files that replace these
         class Renamer : public FileOp {
         public:
             Renamer( const Path &reservedPath ) : reservedPath_( reservedPath ) {}
@@ -30,6 +30,8 @@
 #include "storage.h"
 #include "jsobjmanipulator.h"
 #include "namespace.h"
+#include "journal.h"
+#include "../util/file_allocator.h"
 
 // see version, versionMinor, below.
 const int VERSION = 4;
@@ -45,6 +47,19 @@ namespace mongo {
     void dropDatabase(const char *ns);
     bool repairDatabase(const char *ns, string &errmsg, bool preserveClonedFilesOnFailure = false, bool backupOriginalFiles = false);
     void dropNS(const string& dropNs);;
+
+    struct CompactStats {
+        CompactStats() : nExtentsFreed(), bytesFreed(), nMoved(), nSkipped(), nYields() { }
+        int nExtentsFreed;
+        long long bytesFreed;
+        long long nMoved;
+        int nSkipped; // extents we could not empty for lack of room elsewhere
+        int nYields;
+    };
+    /* moves the records of extents of ns that are less than maxFill full (0..1) into free
+       space in the other extents, and returns the extents emptied to the database's free list.
+       yields dbMutex every so often.  see the compact command. */
+    void compactCollection(const char *ns, double maxFill, CompactStats& stats);
     bool userCreateNS(const char *ns, BSONObj j, string& err, bool logForReplication);
     auto_ptr<Cursor> findTableScan(const char *ns, const BSONObj& order, const DiskLoc &startLoc=DiskLoc());
 
@@ -79,8 +94,13 @@ namespace mongo {
         /* return max size an extent may be */
         static int maxSize();
 
+        /* start creating the file that comes after this one in the background, sized as
+           open() will want it */
+        void preallocateNext( const string& nextName );
+
     private:
         int defaultSize( const char *filename ) const;
+        int sizeFor( const char *filename, int minSize ) const;
 
         Extent* getExtent(DiskLoc loc);
         Extent* _getExtent(DiskLoc loc);
@@ -96,13 +116,27 @@ namespace mongo {
     public:
         void init(const char *);
 
-        void update(
+        /* returns the record's location after the update, which differs from dl if it had to move.
+           changedFields: the top level fields the update may have changed, if the caller knows
+           (from a ModSet).  otherwise they are found by comparing the old and new objects.
+           indexes on none of them are left alone.
+        */
+        DiskLoc update(
             const char *ns,
             Record *toupdate, const DiskLoc& dl,
-            const char *buf, int len, stringstream& profiling);
+            const char *buf, int len, stringstream& profiling,
+            const set<string> *changedFields = 0);
         // The object o may be updated if modified on insert.                                
         DiskLoc insert(const char *ns, BSONObj &o);
-        DiskLoc insert(const char *ns, const void *buf, int len, bool god = false, const BSONElement &writeId = BSONElement());
+        /* insert several objects into ns, as a series of insert(ns, o) calls would.  record
+           space for the batch comes from one allocation, and each index gets the batch's keys
+           in sorted order.  on return objs refer to the stored objects.  if an insert fails
+           (a duplicate _id, no space for the batch, ...) the objects before it stay inserted,
+           objs is cut back to them and the exception is rethrown.
+        */
+        void insertBatch(const char *ns, vector<BSONObj>& objs);
+        /* near: where the object used to be, if it is being moved.  we try to place it close by. */
+        DiskLoc insert(const char *ns, const void *buf, int len, bool god = false, const BSONElement &writeId = BSONElement(), const DiskLoc& near = DiskLoc());
         void deleteRecord(const char *ns, Record *todelete, const DiskLoc& dl, bool cappedOK = false);
         static auto_ptr<Cursor> findAll(const char *ns, const DiskLoc &startLoc = DiskLoc());
 
@@ -115,6 +149,7 @@ namespace mongo {
         static Extent* getExtent(const DiskLoc& dl);
         static Record* getRecord(const DiskLoc& dl);
     private:
+        void _insertBatch(const char *ns, vector<BSONObj>& objs, unsigned& done);
 
         void _deleteRecord(NamespaceDetails *d, const char *ns, Record *todelete, const DiskLoc& dl);
 
@@ -278,13 +313,14 @@ namespace mongo {
             if ( uninitialized() ) {
                 assert(filelength > 32768 );
                 assert( headerSize() == 8192 );
+                writing(this, headerSize());
                 fileLength = filelength;
                 version = VERSION;
                 versionMinor = VERSION_MINOR;
                 unused.setOfs( fileno, headerSize() );
                 assert( (data-(char*)this) == headerSize() );
                 unusedLength = fileLength - headerSize() - 16;
-                memcpy(data+unusedLength, "      \nthe end\n", 16);
+                memcpy(writing(data+unusedLength, 16), "      \nthe end\n", 16);
             }
         }
     };
@@ -384,6 +420,7 @@ namespace mongo {
     };
 
     inline void _applyOpToDataFiles( const char *database, FileOp &fo, const char *path = dbpath ) {
+        theFileAllocator.waitIdle(); // else a file still being created could show up afterwards
         string c = database;
         c += '.';
         boost::filesystem::path p(path);
@@ -422,6 +459,8 @@ namespace mongo {
                 return "remove";
             }
         } deleter;
+        if ( journaling )
+            journal.checkpoint(); // so nothing journaled gets replayed onto a new file of the same name
         _applyOpToDataFiles( database, deleter );
     }
 
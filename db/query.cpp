@@ -164,7 +164,7 @@ namespace mongo {
     }
 
     struct Mod {
-        enum Op { INC, SET } op;
+        enum Op { INC, SET, PUSH, PULL, UNSET, ADDTOSET, MIN, MAX } op;
         const char *fieldName;
         double *ndouble;
         int *nint;
@@ -177,20 +177,62 @@ namespace mongo {
             return ndouble ? *ndouble : *nint;
         }
         int type;
+        /* for $min/$max: would the mod change the existing value e? */
+        bool beats( const BSONElement &e ) const {
+            int c = elt.woCompare( e, false );
+            return op == MIN ? c < 0 : c > 0;
+        }
     };
 
+    static bool arrayContains( const BSONElement &arr, const BSONElement &x ) {
+        BSONObjIterator i( arr.embeddedObject() );
+        while( i.more() ) {
+            BSONElement e = i.next();
+            if ( e.eoo() )
+                break;
+            if ( e.woCompare( x, false ) == 0 )
+                return true;
+        }
+        return false;
+    }
+
     class ModSet {
         vector< Mod > mods_;
+        void appendNewFromMod( BSONObjBuilder &b, const BSONElement &e, const Mod &m ) const;
     public:
         void getMods( const BSONObj &from );
         bool applyModsInPlace( const BSONObj &obj ) const;
         BSONObj createNewFromMods( const BSONObj &obj ) const;
-        void checkUnindexed( const set<string>& idxKeys ) const {
+        /* true if a mod names an indexed field, or a field above or below one.  such an update
+           can't be patched into the record's bytes, as the index keys must change with it. */
+        bool touchesIndexedField( const set<string>& idxKeys ) const {
             for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); i++ ) {
-                if ( idxKeys.count(i->fieldName) ) {
-                    uassert("can't $inc/$set an indexed field", false);
+                for ( set<string>::const_iterator j = idxKeys.begin(); j != idxKeys.end(); j++ ) {
+                    const char *a = i->fieldName;
+                    const char *b = j->c_str();
+                    while ( *a && *a == *b ) {
+                        a++;
+                        b++;
+                    }
+                    if ( ( *a == 0 || *a == '.' ) && ( *b == 0 || *b == '.' ) )
+                        return true;
                 }
             }
+            return false;
+        }
+        /* the top level fields the mods may change, for DataFileMgr::update */
+        void fieldsTouched( set<string>& fields ) const {
+            for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); i++ ) {
+                const char *dot = strchr( i->fieldName, '.' );
+                fields.insert( dot ? string( i->fieldName, dot - i->fieldName ) : string( i->fieldName ) );
+            }
+        }
+        /* $push can't be replayed safely, so an update using it is logged as the new object */
+        bool idempotent() const {
+            for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); i++ )
+                if ( i->op == Mod::PUSH )
+                    return false;
+            return true;
         }
         unsigned size() const { return mods_.size(); }
         bool haveModForField( const char *fieldName ) const {
@@ -209,10 +251,6 @@ namespace mongo {
             }
             return 0;
         }
-        void appendUpsert( BSONObjBuilder &b ) const {
-            for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); i++ )
-                b.append(i->fieldName, i->getn());   
-        }
         void checkNoEmbedded() const {
             for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); i++ )
                 uassert( "Embedded mods not yet supported when $set requires object recreation",
@@ -227,11 +265,45 @@ namespace mongo {
         for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); ++i ) {
             const Mod& m = *i;
             BSONElement e = obj.getFieldDotted(m.fieldName);
-            uassert( "Cannot apply $inc modifier to non-number", m.op != Mod::INC || e.isNumber() );
-            if ( e.isNumber() && m.elt.isNumber() )
-                continue;
-            if ( m.elt.valuesize() == e.valuesize() )
+            switch( m.op ) {
+            case Mod::INC:
+                if ( e.eoo() )
+                    break;
+                uassert( "Cannot apply $inc modifier to non-number", e.isNumber() );
                 continue;
+            case Mod::SET:
+                if ( e.eoo() )
+                    break;
+                if ( e.isNumber() && m.elt.isNumber() )
+                    continue;
+                if ( m.elt.valuesize() == e.valuesize() )
+                    continue;
+                break;
+            case Mod::MIN:
+            case Mod::MAX:
+                if ( e.eoo() )
+                    break;
+                if ( !m.beats( e ) )
+                    continue;
+                /* the bound replaces the field with its own type: setNumber() would truncate
+                   a double bound written to an int */
+                if ( m.elt.type() == e.type() && m.elt.valuesize() == e.valuesize() )
+                    continue;
+                break;
+            case Mod::UNSET:
+                if ( e.eoo() )
+                    continue;
+                break;
+            case Mod::PULL:
+            case Mod::ADDTOSET:
+            case Mod::PUSH:
+                uassert( "Cannot apply array modifier to non-array", e.eoo() || e.type() == Array );
+                if ( m.op == Mod::PULL && ( e.eoo() || !arrayContains( e, m.elt ) ) )
+                    continue;
+                if ( m.op == Mod::ADDTOSET && !e.eoo() && arrayContains( e, m.elt ) )
+                    continue;
+                break;
+            }
             inPlacePossible = false;
         }
         if ( !inPlacePossible ) {
@@ -240,21 +312,83 @@ namespace mongo {
         for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); ++i ) {
             const Mod& m = *i;
             BSONElement e = obj.getFieldDotted(m.fieldName);
+            if ( !e.eoo() )
+                writing( (void *) e.rawdata(), e.size() );
             if ( m.op == Mod::INC ) {
                 BSONElementManipulator( e ).setNumber( e.number() + m.getn() );
                 m.setn( e.number() );
                 // *m.n = e.number() += *m.n;
-            } else {
+            } else if ( m.op == Mod::SET || ( ( m.op == Mod::MIN || m.op == Mod::MAX ) && m.beats( e ) ) ) {
                 // $set or $SET
                 if ( e.isNumber() && m.elt.isNumber() )
-                    BSONElementManipulator( e ).setNumber( m.getn() );
+                    BSONElementManipulator( e ).setNumber( m.elt.number() );
                 else
                     BSONElementManipulator( e ).replaceTypeAndValue( m.elt );
             }
+            // the other mods were checked above to be no-ops on this object
         }
         return true;
     }
 
+    /* append field e of the object being rebuilt, as mod m leaves it.  e is eoo if the
+       object has no such field. */
+    void ModSet::appendNewFromMod( BSONObjBuilder &b, const BSONElement &e, const Mod &m ) const {
+        switch( m.op ) {
+        case Mod::INC:
+            if ( e.eoo() )
+                b.appendAs( m.elt, m.fieldName );
+            else {
+                uassert( "Cannot apply $inc modifier to non-number", e.isNumber() );
+                if ( e.type() == NumberInt )
+                    b.append( e.fieldName(), int( e.number() + m.getn() ) );
+                else
+                    b.append( e.fieldName(), double( e.number() + m.getn() ) );
+                m.setn( e.number() + m.getn() );
+            }
+            break;
+        case Mod::SET:
+            b.appendAs( m.elt, m.fieldName );
+            break;
+        case Mod::MIN:
+        case Mod::MAX:
+            if ( e.eoo() || m.beats( e ) )
+                b.appendAs( m.elt, m.fieldName );
+            else
+                b.append( e );
+            break;
+        case Mod::UNSET:
+            break;
+        case Mod::PUSH:
+        case Mod::ADDTOSET:
+        case Mod::PULL: {
+            uassert( "Cannot apply array modifier to non-array", e.eoo() || e.type() == Array );
+            if ( m.op == Mod::PULL && e.eoo() )
+                break;
+            BSONObjBuilder arr;
+            int n = 0;
+            bool found = false;
+            if ( !e.eoo() ) {
+                BSONObjIterator i( e.embeddedObject() );
+                while( i.more() ) {
+                    BSONElement x = i.next();
+                    if ( x.eoo() )
+                        break;
+                    if ( x.woCompare( m.elt, false ) == 0 ) {
+                        found = true;
+                        if ( m.op == Mod::PULL )
+                            continue;
+                    }
+                    arr.appendAs( x, BSONObjBuilder::numStr( n++ ).c_str() );
+                }
+            }
+            if ( m.op == Mod::PUSH || ( m.op == Mod::ADDTOSET && !found ) )
+                arr.appendAs( m.elt, BSONObjBuilder::numStr( n++ ).c_str() );
+            b.appendArray( m.fieldName, arr.done() );
+            break;
+        }
+        }
+    }
+
     BSONObj ModSet::createNewFromMods( const BSONObj &obj ) const {
         BSONObjBuilder b;
         
@@ -269,22 +403,24 @@ namespace mongo {
             const Mod *mod = modForField( e.fieldName() );
             if ( !mod ) {
                 b.append( e );
-            } else if ( mod->op == Mod::INC ) {
-                if ( e.type() == NumberInt )
-                    b.append( e.fieldName(), int( e.number() + mod->getn() ) );
-                else
-                    b.append( e.fieldName(), double( e.number() + mod->getn() ) );
-                mod->setn( e.number() );
-            } else if ( mod->op == Mod::SET ) {
-                b.appendAs( mod->elt, e.fieldName() );
+            } else {
+                appendNewFromMod( b, e, *mod );
             }
         }
+        // fields the mods create
+        for ( vector<Mod>::const_iterator i = mods_.begin(); i != mods_.end(); ++i ) {
+            if ( obj.getField( i->fieldName ).eoo() )
+                appendNewFromMod( b, BSONElement(), *i );
+        }
         return b.obj();
     }
     
     /* get special operations like $inc
        { $inc: { a:1, b:1 } }
        { $set: { a:77 } }
+       { $push: { a:1 } } { $pull: { a:1 } } { $addToSet: { a:1 } }
+       { $unset: { a:1 } }
+       { $min: { a:0 } } { $max: { a:100 } }
        NOTE: MODIFIES source from object!
     */
     void ModSet::getMods(const BSONObj &from) {
@@ -294,14 +430,25 @@ namespace mongo {
             if ( e.eoo() )
                 break;
             const char *fn = e.fieldName();
-            uassert( "Invalid modifier specified",
-                    *fn == '$' && e.type() == Object && fn[4] == 0 );
+            uassert( "Invalid modifier specified", *fn == '$' && e.type() == Object );
             BSONObj j = e.embeddedObject();
             BSONObjIterator jt(j);
             Mod::Op op = Mod::SET;
             if ( strcmp("$inc",fn) == 0 ) {
                 op = Mod::INC;
                 strcpy((char *) fn, "$set");
+            } else if ( strcmp("$push",fn) == 0 ) {
+                op = Mod::PUSH;
+            } else if ( strcmp("$pull",fn) == 0 ) {
+                op = Mod::PULL;
+            } else if ( strcmp("$unset",fn) == 0 ) {
+                op = Mod::UNSET;
+            } else if ( strcmp("$addToSet",fn) == 0 ) {
+                op = Mod::ADDTOSET;
+            } else if ( strcmp("$min",fn) == 0 ) {
+                op = Mod::MIN;
+            } else if ( strcmp("$max",fn) == 0 ) {
+                op = Mod::MAX;
             } else {
                 uassert( "Invalid modifier specified", strcmp("$set",fn ) == 0 );
             }
@@ -319,11 +466,11 @@ namespace mongo {
                 }
                 uassert( "Modifier $inc allowed for numbers only", f.isNumber() || op != Mod::INC );
                 m.elt = f;
+                m.ndouble = 0;
+                m.nint = 0;
                 if ( f.type() == NumberDouble ) {
                     m.ndouble = (double *) f.value();
-                    m.nint = 0;
                 } else if ( f.type() == NumberInt ) {
-                    m.ndouble = 0;
                     m.nint = (int *) f.value();
                 }
                 mods_.push_back( m );
@@ -376,8 +523,129 @@ namespace mongo {
         auto_ptr< KeyValJSMatcher > matcher_;
     };
     
-    int __updateObjects(const char *ns, BSONObj updateobj, BSONObj &pattern, bool upsert, stringstream& ss, bool logop=false) {
+    /* for updateMatching(): do the mods touch an indexed field, and in particular one of the
+       index c walks?  asked again after each yield, as indexes may come and go meanwhile. */
+    static void modsTouchIndexes(const char *ns, const BSONObj& updateobj, Cursor *c, bool& indexed, bool& rekeys) {
+        ModSet mods;
+        BSONObj u = updateobj.copy();
+        mods.getMods(u);
+        NamespaceDetailsTransient& ndt = NamespaceDetailsTransient::get(ns);
+        indexed = mods.touchesIndexedField( ndt.indexKeys() );
+        set<string> cursorKeys;
+        c->indexKeyPattern().getFieldNames( cursorKeys );
+        rekeys = mods.touchesIndexedField( cursorKeys );
+    }
+
+    /* multi-update: apply the modifiers to every record matching pattern.  c is positioned
+       at the first match by UpdateOp, and we keep walking it rather than planning again per
+       record.  a record that moves, or whose key changes in the index c walks, may be met
+       again further along the cursor, so we remember where those ended up and skip them
+       there.  records updated where they are, with their keys in c's index unchanged, can't
+       be met again and aren't remembered.
+
+       we yield dbMutex every so often, like a long query.  records inserted or changed
+       meanwhile may or may not be updated.  each change is logged by _id.  returns the number
+       of records updated.
+    */
+    long long updateMatching(const char *ns, const BSONObj& updateobj, const BSONObj& pattern, auto_ptr< Cursor > c, bool logop, stringstream& ss) {
+        int profile = database->profile;
+        bool indexed, rekeys;
+        modsTouchIndexes( ns, updateobj, c.get(), indexed, rekeys );
+        set<string> touched;
+        {
+            ModSet mods;
+            BSONObj u = updateobj.copy();
+            mods.getMods(u);
+            mods.fieldsTouched( touched );
+        }
+
+        KeyValJSMatcher matcher(pattern, c->indexKeyPattern());
+        set<DiskLoc> seen;
+        long long nModified = 0;
+        int nFast = 0;
+        int nPadded = 0;
+        YieldTracker yt;
+        while ( c->ok() ) {
+            DiskLoc rloc = c->currLoc();
+            bool deep;
+            if ( seen.count(rloc) || !matcher.matches(c->currKey(), rloc, &deep) || ( deep && c->getsetdup(rloc) ) ) {
+                c->advance();
+                continue;
+            }
+            Record *r = c->_current();
+            BSONObj js(r);
+
+            BSONObj logPattern;
+            if ( logop ) {
+                BSONElement id;
+                if ( js.getObjectID( id ) ) {
+                    BSONObjBuilder idPattern;
+                    idPattern.append( id );
+                    logPattern = idPattern.obj();
+                }
+                else {
+                    // no _id: the record's old contents are the only pattern that picks it out.
+                    logPattern = js.copy();
+                }
+            }
+
+            /* applying mods rewrites them in place ($inc becomes a $set of the result, for
+               the log), so each record starts from a fresh copy. */
+            BSONObj u = updateobj.copy();
+            ModSet mods;
+            mods.getMods(u);
+
+            /* advance first: the update may delete the current record (if it moves), and
+               the index changes that go with a move can shift the bucket the cursor is in. */
+            c->advance();
+            c->noteLocation();
+            DiskLoc newLoc = rloc;
+            if ( !indexed && mods.applyModsInPlace( js ) ) {
+                nFast++;
+            }
+            else {
+                BSONObj newObj = mods.createNewFromMods( js );
+                newLoc = theDataFileMgr.update(ns, r, rloc, newObj.objdata(), newObj.objsize(), ss, &touched);
+                if ( newLoc == rloc )
+                    nPadded++;
+            }
+            if ( newLoc != rloc || rekeys )
+                seen.insert( newLoc );
+            c->checkLocation();
+            nModified++;
+            if ( logop && mods.size() ) {
+                bool upsert = false;
+                if ( mods.idempotent() )
+                    logOp("u", ns, u, &logPattern, &upsert);
+                else
+                    logOp("u", ns, newLoc.obj(), &logPattern, &upsert);
+            }
+
+            if ( c->ok() && yt.ping() && dbMutexInfo.haveWriteLock() && OpScope::mayYield() ) {
+                SavedCursor saved;
+                saved.save(ns, c);
+                currentOp.yields++;
+                {
+                    dbtemprelease unlock;
+                    boost::thread::yield();
+                }
+                c = saved.restore();
+                if ( c.get() == 0 )
+                    break; // the rest of the collection was deleted while we were unlocked
+                modsTouchIndexes( ns, updateobj, c.get(), indexed, rekeys );
+            }
+        }
+        if ( profile )
+            ss << " nmodified:" << nModified << " fastmod:" << nFast << " fastmodpadded:" << nPadded;
+        return nModified;
+    }
+
+    int __updateObjects(const char *ns, BSONObj updateobj, BSONObj &pattern, bool upsert, stringstream& ss, bool logop=false, bool multi=false, long long *nModified=0) {
         int profile = database->profile;
+        long long dummy;
+        if ( nModified == 0 )
+            nModified = &dummy;
+        *nModified = 0;
         
         if ( strstr(ns, ".system.") ) {
             if( strstr(ns, ".system.users") )
@@ -394,10 +662,19 @@ namespace mongo {
         shared_ptr< UpdateOp > u = qps.runOp( original );
         massert( u->exceptionMessage(), u->complete() );
         auto_ptr< Cursor > c = u->c();
+        if ( multi && c->ok() ) {
+            uassert( "multi-update requires all modifiers", updateobj.firstElement().fieldName()[0] == '$' );
+            if ( profile )
+                ss << " nscanned:" << u->nscanned();
+            *nModified = updateMatching( ns, updateobj, pattern, c, logop, ss );
+            return logop ? 5 : 2;
+        }
         if ( c->ok() ) {
+            *nModified = 1;
             Record *r = c->_current();
             BSONObj js(r);
             
+            BSONObj logPattern;
             if ( logop ) {
                 BSONObjBuilder idPattern;
                 BSONElement id;
@@ -408,6 +685,12 @@ namespace mongo {
                 if ( js.getObjectID( id ) ) {
                     idPattern.append( id );
                     pattern = idPattern.obj();
+                    logPattern = pattern;
+                }
+                else {
+                    // as in the multi update path: the old contents are the only pattern that
+                    // picks out this record.
+                    logPattern = js.copy();
                 }
             }
             
@@ -427,17 +710,31 @@ namespace mongo {
                 mods.getMods(updateobj);
                 NamespaceDetailsTransient& ndt = NamespaceDetailsTransient::get(ns);
                 set<string>& idxKeys = ndt.indexKeys();
-                mods.checkUnindexed( idxKeys );
-                if ( mods.applyModsInPlace( c->currLoc().obj() ) ) {
+                DiskLoc loc = c->currLoc();
+                if ( !mods.touchesIndexedField( idxKeys ) && mods.applyModsInPlace( loc.obj() ) ) {
                     if ( profile )
                         ss << " fastmod ";
                 } else {
-                    BSONObj newObj = mods.createNewFromMods( c->currLoc().obj() );
-                    theDataFileMgr.update(ns, r, c->currLoc(), newObj.objdata(), newObj.objsize(), ss);                    
+                    /* still no move if the new object fits the record's padding.  DataFileMgr::update
+                       only recomputes keys for indexes on the fields the mods touch. */
+                    BSONObj newObj = mods.createNewFromMods( loc.obj() );
+                    set<string> touched;
+                    mods.fieldsTouched( touched );
+                    DiskLoc newLoc = theDataFileMgr.update(ns, r, loc, newObj.objdata(), newObj.objsize(), ss, &touched);
+                    if ( profile && newLoc == loc )
+                        ss << " fastmodpadded ";
+                    loc = newLoc;
                 }
                 if ( logop ) {
                     if ( mods.size() ) {
-                        logOp("u", ns, updateobj, &pattern, &upsert);
+                        if ( mods.idempotent() )
+                            logOp("u", ns, updateobj, &pattern, &upsert);
+                        else {
+                            /* the full new object replaces the record on the slave, so it must
+                               hit exactly this one and must not insert when it misses */
+                            bool no = false;
+                            logOp("u", ns, loc.obj(), &logPattern, &no);
+                        }
                         return 5;
                     }
                 }
@@ -456,7 +753,7 @@ namespace mongo {
         
         if ( upsert ) {
             if ( updateobj.firstElement().fieldName()[0] == '$' ) {
-                /* upsert of an $inc. build a default */
+                /* upsert with mods.  build a default from the pattern and apply them to it */
                 ModSet mods;
                 mods.getMods(updateobj);
                 BSONObjBuilder b;
@@ -468,17 +765,18 @@ namespace mongo {
                     if ( !mods.haveModForField( e.fieldName() ) )
                         b.append( e );
                 }
-                mods.appendUpsert( b );
-                BSONObj obj = b.done();
+                BSONObj obj = mods.createNewFromMods( b.done() );
                 theDataFileMgr.insert(ns, obj);
                 if ( profile )
                     ss << " fastmodinsert ";
                 if ( logop )
                     logOp( "i", ns, obj );
+                *nModified = 1;
                 return 3;
             }
             if ( profile )
                 ss << " upsert ";
+            *nModified = 1;
             theDataFileMgr.insert(ns, updateobj);
             if ( logop )
                 logOp( "i", ns, updateobj );
@@ -495,10 +793,12 @@ namespace mongo {
         return __updateObjects( ns, updateobj, pattern, upsert, ss, logop );
     }
         
-    void updateObjects(const char *ns, BSONObj updateobj, BSONObj pattern, bool upsert, stringstream& ss) {
-        int rc = __updateObjects(ns, updateobj, pattern, upsert, ss, true);
+    long long updateObjects(const char *ns, BSONObj updateobj, BSONObj pattern, bool upsert, stringstream& ss, bool multi) {
+        long long nModified;
+        int rc = __updateObjects(ns, updateobj, pattern, upsert, ss, true, multi, &nModified);
         if ( rc != 5 && rc != 0 && rc != 4 && rc != 3 )
             logOp("u", ns, updateobj, &pattern, &upsert);
+        return nModified;
     }
 
     int queryTraceLevel = 0;
@@ -576,10 +876,79 @@ namespace mongo {
         return qr;
     }
 
+    /* A query is covered by its index when the results can be built from index keys without
+       reading the records: the matcher needs nothing outside the key, the requested fields --
+       and _id, which is always returned -- are all top level fields of the key, and no
+       document has an array where the index looks (a multikey index holds an element of
+       the array, not the array).  Checked again after anything that may have released
+       dbMutex, as a write meanwhile could make the index multikey.
+    */
+    static bool coveredQuery(const char *ns, Cursor *c, KeyValJSMatcher *matcher, FieldsToReturn *filter) {
+        if ( filter == 0 || filter->empty() || !matcher->keyMatch() )
+            return false;
+        BtreeCursor *bc = dynamic_cast< BtreeCursor* >( c );
+        if ( bc == 0 )
+            return false;
+        BSONObj keyPattern = bc->indexKeyPattern();
+        if ( !keyPattern.hasField( "_id" ) )
+            return false;
+        for ( unsigned i = 0; i < filter->size(); i++ )
+            if ( strchr( (*filter)[ i ].c_str(), '.' ) || !keyPattern.hasField( (*filter)[ i ].c_str() ) )
+                return false;
+        NamespaceDetails *d = nsdetails( ns );
+        return d && !d->isMultikey( d->idxNo( bc->getIndexDetails() ) );
+    }
+
+    /* fillQueryResultFromObj() for a covered query: builds the result from the index key,
+       in the same order addFields() uses.  Returns false, appending nothing, if a requested
+       field is null in the key -- the document may not have the field at all -- in which
+       case the caller must use the record.
+    */
+    static bool fillQueryResultFromKey(BufBuilder& b, FieldsToReturn *filter, const BSONObj& keyPattern, const BSONObj& key) {
+        BSONElement id;
+        vector< BSONElement > fields( filter->size() );
+        BSONObjIterator p( keyPattern );
+        BSONObjIterator k( key );
+        while ( p.more() && k.more() ) {
+            BSONElement pe = p.next();
+            BSONElement ke = k.next();
+            if ( pe.eoo() || ke.eoo() )
+                break;
+            bool isId = strcmp( pe.fieldName(), "_id" ) == 0;
+            int pos = filter->pos( pe.fieldName() );
+            if ( !isId && pos < 0 )
+                continue;
+            if ( ke.isNull() || ke.type() == Undefined )
+                return false;
+            if ( isId )
+                id = ke;
+            else
+                fields[ pos ] = ke;
+        }
+        BSONObjBuilder res;
+        if ( !id.eoo() )
+            res.appendAs( id, "_id" );
+        for ( unsigned i = 0; i < fields.size(); i++ )
+            if ( !fields[ i ].eoo() )
+                res.appendAs( fields[ i ], (*filter)[ i ].c_str() );
+        BSONObj o = res.done();
+        b.append( (void*) o.objdata(), o.objsize() );
+        return true;
+    }
+
     QueryResult* getMore(const char *ns, int ntoreturn, long long cursorid) {
         BufBuilder b(32768);
 
-        ClientCursor *cc = ClientCursor::find(cursorid);
+        ClientCursor *cc = ClientCursor::pin(cursorid);
+        /* unpins cc unless we deleted it */
+        struct Unpin {
+            ClientCursor *&cc;
+            Unpin(ClientCursor *&_cc) : cc(_cc) { }
+            ~Unpin() {
+                if ( cc )
+                    cc->unpin();
+            }
+        } unpin(cc);
 
         b.skip(sizeof(QueryResult));
 
@@ -596,6 +965,8 @@ namespace mongo {
             start = cc->pos;
             Cursor *c = cc->c.get();
             c->checkLocation();
+            bool covered = coveredQuery(ns, c, cc->matcher.get(), cc->filter.get());
+            BSONObj keyPattern = covered ? c->indexKeyPattern() : BSONObj();
             while ( 1 ) {
                 if ( !c->ok() ) {
                     if ( c->tailable() ) {
@@ -611,7 +982,8 @@ namespace mongo {
                     break;
                 }
                 bool deep;
-                if ( !cc->matcher->matches(c->currKey(), c->currLoc(), &deep) ) {
+                BSONObj key = c->currKey();
+                if ( !cc->matcher->matches(key, c->currLoc(), &deep) ) {
                 }
                 else {
                     //out() << "matches " << c->currLoc().toString() << ' ' << deep << '\n';
@@ -619,8 +991,13 @@ namespace mongo {
                         //out() << "  but it's a dup \n";
                     }
                     else {
-                        BSONObj js = c->current();
-                        bool ok = fillQueryResultFromObj(b, cc->filter.get(), js);
+                        bool ok;
+                        if ( covered && fillQueryResultFromKey(b, cc->filter.get(), keyPattern, key) )
+                            ok = true;
+                        else {
+                            BSONObj js = c->current();
+                            ok = fillQueryResultFromObj(b, cc->filter.get(), js);
+                        }
                         if ( ok ) {
                             n++;
                             if ( (ntoreturn>0 && (n >= ntoreturn || b.len() > MaxBytesToReturnToClientAtOnce)) ||
@@ -670,7 +1047,9 @@ namespace mongo {
             }
             if ( bc_ ) {
                 if ( firstMatch_.isEmpty() ) {
-                    firstMatch_ = bc_->currKeyNode().key;
+                    // copy, the bucket may change if we yield.  currKey() decodes
+                    // normalized keys; the raw key node isn't BSON then.
+                    firstMatch_ = bc_->currKey().copy();
                     // if not match
                     if ( query_.woCompare( firstMatch_, BSONObj(), false ) ) {
                         setComplete();
@@ -678,7 +1057,7 @@ namespace mongo {
                     }
                     ++count_;
                 } else {
-                    if ( !firstMatch_.woEqual( bc_->currKeyNode().key ) ) {
+                    if ( !firstMatch_.woEqual( bc_->currKey() ) ) {
                         setComplete();
                         return;
                     }
@@ -710,7 +1089,20 @@ namespace mongo {
         }
         long long count() const { return count_; }
         virtual bool mayRecordPlan() const { return true; }
+        virtual bool mayYield() const { return true; }
+        virtual void prepareToYield() {
+            saved_.save( qp().ns(), c_ );
+        }
+        virtual void recoverFromYield() {
+            c_ = saved_.restore();
+            if ( !c_.get() ) {
+                // ran off the end or collection went away
+                c_.reset( new BasicCursor( DiskLoc() ) );
+                bc_ = 0;
+            }
+        }
     private:
+        SavedCursor saved_;
         BSONObj spec_;
         long long count_;
         auto_ptr< Cursor > c_;
@@ -751,7 +1143,7 @@ namespace mongo {
     class DoQueryOp : public QueryOp {
     public:
         DoQueryOp( int ntoskip, int ntoreturn, const BSONObj &order, bool wantMore,
-                  bool explain, set< string > *filter, int queryOptions ) :
+                  bool explain, FieldsToReturn *filter, int queryOptions ) :
         b_( 32768 ),
         ntoskip_( ntoskip ),
         ntoreturn_( ntoreturn ),
@@ -765,7 +1157,8 @@ namespace mongo {
         n_(),
         soSize_(),
         saveClientCursor_(),
-        findingStart_( (queryOptions & Option_OplogReplay) != 0 ) 
+        findingStart_( (queryOptions & Option_OplogReplay) != 0 ),
+        covered_()
         {}
 
         virtual void init() {
@@ -783,6 +1176,12 @@ namespace mongo {
                 so_.reset( new ScanAndOrder( ntoskip_, ntoreturn_, order_ ) );
                 wantMore_ = false;
             }
+            checkCovered();
+        }
+        /* ScanAndOrder reads its results from the records, so an ordered query is never covered */
+        void checkCovered() {
+            covered_ = !ordering_ && !findingStart_ && coveredQuery( qp().ns(), c_.get(), matcher_.get(), filter_ );
+            keyPattern_ = covered_ ? c_->indexKeyPattern() : BSONObj();
         }
         virtual void next() {
             if ( findingStart_ ) {
@@ -805,15 +1204,16 @@ namespace mongo {
             
             nscanned_++;
             bool deep;
-            if ( !matcher_->matches(c_->currKey(), c_->currLoc(), &deep) ) {
+            BSONObj key = c_->currKey();
+            if ( !matcher_->matches(key, c_->currLoc(), &deep) ) {
             }
             else if ( !deep || !c_->getsetdup(c_->currLoc()) ) { // i.e., check for dups on deep items only
-                BSONObj js = c_->current();
                 // got a match.
-                assert( js.objsize() >= 0 ); //defensive for segfaults
                 if ( ordering_ ) {
-                    // note: no cursors for non-indexed, ordered results.  results must be fairly small.
-                    so_->add(js);
+                    BSONObj js = c_->current();
+                    assert( js.objsize() >= 0 ); //defensive for segfaults
+                    // note: no cursors for non-indexed, ordered results; they all go in one reply.
+                    so_->add(js, c_->currLoc());
                 }
                 else if ( ntoskip_ > 0 ) {
                     ntoskip_--;
@@ -827,7 +1227,14 @@ namespace mongo {
                         }
                     }
                     else {
-                        bool ok = fillQueryResultFromObj(b_, filter_, js);
+                        bool ok;
+                        if ( covered_ && fillQueryResultFromKey(b_, filter_, keyPattern_, key) )
+                            ok = true;
+                        else {
+                            BSONObj js = c_->current();
+                            assert( js.objsize() >= 0 ); //defensive for segfaults
+                            ok = fillQueryResultFromObj(b_, filter_, js);
+                        }
                         if ( ok ) n_++;
                         if ( ok ) {
                             if ( (ntoreturn_>0 && (n_ >= ntoreturn_ || b_.len() > MaxBytesToReturnToClientAtOnce)) ||
@@ -877,6 +1284,17 @@ namespace mongo {
         virtual QueryOp *clone() const {
             return new DoQueryOp( ntoskip_, ntoreturn_, order_, wantMore_, explain_, filter_, queryOptions_ );
         }
+        /* so_ keeps the locations of the records it has seen, so we can't let them move */
+        virtual bool mayYield() const { return !ordering_ && !findingStart_; }
+        virtual void prepareToYield() {
+            saved_.save( qp().ns(), c_ );
+        }
+        virtual void recoverFromYield() {
+            c_ = saved_.restore();
+            if ( !c_.get() )
+                c_.reset( new BasicCursor( DiskLoc() ) );
+            checkCovered();
+        }
         BufBuilder &builder() { return b_; }
         bool scanAndOrderRequired() const { return ordering_; }
         auto_ptr< Cursor > cursor() { return c_; }
@@ -884,6 +1302,7 @@ namespace mongo {
         int n() const { return n_; }
         long long nscanned() const { return nscanned_; }
         bool saveClientCursor() const { return saveClientCursor_; }
+        bool covered() const { return covered_; }
     private:
         BufBuilder b_;
         int ntoskip_;
@@ -891,7 +1310,7 @@ namespace mongo {
         BSONObj order_;
         bool wantMore_;
         bool explain_;
-        set< string > *filter_;   
+        FieldsToReturn *filter_;
         bool ordering_;
         auto_ptr< Cursor > c_;
         long long nscanned_;
@@ -902,6 +1321,9 @@ namespace mongo {
         bool saveClientCursor_;
         auto_ptr< ScanAndOrder > so_;
         bool findingStart_;
+        SavedCursor saved_;
+        bool covered_; // results are built from index keys, see coveredQuery()
+        BSONObj keyPattern_;
     };
     
     auto_ptr< QueryResult > runQuery(Message& m, stringstream& ss ) {
@@ -911,7 +1333,7 @@ namespace mongo {
         int ntoskip = q.ntoskip;
         int _ntoreturn = q.ntoreturn;
         BSONObj jsobj = q.query;
-        auto_ptr< set< string > > filter = q.fields;
+        auto_ptr< FieldsToReturn > filter = q.fields;
         int queryOptions = q.queryOptions;
         
         Timer t;
@@ -930,7 +1352,8 @@ namespace mongo {
             wantMore = false;
         }
         ss << "query " << ns << " ntoreturn:" << ntoreturn;
-        {
+        if ( dbMutexInfo.haveWriteLock() ) {
+            // currentOp only describes exclusive operations
             string s = jsobj.toString();
             strncpy(currentOp.query, s.c_str(), sizeof(currentOp.query)-1);
         }
@@ -1019,6 +1442,8 @@ namespace mongo {
             nscanned = dqo.nscanned();
             if ( dqo.scanAndOrderRequired() )
                 ss << " scanAndOrder ";
+            if ( dqo.covered() )
+                ss << " covered ";
             auto_ptr< Cursor > c = dqo.cursor();
             if ( dqo.saveClientCursor() ) {
                 ClientCursor *cc = new ClientCursor();
@@ -1045,6 +1470,8 @@ namespace mongo {
                 builder.append("n", n);
                 if ( dqo.scanAndOrderRequired() )
                     builder.append("scanAndOrder", true);
+                if ( dqo.covered() )
+                    builder.append("covered", true);
                 builder.append("millis", t.millis());
                 if ( !oldPlan.isEmpty() )
                     builder.append( "oldPlan", oldPlan.firstElement().embeddedObject().firstElement().embeddedObject() );
@@ -41,7 +41,7 @@
       JSObject query;
    dbUpdate:
       string collection;
-	  int flags; // 1=upsert
+	  int flags; // 1=upsert, 2=multi (update every match; $ modifiers only)
       JSObject query;
 	  JSObject objectToUpdate;
         objectToUpdate may include { $inc: <field> } or { $set: ... }, see struct Mod.
@@ -72,7 +72,8 @@ namespace mongo {
 // for an existing query (ie a ClientCursor), send back additional information.
     QueryResult* getMore(const char *ns, int ntoreturn, long long cursorid);
 
-    void updateObjects(const char *ns, BSONObj updateobj, BSONObj pattern, bool upsert, stringstream& ss);
+    /* returns the number of records updated, or 1 if the update became an insert */
+    long long updateObjects(const char *ns, BSONObj updateobj, BSONObj pattern, bool upsert, stringstream& ss, bool multi = false);
 
     // If justOne is true, deletedId is set to the id of the deleted object.
     int deleteObjects(const char *ns, BSONObj pattern, bool justOne, BSONObj *deletedId = 0, bool god=false);
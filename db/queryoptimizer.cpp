@@ -21,9 +21,103 @@
 #include "btree.h"
 #include "pdfile.h"
 #include "queryoptimizer.h"
+#include "curop.h"
+#include "clientcursor.h"
+#include <cmath>
 
 namespace mongo {
 
+    /* orders keys of an index the way the btree does */
+    struct KeyLess {
+        KeyLess( const BSONObj &keyPattern ) : keyPattern_( keyPattern ) {}
+        bool operator()( const BSONObj &l, const BSONObj &r ) const {
+            return l.woCompare( r, keyPattern_, false ) < 0;
+        }
+        const BSONObj &keyPattern_;
+    };
+
+    /* the number of leading fields a and b have in common */
+    static int equalPrefix( const BSONObj &a, const BSONObj &b ) {
+        BSONObjIterator i( a );
+        BSONObjIterator j( b );
+        int n = 0;
+        while( i.more() && j.more() ) {
+            BSONElement e = i.next();
+            BSONElement f = j.next();
+            if ( e.eoo() || f.eoo() || e.woCompare( f, false ) != 0 )
+                break;
+            ++n;
+        }
+        return n;
+    }
+
+    IndexStats::IndexStats( NamespaceDetails *d, const IndexDetails &idx ) :
+    keyPattern_( idx.keyPattern().getOwned() ),
+    nKeys_( 0 ),
+    exact_( false ) {
+        exact_ = idx.head.btree()->sampleKeys( idx.head, keyPattern_, SampleSize, sample_, nKeys_ );
+        // without arrays there is a key per record, which beats extrapolating from the tree
+        if ( !exact_ && !d->isMultikey( d->idxNo( idx ) ) )
+            nKeys_ = d->nrecords;
+        if ( nKeys_ < (long long) sample_.size() )
+            nKeys_ = sample_.size();
+
+        int nFields = keyPattern_.nFields();
+        for( int n = 1; n <= nFields; ++n ) {
+            // keys with the same prefix are next to each other in the sample
+            long long groups = 0;
+            long long singles = 0;
+            for( unsigned i = 0; i < sample_.size(); ) {
+                unsigned j = i + 1;
+                while( j < sample_.size() && equalPrefix( sample_[ i ], sample_[ j ] ) >= n )
+                    ++j;
+                ++groups;
+                if ( j == i + 1 )
+                    ++singles;
+                i = j;
+            }
+            long long est = groups;
+            if ( !exact_ && !sample_.empty() ) {
+                // the GEE estimator: a value seen once stands for sqrt( nKeys / sampled ) of them
+                est = (long long) ( sqrt( double( nKeys_ ) / sample_.size() ) * singles ) + groups - singles;
+                if ( est > nKeys_ )
+                    est = nKeys_;
+            }
+            distinct_.push_back( est > 0 ? est : 1 );
+        }
+    }
+
+    shared_ptr< IndexStats > IndexStats::get( NamespaceDetails *d, const IndexDetails &idx ) {
+        NamespaceDetailsTransient &t = NamespaceDetailsTransient::get( idx.parentNS().c_str() );
+        string name = idx.indexName();
+        shared_ptr< IndexStats > stats = t.indexStats( name, d->nrecords );
+        if ( stats.get() == 0 ) {
+            stats.reset( new IndexStats( d, idx ) );
+            t.registerIndexStats( name, stats );
+        }
+        return stats;
+    }
+
+    long long IndexStats::keysInRange( const BSONObj &start, const BSONObj &end ) const {
+        KeyLess less( keyPattern_ );
+        bool reversed = less( end, start );
+        const BSONObj &lo = reversed ? end : start;
+        const BSONObj &hi = reversed ? start : end;
+        long long n = upper_bound( sample_.begin(), sample_.end(), hi, less ) -
+            lower_bound( sample_.begin(), sample_.end(), lo, less );
+        if ( exact_ )
+            return n;
+        // fewer than two sampled keys says little more than that the value isn't a common
+        // one, so an equality on a prefix is taken to match an average number of keys
+        int points = equalPrefix( start, end );
+        if ( n < 2 && points > 0 )
+            return nKeys_ / distinct( points );
+        // each sampled key stands for a piece of the index, and the range may take in part
+        // of one more
+        long long est = ( n + 1 ) * nKeys_ / ( (long long) sample_.size() + 1 );
+        return est < nKeys_ ? est : nKeys_;
+    }
+
     QueryPlan::QueryPlan( const FieldBoundSet &fbs, const BSONObj &order, const IndexDetails *index ) :
     fbs_( fbs ),
     order_( order ),
@@ -82,6 +176,12 @@ namespace mongo {
         order.getFieldNames( orderFieldsUnindexed );
         BSONObjBuilder startKeyBuilder;
         BSONObjBuilder endKeyBuilder;
+        // ( start, end ) ranges for each index field, in scan order.  Fields are expanded
+        // to their separate intervals up to and including the first one that isn't all
+        // points; after that a field's whole span is used.
+        vector< vector< pair< BSONElement, BSONElement > > > fieldRanges;
+        bool expandRanges = true;
+        unsigned nRanges = 1;
         while( i.more() ) {
             BSONElement e = i.next();
             if ( e.eoo() )
@@ -91,6 +191,23 @@ namespace mongo {
             bool forward = ( ( number >= 0 ? 1 : -1 ) * ( direction_ >= 0 ? 1 : -1 ) > 0 );
             startKeyBuilder.appendAs( forward ? fb.lower() : fb.upper(), "" );
             endKeyBuilder.appendAs( forward ? fb.upper() : fb.lower(), "" );
+            fieldRanges.push_back( vector< pair< BSONElement, BSONElement > >() );
+            vector< pair< BSONElement, BSONElement > > &ranges = fieldRanges.back();
+            const vector< FieldInterval > &intervals = fb.intervals();
+            if ( expandRanges && !intervals.empty() && nRanges * intervals.size() <= maxIndexRanges ) {
+                if ( forward ) {
+                    for( vector< FieldInterval >::const_iterator j = intervals.begin(); j != intervals.end(); ++j )
+                        ranges.push_back( make_pair( j->lower, j->upper ) );
+                } else {
+                    for( vector< FieldInterval >::const_reverse_iterator j = intervals.rbegin(); j != intervals.rend(); ++j )
+                        ranges.push_back( make_pair( j->upper, j->lower ) );
+                }
+                nRanges *= intervals.size();
+                expandRanges = fb.pointIntervals();
+            } else {
+                ranges.push_back( make_pair( forward ? fb.lower() : fb.upper(), forward ? fb.upper() : fb.lower() ) );
+                expandRanges = false;
+            }
             if ( fb.nontrivial() )
                 ++indexedQueryCount;
             if ( stillOptimalIndexedQueryCount ) {
@@ -120,6 +237,23 @@ namespace mongo {
         }
         startKey_ = startKeyBuilder.obj();
         endKey_ = endKeyBuilder.obj();
+        // Cartesian product of the per field ranges, first field varying slowest so the
+        // key ranges come out in index order.
+        vector< unsigned > pos( fieldRanges.size(), 0 );
+        for( unsigned n = 0; n < nRanges; ++n ) {
+            BSONObjBuilder start;
+            BSONObjBuilder end;
+            for( unsigned f = 0; f < fieldRanges.size(); ++f ) {
+                start.appendAs( fieldRanges[ f ][ pos[ f ] ].first, "" );
+                end.appendAs( fieldRanges[ f ][ pos[ f ] ].second, "" );
+            }
+            indexBounds_.push_back( make_pair( start.obj(), end.obj() ) );
+            for( int f = fieldRanges.size() - 1; f >= 0; --f ) {
+                if ( ++pos[ f ] < fieldRanges[ f ].size() )
+                    break;
+                pos[ f ] = 0;
+            }
+        }
         if ( !keyMatch_ &&
             ( scanAndOrderRequired_ || order_.isEmpty() ) &&
             !fbs.bound( idxKey.firstElement().fieldName() ).nontrivial() )
@@ -133,7 +267,7 @@ namespace mongo {
             return findTableScan( fbs_.ns(), order_, startLoc );
         massert( "newCursor() with start location not implemented for indexed plans", startLoc.isNull() );
         //TODO This constructor should really take a const ref to the index details.
-        return auto_ptr< Cursor >( new BtreeCursor( *const_cast< IndexDetails* >( index_ ), startKey_, endKey_, direction_ >= 0 ? 1 : -1 ) );
+        return auto_ptr< Cursor >( new BtreeCursor( *const_cast< IndexDetails* >( index_ ), indexBounds_, direction_ >= 0 ? 1 : -1 ) );
     }
 
     auto_ptr< Cursor > QueryPlan::newReverseCursor() const {
@@ -158,11 +292,25 @@ namespace mongo {
     void QueryPlan::registerSelf( long long nScanned ) const {
         NamespaceDetailsTransient::get( ns() ).registerIndexForPattern( fbs_.pattern( order_ ), indexKey(), nScanned );  
     }
+
+    long long QueryPlan::estimatedNScanned() const {
+        NamespaceDetails *d = nsdetails( ns() );
+        if ( !d || !fbs_.matchPossible() )
+            return 0;
+        if ( !index_ )
+            return d->nrecords;
+        shared_ptr< IndexStats > stats = IndexStats::get( d, *index_ );
+        long long n = 0;
+        for( BoundList::const_iterator i = indexBounds_.begin(); i != indexBounds_.end(); ++i )
+            n += stats->keysInRange( i->first, i->second );
+        return n < stats->nKeys() ? n : stats->nKeys();
+    }
     
     QueryPlanSet::QueryPlanSet( const char *ns, const BSONObj &query, const BSONObj &order, const BSONElement *hint, bool honorRecordedPlan ) :
     fbs_( ns, query ),
     mayRecordPlan_( true ),
     usingPrerecordedPlan_( false ),
+    usingEstimatedPlans_( false ),
     hint_( BSONObj() ),
     order_( order.getOwned() ),
     oldNScanned_( 0 ),
@@ -175,10 +323,11 @@ namespace mongo {
         init();
     }
     
-    void QueryPlanSet::init() {
+    void QueryPlanSet::init( bool useEstimates ) {
         plans_.clear();
         mayRecordPlan_ = true;
         usingPrerecordedPlan_ = false;
+        usingEstimatedPlans_ = false;
         
         const char *ns = fbs_.ns();
         NamespaceDetails *d = nsdetails( ns );
@@ -243,9 +392,41 @@ namespace mongo {
         }
         
         addOtherPlans( false );
+        if ( useEstimates )
+            pruneByEstimate();
+    }
+
+    void QueryPlanSet::pruneByEstimate() {
+        NamespaceDetails *d = nsdetails( fbs_.ns() );
+        if ( plans_.size() < 2 || d->nrecords < minRecordsForEstimates )
+            return;
+        // A plan that needn't sort may stop early, so how much it scans running to the end
+        // doesn't compare it fairly with one that must sort.
+        for( PlanSet::iterator i = plans_.begin(); i != plans_.end(); ++i )
+            if ( (*i)->scanAndOrderRequired() != plans_[ 0 ]->scanAndOrderRequired() )
+                return;
+        vector< long long > estimates;
+        for( PlanSet::iterator i = plans_.begin(); i != plans_.end(); ++i )
+            estimates.push_back( (*i)->estimatedNScanned() );
+        long long best = *min_element( estimates.begin(), estimates.end() );
+        PlanSet close;
+        long long worst = 0;
+        for( unsigned i = 0; i < plans_.size(); ++i ) {
+            if ( estimates[ i ] <= best * raceRatio ) {
+                close.push_back( plans_[ i ] );
+                if ( estimates[ i ] > worst )
+                    worst = estimates[ i ];
+            }
+        }
+        if ( close.size() == plans_.size() )
+            return;
+        plans_.swap( close );
+        usingEstimatedPlans_ = true;
+        // Runner::run() brings the other plans back if these scan much more than estimated
+        oldNScanned_ = worst + 1;
     }
     
-    void QueryPlanSet::addOtherPlans( bool checkFirst ) {
+    void QueryPlanSet::addOtherPlans( bool checkExisting ) {
         const char *ns = fbs_.ns();
         NamespaceDetails *d = nsdetails( ns );
         if ( !d )
@@ -255,7 +436,7 @@ namespace mongo {
         if ( ( fbs_.nNontrivialBounds() == 0 && order_.isEmpty() ) ||
             ( !order_.isEmpty() && !strcmp( order_.firstElement().fieldName(), "$natural" ) ) ) {
             // Table scan plan
-            addPlan( PlanPtr( new QueryPlan( fbs_, order_ ) ), checkFirst );
+            addPlan( PlanPtr( new QueryPlan( fbs_, order_ ) ), checkExisting );
             return;
         }
         
@@ -263,28 +444,30 @@ namespace mongo {
         for( int i = 0; i < d->nIndexes; ++i ) {
             PlanPtr p( new QueryPlan( fbs_, order_, &d->indexes[ i ] ) );
             if ( p->optimal() ) {
-                addPlan( p, checkFirst );
+                addPlan( p, checkExisting );
                 return;
             } else if ( !p->unhelpful() ) {
                 plans.push_back( p );
             }
         }
         for( PlanSet::iterator i = plans.begin(); i != plans.end(); ++i )
-            addPlan( *i, checkFirst );
+            addPlan( *i, checkExisting );
 
         // Table scan plan
-        addPlan( PlanPtr( new QueryPlan( fbs_, order_ ) ), checkFirst );
+        addPlan( PlanPtr( new QueryPlan( fbs_, order_ ) ), checkExisting );
     }
     
     shared_ptr< QueryOp > QueryPlanSet::runOp( QueryOp &op ) {
-        if ( usingPrerecordedPlan_ ) {
+        if ( usingPrerecordedPlan_ || usingEstimatedPlans_ ) {
+            unsigned nPlans = plans_.size();
             Runner r( *this, op );
             shared_ptr< QueryOp > res = r.run();
-            // plans_.size() > 1 if addOtherPlans was called in Runner::run().
-            if ( res->complete() || plans_.size() > 1 )
+            // plans_.size() > nPlans if addOtherPlans was called in Runner::run().
+            if ( res->complete() || plans_.size() > nPlans )
                 return res;
-            NamespaceDetailsTransient::get( fbs_.ns() ).registerIndexForPattern( fbs_.pattern( order_ ), BSONObj(), 0 );
-            init();
+            if ( usingPrerecordedPlan_ )
+                NamespaceDetailsTransient::get( fbs_.ns() ).registerIndexForPattern( fbs_.pattern( order_ ), BSONObj(), 0 );
+            init( false );
         }
         Runner r( *this, op );
         return r.run();
@@ -324,8 +507,11 @@ namespace mongo {
         
         long long nScanned = 0;
         long long nScannedBackup = 0;
+        YieldTracker yieldTracker;
         while( 1 ) {
             ++nScanned;
+            if ( yieldTracker.ping() )
+                yield( ops );
             unsigned errCount = 0;
             bool first = true;
             for( vector< shared_ptr< QueryOp > >::iterator i = ops.begin(); i != ops.end(); ++i ) {
@@ -344,10 +530,11 @@ namespace mongo {
             }
             if ( errCount == ops.size() )
                 break;
-            if ( plans_.usingPrerecordedPlan_ && nScanned > plans_.oldNScanned_ * 10 ) {
+            if ( ( plans_.usingPrerecordedPlan_ || plans_.usingEstimatedPlans_ ) &&
+                nScanned > plans_.oldNScanned_ * 10 ) {
+                unsigned nRunning = plans_.plans_.size();
                 plans_.addOtherPlans( true );
-                PlanSet::iterator i = plans_.plans_.begin();
-                ++i;
+                PlanSet::iterator i = plans_.plans_.begin() + nRunning;
                 for( ; i != plans_.plans_.end(); ++i ) {
                     shared_ptr< QueryOp > op( op_.clone() );
                     op->setQueryPlan( i->get() );
@@ -358,6 +545,7 @@ namespace mongo {
                 }                
                 plans_.mayRecordPlan_ = true;
                 plans_.usingPrerecordedPlan_ = false;
+                plans_.usingEstimatedPlans_ = false;
                 nScannedBackup = nScanned;
                 nScanned = 0;
             }
@@ -375,6 +563,26 @@ namespace mongo {
         }        
     }
 
+    void QueryPlanSet::Runner::yield( vector< shared_ptr< QueryOp > > &ops ) {
+        if ( !dbMutexInfo.haveLock() || !OpScope::mayYield() )
+            return;
+        for( vector< shared_ptr< QueryOp > >::iterator i = ops.begin(); i != ops.end(); ++i )
+            if ( !(*i)->error() && !(*i)->mayYield() )
+                return;
+        for( vector< shared_ptr< QueryOp > >::iterator i = ops.begin(); i != ops.end(); ++i )
+            if ( !(*i)->error() )
+                (*i)->prepareToYield();
+        if ( dbMutexInfo.haveWriteLock() )
+            currentOp.yields++;
+        {
+            dbtemprelease unlock;
+            boost::thread::yield();
+        }
+        for( vector< shared_ptr< QueryOp > >::iterator i = ops.begin(); i != ops.end(); ++i )
+            if ( !(*i)->error() )
+                (*i)->recoverFromYield();
+    }
+
     void QueryPlanSet::Runner::nextOp( QueryOp &op ) {
         try {
             if ( !op.error() )
@@ -25,6 +25,40 @@
 namespace mongo {
     
     class IndexDetails;
+    class NamespaceDetails;
+
+    /* What the optimizer knows about the keys of an index without scanning it.  Taken from
+       the btree levels nearest the root (see BtreeBucket::sampleKeys()), which every lookup
+       reads anyway.  Their keys split the index into pieces of about the same size, so as a
+       sorted sample they make an equi-depth histogram.  Nothing extra is stored on disk -- the
+       index is its own persistent copy of these, and NamespaceDetailsTransient caches a sample
+       until the collection has changed by a tenth since it was taken.
+    */
+    class IndexStats {
+    public:
+        /* requires dbMutex, in either mode */
+        IndexStats( NamespaceDetails *d, const IndexDetails &idx );
+        /* cached stats for idx, sampling it again first if they are stale */
+        static shared_ptr< IndexStats > get( NamespaceDetails *d, const IndexDetails &idx );
+
+        long long nKeys() const { return nKeys_; }
+        /* true if the sample is every key in the index */
+        bool exact() const { return exact_; }
+        int nSampled() const { return sample_.size(); }
+        /* estimated number of distinct values of the first n fields of the key */
+        long long distinct( int n ) const { return distinct_[ n - 1 ]; }
+        /* estimated number of keys from start to end, inclusive -- either may be first */
+        long long keysInRange( const BSONObj &start, const BSONObj &end ) const;
+
+        enum { SampleSize = 1000 };
+    private:
+        BSONObj keyPattern_;
+        vector< BSONObj > sample_; // in index order
+        long long nKeys_;
+        bool exact_;
+        vector< long long > distinct_;
+    };
+
     class QueryPlan {
     public:
         QueryPlan( const FieldBoundSet &fbs, const BSONObj &order, const IndexDetails *index = 0 );
@@ -45,6 +79,12 @@ namespace mongo {
         int direction() const { return direction_; }
         BSONObj startKey() const { return startKey_; }
         BSONObj endKey() const { return endKey_; }
+        /* The key ranges an index cursor visits; more than one when $in values (possibly
+           combined with equalities on other fields) let it skip the keys in between. */
+        const BoundList &indexBounds() const { return indexBounds_; }
+        /* Upper limit on indexBounds().size() -- past it, the remaining fields are scanned
+           across their whole span. */
+        static const unsigned maxIndexRanges = 4096;
         auto_ptr< Cursor > newCursor( const DiskLoc &startLoc = DiskLoc() ) const;
         auto_ptr< Cursor > newReverseCursor() const;
         BSONObj indexKey() const;
@@ -52,6 +92,9 @@ namespace mongo {
         BSONObj query() const { return fbs_.query(); }
         const FieldBound &bound( const char *fieldName ) const { return fbs_.bound( fieldName ); }
         void registerSelf( long long nScanned ) const;
+        /* How many keys or records the plan would look at running to the end, from the
+           index's statistics (see IndexStats) or the size of the collection. */
+        long long estimatedNScanned() const;
     private:
         const FieldBoundSet &fbs_;
         const BSONObj &order_;
@@ -63,6 +106,7 @@ namespace mongo {
         int direction_;
         BSONObj startKey_;
         BSONObj endKey_;
+        BoundList indexBounds_;
         bool unhelpful_;
     };
 
@@ -77,6 +121,13 @@ namespace mongo {
         // Return a copy of the inheriting class, which will be run with its own
         // query plan.
         virtual QueryOp *clone() const = 0;
+        // The runner releases dbMutex now and then during a long race if every op
+        // returns true from mayYield().  prepareToYield() must save the op's cursor
+        // (see SavedCursor) and recoverFromYield() restore it -- records may have
+        // been deleted or the collection dropped meanwhile.
+        virtual bool mayYield() const { return false; }
+        virtual void prepareToYield() {}
+        virtual void recoverFromYield() {}
         bool complete() const { return complete_; }
         bool error() const { return error_; }
         string exceptionMessage() const { return exceptionMessage_; }
@@ -108,16 +159,26 @@ namespace mongo {
         const FieldBoundSet &fbs() const { return fbs_; }
         BSONObj explain() const;
         bool usingPrerecordedPlan() const { return usingPrerecordedPlan_; }
+        /* true if plans were left out because their estimated nscanned was much higher */
+        bool usingEstimatedPlans() const { return usingEstimatedPlans_; }
+        /* Estimates are only trusted to choose between plans on collections this big; below it
+           racing every plan costs little. */
+        static const int minRecordsForEstimates = 1000;
+        /* Plans estimated to scan more than this many times what the best one does aren't run. */
+        static const int raceRatio = 2;
     private:
-        void addOtherPlans( bool checkFirst );
+        void addOtherPlans( bool checkExisting );
         typedef boost::shared_ptr< QueryPlan > PlanPtr;
         typedef vector< PlanPtr > PlanSet;
-        void addPlan( PlanPtr plan, bool checkFirst ) {
-            if ( checkFirst && plan->indexKey().woCompare( plans_[ 0 ]->indexKey() ) == 0 )
-                return;
+        void addPlan( PlanPtr plan, bool checkExisting ) {
+            if ( checkExisting )
+                for( PlanSet::const_iterator i = plans_.begin(); i != plans_.end(); ++i )
+                    if ( plan->indexKey().woCompare( (*i)->indexKey() ) == 0 )
+                        return;
             plans_.push_back( plan );
         }
-        void init();
+        void init( bool useEstimates = true );
+        void pruneByEstimate();
         struct Runner {
             Runner( QueryPlanSet &plans, QueryOp &op );
             shared_ptr< QueryOp > run();
@@ -125,11 +186,13 @@ namespace mongo {
             QueryPlanSet &plans_;
             static void initOp( QueryOp &op );
             static void nextOp( QueryOp &op );
+            static void yield( vector< shared_ptr< QueryOp > > &ops );
         };
         FieldBoundSet fbs_;
         PlanSet plans_;
         bool mayRecordPlan_;
         bool usingPrerecordedPlan_;
+        bool usingEstimatedPlans_;
         BSONObj hint_;
         BSONObj order_;
         long long oldNScanned_;
@@ -24,77 +24,92 @@
 
 namespace mongo {
 
-    FieldBound::FieldBound( const BSONElement &e ) :
-    lower_( minKey.firstElement() ),
-    lowerInclusive_( true ),
-    upper_( maxKey.firstElement() ),
-    upperInclusive_( true ) {
-        if ( e.eoo() )
+    struct ElementLess {
+        bool operator()( const BSONElement &l, const BSONElement &r ) const {
+            return l.woCompare( r, false ) < 0;
+        }
+    };
+    
+    FieldBound::FieldBound( const BSONElement &e ) {
+        FieldInterval all;
+        all.lower = minKey.firstElement();
+        all.upper = maxKey.firstElement();
+        if ( e.eoo() ) {
+            intervals_.push_back( all );
             return;
+        }
         if ( e.type() == RegEx ) {
             const char *r = e.simpleRegex();
             if ( r ) {
-                lower_ = addObj( BSON( "" << r ) ).firstElement();
-                upper_ = addObj( BSON( "" << simpleRegexEnd( r ) ) ).firstElement();
-                upperInclusive_ = false;
-            }            
+                all.lower = addObj( BSON( "" << r ) ).firstElement();
+                all.upper = addObj( BSON( "" << simpleRegexEnd( r ) ) ).firstElement();
+                all.upperInclusive = false;
+            }
+            intervals_.push_back( all );
             return;
         }
         switch( e.getGtLtOp() ) {
             case JSMatcher::Equality:
-                lower_ = e;
-                upper_ = e;
+                all.lower = e;
+                all.upper = e;
                 break;
             case JSMatcher::LT:
-                upperInclusive_ = false;
+                all.upperInclusive = false;
             case JSMatcher::LTE:
-                upper_ = e;
+                all.upper = e;
                 break;
             case JSMatcher::GT:
-                lowerInclusive_ = false;
+                all.lowerInclusive = false;
             case JSMatcher::GTE:
-                lower_ = e;
+                all.lower = e;
                 break;
             case JSMatcher::opIN: {
                 massert( "$in requires array", e.type() == Array );
-                BSONElement max = minKey.firstElement();
-                BSONElement min = maxKey.firstElement();
+                vector< BSONElement > vals;
                 BSONObjIterator i( e.embeddedObject() );
                 while( i.more() ) {
                     BSONElement f = i.next();
                     if ( f.eoo() )
                         break;
-                    if ( max.woCompare( f, false ) < 0 )
-                        max = f;
-                    if ( min.woCompare( f, false ) > 0 )
-                        min = f;
+                    vals.push_back( f );
                 }
-                lower_ = min;
-                upper_ = max;
+                sort( vals.begin(), vals.end(), ElementLess() );
+                for( vector< BSONElement >::const_iterator i = vals.begin(); i != vals.end(); ++i )
+                    if ( intervals_.empty() || intervals_.back().lower.woCompare( *i, false ) != 0 )
+                        intervals_.push_back( FieldInterval( *i ) );
+                return;
             }
             default:
                 break;
         }
+        intervals_.push_back( all );
     }
     
+    // Both lists are sorted and disjoint, so one merge-like pass finds every overlap.
     const FieldBound &FieldBound::operator&=( const FieldBound &other ) {
-        int cmp;
-        cmp = other.upper_.woCompare( upper_, false );
-        if ( cmp == 0 )
-            if ( !other.upperInclusive_ )
-                upperInclusive_ = false;
-        if ( cmp < 0 ) {
-            upper_ = other.upper_;
-            upperInclusive_ = other.upperInclusive_;
-        }
-        cmp = other.lower_.woCompare( lower_, false );
-        if ( cmp == 0 )
-            if ( !other.lowerInclusive_ )
-                lowerInclusive_ = false;
-        if ( cmp > 0 ) {
-            lower_ = other.lower_;
-            lowerInclusive_ = other.lowerInclusive_;
+        vector< FieldInterval > result;
+        vector< FieldInterval >::const_iterator i = intervals_.begin();
+        vector< FieldInterval >::const_iterator j = other.intervals_.begin();
+        while( i != intervals_.end() && j != other.intervals_.end() ) {
+            FieldInterval overlap;
+            int cmp = i->lower.woCompare( j->lower, false );
+            const FieldInterval &lower = ( cmp > 0 ) ? *i : *j;
+            overlap.lower = lower.lower;
+            overlap.lowerInclusive = lower.lowerInclusive && ( cmp != 0 || i->lowerInclusive );
+            cmp = i->upper.woCompare( j->upper, false );
+            bool iFirst = cmp < 0 || ( cmp == 0 && !i->upperInclusive );
+            const FieldInterval &upper = iFirst ? *i : *j;
+            overlap.upper = upper.upper;
+            overlap.upperInclusive = upper.upperInclusive;
+            if ( overlap.valid() )
+                result.push_back( overlap );
+            // whichever interval ends first can't overlap anything later in the other list
+            if ( iFirst )
+                ++i;
+            else
+                ++j;
         }
+        intervals_.swap( result );
         for( vector< BSONObj >::const_iterator i = other.objData_.begin(); i != other.objData_.end(); ++i )
             objData_.push_back( *i );
         return *this;
@@ -147,6 +162,16 @@ namespace mongo {
         for( map< string, FieldBound >::const_iterator i = bounds_.begin(); i != bounds_.end(); ++i ) {
             if ( i->second.equality() )
                 b.appendAs( i->second.lower(), i->first.c_str() );
+            else if ( !i->second.empty() && i->second.pointIntervals() ) {
+                BSONObjBuilder c;
+                BSONObjBuilder in;
+                int n = 0;
+                const vector< FieldInterval > &intervals = i->second.intervals();
+                for( vector< FieldInterval >::const_iterator j = intervals.begin(); j != intervals.end(); ++j )
+                    in.appendAs( j->lower, BSONObjBuilder::numStr( n++ ).c_str() );
+                c.appendArray( "$in", in.done() );
+                b.append( i->first.c_str(), c.done() );
+            }
             else if ( i->second.nontrivial() ) {
                 BSONObjBuilder c;
                 if ( i->second.lower().type() != MinKey )
@@ -22,35 +22,72 @@
 
 namespace mongo {
 
+    /* A range of values for one field.  An equality is a range whose two ends are the
+       same value, both inclusive.
+    */
+    struct FieldInterval {
+        FieldInterval() : lowerInclusive( true ), upperInclusive( true ) {}
+        FieldInterval( const BSONElement &e ) : lower( e ), lowerInclusive( true ), upper( e ), upperInclusive( true ) {}
+        bool equality() const {
+            return
+            lower.woCompare( upper, false ) == 0 &&
+            upperInclusive &&
+            lowerInclusive;
+        }
+        /* false if no value can fall in the range */
+        bool valid() const {
+            int cmp = lower.woCompare( upper, false );
+            return cmp < 0 || ( cmp == 0 && lowerInclusive && upperInclusive );
+        }
+        BSONElement lower;
+        bool lowerInclusive;
+        BSONElement upper;
+        bool upperInclusive;
+    };
+
+    /* The values a field may take to match a query, as a sorted list of disjoint intervals.
+       Most operators give a single interval; $in gives one per value.  An empty list means
+       nothing can match.
+    */
     class FieldBound {
     public:
         FieldBound( const BSONElement &e = BSONObj().firstElement() );
         const FieldBound &operator&=( const FieldBound &other );
-        BSONElement lower() const { return lower_; }
-        BSONElement upper() const { return upper_; }
-        bool lowerInclusive() const { return lowerInclusive_; }
-        bool upperInclusive() const { return upperInclusive_; }
+        // lower() and upper() are the ends of the whole list.  If the list is empty lower()
+        // is MaxKey and upper() is MinKey, so lower() > upper().
+        BSONElement lower() const { return empty() ? maxKey.firstElement() : intervals_.front().lower; }
+        BSONElement upper() const { return empty() ? minKey.firstElement() : intervals_.back().upper; }
+        bool lowerInclusive() const { return empty() || intervals_.front().lowerInclusive; }
+        bool upperInclusive() const { return empty() || intervals_.back().upperInclusive; }
         bool equality() const {
-            return
-            lower_.woCompare( upper_, false ) == 0 &&
-            upperInclusive_ &&
-            lowerInclusive_;
+            return intervals_.size() == 1 && intervals_.front().equality();
+        }
+        /* true if every interval is a single value, as for an equality or an $in */
+        bool pointIntervals() const {
+            for( vector< FieldInterval >::const_iterator i = intervals_.begin(); i != intervals_.end(); ++i )
+                if ( !i->equality() )
+                    return false;
+            return true;
         }
         bool nontrivial() const {
             return
-            minKey.firstElement().woCompare( lower_, false ) != 0 ||
-            maxKey.firstElement().woCompare( upper_, false ) != 0;
+            intervals_.size() != 1 ||
+            minKey.firstElement().woCompare( lower(), false ) != 0 ||
+            maxKey.firstElement().woCompare( upper(), false ) != 0;
         }
+        bool empty() const { return intervals_.empty(); }
+        const vector< FieldInterval > &intervals() const { return intervals_; }
     private:
         BSONObj addObj( const BSONObj &o );
         string simpleRegexEnd( string regex );
-        BSONElement lower_;
-        bool lowerInclusive_;
-        BSONElement upper_;
-        bool upperInclusive_;
+        vector< FieldInterval > intervals_;
         vector< BSONObj > objData_;
     };
     
+    /* Index key ranges to scan, as ( startKey, endKey ) pairs in the order a cursor should
+       visit them. */
+    typedef vector< pair< BSONObj, BSONObj > > BoundList;
+    
     class QueryPattern {
     public:
         friend class FieldBoundSet;
@@ -135,7 +172,7 @@ namespace mongo {
         BSONObj simplifiedQuery() const;
         bool matchPossible() const {
             for( map< string, FieldBound >::const_iterator i = bounds_.begin(); i != bounds_.end(); ++i )
-                if ( i->second.lower().woCompare( i->second.upper(), false ) > 0 )
+                if ( i->second.empty() )
                     return false;
             return true;
         }
@@ -29,7 +29,10 @@ public:
         return theDataFileMgr.insert(ns, obuf, len, god);
     }
 
-    virtual void modified(DiskLoc d) { }
+    virtual void modified(DiskLoc d) {
+        Record *r = d.rec();
+        writing(r->data, r->netLength());
+    }
 
     virtual void drop(const char *ns) { 
         dropNS(ns);
@@ -10,6 +10,8 @@ int aaa;
 
 #include "db.h"
 
+#include "journal.h"
+
 namespace mongo {
 
 RecCache theRecCache(BucketSize);
@@ -398,6 +400,8 @@ void RecCache::drop(const char *_ns) {
 
 void dbunlocking() { 
     dassert( dbMutexInfo.isLocked() );
+    if ( journaling )
+        journal.unlocking();
     theRecCache.ejectOld();
 }
 
@@ -44,11 +44,11 @@
 #include "db.h"
 #include "commands.h"
 #include "security.h"
+#include "dbhelpers.h"
 
 namespace mongo {
 
     extern bool quiet;
-    extern boost::mutex &dbMutex;
     extern long long oplogSize;
     int _updateObjects(const char *ns, BSONObj updateobj, BSONObj pattern, bool upsert, stringstream& ss, bool logOp=false);
     void ensureHaveIdIndex(const char *ns);
@@ -208,6 +208,38 @@ namespace mongo {
         }        
     } cmdResync;
     
+    /* how far behind our sources we are */
+    class CmdSlaveInfo : public Command {
+    public:
+        virtual bool slaveOk() {
+            return true;
+        }
+        virtual bool logTheOp() {
+            return false;
+        }
+        CmdSlaveInfo() : Command("slaveinfo") { }
+        virtual bool run(const char *ns, BSONObj& cmdObj, string& errmsg, BSONObjBuilder& result, bool fromRepl) {
+            ReplSource::ApplyStats s = ReplSource::applyStats();
+            if ( s.batches == 0 && !s.caughtUp ) {
+                errmsg = "not a slave, or nothing applied yet";
+                return false;
+            }
+            double lag = 0;
+            if ( !s.caughtUp && s.lastOpSecs )
+                lag = (double) time(0) - s.lastOpSecs;
+            result.append("lagSecs", lag);
+            result.append("opsPerSec", s.opsPerSec);
+            result.append("applied", (double) s.ops);
+            result.append("batches", (double) s.batches);
+            result.append("avgBatchSize", s.batches ? (double) s.ops / s.batches : 0.0);
+            result.append("prefetchMs", (double) s.prefetchMillis);
+            result.append("applyMs", (double) s.applyMillis);
+            if ( replAllDead )
+                result.append("info", replAllDead);
+            return true;
+        }
+    } cmdSlaveInfo;
+
     class CmdIsMaster : public Command {
     public:
         virtual bool requiresAuth() { return false; }
@@ -786,7 +818,7 @@ namespace mongo {
             return;
         }
 
-        dblock lk;
+        assert( dbMutexInfo.haveWriteLock() ); // callers hold it; dbMutex isn't reentrant
         bool justCreated;
         try {
             justCreated = setClientTempNs(ns);
@@ -820,6 +852,123 @@ namespace mongo {
         database = 0;
     }
 
+    static boost::mutex applyStatsMutex;
+    static ReplSource::ApplyStats applyStats_;
+
+    ReplSource::ApplyStats ReplSource::applyStats() {
+        boostlock lk( applyStatsMutex );
+        return applyStats_;
+    }
+
+    static void noteApplied(int n, const OpTime& last, int prefetchMillis, int applyMillis) {
+        boostlock lk( applyStatsMutex );
+        ReplSource::ApplyStats& s = applyStats_;
+        s.ops += n;
+        s.batches++;
+        s.prefetchMillis += prefetchMillis;
+        s.applyMillis += applyMillis;
+        s.lastOpSecs = last.getSecs();
+        s.caughtUp = false;
+        time_t now = time(0);
+        if ( s.windowStart == 0 )
+            s.windowStart = now;
+        s.windowOps += n;
+        if ( now - s.windowStart >= 10 ) {
+            s.opsPerSec = (double) s.windowOps / ( now - s.windowStart );
+            s.windowStart = now;
+            s.windowOps = 0;
+        }
+    }
+
+    static void noteCaughtUp() {
+        boostlock lk( applyStatsMutex );
+        applyStats_.caughtUp = true;
+    }
+
+    /* read a byte from each page of o */
+    static void touch(const BSONObj& o) {
+        const char *p = o.objdata();
+        int n = o.objsize();
+        volatile char c = 0;
+        for ( int i = 0; i < n; i += 4096 )
+            c += p[i];
+        c += p[n - 1];
+    }
+
+    /* fault in what applying op will need: the btree buckets between the index root and its
+       target, and the target record.  only the first match is looked at, and only through an
+       index; a table scan would cost more than the faults it saves. */
+    static void prefetch(const BSONObj& op) {
+        const char *ns = op.getStringField("ns");
+        const char *opType = op.getStringField("op");
+        if ( *ns == 0 || *ns == '.' )
+            return;
+        BSONObj pattern;
+        if ( *opType == 'i' ) {
+            const char *p = strchr(ns, '.');
+            if ( p && strcmp(p, ".system.indexes") == 0 )
+                return;
+            BSONElement _id;
+            if ( !op.getObjectField("o").getObjectID(_id) )
+                return;
+            /* applied as an upsert by _id, so this warms the _id index path even when the
+               object is new */
+            BSONObjBuilder b;
+            b.append(_id);
+            pattern = b.obj();
+        }
+        else if ( *opType == 'u' )
+            pattern = op.getObjectField("o2");
+        else if ( *opType == 'd' && opType[1] == 0 )
+            pattern = op.getObjectField("o");
+        else
+            return;
+        /* $where runs javascript, which can't under a shared lock */
+        if ( pattern.isEmpty() || pattern.hasElement("$where") )
+            return;
+        /* the apply will open the database */
+        if ( !databaseOpen(ns) )
+            return;
+        setClientTempNs(ns);
+        if ( !database->namespaceIndex.initialized() )
+            return;
+        BSONObj o;
+        if ( Helpers::findOne(ns, pattern, o, true) )
+            touch(o);
+    }
+
+    /* run through batch under a shared lock first, so that the faults it would take happen
+       here and not while we hold dbMutex exclusively.  best effort: whatever goes wrong is
+       left for the apply to deal with. */
+    static void prefetchBatch(const vector< BSONObj >& batch) {
+        readlock lk;
+        for ( vector< BSONObj >::const_iterator i = batch.begin(); i != batch.end(); ++i ) {
+            try {
+                prefetch( *i );
+            }
+            catch ( AssertionException& e ) {
+                log(2) << "repl: prefetch skipped " << i->toString() << ": " << e.msg << endl;
+            }
+            database = 0;
+        }
+    }
+
+    /* apply ops read ahead from the source.  rather than taking dbMutex for each op we
+       hold it for as many as fit in MaxApplyMillis, so a busy master's ops don't each pay
+       for a lock handoff, while queries still get in between holds.  the ops are applied
+       in order, on this thread.
+    */
+    void ReplSource::sync_pullOpLog_applyBatch(vector< BSONObj >& batch) {
+        unsigned i = 0;
+        while ( i < batch.size() ) {
+            dblock lk;
+            Timer t;
+            do {
+                sync_pullOpLog_applyOperation( batch[ i++ ] );
+            } while ( i < batch.size() && t.millis() < MaxApplyMillis );
+        }
+    }
+
     /* note: not yet in mutex at this point. */
     bool ReplSource::sync_pullOpLog() {
         string ns = string("local.oplog.$") + sourceName();
@@ -905,11 +1054,13 @@ namespace mongo {
                 b.append("ns", *i + '.');
                 b.append("op", "db");
                 BSONObj op = b.done();
+                dblock lk;
                 sync_pullOpLog_applyOperation(op);
             }
         }
 
         if ( !c->more() ) {
+            noteCaughtUp();
             if ( tailing ) {
                 log(2) << "repl: tailing & no new activity\n";
             } else
@@ -934,10 +1085,10 @@ namespace mongo {
         }
         OpTime nextOpTime( ts.date() );
         log(2) << "repl: first op time received: " << nextOpTime.toString() << '\n';
+        vector< BSONObj > batch;
         if ( tailing ) {
             assert( syncedTo < nextOpTime );
-            sync_pullOpLog_applyOperation(op);
-            n++;
+            batch.push_back( op );
         }
         else if ( nextOpTime != syncedTo ) {
             Nullstream& l = log();
@@ -961,21 +1112,52 @@ namespace mongo {
                it. */
         }
 
-        // apply operations
+        // apply operations, a batch at a time
         {
 			unsigned nSaveLast = 0;
 			time_t saveLast = time(0);
             while ( 1 ) {
+                /* read ahead, outside the lock, whatever the last reply from the source holds */
+                while ( batch.size() < ApplyBatchSize && c->moreInCurrentBatch() ) {
+                    BSONObj op = c->next();
+                    ts = op.findElement("ts");
+                    assert( ts.type() == Date );
+                    OpTime last = nextOpTime;
+                    OpTime tmp( ts.date() );
+                    nextOpTime = tmp;
+                    if ( !( last < nextOpTime ) ) {
+                        problem() << "sync error: last " << last.toString() << " >= nextOpTime " << nextOpTime.toString() << endl;
+                        uassert("bad 'ts' value in sources", false);
+                    }
+                    batch.push_back( op );
+                }
+
+                if ( !batch.empty() ) {
+                    Timer t;
+                    prefetchBatch( batch );
+                    int prefetchMillis = t.millis();
+                    t.reset();
+                    sync_pullOpLog_applyBatch( batch );
+                    int applyMillis = t.millis();
+                    n += batch.size();
+                    nSaveLast += batch.size();
+                    /* only now is everything up to nextOpTime applied */
+                    syncedTo = nextOpTime;
+                    noteApplied( batch.size(), nextOpTime, prefetchMillis, applyMillis );
+                    batch.clear();
+                }
+
+                /* may ask the source for more.  the batch is empty: objects from the previous
+                   reply are no longer valid after this. */
                 if ( !c->more() ) {
+                    noteCaughtUp();
                     log() << "pull:   applied " << n << " operations" << endl;
-                    syncedTo = nextOpTime;
                     log(2) << "repl: end sync_pullOpLog syncedTo: " << syncedTo.toStringLong() << '\n';
                     dblock lk;
                     save(); // note how far we are synced up to now
                     break;
                 }
 
-				nSaveLast++;
 				OCCASIONALLY if( nSaveLast > 100000 || time(0) - saveLast > 5 * 60 ) { 
 					// periodically note our progress, in case we are doing a lot of work and crash
 					dblock lk;
@@ -983,21 +1165,6 @@ namespace mongo {
 					saveLast = time(0);
 					nSaveLast = 0;
 				}
-
-                /* todo: get out of the mutex for the next()? */
-                BSONObj op = c->next();
-                ts = op.findElement("ts");
-                assert( ts.type() == Date );
-                OpTime last = nextOpTime;
-                OpTime tmp( ts.date() );
-                nextOpTime = tmp;
-                if ( !( last < nextOpTime ) ) {
-                    problem() << "sync error: last " << last.toString() << " >= nextOpTime " << nextOpTime.toString() << endl;
-                    uassert("bad 'ts' value in sources", false);
-                }
-
-                sync_pullOpLog_applyOperation(op);
-                n++;
             }
         }
 
@@ -1121,6 +1288,17 @@ namespace mongo {
         }
     }    
     
+    /* the entries go into the capped log one after another, which lays them out back to back,
+       so there is nothing to gain from allocating them as a block.  we do skip the work when
+       nothing is logging.
+    */
+    void logInserts(const char *ns, const vector<BSONObj>& objs) {
+        if ( !master && !NamespaceDetailsTransient::get( ns ).logValid() )
+            return;
+        for ( vector<BSONObj>::const_iterator i = objs.begin(); i != objs.end(); ++i )
+            logOp( "i", ns, *i );
+    }
+
     /* we write to local.opload.$main:
          { ts : ..., op: ..., ns: ..., o: ... }
        ts: an OpTime timestamp
@@ -125,8 +125,13 @@ namespace mongo {
     class ReplSource {
         bool resync(string db);
         bool sync_pullOpLog();
+    protected:
+        /* caller must hold dbMutex exclusively.  it isn't reentrant, so this doesn't take it. */
         void sync_pullOpLog_applyOperation(BSONObj& op);
-        
+        /* takes dbMutex itself.  if an op throws, the ops before it in batch stay applied and
+           syncedTo isn't advanced, so they are applied again on the next pass. */
+        void sync_pullOpLog_applyBatch(vector< BSONObj >& batch);
+    private:
         auto_ptr<DBClientConnection> conn;
         auto_ptr<DBClientCursor> cursor;
 
@@ -182,6 +187,27 @@ namespace mongo {
 
         bool haveMoreDbsToSync() const { return !addDbNextPass.empty(); }        
 
+        enum {
+            ApplyBatchSize = 1000, // most ops read ahead before applying them
+            MaxApplyMillis = 50    // longest we hold dbMutex applying one batch
+        };
+
+        /* how well we are keeping up with our sources.  see the slaveinfo command. */
+        struct ApplyStats {
+            ApplyStats() : ops(), batches(), prefetchMillis(), applyMillis(), lastOpSecs(), caughtUp(),
+                windowStart(), windowOps(), opsPerSec() { }
+            long long ops;
+            long long batches;
+            long long prefetchMillis; // reading ahead, under a shared lock
+            long long applyMillis;    // applying, under the write lock
+            unsigned lastOpSecs;   // ts of the last op applied
+            bool caughtUp;         // the source had nothing more for us last we asked
+            time_t windowStart;
+            long long windowOps;
+            double opsPerSec;      // over the last window of ~10 seconds
+        };
+        static ApplyStats applyStats();
+
         static bool throttledForceResyncDead( const char *requester );
         static void forceResyncDead( const char *requester );
         void forceResync( const char *requester );
@@ -196,5 +222,7 @@ namespace mongo {
     */
     void _logOp(const char *opstr, const char *ns, const char *logNs, const BSONObj& obj, BSONObj *patt, bool *b);
     void logOp(const char *opstr, const char *ns, const BSONObj& obj, BSONObj *patt = 0, bool *b = 0);
+    /* an "i" entry for each object of a batch insert */
+    void logInserts(const char *ns, const vector<BSONObj>& objs);
 
 } // namespace mongo
@@ -20,11 +20,12 @@
 
 #pragma once
 
+#include "extsort.h"
+
 namespace mongo {
 
     /* todo:
        _ handle compound keys with differing directions.  we don't handle this yet: neither here nor in indexes i think!!!
-       _ limit amount of data
     */
 
     /* see also IndexDetails::getKeysFromObject, which needs some merging with this. */
@@ -44,13 +45,7 @@ namespace mongo {
         }
     };
 
-    /* todo:
-       _ respect limit
-       _ check for excess mem usage
-       _ response size limit from runquery; push it up a bit.
-    */
-
-    inline bool fillQueryResultFromObj(BufBuilder& b, set<string> *filter, BSONObj& js) {
+    inline bool fillQueryResultFromObj(BufBuilder& b, FieldsToReturn *filter, BSONObj& js) {
         if ( filter ) {
             BSONObj x;
             bool ok = x.addFields(js, *filter) > 0;
@@ -63,79 +58,129 @@ namespace mongo {
         return true;
     }
 
-    typedef multimap<BSONObj,BSONObj,BSONObjCmp> BestMap;
+    /* Orders query results that no index gives us in order.  Only the sort key and DiskLoc of
+       each match are kept, and the documents are read again by fill().
+
+       With a limit, the best limit+startFrom of them are kept in a binary heap, worst on top,
+       so a match that is no better than that is dropped right away.  Without one -- or should
+       the heap's keys pass maxHeapBytes -- everything goes to a BSONObjExternalSorter, which
+       sorts in memory until runBytes of keys and then spills sorted runs to a temp directory
+       under dbpath.
+
+       The DiskLocs have to stay valid until fill(), so the caller mustn't yield in between.
+    */
     class ScanAndOrder {
-        BestMap best; // key -> full object
+        typedef BSONObjExternalSorter::Data Data; // sort key, record
+        class Cmp {
+        public:
+            Cmp( const BSONObj &order ) : order_( order ) { }
+            bool operator()( const Data &l, const Data &r ) const {
+                int x = l.first.woCompare( r.first, order_ );
+                return x ? x < 0 : l.second.compare( r.second ) < 0;
+            }
+        private:
+            BSONObj order_;
+        };
+
         int startFrom;
         int limit;   // max to send back.
+        int keep;    // max to hold in the heap: the best limit+startFrom
+        long maxHeapBytes;
+        long runBytes;
         KeyType order;
-        unsigned approxSize;
-
-        void _add(BSONObj& k, BSONObj o) {
-            best.insert(make_pair(k,o));
+        Cmp cmp;
+        vector<Data> heap;
+        long heapBytes;
+        auto_ptr<BSONObjExternalSorter> sorter;
+
+        /* from here on everything goes to the sorter */
+        void spill() {
+            sorter.reset( new BSONObjExternalSorter( order.pattern, runBytes ) );
+            for ( vector<Data>::iterator i = heap.begin(); i != heap.end(); i++ )
+                sorter->add( i->first, i->second );
+            heap.clear();
+            heapBytes = 0;
         }
 
-        void _addIfBetter(BSONObj& k, BSONObj o, BestMap::iterator i) {
-            const BSONObj& worstBestKey = i->first;
-            int c = worstBestKey.woCompare(k, order.pattern);
-            if ( c > 0 ) {
-                // k is better, 'upgrade'
-                best.erase(i);
-                _add(k, o);
+        /* false once no more are wanted */
+        bool fillOne(BufBuilder& b, FieldsToReturn *filter, int& n, int& nFilled, const DiskLoc& loc) {
+            if ( ++n <= startFrom )
+                return true;
+            BSONObj o = loc.obj();
+            if ( fillQueryResultFromObj(b, filter, o) ) {
+                nFilled++;
+                if ( nFilled >= limit )
+                    return false;
+                /* all of a sort goes in the first reply -- there is no getMore for it */
+                uassert( "too much data for sort() with no index", b.len() < 4000000 ); // appserver limit
             }
+            return true;
         }
 
     public:
-        ScanAndOrder(int _startFrom, int _limit, BSONObj _order) :
-                best( BSONObjCmp( _order ) ),
-                startFrom(_startFrom), order(_order) {
-            limit = _limit > 0 ? _limit + startFrom : 0x7fffffff;
-            approxSize = 0;
+        enum { MaxHeapBytes = 32 * 1024 * 1024, RunBytes = 32 * 1024 * 1024 };
+
+        ScanAndOrder(int _startFrom, int _limit, BSONObj _order,
+                     long _maxHeapBytes = MaxHeapBytes, long _runBytes = RunBytes) :
+                startFrom(_startFrom), maxHeapBytes(_maxHeapBytes), runBytes(_runBytes),
+                order(_order), cmp(_order), heapBytes(0) {
+            limit = _limit > 0 ? _limit : 0x7fffffff;
+            keep = _limit > 0 ? _limit + startFrom : 0x7fffffff;
+            if ( _limit <= 0 )
+                spill();
         }
 
         int size() const {
-            return best.size();
+            return sorter.get() ? (int) sorter->numAdded() : (int) heap.size();
         }
 
-        void add(BSONObj o) {
-            BSONObj k = order.getKeyFromObject(o);
-            if ( (int) best.size() < limit ) {
-                approxSize += k.objsize();
-                uassert( "too much key data for sort() with no index", approxSize < 1 * 1024 * 1024 );
-                _add(k, o);
+        /* spilled to disk */
+        bool external() const {
+            return sorter.get() && sorter->numFiles() > 0;
+        }
+
+        void add(const BSONObj& o, const DiskLoc& loc) {
+            Data d( order.getKeyFromObject(o), loc );
+            if ( sorter.get() ) {
+                sorter->add( d.first, d.second );
                 return;
             }
-            BestMap::iterator i;
-            assert( best.end() != best.begin() );
-            i = best.end();
-            i--;
-            _addIfBetter(k, o, i);
+            if ( (int) heap.size() < keep ) {
+                heap.push_back( d );
+                push_heap( heap.begin(), heap.end(), cmp );
+                heapBytes += d.first.objsize() + sizeof( Data );
+                if ( heapBytes > maxHeapBytes )
+                    spill();
+                return;
+            }
+            if ( cmp( d, heap.front() ) ) {
+                // better than the worst we have, which it replaces
+                heapBytes += d.first.objsize() - heap.front().first.objsize();
+                pop_heap( heap.begin(), heap.end(), cmp );
+                heap.back() = d;
+                push_heap( heap.begin(), heap.end(), cmp );
+            }
         }
 
-        void _fill(BufBuilder& b, set<string> *filter, int& nout, BestMap::iterator begin, BestMap::iterator end) {
+        /* scanning complete. stick the query result in b for n objects. */
+        void fill(BufBuilder& b, FieldsToReturn *filter, int& nout) {
             int n = 0;
             int nFilled = 0;
-            for ( BestMap::iterator i = begin; i != end; i++ ) {
-                n++;
-                if ( n <= startFrom )
-                    continue;
-                BSONObj& o = i->second;
-                if ( fillQueryResultFromObj(b, filter, o) ) {
-                    nFilled++;
-                    if ( nFilled >= limit )
-                        goto done;
-                    uassert( "too much data for sort() with no index", b.len() < 4000000 ); // appserver limit
-                }
+            if ( sorter.get() ) {
+                sorter->sort();
+                auto_ptr<BSONObjExternalSorter::Iterator> i = sorter->iterator();
+                while ( i->more() && fillOne(b, filter, n, nFilled, i->next().second) )
+                    ;
+            }
+            else {
+                sort_heap( heap.begin(), heap.end(), cmp );
+                for ( vector<Data>::iterator i = heap.begin(); i != heap.end(); i++ )
+                    if ( !fillOne(b, filter, n, nFilled, i->second) )
+                        break;
             }
-done:
             nout = nFilled;
         }
 
-        /* scanning complete. stick the query result in b for n objects. */
-        void fill(BufBuilder& b, set<string> *filter, int& nout) {
-            _fill(b, filter, nout, best.begin(), best.end());
-        }
-
     };
 
 } // namespace mongo
@@ -27,11 +27,12 @@ namespace BtreeTests {
 
     class Base {
     public:
-        Base() {
+        Base( const BSONObj &spec = BSONObj() ) {
             setClient( ns() );
             BSONObjBuilder builder;
             builder.append( "ns", ns() );
             builder.append( "name", "testIndex" );
+            builder.appendElements( spec );
             BSONObj bobj = builder.done();
             idx_.info =
                 theDataFileMgr.insert( ns(), bobj.objdata(), bobj.objsize() );
@@ -213,6 +214,268 @@ namespace BtreeTests {
         }
     };
 
+    class BuilderBase : public Base {
+    protected:
+        static BSONObj key( int i ) {
+            BSONObjBuilder b;
+            b.append( "a", i );
+            b.append( "b", string( 100, 'x' ) );
+            return b.obj();
+        }
+        // dummy, valid and distinct record locs
+        static DiskLoc loc( int i ) {
+            return DiskLoc( 0, 2 * ( i + 1 ) );
+        }
+        static int nBuckets( IndexDetails &idx ) {
+            return nsdetails( idx.indexNamespace().c_str() )->nrecords;
+        }
+        enum { N = 10000 };
+    };
+
+    class BuildEmpty : public BuilderBase {
+    public:
+        void run() {
+            BtreeBuilder builder( true, id() );
+            builder.commit();
+            checkValid( 0 );
+        }
+    };
+
+    class BuildBottomUp : public BuilderBase {
+    public:
+        void run() {
+            BtreeBuilder builder( true, id() );
+            for ( int i = 0; i < N; ++i ) {
+                BSONObj k = key( i );
+                builder.addKey( k, loc( i ) );
+            }
+            builder.commit();
+            ASSERT_EQUALS( N, (int) builder.getn() );
+            checkValid( N );
+            for ( int i = 0; i < N; i += 97 ) {
+                BSONObj k = key( i );
+                ASSERT( bt()->hasKey( id(), dl(), k, loc( i ) ) );
+            }
+        }
+    };
+
+    /* building bottom up fills buckets; inserting in order leaves them half full */
+    class BuildDenserThanInsert : public BuilderBase {
+    public:
+        ~BuildDenserThanInsert() {
+            if ( other_.info.isNull() )
+                return;
+            theDataFileMgr.deleteRecord( ns(), other_.info.rec(), other_.info );
+            dropNS( other_.indexNamespace() );
+        }
+        void run() {
+            int before = nBuckets( id() );
+            BtreeBuilder builder( true, id() );
+            for ( int i = 0; i < N; ++i ) {
+                BSONObj k = key( i );
+                builder.addKey( k, loc( i ) );
+            }
+            builder.commit();
+            int built = nBuckets( id() ) - before;
+
+            IndexDetails &other = other_;
+            BSONObj info = BSON( "ns" << ns() << "name" << "testIndex2" );
+            other.info = theDataFileMgr.insert( ns(), info.objdata(), info.objsize() );
+            other.head = BtreeBucket::addHead( other );
+            before = nBuckets( other );
+            for ( int i = 0; i < N; ++i ) {
+                BSONObj k = key( i );
+                other.head.btree()->bt_insert( other.head, loc( i ), k, order(), true, other, true );
+            }
+            int inserted = nBuckets( other ) - before;
+
+            ASSERT( built * 3 / 2 < inserted );
+        }
+    private:
+        IndexDetails other_; // dropped, btree and all, when we are done
+    };
+
+    class BuildDupKey : public BuilderBase {
+    public:
+        void run() {
+            BtreeBuilder builder( false, id() );
+            BSONObj k = key( 0 );
+            builder.addKey( k, loc( 0 ) );
+            ASSERT_EXCEPTION( builder.addKey( k, loc( 1 ) ), UserException );
+        }
+    };
+
+    class CompressedBase : public Base {
+    public:
+        CompressedBase() : Base( BSON( "v" << 1 ) ) {}
+    protected:
+        // similar strings of varying length, as in an index on urls
+        static string url( int i ) {
+            stringstream ss;
+            ss << "http://www.example.com/page/" << i << "?ref=" << ( i % 7 );
+            return ss.str();
+        }
+        static BSONObj key( int i ) {
+            return BSON( "a" << url( i ) );
+        }
+        static DiskLoc loc( int i ) {
+            return DiskLoc( 0, 2 * ( i + 1 ) );
+        }
+        static int nBuckets( IndexDetails &idx ) {
+            return nsdetails( idx.indexNamespace().c_str() )->nrecords;
+        }
+        void insert( int i, IndexDetails &idx ) {
+            BSONObj k = key( i );
+            idx.head.btree()->bt_insert( idx.head, loc( i ), k, order(), true, idx, true );
+        }
+        bool has( int i ) {
+            BSONObj k = key( i );
+            return bt()->hasKey( id(), dl(), k, loc( i ) );
+        }
+        enum { N = 5000 };
+    };
+
+    class CompressedInsertUnindex : public CompressedBase {
+    public:
+        void run() {
+            ASSERT_EQUALS( 1, id().version() );
+            // a permutation, so that we insert into the middle of buckets and split them
+            for ( int i = 0; i < N; ++i )
+                insert( ( i * 7919 ) % N, id() );
+            checkValid( N );
+            for ( int i = 0; i < N; i += 2 ) {
+                BSONObj k = key( i );
+                ASSERT( bt()->unindex( dl(), id(), k, loc( i ) ) );
+            }
+            checkValid( N / 2 );
+            for ( int i = 0; i < N; ++i )
+                ASSERT_EQUALS( i % 2 == 1, has( i ) );
+        }
+    };
+
+    class CompressedFewerBuckets : public CompressedBase {
+    public:
+        ~CompressedFewerBuckets() {
+            if ( other_.info.isNull() )
+                return;
+            theDataFileMgr.deleteRecord( ns(), other_.info.rec(), other_.info );
+            dropNS( other_.indexNamespace() );
+        }
+        void run() {
+            int before = nBuckets( id() );
+            for ( int i = 0; i < N; ++i )
+                insert( i, id() );
+            int compressed = nBuckets( id() ) - before;
+
+            IndexDetails &other = other_;
+            BSONObj info = BSON( "ns" << ns() << "name" << "testIndex2" );
+            other.info = theDataFileMgr.insert( ns(), info.objdata(), info.objsize() );
+            other.head = BtreeBucket::addHead( other );
+            before = nBuckets( other );
+            for ( int i = 0; i < N; ++i )
+                insert( i, other );
+            int plain = nBuckets( other ) - before;
+
+            ASSERT( compressed * 3 / 2 < plain );
+        }
+    private:
+        IndexDetails other_; // dropped, btree and all, when we are done
+    };
+
+    class CompressedBuild : public CompressedBase {
+    public:
+        void run() {
+            vector< pair< string, int > > keys;
+            for ( int i = 0; i < N; ++i )
+                keys.push_back( make_pair( url( i ), i ) );
+            sort( keys.begin(), keys.end() );
+            BtreeBuilder builder( true, id() );
+            for ( unsigned i = 0; i < keys.size(); ++i ) {
+                BSONObj k = BSON( "a" << keys[ i ].first );
+                builder.addKey( k, loc( keys[ i ].second ) );
+            }
+            builder.commit();
+            checkValid( N );
+            for ( int i = 0; i < N; i += 13 )
+                ASSERT( has( i ) );
+        }
+    };
+
+    class NormalizedKeys : public Base {
+    public:
+        NormalizedKeys() : Base( BSON( "normalizedKeys" << true ) ) {}
+        void run() {
+            vector< BSONObj > keys;
+            for ( int i = 0; i < 300; ++i ) {
+                int x = ( i * 7919 ) % 300;
+                if ( x % 3 == 0 )
+                    keys.push_back( BSON( "" << x ) );
+                else if ( x % 3 == 1 )
+                    keys.push_back( BSON( "" << x + 0.5 ) );
+                else
+                    keys.push_back( BSON( "" << string( x % 50 + 1, 'a' + x % 26 ) ) );
+            }
+            for ( unsigned i = 0; i < keys.size(); ++i )
+                insert( keys[ i ] );
+            checkValid( keys.size() );
+            for ( unsigned i = 0; i < keys.size(); ++i )
+                ASSERT( bt()->hasKey( id(), dl(), keys[ i ], recordLoc() ) );
+
+            // the cursor hands out keys as BSON, in BSON order
+            BtreeCursor c( id(), minKey, maxKey, 1 );
+            BSONObj last;
+            unsigned n = 0;
+            for ( ; c.ok(); c.advance(), ++n ) {
+                BSONObj k = c.currKey();
+                if ( n )
+                    ASSERT( last.woCompare( k ) < 0 );
+                last = k;
+            }
+            ASSERT_EQUALS( keys.size(), n );
+
+            for ( unsigned i = 0; i < keys.size(); i += 2 )
+                unindex( keys[ i ] );
+            checkValid( keys.size() - ( keys.size() + 1 ) / 2 );
+        }
+    };
+
+    class MultiRangeCursor : public Base {
+    public:
+        void run() {
+            for ( int i = 0; i < 1000; ++i ) {
+                BSONObj k = BSON( "" << i );
+                insert( k );
+            }
+            BoundList bounds;
+            bounds.push_back( make_pair( BSON( "" << 10 ), BSON( "" << 12 ) ) );
+            bounds.push_back( make_pair( BSON( "" << 500 ), BSON( "" << 500 ) ) );
+            bounds.push_back( make_pair( BSON( "" << 501 ), BSON( "" << 502 ) ) );
+            bounds.push_back( make_pair( BSON( "" << 2000 ), BSON( "" << 3000 ) ) );
+            bounds.push_back( make_pair( BSON( "" << 990 ), BSON( "" << 995 ) ) );
+            BtreeCursor c( id(), bounds, 1 );
+            int expected[] = { 10, 11, 12, 500, 501, 502 };
+            unsigned n = 0;
+            for ( ; c.ok(); c.advance(), ++n ) {
+                ASSERT( n < sizeof( expected ) / sizeof( int ) );
+                ASSERT_EQUALS( expected[ n ], c.currKey().firstElement().number() );
+            }
+            // ranges must come in scan order; 990 is behind 2000 so it is never reached
+            ASSERT_EQUALS( sizeof( expected ) / sizeof( int ), n );
+
+            BoundList reverse;
+            reverse.push_back( make_pair( BSON( "" << 995 ), BSON( "" << 994 ) ) );
+            reverse.push_back( make_pair( BSON( "" << 3 ), BSON( "" << 2 ) ) );
+            BtreeCursor r( id(), reverse, -1 );
+            int expectedReverse[] = { 995, 994, 3, 2 };
+            n = 0;
+            for ( ; r.ok(); r.advance(), ++n ) {
+                ASSERT( n < sizeof( expectedReverse ) / sizeof( int ) );
+                ASSERT_EQUALS( expectedReverse[ n ], r.currKey().firstElement().number() );
+            }
+            ASSERT_EQUALS( sizeof( expectedReverse ) / sizeof( int ), n );
+        }
+    };
+
     class All : public UnitTest::Suite {
     public:
         All() {
@@ -222,6 +485,15 @@ namespace BtreeTests {
             add< SplitLeftHeavyBucket >();
             add< MissingLocate >();
             add< MissingLocateMultiBucket >();
+            add< BuildEmpty >();
+            add< BuildBottomUp >();
+            add< BuildDenserThanInsert >();
+            add< BuildDupKey >();
+            add< CompressedInsertUnindex >();
+            add< CompressedFewerBuckets >();
+            add< CompressedBuild >();
+            add< NormalizedKeys >();
+            add< MultiRangeCursor >();
         }
     };
 }
@@ -89,10 +89,13 @@ int main( int argc, char** argv ) {
     tests.add( javajsTests(), "javajs" );
 
     tests.add( btreeTests(), "btree" );
+    tests.add( extSortTests(), "extsort" );
     tests.add( jsobjTests(), "jsobj" );
     tests.add( jsonTests(), "json" );
+    tests.add( journalTests(), "journal" );
     tests.add( matcherTests(), "matcher" );
     tests.add( namespaceTests(), "namespace" );
+    tests.add( normKeyTests(), "normkey" );
     tests.add( pairingTests(), "pairing" );
     tests.add( pdfileTests(), "pdfile" );
     tests.add( queryTests(), "query" );
@@ -22,11 +22,14 @@
 using namespace mongo;
 
 UnitTest::TestPtr btreeTests();
+UnitTest::TestPtr extSortTests();
 UnitTest::TestPtr javajsTests();
 UnitTest::TestPtr jsobjTests();
 UnitTest::TestPtr jsonTests();
+UnitTest::TestPtr journalTests();
 UnitTest::TestPtr matcherTests();
 UnitTest::TestPtr namespaceTests();
+UnitTest::TestPtr normKeyTests();
 UnitTest::TestPtr pairingTests();
 UnitTest::TestPtr pdfileTests();
 UnitTest::TestPtr queryTests();
@@ -0,0 +1,106 @@
+// extsorttests.cpp : external sort unit tests.
+//
+
+/**
+ *    Copyright (C) 2008 10gen Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../db/extsort.h"
+
+#include "../db/db.h"
+
+#include "dbtests.h"
+
+namespace ExtSortTests {
+
+    class Base {
+    public:
+        virtual ~Base() {}
+        void run() {
+            BSONObjExternalSorter sorter( order(), maxFileSize() );
+            for ( int i = 0; i < n(); ++i ) {
+                // a permutation of 0..n-1, each value twice with different DiskLocs
+                int x = ( i * 7919 ) % n();
+                sorter.add( BSON( "a" << x ), DiskLoc( 0, 2 * ( n() - i ) ) );
+                sorter.add( BSON( "a" << x ), DiskLoc( 0, 2 * ( n() + i ) ) );
+            }
+            sorter.sort();
+            ASSERT_EQUALS( 2 * n(), sorter.numAdded() );
+            check( sorter );
+
+            auto_ptr< BSONObjExternalSorter::Iterator > i = sorter.iterator();
+            int count = 0;
+            BSONObj lastObj;
+            DiskLoc lastLoc;
+            while ( i->more() ) {
+                BSONObjExternalSorter::Data d = i->next();
+                if ( count ) {
+                    int c = lastObj.woCompare( d.first, order() );
+                    ASSERT( c < 0 || ( c == 0 && lastLoc.compare( d.second ) < 0 ) );
+                }
+                lastObj = d.first;
+                lastLoc = d.second;
+                ++count;
+            }
+            ASSERT_EQUALS( 2 * n(), count );
+        }
+    protected:
+        virtual BSONObj order() const { return BSONObj(); }
+        virtual long maxFileSize() const { return 1024 * 1024; }
+        virtual int n() const { return 1000; }
+        virtual void check( BSONObjExternalSorter &sorter ) {}
+    };
+
+    class InMemory : public Base {
+        virtual void check( BSONObjExternalSorter &sorter ) {
+            ASSERT_EQUALS( 0, sorter.numFiles() );
+        }
+    };
+
+    class Spill : public Base {
+        virtual long maxFileSize() const { return 10000; }
+        virtual void check( BSONObjExternalSorter &sorter ) {
+            ASSERT( sorter.numFiles() > 1 );
+        }
+    };
+
+    class SpillDescending : public Spill {
+        virtual BSONObj order() const { return BSON( "a" << -1 ); }
+    };
+
+    class Empty {
+    public:
+        void run() {
+            BSONObjExternalSorter sorter;
+            sorter.sort();
+            ASSERT( !sorter.iterator()->more() );
+        }
+    };
+
+    class All : public UnitTest::Suite {
+    public:
+        All() {
+            add< InMemory >();
+            add< Spill >();
+            add< SpillDescending >();
+            add< Empty >();
+        }
+    };
+
+} // namespace ExtSortTests
+
+UnitTest::TestPtr extSortTests() {
+    return UnitTest::createSuite< ExtSortTests::All >();
+}
@@ -0,0 +1,220 @@
+// journaltests.cpp : journal recovery unit tests.
+//
+
+/**
+ *    Copyright (C) 2009 10gen Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../db/journal.h"
+
+#include "../db/db.h"
+
+#include "dbtests.h"
+
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+
+namespace JournalTests {
+
+    /* The tests use their own Journal on files mapped the usual (shared) way, so what
+       a commit writes back is already in the file.  A crash before the write back is
+       simulated by zeroing the file under the view, then replaying. */
+    class Base {
+    public:
+        Base() {
+            j_.open();
+            mapFile( f_, "journaltests.dat" );
+        }
+        virtual ~Base() {
+            f_.close();
+            boost::filesystem::remove_all( journalDir() );
+            boost::filesystem::remove( dataPath( "journaltests.dat" ) );
+            boost::filesystem::remove( dataPath( "journaltests2.dat" ) );
+        }
+    protected:
+        enum { Len = 16 * 1024 };
+        static boost::filesystem::path journalDir() {
+            return boost::filesystem::path( dbpath ) / "journal";
+        }
+        static string journalFile( int n ) {
+            stringstream ss;
+            ss << "j._" << n;
+            return ( journalDir() / ss.str() ).string();
+        }
+        static string dataPath( const char *name ) {
+            return ( boost::filesystem::path( dbpath ) / name ).string();
+        }
+        static char *mapFile( MemoryMappedFile& f, const char *name ) {
+            char *p = (char *) f.map( dataPath( name ).c_str(), Len );
+            ASSERT( p );
+            return p;
+        }
+        char *view() {
+            return (char *) f_.viewOfs();
+        }
+        /* change [ofs, ofs+n) to c and commit it as one section.  returns the journal's
+           length after the commit. */
+        long long change( MemoryMappedFile& f, int ofs, int n, char c ) {
+            char *p = (char *) f.viewOfs() + ofs;
+            memset( p, c, n );
+            j_.note( p, n );
+            j_.unlocking();
+            j_.commit();
+            return boost::filesystem::file_size( journalFile( 0 ) );
+        }
+        long long change( int ofs, int n, char c ) {
+            return change( f_, ofs, n, c );
+        }
+        /* lose everything written to the data file */
+        void crash( const char *name = "journaltests.dat" ) {
+            File f;
+            f.open( dataPath( name ).c_str() );
+            vector< char > zeros( Len );
+            f.write( 0, &zeros[0], Len );
+            f.fsync();
+        }
+        /* [ofs, ofs+n) of the data file all c? */
+        static bool fileHas( int ofs, int n, char c, const char *name = "journaltests.dat" ) {
+            File f;
+            f.open( dataPath( name ).c_str() );
+            vector< char > b( n );
+            f.read( ofs, &b[0], n );
+            for ( int i = 0; i < n; ++i )
+                if ( b[ i ] != c )
+                    return false;
+            return true;
+        }
+        /* rewrite the journal file with its first len bytes, with byte flip (if >= 0)
+           changed */
+        static void rewriteJournal( long long len, long long flip = -1 ) {
+            string name = journalFile( 0 );
+            vector< char > b( len );
+            {
+                ifstream in( name.c_str(), ios::in | ios::binary );
+                in.read( &b[0], len );
+                ASSERT( in.good() );
+            }
+            if ( flip >= 0 )
+                b[ flip ] ^= 0xff;
+            boost::filesystem::remove( name );
+            ofstream out( name.c_str(), ios::out | ios::binary );
+            out.write( &b[0], len );
+        }
+        dblock lk_;
+        Journal j_;
+        MemoryMappedFile f_;
+    };
+
+    class ReplayAppliesSections : public Base {
+    public:
+        void run() {
+            change( 0, 100, 'a' );
+            change( 4096, 200, 'b' );
+            change( 50, 10, 'c' );
+            crash();
+            ASSERT( fileHas( 0, 100, 0 ) );
+            j_.replay();
+            ASSERT( fileHas( 0, 50, 'a' ) );
+            ASSERT( fileHas( 50, 10, 'c' ) );
+            ASSERT( fileHas( 60, 40, 'a' ) );
+            ASSERT( fileHas( 100, 3996, 0 ) );
+            ASSERT( fileHas( 4096, 200, 'b' ) );
+            ASSERT( !boost::filesystem::exists( journalFile( 0 ) ) );
+        }
+    };
+
+    class TruncatedSectionIgnored : public Base {
+    public:
+        void run() {
+            long long first = change( 0, 100, 'a' );
+            long long second = change( 1000, 100, 'b' );
+            crash();
+            rewriteJournal( first + ( second - first ) / 2 );
+            j_.replay();
+            ASSERT( fileHas( 0, 100, 'a' ) );
+            ASSERT( fileHas( 1000, 100, 0 ) );
+        }
+    };
+
+    class BadMd5Ignored : public Base {
+    public:
+        void run() {
+            change( 0, 100, 'a' );
+            long long second = change( 1000, 100, 'b' );
+            long long third = change( 2000, 100, 'c' );
+            crash();
+            /* a byte of the second section's data, which its 16 byte digest follows.  the
+               third section is whole but comes after it. */
+            rewriteJournal( third, second - 16 - 50 );
+            j_.replay();
+            ASSERT( fileHas( 0, 100, 'a' ) );
+            ASSERT( fileHas( 1000, 100, 0 ) );
+            ASSERT( fileHas( 2000, 100, 0 ) );
+        }
+    };
+
+    class CheckpointRemovesOldFiles : public Base {
+    public:
+        void run() {
+            change( 0, 100, 'a' );
+            ASSERT( boost::filesystem::file_size( journalFile( 0 ) ) > 0 );
+            memset( view() + 500, 'b', 10 );
+            j_.note( view() + 500, 10 );
+            j_.checkpoint(); // commits what was noted, lk_ is held
+            ASSERT( !boost::filesystem::exists( journalFile( 0 ) ) );
+            ASSERT( boost::filesystem::exists( journalFile( 1 ) ) );
+            ASSERT_EQUALS( 0, (int) boost::filesystem::file_size( journalFile( 1 ) ) );
+            ASSERT( fileHas( 0, 100, 'a' ) );
+            ASSERT( fileHas( 500, 10, 'b' ) );
+            ASSERT_EQUALS( 1, (int) j_.stats().checkpoints );
+        }
+    };
+
+    class MissingDataFileSkipped : public Base {
+    public:
+        void run() {
+            {
+                MemoryMappedFile other;
+                mapFile( other, "journaltests2.dat" );
+                change( other, 0, 100, 'x' );
+                change( 0, 100, 'a' );
+                change( other, 200, 100, 'y' );
+                other.close();
+            }
+            /* dropped after the changes were made */
+            boost::filesystem::remove( dataPath( "journaltests2.dat" ) );
+            crash();
+            j_.replay();
+            ASSERT( !boost::filesystem::exists( dataPath( "journaltests2.dat" ) ) );
+            ASSERT( fileHas( 0, 100, 'a' ) );
+        }
+    };
+
+    class All : public UnitTest::Suite {
+    public:
+        All() {
+            add< ReplayAppliesSections >();
+            add< TruncatedSectionIgnored >();
+            add< BadMd5Ignored >();
+            add< CheckpointRemovesOldFiles >();
+            add< MissingDataFileSkipped >();
+        }
+    };
+
+} // namespace JournalTests
+
+UnitTest::TestPtr journalTests() {
+    return UnitTest::createSuite< JournalTests::All >();
+}
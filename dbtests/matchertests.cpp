@@ -64,6 +64,75 @@ namespace MatcherTests {
         }        
     };
 
+    /* the compiled program must give the answers JSMatcher's own evaluation does */
+    class CompiledSameAsInterpreted {
+    public:
+        void run() {
+            const char *queries[] = {
+                "{a:5}", "{a:{$gt:4}}", "{a:{$gte:5,$lt:6}}", "{a:{$ne:5}}", "{a:null}",
+                "{a:{$ne:null}}", "{a:{$in:[1,5,'x']}}", "{a:{$in:[5]},b:{$in:[2]}}", "{'a.b':5}",
+                "{'a.b':{$lt:3}}", "{'a.b.c':1}", "{a:'x',b:{$gt:1}}", "{a:{x:1}}", "{b:{$lte:'x'}}", 0
+            };
+            const char *docs[] = {
+                "{a:5}", "{a:5.5}", "{a:6}", "{a:'x'}", "{a:null}", "{}", "{b:2}", "{a:[1,5]}",
+                "{a:[4,'xy']}", "{a:{b:5}}", "{a:{b:[1,2]}}", "{a:[{b:5},{b:2}]}", "{a:[{b:{c:1}}]}",
+                "{a:{b:{c:1}}}", "{a:{x:1}}", "{a:'xyz',b:2}", "{a:5,b:2}", "{b:'w',a:'x'}", 0
+            };
+            vector< BSONObj > q;
+            for( int i = 0; queries[ i ]; ++i )
+                q.push_back( fromjson( queries[ i ] ) );
+            BSONObjBuilder r;
+            r.appendRegex( "a", "^x" );
+            q.push_back( r.obj() );
+            BSONObjBuilder r2;
+            r2.appendRegex( "a.b", "y" );
+            q.push_back( r2.obj() );
+            for( vector< BSONObj >::iterator i = q.begin(); i != q.end(); ++i ) {
+                JSMatcher compiled( *i );
+                JSMatcher interpreted( *i, BSONObj(), false );
+                ASSERT( compiled.compiled() );
+                ASSERT( !interpreted.compiled() );
+                for( int j = 0; docs[ j ]; ++j ) {
+                    BSONObj d = fromjson( docs[ j ] );
+                    bool deep1, deep2;
+                    bool m1 = compiled.matches( d, &deep1 );
+                    bool m2 = interpreted.matches( d, &deep2 );
+                    ASSERT_EQUALS( m2, m1 );
+                    if ( m1 )
+                        ASSERT_EQUALS( deep2, deep1 );
+                }
+            }
+        }
+    };
+
+    /* matching index keys, whose field names are empty */
+    class CompiledIndexKey {
+    public:
+        void run() {
+            BSONObj keyPattern = BSON( "a" << 1 << "b" << 1 );
+            JSMatcher m( fromjson( "{b:{$gt:2},a:4}" ), keyPattern );
+            ASSERT( m.compiled() );
+            ASSERT( m.matches( BSON( "" << 4 << "" << 3 ) ) );
+            ASSERT( !m.matches( BSON( "" << 4 << "" << 2 ) ) );
+            ASSERT( !m.matches( BSON( "" << 3 << "" << 3 ) ) );
+        }
+    };
+
+    /* there used to be room for just one $in, four regexes and eight operators */
+    class ManyOperators {
+    public:
+        void run() {
+            BSONObj query = fromjson( "{a:{$in:[1,2]},b:{$in:[3]},c:{$gt:0,$lt:9},d:{$gt:0,$lt:9},"
+                                      "e:{$gt:0,$lt:9},f:{$gt:0,$lt:9},g:{$gt:0,$lt:9}}" );
+            BSONObj doc = fromjson( "{a:2,b:3,c:1,d:2,e:3,f:4,g:5}" );
+            JSMatcher m( query );
+            ASSERT( m.matches( doc ) );
+            JSMatcher n( query, BSONObj(), false );
+            ASSERT( n.matches( doc ) );
+            ASSERT( !m.matches( fromjson( "{a:2,b:3,c:1,d:2,e:3,f:4,g:10}" ) ) );
+        }
+    };
+
     class All : public UnitTest::Suite {
     public:
         All() {
@@ -71,6 +140,9 @@ namespace MatcherTests {
             add< DoubleEqual >();
             add< MixedNumericEqual >();
             add< MixedNumericGt >();
+            add< CompiledSameAsInterpreted >();
+            add< CompiledIndexKey >();
+            add< ManyOperators >();
         }
     };
     
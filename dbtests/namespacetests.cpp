@@ -21,6 +21,7 @@
 #include "../db/namespace.h"
 
 #include "../db/db.h"
+#include "../db/dbhelpers.h"
 #include "../db/json.h"
 
 #include "dbtests.h"
@@ -528,7 +529,10 @@ namespace NamespaceTests {
                 zero( &d->capExtent );
                 zero( &d->capFirstNewRecord );
 
-                nsd();
+                {
+                    dblock lk;
+                    database->namespaceIndex.checkMigrateAll();
+                }
 
                 ASSERT( nsd()->firstExtent == nsd()->capExtent );
                 ASSERT( nsd()->capExtent.getOfs() != 0 );
@@ -547,6 +551,114 @@ namespace NamespaceTests {
             }
         };
 
+        class FreeSpaceBase : public Base {
+        protected:
+            virtual string spec() const {
+                return "{\"size\":100000}";
+            }
+            DiskLoc insert( int size, const DiskLoc &near = DiskLoc() ) {
+                BSONObjBuilder b;
+                b.append( "a", string( size, 'a' ) );
+                BSONObj o = b.obj();
+                return theDataFileMgr.insert( ns(), o.objdata(), o.objsize(), false, BSONElement(), near );
+            }
+            void remove( const DiskLoc &l ) {
+                theDataFileMgr.deleteRecord( ns(), l.rec(), l );
+            }
+            int nDeleted() const {
+                int n = 0;
+                for ( int i = 0; i < Buckets; ++i )
+                    for ( DiskLoc j = nsd()->deletedList[ i ]; !j.isNull(); j = j.drec()->nextDeleted )
+                        ++n;
+                return n;
+            }
+            void checkMap() {
+                ASSERT_EQUALS( nDeleted(), NamespaceDetailsTransient::get( ns() ).freeSpace().nFree() );
+            }
+        };
+
+        class FreeSpaceBestFit : public FreeSpaceBase {
+        public:
+            void run() {
+                create();
+                DiskLoc small = insert( 100 );
+                DiskLoc big = insert( 1000 );
+                DiskLoc mid = insert( 500 );
+                insert( 100 );
+                remove( small );
+                remove( big );
+                remove( mid );
+                checkMap();
+                ASSERT( mid == insert( 480 ) );
+                checkMap();
+                ASSERT( small == insert( 90 ) );
+                checkMap();
+            }
+        };
+
+        class FreeSpaceNear : public FreeSpaceBase {
+        public:
+            void run() {
+                create();
+                DiskLoc l[ 4 ];
+                for ( int i = 0; i < 4; ++i )
+                    l[ i ] = insert( 200 );
+                insert( 100 );
+                remove( l[ 3 ] );
+                remove( l[ 0 ] );
+                ASSERT( l[ 3 ] == insert( 200, l[ 2 ] ) );
+                ASSERT( l[ 0 ] == insert( 200 ) );
+                checkMap();
+            }
+        };
+
+        class Compact : public Base {
+        public:
+            Compact() : Base( "NamespaceDetailsTests_Compact" ) {}
+            void run() {
+                create();
+                Helpers::ensureIndex( ns(), BSON( "i" << 1 ), "i_1" );
+                vector< DiskLoc > l;
+                for ( int i = 0; i < 72; ++i ) {
+                    BSONObj o = BSON( "i" << i << "a" << string( 150, 'a' ) );
+                    l.push_back( theDataFileMgr.insert( ns(), o.objdata(), o.objsize() ) );
+                }
+                ASSERT_EQUALS( 4, nExtents() );
+                vector< DiskLoc > extents;
+                for ( DiskLoc i = nsd()->firstExtent; !i.isNull(); i = i.ext()->xnext )
+                    extents.push_back( i );
+
+                // leave the first two extents two thirds full, the others nearly empty
+                set< int > kept;
+                map< int, int > nInExtent;
+                for ( int i = 0; i < 72; ++i ) {
+                    DiskLoc e( l[ i ].a(), l[ i ].rec()->extentOfs );
+                    bool dense = e == extents[ 0 ] || e == extents[ 1 ];
+                    int n = nInExtent[ e.getOfs() ]++;
+                    if ( dense ? n % 3 == 2 : n >= 2 )
+                        theDataFileMgr.deleteRecord( ns(), l[ i ].rec(), l[ i ] );
+                    else
+                        kept.insert( i );
+                }
+
+                CompactStats stats;
+                compactCollection( ns(), 0.5, stats );
+                ASSERT_EQUALS( 2, stats.nExtentsFreed );
+                ASSERT_EQUALS( 4, stats.nMoved );
+                ASSERT_EQUALS( 2, nExtents() );
+                ASSERT_EQUALS( (int) kept.size(), nRecords() );
+                for ( set< int >::iterator i = kept.begin(); i != kept.end(); ++i ) {
+                    BSONObj o;
+                    ASSERT( Helpers::findOne( ns(), BSON( "i" << *i ), o, true ) );
+                    ASSERT_EQUALS( *i, (int) o.getField( "i" ).number() );
+                }
+            }
+        private:
+            virtual string spec() const {
+                return "{\"size\":4096,\"$nExtents\":4}";
+            }
+        };
+
         // This isn't a particularly useful test, and because it doesn't clean up
         // after itself, /tmp/unittest needs to be cleared after running.
 //        class BigCollection : public Base {
@@ -589,6 +701,9 @@ namespace NamespaceTests {
             add< NamespaceDetailsTests::Realloc >();
             add< NamespaceDetailsTests::TwoExtent >();
             add< NamespaceDetailsTests::Migrate >();
+            add< NamespaceDetailsTests::FreeSpaceBestFit >();
+            add< NamespaceDetailsTests::FreeSpaceNear >();
+            add< NamespaceDetailsTests::Compact >();
 //            add< NamespaceDetailsTests::BigCollection >();
         }
     };
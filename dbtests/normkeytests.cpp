@@ -0,0 +1,117 @@
+// normkeytests.cpp : normalized index key unit tests.
+//
+
+/**
+ *    Copyright (C) 2008 10gen Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../db/normkey.h"
+
+#include "../db/json.h"
+
+#include "dbtests.h"
+
+namespace NormKeyTests {
+
+    class Base {
+    public:
+        virtual ~Base() {}
+        void run() {
+            vector< BSONObj > k = keys();
+            for ( unsigned i = 0; i < k.size(); ++i ) {
+                BSONObj e = NormalizedKey::encode( k[ i ], pattern() );
+                ASSERT( k[ i ].woEqual( NormalizedKey::decode( e, pattern() ) ) );
+                for ( unsigned j = 0; j < k.size(); ++j ) {
+                    int w = k[ i ].woCompare( k[ j ], pattern() );
+                    int n = NormalizedKey::compare( e, NormalizedKey::encode( k[ j ], pattern() ) );
+                    ASSERT_EQUALS( sgn( w ), sgn( n ) );
+                }
+            }
+        }
+    protected:
+        virtual BSONObj pattern() const = 0;
+        virtual vector< BSONObj > keys() const {
+            const char *json[] = {
+                "{'':{$minKey:1}}", "{'':null}", "{'':-5.5}", "{'':-1}", "{'':-0.0}", "{'':0}",
+                "{'':3}", "{'':3.0}", "{'':3.5}", "{'':1e10}", "{'':''}", "{'':'a'}", "{'':'ab'}",
+                "{'':'b'}", "{'':{}}", "{'':{a:1}}", "{'':{a:1,b:2}}", "{'':{b:0}}", "{'':[1,2]}",
+                "{'':[1,'x']}", "{'':true}", "{'':false}", "{'':{$date:5}}", "{'':/ab/i}",
+                "{'':{$maxKey:1}}" };
+            vector< BSONObj > ret;
+            for ( unsigned i = 0; i < sizeof( json ) / sizeof( json[ 0 ] ); ++i )
+                ret.push_back( fromjson( json[ i ] ) );
+            BSONObjBuilder b;
+            b.append( "", string( "a\0b", 3 ) );
+            ret.push_back( b.obj() );
+            BSONObjBuilder c;
+            c.append( "", string( "a\0a", 3 ) );
+            ret.push_back( c.obj() );
+            ret.push_back( fromjson( "{'':{$oid:'4a0b8cf8a4b1c0d7e6f50413'}}" ) );
+            return ret;
+        }
+        static int sgn( int i ) {
+            return i == 0 ? 0 : ( i > 0 ? 1 : -1 );
+        }
+    };
+
+    class Ascending : public Base {
+        virtual BSONObj pattern() const { return BSON( "a" << 1 ); }
+    };
+
+    class Descending : public Base {
+        virtual BSONObj pattern() const { return BSON( "a" << -1 ); }
+    };
+
+    class Compound : public Base {
+        virtual BSONObj pattern() const { return BSON( "a" << 1 << "b" << -1 ); }
+        virtual vector< BSONObj > keys() const {
+            vector< BSONObj > ret;
+            ret.push_back( BSON( "" << 1 << "" << "zz" ) );
+            ret.push_back( BSON( "" << 1 << "" << "zzz" ) );
+            ret.push_back( BSON( "" << 1.5 << "" << "a" ) );
+            ret.push_back( BSON( "" << "x" << "" << 5 ) );
+            ret.push_back( BSON( "" << "x" << "" << -5 ) );
+            return ret;
+        }
+    };
+
+    /* equal numbers compare equal, but decode to their own type */
+    class IntDouble {
+    public:
+        void run() {
+            BSONObj p = BSON( "a" << 1 );
+            BSONObj i = NormalizedKey::encode( BSON( "" << 3 ), p );
+            BSONObj d = NormalizedKey::encode( BSON( "" << 3.0 ), p );
+            ASSERT_EQUALS( 0, NormalizedKey::compare( i, d ) );
+            ASSERT_EQUALS( NumberInt, NormalizedKey::decode( i, p ).firstElement().type() );
+            ASSERT_EQUALS( NumberDouble, NormalizedKey::decode( d, p ).firstElement().type() );
+        }
+    };
+
+    class All : public UnitTest::Suite {
+    public:
+        All() {
+            add< Ascending >();
+            add< Descending >();
+            add< Compound >();
+            add< IntDouble >();
+        }
+    };
+
+} // namespace NormKeyTests
+
+UnitTest::TestPtr normKeyTests() {
+    return UnitTest::createSuite< NormKeyTests::All >();
+}
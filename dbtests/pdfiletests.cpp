@@ -21,6 +21,10 @@
 
 #include "../db/db.h"
 #include "../db/json.h"
+#include "../db/btree.h"
+#include "../db/clientcursor.h"
+#include "../db/curop.h"
+#include "../db/query.h"
 
 #include "dbtests.h"
 
@@ -299,7 +303,243 @@ namespace PdfileTests {
                 ASSERT( 0 != o.getField( "a" ).date() );
             }
         };
+
+        class BatchBase : public Base {
+        protected:
+            static void index( const char *name, const BSONObj &key ) {
+                BSONObj spec = BSON( "name" << name << "ns" << ns() << "key" << key );
+                theDataFileMgr.insert( "pdfiletests.system.indexes", spec );
+            }
+            static int nKeys( int i ) {
+                IndexDetails &id = nsd()->indexes[ i ];
+                return id.head.btree()->fullValidate( id.head, id.keyPattern() );
+            }
+            static int count() {
+                int n = 0;
+                for( auto_ptr< Cursor > c = theDataFileMgr.findAll( ns() ); c->ok(); c->advance() )
+                    ++n;
+                return n;
+            }
+        };
+
+        /* keys go into the index out of the order the objects come in */
+        class Batch : public BatchBase {
+        public:
+            void run() {
+                index( "a_1", BSON( "a" << 1 ) );
+                vector< BSONObj > objs;
+                for( int i = 0; i < 100; ++i )
+                    objs.push_back( BSON( "a" << 99 - i << "b" << string( i, 'x' ) ) );
+                theDataFileMgr.insertBatch( ns(), objs );
+                ASSERT_EQUALS( 100U, objs.size() );
+                for( int i = 0; i < 100; ++i ) {
+                    ASSERT( objs[ i ].hasField( "_id" ) );
+                    ASSERT_EQUALS( 99 - i, objs[ i ].getIntField( "a" ) );
+                    ASSERT_EQUALS( i, (int) strlen( objs[ i ].getStringField( "b" ) ) );
+                }
+                ASSERT_EQUALS( 100, count() );
+                ASSERT_EQUALS( 100, nsd()->nrecords );
+                ASSERT_EQUALS( 100, nKeys( 0 ) );
+            }
+        };
+
+        /* a duplicate _id stops the batch there, as it would inserting one at a time */
+        class BatchDuplicateId : public BatchBase {
+        public:
+            void run() {
+                index( "_id_", BSON( "_id" << 1 ) );
+                index( "a_1", BSON( "a" << 1 ) );
+                BSONObj o = BSON( "_id" << 5 << "a" << 5 );
+                theDataFileMgr.insert( ns(), o );
+                vector< BSONObj > objs;
+                objs.push_back( BSON( "_id" << 1 << "a" << 1 ) );
+                objs.push_back( BSON( "_id" << 2 << "a" << 2 ) );
+                objs.push_back( BSON( "_id" << 5 << "a" << 3 ) );
+                objs.push_back( BSON( "_id" << 6 << "a" << 4 ) );
+                ASSERT_EXCEPTION( theDataFileMgr.insertBatch( ns(), objs ), AssertionException );
+                ASSERT_EQUALS( 2U, objs.size() );
+                ASSERT_EQUALS( 3, count() );
+                ASSERT_EQUALS( 3, nKeys( 0 ) );
+                ASSERT_EQUALS( 3, nKeys( 1 ) );
+            }
+        };
     } // namespace Insert
+
+    namespace BackgroundIndex {
+        class Base {
+        public:
+            Base() {
+                setClient( ns() );
+            }
+            virtual ~Base() {
+                if ( !nsd() )
+                    return;
+                string n( ns() );
+                dropNS( n );
+            }
+        protected:
+            static const char *ns() {
+                return "pdfiletests.BackgroundIndex";
+            }
+            static NamespaceDetails *nsd() {
+                return nsdetails( ns() );
+            }
+            static void insert( int a ) {
+                BSONObj o = BSON( "a" << a );
+                theDataFileMgr.insert( ns(), o );
+            }
+            static int nKeys( IndexDetails &id ) {
+                return id.head.btree()->fullValidate( id.head, id.keyPattern() );
+            }
+        private:
+            dblock lk_;
+        };
+
+        /* a build long enough to yield produces a complete index */
+        class Build : public Base {
+        public:
+            void run() {
+                OpScope op;
+                int n = 3 * YieldTracker::Hits;
+                for( int i = 0; i < n; ++i )
+                    insert( i );
+                int yields = currentOp.yields;
+                BSONObj spec = BSON( "name" << "a_1" << "ns" << ns() << "key" << BSON( "a" << 1 ) << "background" << true );
+                theDataFileMgr.insert( "pdfiletests.system.indexes", spec );
+                ASSERT_EQUALS( 1, nsd()->nIndexes );
+                ASSERT_EQUALS( n, nKeys( nsd()->indexes[ 0 ] ) );
+                ASSERT( currentOp.yields > yields );
+                ASSERT( !BackgroundIndexBuild::inProgForNs( ns() ) );
+            }
+        };
+
+        /* writes made while a build is in progress are applied to the index being built,
+           which isn't visible until the build is done */
+        class MaintainedDuringBuild : public Base {
+        public:
+            void run() {
+                insert( 0 );
+                BSONObj spec = BSON( "name" << "a_1" << "ns" << ns() << "key" << BSON( "a" << 1 ) );
+                theDataFileMgr.insert( "pdfiletests.BackgroundIndexSpec", spec );
+                IndexDetails &id = nsd()->indexes[ nsd()->nIndexes ];
+                id.info = nsdetails( "pdfiletests.BackgroundIndexSpec" )->firstExtent.ext()->firstRecord;
+                id.head = BtreeBucket::addHead( id );
+                {
+                    BackgroundIndexBuild inProg( ns() );
+                    insert( 1 );
+                    insert( 2 );
+                    ASSERT_EQUALS( 0, nsd()->nIndexes );
+                    ASSERT_EQUALS( 2, nKeys( id ) );
+                    ASSERT( NamespaceDetailsTransient::get( ns() ).indexKeys().count( "a" ) );
+
+                    deleteObjects( ns(), BSON( "a" << 1 ), true );
+                    ASSERT_EQUALS( 1, nKeys( id ) );
+
+                    DiskLoc loc = nsd()->lastExtent.ext()->lastRecord;
+                    ASSERT_EQUALS( 2, loc.obj().getIntField( "a" ) );
+                    BSONObj updated = BSON( "_id" << loc.obj()[ "_id" ] << "a" << 3 );
+                    stringstream ss;
+                    theDataFileMgr.update( ns(), loc.rec(), loc, updated.objdata(), updated.objsize(), ss );
+                    ASSERT_EQUALS( 1, nKeys( id ) );
+                    BSONObj key = BSON( "" << 3 );
+                    ASSERT( id.head.btree()->hasKey( id, id.head, key, loc ) );
+
+                    ASSERT_EXCEPTION( dropNS( ns() ), AssertionException );
+                    ASSERT_EXCEPTION( theDataFileMgr.insert( "pdfiletests.system.indexes", spec ),
+                                      AssertionException );
+                }
+                ASSERT( !BackgroundIndexBuild::inProgForNs( ns() ) );
+                string s( "pdfiletests.BackgroundIndexSpec" );
+                dropNS( s );
+            }
+        };
+    } // namespace BackgroundIndex
+
+    namespace Prealloc {
+
+        class Base {
+        public:
+            Base() : name_( ( boost::filesystem::path( dbpath ) / "pdfiletests_prealloc.0" ).string() ) {
+                remove();
+            }
+            ~Base() {
+                remove();
+            }
+        protected:
+            const string& name() const { return name_; }
+            void remove() {
+                theFileAllocator.waitIdle();
+                boost::filesystem::remove( name_ );
+            }
+        private:
+            string name_;
+        };
+
+        class Background : public Base {
+        public:
+            void run() {
+                theFileAllocator.requestAllocation( name(), 1024 * 1024 + 4096 );
+                theFileAllocator.allocateAsap( name(), 1024 * 1024 + 4096 );
+                ASSERT( boost::filesystem::exists( name() ) );
+                ASSERT_EQUALS( 1024 * 1024 + 4096, (int) boost::filesystem::file_size( name() ) );
+                ASSERT( !boost::filesystem::exists( name() + ".prealloc" ) );
+            }
+        };
+
+        /* a file that is already there is left alone */
+        class Existing : public Base {
+        public:
+            void run() {
+                FileAllocator::allocate( name(), 8192 );
+                theFileAllocator.requestAllocation( name(), 16384 );
+                theFileAllocator.waitIdle();
+                ASSERT_EQUALS( 8192, (int) boost::filesystem::file_size( name() ) );
+            }
+        };
+
+        /* rolling over to a file that has to hold a bigger extent than it was preallocated
+           for grows the file, and the header records the length that is mapped */
+        class RolloverBiggerExtent {
+        public:
+            RolloverBiggerExtent() {
+                setClient( ns() );
+            }
+            ~RolloverBiggerExtent() {
+                dropDatabase( ns() );
+            }
+            void run() {
+                string err;
+                ASSERT( userCreateNS( ns(), fromjson( "{\"size\":4096}" ), err, false ) );
+                theFileAllocator.waitIdle();
+                string next = database->fileName( 1 );
+                ASSERT( boost::filesystem::exists( next ) );
+                int preallocated = (int) boost::filesystem::file_size( next );
+
+                BSONObjBuilder b;
+                b.append( "size", 2 * preallocated );
+                ASSERT( userCreateNS( bigNs(), b.done(), err, false ) );
+                Extent *e = nsdetails( bigNs() )->firstExtent.ext();
+                ASSERT_EQUALS( 1, nsdetails( bigNs() )->firstExtent.a() );
+                ASSERT( e->length >= 2 * preallocated );
+
+                MDFHeader *h = database->getFile( 1 )->getHeader();
+                ASSERT_EQUALS( (int) boost::filesystem::file_size( next ), h->fileLength );
+                ASSERT( h->fileLength > 2 * preallocated );
+                ASSERT( h->unusedLength >= 0 );
+                ASSERT( h->unusedLength <= h->fileLength - MDFHeader::headerSize() - 16 - e->length );
+                ASSERT_EQUALS( 0, strncmp( h->data + h->fileLength - MDFHeader::headerSize() - 16, "      \nthe end\n", 16 ) );
+            }
+        private:
+            static const char *ns() {
+                return "pdfiletests_hudsonSmall.Rollover";
+            }
+            static const char *bigNs() {
+                return "pdfiletests_hudsonSmall.RolloverBig";
+            }
+            dblock lk_;
+        };
+
+    } // namespace Prealloc
     
     class All : public UnitTest::Suite {
     public:
@@ -318,6 +558,13 @@ namespace PdfileTests {
             add< ScanCapped::FirstInExtent >();
             add< ScanCapped::LastInExtent >();
             add< Insert::UpdateDate >();
+            add< Insert::Batch >();
+            add< Insert::BatchDuplicateId >();
+            add< BackgroundIndex::Build >();
+            add< BackgroundIndex::MaintainedDuringBuild >();
+            add< Prealloc::Background >();
+            add< Prealloc::Existing >();
+            add< Prealloc::RolloverBiggerExtent >();
         }
     };
 
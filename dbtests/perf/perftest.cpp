@@ -21,6 +21,7 @@
 
 #include "../../client/dbclient.h"
 #include "../../db/instance.h"
+#include "../../db/matcher.h"
 #include "../../db/query.h"
 #include "../../db/queryoptimizer.h"
 
@@ -159,6 +160,26 @@ namespace Insert {
         string ns_;
     };
     
+    /* OneIndexHighLow's key order on a secondary index, a hundred objects per message */
+    class BatchHighLow {
+    public:
+        BatchHighLow() : ns_( testNs( this ) ) {
+            client_->ensureIndex( ns_, BSON( "a" << 1 ) );
+        }
+        void run() {
+            vector< BSONObj > batch;
+            for( int i = 0; i < 100000; ++i ) {
+                int j = 50000 + ( ( i % 2 == 0 ) ? 1 : -1 ) * ( i / 2 + 1 );
+                batch.push_back( BSON( "a" << j ) );
+                if ( batch.size() == 100 ) {
+                    client_->insert( ns_.c_str(), batch );
+                    batch.clear();
+                }
+            }
+        }
+        string ns_;
+    };
+
     class All : public RunnerSuite {
     public:
         All() {
@@ -168,6 +189,7 @@ namespace Insert {
             add< Capped >();
             add< OneIndexReverse >();
             add< OneIndexHighLow >();
+            add< BatchHighLow >();
         }
     };
 } // namespace Insert
@@ -201,11 +223,31 @@ namespace Update {
         string ns_;
     };
 
+    // Documents keep growing, so they are moved again and again; this is mostly
+    // record allocation.  See the allocinfo command for the free list numbers.
+    class Growing {
+    public:
+        Growing() : ns_( testNs( this ) ) {
+            client_->ensureIndex( ns_, BSON( "_id" << 1 ) );
+            for( int i = 0; i < 20000; ++i )
+                client_->insert( ns_.c_str(), BSON( "_id" << i ) );
+        }
+        void run() {
+            for( int pass = 1; pass <= 10; ++pass ) {
+                string s( pass * 40, 'a' );
+                for( int i = 0; i < 20000; ++i )
+                    client_->update( ns_.c_str(), QUERY( "_id" << i ), BSON( "_id" << i << "s" << s ) );
+            }
+        }
+        string ns_;
+    };
+
     class All : public RunnerSuite {
     public:
         All() {
             add< Smaller >();
             add< Bigger >();
+            add< Growing >();
         }
     };
 } // namespace Update
@@ -575,6 +617,123 @@ namespace Plan {
     
 } // namespace Plan
 
+namespace BtreeFormat {
+
+    /* url-like keys, which share long prefixes, under a plain (v:0), prefix compressed
+       (v:1) or normalized keys index.  reports keys per bucket, and times lookups. */
+    class Base {
+    public:
+        Base( const string &ns, const BSONObj &spec ) : ns_( ns ) {
+            string db = ns_.substr( 0, ns_.find( '.' ) );
+            BSONObjBuilder b;
+            b << "ns" << ns_ << "key" << BSON( "a" << 1 ) << "name" << "a_1";
+            b.appendElements( spec );
+            client_->insert( ( db + ".system.indexes" ).c_str(), b.obj() );
+            for( int i = 0; i < N; ++i )
+                client_->insert( ns_.c_str(), BSON( "a" << url( i ) ) );
+        }
+        void run() {
+            for( int i = 0; i < N; i += 10 )
+                client_->findOne( ns_.c_str(), QUERY( "a" << url( i ) ) );
+            dblock lk;
+            setClient( ns_.c_str() );
+            int buckets = nsdetails( ( ns_ + ".$a_1" ).c_str() )->nrecords;
+            cout << ns_ << ": " << buckets << " buckets, " << N / buckets << " keys/bucket" << endl;
+        }
+    protected:
+        static string url( int i ) {
+            stringstream ss;
+            ss << "http://www.example.com/catalog/products/item" << i << ".html";
+            return ss.str();
+        }
+        enum { N = 100000 };
+        string ns_;
+    };
+
+    class FindV0 : public Base {
+    public:
+        FindV0() : Base( testNs( this ), BSON( "v" << 0 ) ) {}
+    };
+
+    class FindV1 : public Base {
+    public:
+        FindV1() : Base( testNs( this ), BSON( "v" << 1 ) ) {}
+    };
+
+    class FindNormalized : public Base {
+    public:
+        FindNormalized() : Base( testNs( this ), BSON( "normalizedKeys" << true ) ) {}
+    };
+
+    class FindNormalizedV1 : public Base {
+    public:
+        FindNormalizedV1() : Base( testNs( this ), BSON( "v" << 1 << "normalizedKeys" << true ) ) {}
+    };
+
+    class All : public RunnerSuite {
+    public:
+        All() {
+            add< FindV0 >();
+            add< FindV1 >();
+            add< FindNormalized >();
+            add< FindNormalizedV1 >();
+        }
+    };
+
+} // namespace BtreeFormat
+
+namespace Matcher {
+
+    /* the same predicates over the same records, evaluated by a compiled MatchProgram
+       or by JSMatcher's interpretive loop. */
+    class Base {
+    public:
+        Base( bool compile ) :
+        m_( fromjson( "{a:{$gt:0,$lt:100},'b.c':'x',d:{$in:[1,3,5,7]},e:{$ne:null}}" ), BSONObj(), compile ) {
+            ASSERT( m_.compiled() == compile );
+            for( int i = 0; i < 10; ++i ) {
+                BSONObjBuilder b;
+                b.append( "_id", i );
+                b.append( "z", "a string field that is never looked at" );
+                b.append( "a", i * 10 );
+                b.append( "b", BSON( "c" << "x" << "d" << i ) );
+                b.append( "d", i );
+                if ( i % 2 )
+                    b.append( "e", i );
+                b.append( "f", 1.5 );
+                docs_.push_back( b.obj() );
+            }
+        }
+        void run() {
+            for( int i = 0; i < 100000; ++i )
+                for( vector< BSONObj >::iterator j = docs_.begin(); j != docs_.end(); ++j )
+                    m_.matches( *j );
+        }
+    private:
+        JSMatcher m_;
+        vector< BSONObj > docs_;
+    };
+
+    class Compiled : public Base {
+    public:
+        Compiled() : Base( true ) {}
+    };
+
+    class Interpreted : public Base {
+    public:
+        Interpreted() : Base( false ) {}
+    };
+
+    class All : public RunnerSuite {
+    public:
+        All() {
+            add< Compiled >();
+            add< Interpreted >();
+        }
+    };
+
+} // namespace Matcher
+
 template< class T >
 UnitTest::TestPtr suite() {
     return UnitTest::createSuite< T >();
@@ -599,6 +758,8 @@ int main( int argc, char **argv ) {
     tests.add( suite< Index::All >(), "index" );
     tests.add( suite< QueryTests::All >(), "query" );
     tests.add( suite< Plan::All >(), "plan" );
+    tests.add( suite< BtreeFormat::All >(), "btree" );
+    tests.add( suite< Matcher::All >(), "matcher" );
 
     return tests.run( argc, argv );    
 }
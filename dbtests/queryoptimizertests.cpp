@@ -222,6 +222,29 @@ namespace QueryOptimizerTests {
             }
         };
         
+        class InIntervals {
+        public:
+            void run() {
+                FieldBoundSet s( "ns", fromjson( "{a:{$in:[5,1,3,1]}}" ) );
+                const vector< FieldInterval > &i = s.bound( "a" ).intervals();
+                ASSERT_EQUALS( 3U, i.size() );
+                ASSERT_EQUALS( 1, i[ 0 ].lower.number() );
+                ASSERT_EQUALS( 3, i[ 1 ].lower.number() );
+                ASSERT_EQUALS( 5, i[ 2 ].upper.number() );
+                ASSERT( s.bound( "a" ).pointIntervals() );
+                ASSERT( !s.bound( "a" ).equality() );
+                ASSERT( s.bound( "a" ).nontrivial() );
+                FieldBoundSet s2( "ns", fromjson( "{a:{$in:[5,1,3],$gt:1}}" ) );
+                ASSERT_EQUALS( 2U, s2.bound( "a" ).intervals().size() );
+                ASSERT( !s2.simplifiedQuery().getObjectField( "a" ).woCompare( fromjson( "{$in:[3,5]}" ) ) );
+                FieldBoundSet s3( "ns", fromjson( "{a:{$in:[5,1,3],$gt:7}}" ) );
+                ASSERT( !s3.matchPossible() );
+                FieldBoundSet s4( "ns", fromjson( "{a:{$in:[5,1,3],$gte:2,$lte:4}}" ) );
+                ASSERT( s4.bound( "a" ).equality() );
+                ASSERT_EQUALS( 3, s4.bound( "a" ).lower().number() );
+            }
+        };
+        
         class NoWhere {
         public:
             void run() {
@@ -497,6 +520,34 @@ namespace QueryOptimizerTests {
             }
         };
         
+        class InBounds : public Base {
+        public:
+            void run() {
+                QueryPlan p( FBS( fromjson( "{a:{$in:[3,1]},b:5}" ) ), BSONObj(), INDEX( "a" << 1 << "b" << 1 ) );
+                const BoundList &b = p.indexBounds();
+                ASSERT_EQUALS( 2U, b.size() );
+                ASSERT( !b[ 0 ].first.woCompare( BSON( "" << 1 << "" << 5 ) ) );
+                ASSERT( !b[ 0 ].second.woCompare( BSON( "" << 1 << "" << 5 ) ) );
+                ASSERT( !b[ 1 ].first.woCompare( BSON( "" << 3 << "" << 5 ) ) );
+                ASSERT( !b[ 1 ].second.woCompare( BSON( "" << 3 << "" << 5 ) ) );
+                
+                QueryPlan p2( FBS( fromjson( "{a:{$in:[3,1]},b:{$lte:5}}" ) ), BSON( "a" << -1 ), INDEX( "a" << 1 << "b" << 1 ) );
+                ASSERT_EQUALS( -1, p2.direction() );
+                const BoundList &b2 = p2.indexBounds();
+                ASSERT_EQUALS( 2U, b2.size() );
+                ASSERT( !b2[ 0 ].first.woCompare( BSON( "" << 3 << "" << 5 ) ) );
+                BSONObjBuilder end;
+                end.append( "", 1 );
+                end.appendMinKey( "" );
+                ASSERT( !b2[ 1 ].second.woCompare( end.obj() ) );
+
+                // a range ahead of the $in field: b is scanned across its whole span
+                QueryPlan p3( FBS( fromjson( "{a:{$gt:1},b:{$in:[3,1]}}" ) ), BSONObj(), INDEX( "a" << 1 << "b" << 1 ) );
+                ASSERT_EQUALS( 1U, p3.indexBounds().size() );
+                ASSERT( !p3.indexBounds()[ 0 ].first.woCompare( BSON( "" << 1 << "" << 1 ) ) );
+            }
+        };
+        
     } // namespace QueryPlanTests
 
     namespace QueryPlanSetTests {
@@ -869,6 +920,29 @@ namespace QueryOptimizerTests {
             }
         };
         
+        class InQuery : public Base {
+        public:
+            void run() {
+                Helpers::ensureIndex( ns(), BSON( "a" << 1 ), "a_1" );
+                for( int i = 0; i < 1000; ++i ) {
+                    BSONObj o = BSON( "a" << i );
+                    theDataFileMgr.insert( ns(), o );
+                }
+                FieldBoundSet fbs( ns(), fromjson( "{a:{$in:[995,5,500]}}" ) );
+                NamespaceDetails *d = nsd();
+                QueryPlan p( fbs, BSONObj(), &d->indexes[ d->findIndexByName( "a_1" ) ] );
+                auto_ptr< Cursor > c = p.newCursor();
+                int expected[] = { 5, 500, 995 };
+                int n = 0;
+                for( ; c->ok(); c->advance(), ++n ) {
+                    ASSERT( n < 3 );
+                    ASSERT_EQUALS( expected[ n ], c->current().getIntField( "a" ) );
+                }
+                // only the keys asked for are visited, not the 990 in between
+                ASSERT_EQUALS( 3, n );
+            }
+        };
+        
         class Delete : public Base {
         public:
             void run() {
@@ -942,6 +1016,79 @@ namespace QueryOptimizerTests {
             }
         };
         
+        class EstimatedPlan : public Base {
+        public:
+            void run() {
+                Helpers::ensureIndex( ns(), BSON( "a" << 1 ), "a_1" );
+                Helpers::ensureIndex( ns(), BSON( "b" << 1 ), "b_1" );
+                for( int i = 0; i < 2000; ++i ) {
+                    BSONObj o = BSON( "a" << i << "b" << i % 2 );
+                    theDataFileMgr.insert( ns(), o );
+                }
+                // a is unique and b has two values, so only a_1 is worth running
+                QueryPlanSet s( ns(), BSON( "a" << 5 << "b" << 1 ), BSONObj() );
+                ASSERT_EQUALS( 1, s.nPlans() );
+                ASSERT( s.usingEstimatedPlans() );
+                BSONObj plan = s.explain().getObjectField( "allPlans" ).firstElement().embeddedObject();
+                ASSERT_EQUALS( string( "BtreeCursor a_1" ), plan.getStringField( "cursor" ) );
+                string err;
+                ASSERT_EQUALS( 1, runCount( ns(), BSON( "query" << BSON( "a" << 5 << "b" << 1 ) ), err ) );
+                // when every plan scans everything they are all raced
+                QueryPlanSet s2( ns(), BSON( "a" << GTE << 0 << "b" << GTE << 0 ), BSONObj() );
+                ASSERT_EQUALS( 3, s2.nPlans() );
+                ASSERT( !s2.usingEstimatedPlans() );
+            }
+        };
+
+        class IndexStatsSample : public Base {
+        public:
+            void run() {
+                Helpers::ensureIndex( ns(), BSON( "a" << 1 ), "a_1" );
+                for( int i = 0; i < 10; ++i ) {
+                    BSONObj o = BSON( "a" << i / 2 );
+                    theDataFileMgr.insert( ns(), o );
+                }
+                NamespaceDetails *d = nsd();
+                IndexDetails &idx = d->indexes[ d->findIndexByName( "a_1" ) ];
+                IndexStats few( d, idx );
+                ASSERT( few.exact() );
+                ASSERT_EQUALS( 10, few.nKeys() );
+                ASSERT_EQUALS( 5, few.distinct( 1 ) );
+                ASSERT_EQUALS( 2, few.keysInRange( BSON( "" << 1 ), BSON( "" << 1 ) ) );
+                ASSERT_EQUALS( 6, few.keysInRange( BSON( "" << 4 ), BSON( "" << 2 ) ) );
+                for( int i = 0; i < 5000; ++i ) {
+                    BSONObj o = BSON( "a" << 10 + i );
+                    theDataFileMgr.insert( ns(), o );
+                }
+                IndexStats many( d, idx );
+                ASSERT( !many.exact() );
+                ASSERT( many.nSampled() <= IndexStats::SampleSize );
+                ASSERT_EQUALS( 5010, many.nKeys() );
+                long long upper = many.keysInRange( BSON( "" << 2510 ), BSON( "" << 5009 ) );
+                ASSERT( upper > 1500 && upper < 3500 );
+            }
+        };
+
+        class QueryCacheDecay : public Base {
+        public:
+            void run() {
+                NamespaceDetailsTransient &t = NamespaceDetailsTransient::get( ns() );
+                QueryPattern p = FieldBoundSet( ns(), BSON( "a" << 1 ) ).pattern();
+                t.registerIndexForPattern( p, BSON( "a" << 1 ), 1 );
+                for( int i = 0; i < 150; ++i )
+                    t.registerWriteOp( 2000 );
+                // less than a tenth of the collection has changed
+                ASSERT( !t.indexForPattern( p ).isEmpty() );
+                for( int i = 0; i < 50; ++i )
+                    t.registerWriteOp( 2000 );
+                ASSERT( t.indexForPattern( p ).isEmpty() );
+                t.registerIndexForPattern( p, BSON( "a" << 1 ), 1 );
+                for( int i = 0; i < 100; ++i )
+                    t.registerWriteOp( 10 );
+                ASSERT( t.indexForPattern( p ).isEmpty() );
+            }
+        };
+
     } // namespace QueryPlanSetTests
     
     class All : public UnitTest::Suite {
@@ -964,6 +1111,7 @@ namespace QueryOptimizerTests {
             add< FieldBoundTests::Equality >();
             add< FieldBoundTests::SimplifiedQuery >();
             add< FieldBoundTests::QueryPatternTest >();
+            add< FieldBoundTests::InIntervals >();
             add< FieldBoundTests::NoWhere >();
             add< QueryPlanTests::NoIndex >();
             add< QueryPlanTests::SimpleOrder >();
@@ -977,6 +1125,7 @@ namespace QueryOptimizerTests {
             add< QueryPlanTests::KeyMatch >();
             add< QueryPlanTests::ExactKeyQueryTypes >();
             add< QueryPlanTests::Unhelpful >();
+            add< QueryPlanTests::InBounds >();
             add< QueryPlanSetTests::NoIndexes >();
             add< QueryPlanSetTests::Optimal >();
             add< QueryPlanSetTests::NoOptimal >();
@@ -994,10 +1143,14 @@ namespace QueryOptimizerTests {
             add< QueryPlanSetTests::SaveGoodIndex >();
             add< QueryPlanSetTests::TryAllPlansOnErr >();
             add< QueryPlanSetTests::FindOne >();
+            add< QueryPlanSetTests::InQuery >();
             add< QueryPlanSetTests::Delete >();
             add< QueryPlanSetTests::DeleteOneScan >();
             add< QueryPlanSetTests::DeleteOneIndex >();
             add< QueryPlanSetTests::TryOtherPlansBeforeFinish >();
+            add< QueryPlanSetTests::EstimatedPlan >();
+            add< QueryPlanSetTests::IndexStatsSample >();
+            add< QueryPlanSetTests::QueryCacheDecay >();
         }
     };
     
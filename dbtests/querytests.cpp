@@ -23,6 +23,9 @@
 #include "../db/instance.h"
 #include "../db/json.h"
 #include "../db/lasterror.h"
+#include "../db/clientcursor.h"
+#include "../db/curop.h"
+#include "../db/scanandorder.h"
 
 #include "dbtests.h"
 
@@ -124,6 +127,138 @@ namespace QueryTests {
             ASSERT_EQUALS( 1, runCount( ns(), cmd, err ) );
         }
     };
+
+    /* exact key match counting over an index that stores normalized keys */
+    class CountNormalizedKeys {
+    public:
+        CountNormalizedKeys() {
+            dblock lk;
+            setClient( ns() );
+            BSONObj spec = BSON( "name" << "b_1" << "ns" << ns() << "key" << BSON( "b" << 1 ) << "normalizedKeys" << true );
+            theDataFileMgr.insert( "unittest.querytests_normkeys.system.indexes", spec.objdata(), spec.objsize() );
+        }
+        ~CountNormalizedKeys() {
+            dblock lk;
+            setClient( ns() );
+            string s( ns() );
+            dropNS( s );
+        }
+        void run() {
+            dblock lk;
+            setClient( ns() );
+            insert( BSON( "b" << 1 ) );
+            insert( BSON( "b" << 2 ) );
+            insert( BSON( "b" << 2 ) );
+            insert( BSON( "b" << 2 ) );
+            insert( BSON( "b" << 3 ) );
+            insert( BSON( "b" << "two" ) );
+            insert( BSON( "b" << "two" ) );
+            string err;
+            ASSERT_EQUALS( 3, runCount( ns(), BSON( "query" << BSON( "b" << 2 ) ), err ) );
+            ASSERT_EQUALS( 2, runCount( ns(), BSON( "query" << BSON( "b" << "two" ) ), err ) );
+            ASSERT_EQUALS( 1, runCount( ns(), BSON( "query" << BSON( "b" << 3 ) ), err ) );
+            ASSERT_EQUALS( 0, runCount( ns(), BSON( "query" << BSON( "b" << 7 ) ), err ) );
+        }
+    private:
+        static const char *ns() {
+            return "unittest.querytests_normkeys";
+        }
+        static void insert( const BSONObj &o ) {
+            theDataFileMgr.insert( ns(), o.objdata(), o.objsize() );
+        }
+    };
+
+    class CountYields : public Base {
+    public:
+        void run() {
+            OpScope op;
+            dblock lk;
+            setClient( ns() );
+            for( int i = 0; i < 3 * YieldTracker::Hits; ++i )
+                insert( BSON( "a" << i << "b" << 1 ) );
+            currentOp.yields = 0;
+            BSONObj cmd = fromjson( "{\"query\":{\"b\":1}}" );
+            string err;
+            ASSERT_EQUALS( 3 * YieldTracker::Hits, runCount( ns(), cmd, err ) );
+            ASSERT( currentOp.yields > 0 );
+        }
+    };
+
+    /* a count run from within another operation keeps dbMutex */
+    class NestedCountDoesntYield : public Base {
+    public:
+        void run() {
+            OpScope op;
+            dblock lk;
+            setClient( ns() );
+            for( int i = 0; i < 3 * YieldTracker::Hits; ++i )
+                insert( BSON( "a" << i << "b" << 1 ) );
+            currentOp.yields = 0;
+            BSONObj cmd = fromjson( "{\"query\":{\"b\":1}}" );
+            string err;
+            OpScope nested;
+            ASSERT_EQUALS( 3 * YieldTracker::Hits, runCount( ns(), cmd, err ) );
+            ASSERT_EQUALS( 0, currentOp.yields );
+        }
+    };
+
+    class SavedCursorDelete : public Base {
+    public:
+        void run() {
+            dblock lk;
+            setClient( ns() );
+            insert( "{\"a\":1}" );
+            insert( "{\"a\":2}" );
+            auto_ptr< Cursor > c = theDataFileMgr.findAll( ns() );
+            DiskLoc first = c->currLoc();
+            SavedCursor saved;
+            saved.save( ns(), c );
+            theDataFileMgr.deleteRecord( ns(), first.rec(), first, false );
+            c = saved.restore();
+            ASSERT( c.get() );
+            ASSERT( c->ok() );
+            ASSERT_EQUALS( 2, c->current().getIntField( "a" ) );
+        }
+    };
+
+    class SavedCursorDrop : public Base {
+    public:
+        void run() {
+            dblock lk;
+            setClient( ns() );
+            insert( "{\"a\":1}" );
+            auto_ptr< Cursor > c = theDataFileMgr.findAll( ns() );
+            SavedCursor saved;
+            saved.save( ns(), c );
+            ClientCursor::invalidate( ns() );
+            ASSERT( saved.restore().get() == 0 );
+        }
+    };
+    
+    /* getMore, killCursors and the $where check can't reach a cursor saved for a yield */
+    class SavedCursorHidden : public Base {
+    public:
+        void run() {
+            dblock lk;
+            setClient( ns() );
+            insert( "{\"a\":1}" );
+            auto_ptr< Cursor > c = theDataFileMgr.findAll( ns() );
+            unsigned clientCursors = clientCursorsById.size();
+            SavedCursor saved;
+            saved.save( ns(), c );
+            ASSERT_EQUALS( clientCursors, clientCursorsById.size() );
+            ASSERT_EQUALS( 1U, savedCursorsById.size() );
+            CursorId id = savedCursorsById.begin()->first;
+            ASSERT( ClientCursor::find( id, false ) == 0 );
+            ASSERT( ClientCursor::pin( id ) == 0 );
+            ASSERT( !ClientCursor::usesWhere( id ) );
+            ASSERT( !ClientCursor::erase( id ) );
+            c = saved.restore();
+            ASSERT( c.get() );
+            ASSERT( c->ok() );
+            ASSERT_EQUALS( 0U, savedCursorsById.size() );
+        }
+    };
     
     class ClientBase {
     public:
@@ -244,6 +379,207 @@ namespace QueryTests {
         }
     };
     
+    /* a cursor in use by one getMore is refused to a second */
+    class GetMorePinned : public ClientBase {
+    public:
+        ~GetMorePinned() {
+            client().dropCollection( "querytests.GetMorePinned" );
+        }
+        void run() {
+            const char *ns = "querytests.GetMorePinned";
+            insert( ns, BSON( "a" << 1 ) );
+            insert( ns, BSON( "a" << 2 ) );
+            insert( ns, BSON( "a" << 3 ) );
+            auto_ptr< DBClientCursor > cursor = client().query( ns, BSONObj(), 2 );
+            long long cursorId = cursor->getCursorId();
+            cursor->decouple();
+            cursor.reset();
+            ClientCursor *cc = ClientCursor::pin( cursorId );
+            ASSERT( cc );
+            ASSERT_EXCEPTION( ClientCursor::pin( cursorId ), AssertionException );
+            cc->unpin();
+            cursor = client().getMore( ns, cursorId );
+            ASSERT( cursor->more() );
+            ASSERT_EQUALS( 3, cursor->next().getIntField( "a" ) );
+        }
+    };
+    
+    class Covered : public ClientBase {
+    public:
+        ~Covered() {
+            client().dropCollection( "querytests.Covered" );
+        }
+        void run() {
+            const char *ns = "querytests.Covered";
+            client().ensureIndex( ns, BSON( "a" << 1 << "_id" << 1 ) );
+            for( int i = 0; i < 10; ++i )
+                insert( ns, BSON( "_id" << i << "a" << i * 10 << "b" << "not in the index" ) );
+            Query q( BSON( "a" << GT << 35 ) );
+            BSONObj fields = BSON( "a" << 1 );
+            ASSERT( client().findOne( ns, Query( BSON( "a" << GT << 35 ) ).explain(), &fields ).getBoolField( "covered" ) );
+            auto_ptr< DBClientCursor > c = client().query( ns, q, 0, 0, &fields );
+            int n = 0;
+            while( c->more() ) {
+                BSONObj o = c->next();
+                ASSERT_EQUALS( 4 + n, o.getIntField( "_id" ) );
+                ASSERT_EQUALS( ( 4 + n ) * 10, o.getIntField( "a" ) );
+                ASSERT( !o.hasField( "b" ) );
+                ++n;
+            }
+            ASSERT_EQUALS( 6, n );
+
+            // b has to come from the record
+            BSONObj fields2 = BSON( "a" << 1 << "b" << 1 );
+            ASSERT( !client().findOne( ns, Query( BSON( "a" << GT << 35 ) ).explain(), &fields2 ).getBoolField( "covered" ) );
+
+            // once a document has an array for a, a key no longer tells what a holds
+            insert( ns, fromjson( "{_id:20,a:[1,2]}" ) );
+            ASSERT( !client().findOne( ns, Query( BSON( "a" << GT << 35 ) ).explain(), &fields ).getBoolField( "covered" ) );
+        }
+    };
+    
+    /* results are _id and then the requested fields in the order asked for, whatever the
+       plan: from the index key, from the record for a key with a null field, or from a
+       table scan. */
+    class CoveredFieldOrder : public ClientBase {
+    public:
+        ~CoveredFieldOrder() {
+            client().dropCollection( "querytests.CoveredFieldOrder" );
+        }
+        void run() {
+            const char *ns = "querytests.CoveredFieldOrder";
+            client().ensureIndex( ns, BSON( "b" << 1 << "_id" << 1 << "a" << 1 ) );
+            for( int i = 0; i < 10; ++i )
+                insert( ns, BSON( "b" << i << "a" << i * 10 << "_id" << i ) );
+            insert( ns, BSON( "b" << 10 << "_id" << 10 ) ); // null a in the key
+            BSONObj fields = BSON( "b" << 1 << "a" << 1 );
+            ASSERT( client().findOne( ns, Query( BSON( "b" << GT << 4 ) ).explain(), &fields ).getBoolField( "covered" ) );
+            check( client().query( ns, Query( BSON( "b" << GT << 4 ) ), 0, 0, &fields ) );
+            check( client().query( ns, Query( BSON( "b" << GT << 4 ) ).hint( BSON( "$natural" << 1 ) ), 0, 0, &fields ) );
+        }
+    private:
+        static void check( auto_ptr< DBClientCursor > c ) {
+            int n = 0;
+            while( c->more() ) {
+                BSONObj o = c->next();
+                int i = o.getIntField( "_id" );
+                BSONObj expected;
+                if ( i == 10 )
+                    expected = BSON( "_id" << i << "b" << i );
+                else
+                    expected = BSON( "_id" << i << "b" << i << "a" << i * 10 );
+                ASSERT_EQUALS( 0, o.woCompare( expected ) );
+                ++n;
+            }
+            ASSERT_EQUALS( 6, n );
+        }
+    };
+
+    class ScanAndOrderLimit : public ClientBase {
+    public:
+        ~ScanAndOrderLimit() {
+            client().dropCollection( "querytests.ScanAndOrderLimit" );
+        }
+        void run() {
+            const char *ns = "querytests.ScanAndOrderLimit";
+            for( int i = 0; i < 1000; ++i )
+                insert( ns, BSON( "a" << ( i * 7 ) % 1000 ) );
+            auto_ptr< DBClientCursor > c = client().query( ns, Query().sort( "a" ), 5, 3 );
+            for( int i = 3; i < 8; ++i ) {
+                ASSERT( c->more() );
+                ASSERT_EQUALS( i, c->next().getIntField( "a" ) );
+            }
+            ASSERT( !c->more() );
+        }
+    };
+
+    /* a heap that spills to the sorter, and the sorter to disk, still honors skip and limit */
+    class ScanAndOrderSpillLimit : public ClientBase {
+    public:
+        ~ScanAndOrderSpillLimit() {
+            client().dropCollection( "querytests.ScanAndOrderSpillLimit" );
+        }
+        void run() {
+            const char *ns = "querytests.ScanAndOrderSpillLimit";
+            for( int i = 0; i < 1000; ++i )
+                insert( ns, BSON( "a" << ( i * 7 ) % 1000 ) );
+            dblock lk;
+            setClient( ns );
+            ScanAndOrder so( 3, 5, BSON( "a" << 1 ), 256, 4096 );
+            for( auto_ptr< Cursor > c = theDataFileMgr.findAll( ns ); c->ok(); c->advance() )
+                so.add( c->current(), c->currLoc() );
+            ASSERT( so.external() );
+            BufBuilder b;
+            int n;
+            so.fill( b, 0, n );
+            ASSERT_EQUALS( 5, n );
+            const char *p = b.buf();
+            for( int i = 3; i < 8; ++i ) {
+                BSONObj o( p );
+                ASSERT_EQUALS( i, o.getIntField( "a" ) );
+                p += o.objsize();
+            }
+            ASSERT_EQUALS( b.buf() + b.len(), p );
+        }
+    };
+
+    /* sorted results are returned in the first reply, which is capped at 4MB.  the sort
+       itself may be any size -- here it is the output that is too big. */
+    class ScanAndOrderTooMuchData : public ClientBase {
+    public:
+        ~ScanAndOrderTooMuchData() {
+            client().dropCollection( "querytests.ScanAndOrderTooMuchData" );
+        }
+        void run() {
+            const char *ns = "querytests.ScanAndOrderTooMuchData";
+            string big( 100 * 1024, 'x' );
+            for( int i = 0; i < 50; ++i )
+                insert( ns, BSON( "i" << i << "a" << 49 - i << "s" << big ) );
+            dblock lk;
+            setClient( ns );
+            int n;
+            BufBuilder b;
+            ASSERT_EXCEPTION( sorted( ns )->fill( b, 0, n ), AssertionException );
+
+            FieldsToReturn fields( BSON( "i" << 1 ) );
+            BufBuilder small;
+            sorted( ns )->fill( small, &fields, n );
+            ASSERT_EQUALS( 50, n );
+        }
+    private:
+        static auto_ptr< ScanAndOrder > sorted( const char *ns ) {
+            auto_ptr< ScanAndOrder > so( new ScanAndOrder( 0, 0, BSON( "a" << 1 ) ) );
+            for( auto_ptr< Cursor > c = theDataFileMgr.findAll( ns ); c->ok(); c->advance() )
+                so->add( c->current(), c->currLoc() );
+            return so;
+        }
+    };
+
+    class ScanAndOrderManyKeys : public ClientBase {
+    public:
+        ~ScanAndOrderManyKeys() {
+            client().dropCollection( "querytests.ScanAndOrderManyKeys" );
+        }
+        void run() {
+            const char *ns = "querytests.ScanAndOrderManyKeys";
+            // 1.5MB of sort keys, more than we used to allow without an index
+            string big( 1000, 'x' );
+            for( int i = 0; i < 1500; ++i ) {
+                char num[ 8 ];
+                sprintf( num, "%04d", 1499 - i );
+                insert( ns, BSON( "i" << i << "s" << string( num ) + big ) );
+            }
+            BSONObj fields = BSON( "i" << 1 );
+            auto_ptr< DBClientCursor > c = client().query( ns, Query().sort( "s" ), 0, 0, &fields );
+            int n = 0;
+            while( c->more() ) {
+                ASSERT_EQUALS( 1499 - n, c->next().getIntField( "i" ) );
+                ++n;
+            }
+            ASSERT_EQUALS( 1500, n );
+        }
+    };
+
     class ReturnOneOfManyAndTail : public ClientBase {
     public:
         ~ReturnOneOfManyAndTail() {
@@ -358,6 +694,18 @@ namespace QueryTests {
         }
     };
     
+    class MultiNonmod : public Fail {
+        void doIt() {
+            client().update( ns(), BSONObj(), fromjson( "{a:4}" ), false, true );
+        }
+    };
+
+    class PushNonArray : public Fail {
+        void doIt() {
+            update( ns(), BSONObj(), fromjson( "{$push:{a:4}}" ) );
+        }
+    };
+
     class SetBase : public ClientBase {
     public:
         ~SetBase() {
@@ -433,6 +781,128 @@ namespace QueryTests {
         }
     };
 
+    class ArrayMods : public SetBase {
+    public:
+        void run() {
+            client().insert( ns(), fromjson( "{'_id':0,a:[1]}" ) );
+            check( "{$push:{a:2}}", "{'_id':0,a:[1,2]}" );
+            check( "{$addToSet:{a:2}}", "{'_id':0,a:[1,2]}" );
+            check( "{$addToSet:{a:3}}", "{'_id':0,a:[1,2,3]}" );
+            check( "{$pull:{a:2}}", "{'_id':0,a:[1,3]}" );
+            check( "{$pull:{a:2}}", "{'_id':0,a:[1,3]}" );
+            check( "{$push:{b:'x'}}", "{'_id':0,a:[1,3],b:['x']}" );
+            check( "{$pull:{c:1}}", "{'_id':0,a:[1,3],b:['x']}" );
+        }
+    private:
+        void check( const char *mod, const char *expected ) {
+            client().update( ns(), BSON( "_id" << 0 ), fromjson( mod ) );
+            ASSERT_EQUALS( 0, client().findOne( ns(), BSONObj() ).woCompare( fromjson( expected ) ) );
+        }
+    };
+
+    class UnsetMinMax : public SetBase {
+    public:
+        void run() {
+            client().insert( ns(), fromjson( "{'_id':0,a:1,b:5,c:'x'}" ) );
+            check( "{$unset:{c:1}}", "{'_id':0,a:1,b:5}" );
+            check( "{$unset:{c:1}}", "{'_id':0,a:1,b:5}" );
+            check( "{$min:{b:3}}", "{'_id':0,a:1,b:3}" );
+            check( "{$min:{b:4}}", "{'_id':0,a:1,b:3}" );
+            check( "{$max:{b:10}}", "{'_id':0,a:1,b:10}" );
+            check( "{$max:{d:1},$inc:{e:2}}", "{'_id':0,a:1,b:10,d:1,e:2}" );
+
+            // a double bound beating an int field replaces it whole, not truncated
+            client().insert( ns(), BSON( "_id" << 1 << "i" << 5 ) );
+            client().update( ns(), BSON( "_id" << 1 ), BSON( "$min" << BSON( "i" << 4.5 ) ) );
+            BSONObj o = client().findOne( ns(), BSON( "_id" << 1 ) );
+            ASSERT_EQUALS( NumberDouble, o.getField( "i" ).type() );
+            ASSERT_EQUALS( 4.5, o.getField( "i" ).number() );
+        }
+    private:
+        void check( const char *mod, const char *expected ) {
+            client().update( ns(), BSON( "_id" << 0 ), fromjson( mod ) );
+            ASSERT_EQUALS( 0, client().findOne( ns(), BSONObj() ).woCompare( fromjson( expected ) ) );
+        }
+    };
+
+    /* a mod on an indexed field goes through DataFileMgr::update, which fixes up the keys */
+    class ModIndexedField : public SetBase {
+    public:
+        void run() {
+            client().ensureIndex( ns(), BSON( "a" << 1 ) );
+            client().insert( ns(), BSON( "_id" << 0 << "a" << 1 ) );
+            client().update( ns(), BSON( "_id" << 0 ), BSON( "$inc" << BSON( "a" << 1 ) ) );
+            ASSERT( client().findOne( ns(), QUERY( "a" << 1 ).hint( BSON( "a" << 1 ) ) ).isEmpty() );
+            ASSERT( !client().findOne( ns(), QUERY( "a" << 2 ).hint( BSON( "a" << 1 ) ) ).isEmpty() );
+        }
+    };
+
+    /* updates only recompute the keys of indexes on changed fields; make sure the ones
+       that do change are found, whether or not the update keeps the field order. */
+    class UpdateChangedIndexes : public SetBase {
+    public:
+        void run() {
+            client().ensureIndex( ns(), BSON( "a" << 1 ) );
+            client().ensureIndex( ns(), BSON( "b" << 1 ) );
+            client().ensureIndex( ns(), BSON( "c.d" << 1 ) );
+            client().insert( ns(), fromjson( "{'_id':0,a:1,b:1,c:{d:1}}" ) );
+            client().update( ns(), BSON( "_id" << 0 ), fromjson( "{'_id':0,a:1,b:2,c:{d:1}}" ) );
+            ASSERT( found( "a", 1 ) );
+            ASSERT( !found( "b", 1 ) );
+            ASSERT( found( "b", 2 ) );
+            client().update( ns(), BSON( "_id" << 0 ), fromjson( "{b:2,a:5,c:{d:1}}" ) );
+            ASSERT( !found( "a", 1 ) );
+            ASSERT( found( "a", 5 ) );
+            ASSERT( found( "b", 2 ) );
+            client().update( ns(), BSON( "_id" << 0 ), fromjson( "{$set:{c:{d:7}}}" ) );
+            ASSERT( !found( "c.d", 1 ) );
+            ASSERT( found( "c.d", 7 ) );
+            ASSERT( found( "a", 5 ) );
+        }
+    private:
+        bool found( const char *field, int val ) {
+            return !client().findOne( ns(), QUERY( field << val ).hint( BSON( field << 1 ) ) ).isEmpty();
+        }
+    };
+
+    class MultiUpdate : public SetBase {
+    public:
+        void run() {
+            for( int i = 0; i < 10; ++i )
+                client().insert( ns(), BSON( "_id" << i << "a" << i % 2 << "b" << 0 ) );
+            client().update( ns(), BSON( "a" << 1 ), BSON( "$inc" << BSON( "b" << 2 ) ), false, true );
+            ASSERT_EQUALS( 5, lastError.get()->nObjects );
+            ASSERT_EQUALS( 5U, client().count( ns(), BSON( "a" << 1 << "b" << 2 ) ) );
+            ASSERT_EQUALS( 5U, client().count( ns(), BSON( "a" << 0 << "b" << 0 ) ) );
+            client().update( ns(), BSON( "a" << 3 ), BSON( "$inc" << BSON( "b" << 2 ) ), false, true );
+            ASSERT_EQUALS( 0, lastError.get()->nObjects );
+        }
+    };
+
+    /* records that grow are moved, and must not be updated again when the cursor reaches
+       their new location. */
+    class MultiUpdateMoves : public SetBase {
+    public:
+        void run() {
+            doIt( false );
+            client().dropCollection( ns() );
+            doIt( true );
+        }
+    private:
+        void doIt( bool index ) {
+            if ( index )
+                client().ensureIndex( ns(), BSON( "a" << 1 ) );
+            for( int i = 0; i < 100; ++i )
+                client().insert( ns(), BSON( "a" << i << "s" << "x" << "n" << 0 ) );
+            string big( 200, 'y' );
+            client().update( ns(), BSON( "a" << GTE << 0 ),
+                             BSON( "$set" << BSON( "s" << big ) << "$inc" << BSON( "n" << 1 ) ), false, true );
+            ASSERT_EQUALS( 100, lastError.get()->nObjects );
+            ASSERT_EQUALS( 100U, client().count( ns(), BSON( "n" << 1 ) ) );
+            ASSERT_EQUALS( 100U, client().count( ns(), BSON( "s" << big ) ) );
+        }
+    };
+
 //    class SetRecreateDotted : public SetBase {
 //    public:
 //        void run() {
@@ -450,6 +920,12 @@ namespace QueryTests {
             add< CountFields >();
             add< CountQueryFields >();
             add< CountIndexedRegex >();
+            add< CountNormalizedKeys >();
+            add< CountYields >();
+            add< NestedCountDoesntYield >();
+            add< SavedCursorDelete >();
+            add< SavedCursorDrop >();
+            add< SavedCursorHidden >();
             add< ModId >();
             add< ModNonmodMix >();
             add< InvalidMod >();
@@ -457,8 +933,17 @@ namespace QueryTests {
             add< ModDuplicateFieldSpec >();
             add< IncNonNumber >();
             add< IncTargetNonNumber >();
+            add< MultiNonmod >();
+            add< PushNonArray >();
             add< BoundedKey >();
             add< GetMore >();
+            add< GetMorePinned >();
+            add< Covered >();
+            add< CoveredFieldOrder >();
+            add< ScanAndOrderLimit >();
+            add< ScanAndOrderSpillLimit >();
+            add< ScanAndOrderTooMuchData >();
+            add< ScanAndOrderManyKeys >();
             add< ReturnOneOfManyAndTail >();
             add< TailNotAtEnd >();
             add< EmptyTail >();
@@ -472,6 +957,12 @@ namespace QueryTests {
             add< SetStringToNumInPlace >();
             add< ModDotted >();
             add< SetInPlaceDotted >();
+            add< ArrayMods >();
+            add< UnsetMinMax >();
+            add< ModIndexedField >();
+            add< UpdateChangedIndexes >();
+            add< MultiUpdate >();
+            add< MultiUpdateMoves >();
 //            add< SetRecreateDotted >();
         }
     };
@@ -169,6 +169,41 @@ namespace ReplTests {
         }
     };
     
+    /* a batch that fails partway logs only the inserts that happened.  the first object
+       creates the collection; there is no room for the rest in one allocation */
+    class InsertBatchNoSpace : public Base {
+    public:
+        ~InsertBatchNoSpace() {
+            dblock lk;
+            setClient( smallNs() );
+            dropDatabase( smallNs() );
+        }
+        void run() {
+            vector< BSONObj > objs;
+            objs.push_back( BSON( "a" << 1 ) );
+            for( int i = 0; i < 64; ++i ) // more than the rest of the first (512k) file
+                objs.push_back( BSON( "a" << 2 << "b" << string( 10000, 'x' ) ) );
+            client()->insert( smallNs(), objs );
+            ASSERT_EQUALS( 1, smallOpCount() );
+            dblock lk;
+            setClient( smallNs() );
+            ASSERT_EQUALS( 1, nsdetails( smallNs() )->nrecords );
+        }
+    private:
+        static const char *smallNs() {
+            return "repltests_hudsonSmall.batch";
+        }
+        static int smallOpCount() {
+            dblock lk;
+            setClient( logNs() );
+            int count = 0;
+            for( auto_ptr< Cursor > c = theDataFileMgr.findAll( logNs() ); c->ok(); c->advance() )
+                if ( strcmp( c->current().getStringField( "ns" ), smallNs() ) == 0 )
+                    ++count;
+            return count;
+        }
+    };
+    
     namespace Idempotence {
         
         class Base : public ReplTests::Base {
@@ -609,12 +644,97 @@ namespace ReplTests {
             }
         };
         
+        class UpdatePush : public Base {
+        public:
+            void doIt() const {
+                client()->update( ns(), BSON( "_id" << 0 ), fromjson( "{$push:{a:5}}" ) );
+            }
+            void check() const {
+                ASSERT_EQUALS( 1, count() );
+                checkOne( fromjson( "{'_id':0,a:[4,5]}" ) );
+            }
+            void reset() const {
+                deleteAll( ns() );
+                insert( fromjson( "{'_id':0,a:[4]}" ) );
+            }
+        };
+
     } // namespace Idempotence
+
+    namespace Batch {
+
+        /* applies ops the way the pull does, rather than one at a time */
+        class Source : public ReplSource {
+        public:
+            Source() : ReplSource( BSON( "host" << "localhost" << "dbs" << BSON( "dbtests" << true ) ) ) {}
+            void applyBatch( vector< BSONObj > &batch ) {
+                sync_pullOpLog_applyBatch( batch );
+            }
+        };
+
+        class Base : public ReplTests::Base {
+        protected:
+            /* makes some changes and keeps the ops they logged, in order */
+            void logOps() {
+                client()->insert( ns(), BSON( "_id" << 1 << "a" << 1 ) );
+                client()->insert( ns(), BSON( "_id" << 2 << "a" << 2 ) );
+                client()->update( ns(), BSON( "_id" << 1 ), fromjson( "{$set:{a:3}}" ) );
+                client()->remove( ns(), BSON( "_id" << 2 ) );
+                client()->insert( ns(), BSON( "_id" << 3 << "a" << 4 ) );
+                dblock lk;
+                setClient( logNs() );
+                for( auto_ptr< Cursor > c = theDataFileMgr.findAll( logNs() ); c->ok(); c->advance() )
+                    ops_.push_back( c->current().getOwned() );
+                ASSERT_EQUALS( 5, (int) ops_.size() );
+            }
+            void checkFinal() const {
+                ASSERT_EQUALS( 2, count() );
+                checkOne( BSON( "_id" << 1 << "a" << 3 ) );
+                checkOne( BSON( "_id" << 3 << "a" << 4 ) );
+            }
+            vector< BSONObj > ops_;
+            Source source_;
+        };
+
+        class Apply : public Base {
+        public:
+            void run() {
+                logOps();
+                deleteAll( ns() );
+                int nOps = opCount();
+                source_.applyBatch( ops_ );
+                checkFinal();
+                ASSERT_EQUALS( nOps, opCount() );
+            }
+        };
+
+        /* an op that throws leaves the batch half applied.  syncedTo wasn't advanced, so the
+           next pass applies the whole batch again from the start, which must come out right */
+        class FailurePartway : public Base {
+        public:
+            void run() {
+                logOps();
+                deleteAll( ns() );
+                vector< BSONObj > failing( ops_.begin(), ops_.begin() + 3 );
+                failing.push_back( BSON( "op" << "x" << "ns" << ns() << "o" << BSONObj() ) );
+                failing.insert( failing.end(), ops_.begin() + 3, ops_.end() );
+                ASSERT_EXCEPTION( source_.applyBatch( failing ), AssertionException );
+                ASSERT_EQUALS( 2, count() );
+                checkOne( BSON( "_id" << 1 << "a" << 3 ) );
+                checkOne( BSON( "_id" << 2 << "a" << 2 ) );
+
+                source_.applyBatch( ops_ );
+                checkFinal();
+            }
+        };
+
+    } // namespace Batch
     
     class All : public UnitTest::Suite {
     public:
         All() {
             add< LogBasic >();
+            add< InsertBatchNoSpace >();
             add< Idempotence::InsertTimestamp >();
             add< Idempotence::InsertAutoId >();
             add< Idempotence::InsertWithId >();
@@ -638,6 +758,9 @@ namespace ReplTests {
             add< Idempotence::RemoveOne >();
             add< Idempotence::FailingUpdate >();
             add< Idempotence::SetNumToStr >();
+            add< Idempotence::UpdatePush >();
+            add< Batch::Apply >();
+            add< Batch::FailurePartway >();
         }
     };
     
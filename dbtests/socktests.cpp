@@ -18,6 +18,7 @@
  */
 
 #include "../util/sock.h"
+#include "../util/message.h"
 
 #include "dbtests.h"
 
@@ -31,10 +32,53 @@ namespace SockTests {
         }
     };
     
+#if !defined(_WIN32)
+    /* several requests in flight on one connection: replies come back in order, each
+       answering the right request */
+    class Pipelined {
+    public:
+        void run() {
+            int fds[ 2 ];
+            ASSERT( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == 0 );
+            SockAddr none;
+            MessagingPort client( fds[ 0 ], none );
+            MessagingPort server( fds[ 1 ], none );
+
+            MSGID ids[ 3 ];
+            for ( int i = 0; i < 3; ++i ) {
+                Message m;
+                m.setData( dbQuery, "request" );
+                client.say( m );
+                ids[ i ] = m.data->id;
+            }
+
+            for ( int i = 0; i < 3; ++i ) {
+                Message received;
+                ASSERT( server.recv( received ) );
+                ASSERT_EQUALS( ids[ i ], received.data->id );
+                // the requests behind this one were read along with it
+                ASSERT_EQUALS( i < 2, server.haveBufferedMessage() );
+                Message response;
+                response.setData( opReply, "response" );
+                server.reply( received, response );
+            }
+
+            for ( int i = 0; i < 3; ++i ) {
+                Message response;
+                ASSERT( client.recv( response ) );
+                ASSERT_EQUALS( ids[ i ], response.data->responseTo );
+            }
+        }
+    };
+#endif
+
     class All : public UnitTest::Suite {
     public:
         All() {
             add< HostByName >();
+#if !defined(_WIN32)
+            add< Pipelined >();
+#endif
         }
     };
     
@@ -21,8 +21,8 @@ namespace mongo {
 
         if ( q.fields.get() ){
             BSONObjBuilder b;
-            for ( set<string>::iterator i=q.fields->begin(); i!=q.fields->end(); i++)
-                b.append( i->c_str() , 1 );
+            for ( unsigned i=0; i<q.fields->size(); i++ )
+                b.append( (*q.fields)[i].c_str() , 1 );
             _fields = b.obj();
         }
         else {
@@ -30,8 +30,8 @@
 namespace mongo {
 
     int port = 27017;
-    const char *curNs = "";
-    Database *database = 0;
+    MONGO_TLS const char *curNs = "";
+    MONGO_TLS Database *database = 0;
     string ourHostname;
 
     string getDbContext() {
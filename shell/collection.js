@@ -32,7 +32,7 @@ DBCollection.prototype.help = function(){
     print("\tdb.foo.find(...).count()");
     print("\tdb.foo.count()");
     print("\tdb.foo.save(obj)");
-    print("\tdb.foo.update(query, object[, upsert_bool])");
+    print("\tdb.foo.update(query, object[, upsert_bool[, multi_bool]])");
     print("\tdb.foo.ensureIndex(keypattern)");
     print("\tdb.foo.dropIndexes()");
     print("\tdb.foo.dropIndex(name)");
@@ -112,10 +112,10 @@ DBCollection.prototype.remove = function( t ){
     this._mongo.remove( this._fullName , this._massageObject( t ) );
 }
 
-DBCollection.prototype.update = function( query , obj , upsert ){
+DBCollection.prototype.update = function( query , obj , upsert , multi ){
     assert( query , "need a query" );
     assert( obj , "need an object" );
-    return this._mongo.update( this._fullName , query , obj , upsert ? true : false );
+    return this._mongo.update( this._fullName , query , obj , upsert ? true : false , multi ? true : false );
 }
 
 DBCollection.prototype.save = function( obj ){
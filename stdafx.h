@@ -275,9 +275,18 @@ namespace mongo {
         char string[400];
     } *OWS;
 
+    /* thread local storage.  database and curNs are per operation, and operations holding
+       dbMutex in shared mode run concurrently.
+    */
+#if defined(_WIN32)
+#define MONGO_TLS __declspec(thread)
+#else
+#define MONGO_TLS __thread
+#endif
+
     class Database;
     //extern Database *database;
-    extern const char *curNs;
+    extern MONGO_TLS const char *curNs;
 
     /* for now, running on win32 means development not production --
        use this to log things just there.
@@ -92,10 +92,19 @@ public:
         
         int num = 0;
         
+        /* send the objects in batches, which the server inserts together */
+        vector< BSONObj > batch;
+        int batchBytes = 0;
         while ( read < mmf.length() ) {
             BSONObj o( data );
             
-            _conn.insert( ns.c_str() , o );
+            batch.push_back( o );
+            batchBytes += o.objsize();
+            if ( batch.size() >= 1000 || batchBytes > 1024 * 1024 ) {
+                _conn.insert( ns.c_str() , batch );
+                batch.clear();
+                batchBytes = 0;
+            }
             
             read += o.objsize();
             data += o.objsize();
@@ -103,6 +112,8 @@ public:
             if ( ! ( ++num % 1000 ) )
                 out() << "read " << read << "/" << mmf.length() << " bytes so far. " << num << " objects" << endl;
         }
+        if ( !batch.empty() )
+            _conn.insert( ns.c_str() , batch );
         
         out() << "\t "  << num << " objects" << endl;
     }
@@ -0,0 +1,157 @@
+// file_allocator.cpp
+
+/**
+*    Copyright (C) 2009 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "file_allocator.h"
+#include "file.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+namespace mongo {
+
+    FileAllocator theFileAllocator;
+
+    void FileAllocator::requestAllocation(const string &name, long length) {
+        boostlock lk( m_ );
+        map< string, long >::iterator i = pendingSize_.find( name );
+        if ( i != pendingSize_.end() ) {
+            i->second = max( i->second, length );
+            return;
+        }
+        if ( boost::filesystem::exists( name ) )
+            return;
+        pending_.push_back( name );
+        pendingSize_[ name ] = length;
+        changed_.notify_all();
+        if ( getState() == NotStarted )
+            go();
+    }
+
+    void FileAllocator::allocateAsap(const string &name, long length) {
+        bool requested = false;
+        {
+            boostlock lk( m_ );
+            map< string, long >::iterator i = pendingSize_.find( name );
+            if ( i != pendingSize_.end() ) {
+                i->second = max( i->second, length );
+                while ( pendingSize_.count( name ) )
+                    changed_.wait( lk );
+                requested = true;
+            }
+        }
+        /* a request already being written kept its old length, and one that failed left
+           nothing behind */
+        if ( requested && boost::filesystem::exists( name ) )
+            grow( name, length );
+        else
+            allocate( name, length );
+    }
+
+    void FileAllocator::waitIdle() {
+        boostlock lk( m_ );
+        while ( !pending_.empty() )
+            changed_.wait( lk );
+    }
+
+    void FileAllocator::run() {
+        while ( 1 ) {
+            string name;
+            long length;
+            {
+                boostlock lk( m_ );
+                while ( pending_.empty() )
+                    changed_.wait( lk );
+                name = pending_.front();
+                length = pendingSize_[ name ];
+            }
+            try {
+                allocate( name, length );
+            }
+            catch ( std::exception& e ) {
+                /* whoever needs the file will try again inline, and get the error there */
+                problem() << "FileAllocator: failed to allocate " << name << ": " << e.what() << endl;
+            }
+            boostlock lk( m_ );
+            pending_.pop_front();
+            pendingSize_.erase( name );
+            changed_.notify_all();
+        }
+    }
+
+#if defined(__linux__)
+    /* reserve the blocks without writing them, if the filesystem can */
+    static bool fastAllocate(const char *name, long length) {
+        int fd = open( name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR );
+        if ( fd < 0 )
+            return false;
+        bool ok = posix_fallocate( fd, 0, length ) == 0 && fsync( fd ) == 0;
+        close( fd );
+        return ok;
+    }
+#else
+    static bool fastAllocate(const char *name, long length) {
+        return false;
+    }
+#endif
+
+    /* write zeroes to name from offset from up to length */
+    static void writeZeroes(const string &name, long from, long length) {
+        File f;
+        f.open( name.c_str() );
+        massert( "couldn't open " + name, f.is_open() );
+        const unsigned z = 1024 * 1024;
+        vector< char > buf( z );
+        for ( long ofs = from; ofs < length && !f.bad(); ofs += z )
+            f.write( ofs, &buf[0], (unsigned) min( (long) z, length - ofs ) );
+        f.fsync();
+        massert( "error writing " + name + " - out of disk space?", !f.bad() );
+    }
+
+    void FileAllocator::allocate(const string &name, long length) {
+        if ( boost::filesystem::exists( name ) )
+            return;
+        string tmp = name + ".prealloc";
+        if ( boost::filesystem::exists( tmp ) )
+            boost::filesystem::remove( tmp ); // left by a crash
+
+        Nullstream &l = log();
+        l << "allocating new datafile " << name << ", filling with zeroes...";
+        l.flush();
+        Timer t;
+        if ( !fastAllocate( tmp.c_str(), length ) )
+            writeZeroes( tmp, 0, length );
+        boost::filesystem::rename( tmp, name );
+        l << "done " << ((double)t.millis())/1000.0 << " secs" << endl;
+    }
+
+    void FileAllocator::grow(const string &name, long length) {
+        long old = (long) boost::filesystem::file_size( name );
+        if ( old >= length )
+            return;
+        Nullstream &l = log();
+        l << "growing datafile " << name << " from " << old << " to " << length << " bytes...";
+        l.flush();
+        Timer t;
+        if ( !fastAllocate( name.c_str(), length ) )
+            writeZeroes( name, old, length );
+        l << "done " << ((double)t.millis())/1000.0 << " secs" << endl;
+    }
+
+} // namespace mongo
@@ -0,0 +1,67 @@
+// file_allocator.h
+
+/**
+*    Copyright (C) 2009 10gen Inc.
+*
+*    This program is free software: you can redistribute it and/or  modify
+*    it under the terms of the GNU Affero General Public License, version 3,
+*    as published by the Free Software Foundation.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../stdafx.h"
+#include "background.h"
+#include <boost/thread/condition.hpp>
+
+namespace mongo {
+
+    /* creates data files in the background, so that when a database needs its next file it is
+       usually already there at full length and opening it is just a map.  without this the
+       zeroing happens inline, with dbMutex held, and every client waits on it.
+
+       a file is written under <name>.prealloc and renamed when complete, so a crash can't
+       leave a short file behind under the real name.
+    */
+    class FileAllocator : public BackgroundJob {
+    public:
+        /* create name, length bytes of zeroes, when we get to it.  no-op if it exists. */
+        void requestAllocation(const string &name, long length);
+
+        /* make sure name exists and is at least length bytes: waits for a pending request for
+           it, or creates it now if there is none.  a file that already exists and had no
+           request pending is left alone. */
+        void allocateAsap(const string &name, long length);
+
+        /* wait until everything requested so far is done.  call before removing or renaming
+           data files so a file we are still working on can't reappear afterwards. */
+        void waitIdle();
+
+        /* create name, length bytes of zeroes, in the calling thread */
+        static void allocate(const string &name, long length);
+
+        /* append zeroes to name, which must exist and not be open, until it is at least
+           length bytes */
+        static void grow(const string &name, long length);
+
+    protected:
+        virtual void run();
+
+    private:
+        boost::mutex m_;
+        boost::condition changed_;       // a request was queued or finished
+        list< string > pending_;         // in order; the front one is being worked on
+        map< string, long > pendingSize_;
+    };
+
+    extern FileAllocator theFileAllocator;
+
+} // namespace mongo
@@ -219,6 +219,16 @@ namespace mongo {
     using namespace boost;
     typedef boost::mutex::scoped_lock boostlock;
 
+    /* full memory barrier, for publishing a pointer to readers that don't take a lock:
+       what was written before it is visible to other threads before anything after it. */
+    inline void memoryBarrier() {
+#if defined(_WIN32)
+        MemoryBarrier();
+#else
+        __sync_synchronize();
+#endif
+    }
+
 // simple scoped timer
     class Timer {
     public:
@@ -102,6 +102,15 @@ namespace mongo {
             return 0;
         }
 
+        /* the node holding k, or 0 */
+        Node* node(const Key& k) {
+            bool found;
+            int i = _find(k, found);
+            if ( found )
+                return &nodes[i];
+            return 0;
+        }
+
         void kill(const Key& k) {
             bool found;
             int i = _find(k, found);
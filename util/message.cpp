@@ -138,7 +138,8 @@ namespace mongo {
             (*i)->shutdown();
     }
 
-    MessagingPort::MessagingPort(int _sock, SockAddr& _far) : sock(_sock), piggyBackData(0), farEnd(_far) {
+    MessagingPort::MessagingPort(int _sock, SockAddr& _far) : sock(_sock), piggyBackData(0),
+        readBuf(0), readPos(0), readEnd(0), replyBuf(0), replyLen(0), replySize(0), heldSince(0), farEnd(_far) {
         ports.insert(this);
     }
 
@@ -146,6 +147,9 @@ namespace mongo {
         ports.insert(this);
         sock = -1;
         piggyBackData = 0;
+        readBuf = replyBuf = 0;
+        readPos = readEnd = replyLen = replySize = 0;
+        heldSince = 0;
     }
 
     void MessagingPort::shutdown() {
@@ -160,6 +164,8 @@ namespace mongo {
             delete( piggyBackData );
         shutdown();
         ports.erase(this);
+        free(readBuf);
+        free(replyBuf);
     }
 
 } // namespace mongo
@@ -237,36 +243,59 @@ namespace mongo {
         return true;
     }
 
-    bool MessagingPort::recv(Message& m) {
-again:
-        mmm( out() << "*  recv() sock:" << this->sock << endl; )
-        int len = -1;
-
-        char *lenbuf = (char *) &len;
-        int lft = 4;
-        while ( 1 ) {
-            int x = ::recv(sock, lenbuf, lft, 0);
+    /* read until at least n bytes (n <= ReadAhead) are buffered past readPos */
+    bool MessagingPort::fill(int n) {
+        if ( readBuf == 0 )
+            readBuf = (char *) malloc(ReadAhead);
+        if ( readEnd - readPos >= n )
+            return true;
+        if ( readPos + n > ReadAhead ) {
+            memmove(readBuf, readBuf + readPos, readEnd - readPos);
+            readEnd -= readPos;
+            readPos = 0;
+        }
+        while ( readEnd - readPos < n ) {
+            int x = ::recv(sock, readBuf + readEnd, ReadAhead - readEnd, 0);
             if ( x == 0 ) {
                 DEV out() << "MessagingPort recv() conn closed? " << farEnd.toString() << endl;
-                m.reset();
                 return false;
             }
             if ( x < 0 ) {
-                log() << "MessagingPort recv() error " << errno << ' ' << farEnd.toString()<<endl;
-                m.reset();
+                log() << "MessagingPort recv() error " << errno << ' ' << farEnd.toString() << endl;
                 return false;
             }
-            lft -= x;
-            if ( lft == 0 )
-                break;
-            lenbuf += x;
-            log() << "MessagingPort recv() got " << x << " bytes wanted 4, lft=" << lft << endl;
-            assert( lft > 0 );
+            readEnd += x;
         }
+        return true;
+    }
+
+    bool MessagingPort::haveBufferedMessage() const {
+        int have = readEnd - readPos;
+        if ( have < 4 )
+            return false;
+        int len = *((int *) (readBuf + readPos));
+        return len > 0 && have >= len;
+    }
+
+    bool MessagingPort::recv(Message& m) {
+again:
+        mmm( out() << "*  recv() sock:" << this->sock << endl; )
+        /* about to wait on the client, which may in turn be waiting on the replies we held.
+           a run of pipelined requests doesn't hold them longer than MaxHoldMillis either. */
+        if ( !haveBufferedMessage() ||
+             ( replyLen && curTimeMicros64() - heldSince > MaxHoldMillis * 1000 ) )
+            flushReplies();
+
+        if ( !fill(4) ) {
+            m.reset();
+            return false;
+        }
+        int len = *((int *) (readBuf + readPos));
 
         if ( len < 0 || len > 16000000 ) {
             if ( len == -1 ) {
                 // Endian check from the database, after connecting, to see what mode server is running in.
+                readPos += 4;
                 unsigned foo = 0x10203040;
                 int x = ::send(sock, (char *) &foo, 4,  portSendFlags );
                 if ( x <= 0 ) {
@@ -279,34 +308,49 @@ again:
             return false;
         }
 
-        int z = (len+1023)&0xfffffc00;
-        assert(z>=len);
-        MsgData *md = (MsgData *) malloc(z);
-        md->len = len;
-
         if ( len <= 0 ) {
             out() << "got a length of " << len << ", something is wrong" << endl;
             return false;
         }
 
-        char *p = (char *) &md->id;
-        int left = len -4;
-        while ( 1 ) {
-            int x = ::recv(sock, p, left, 0);
-            if ( x == 0 ) {
-                DEV out() << "MessagingPort::recv(): conn closed? " << farEnd.toString() << endl;
+        int z = (len+1023)&0xfffffc00;
+        assert(z>=len);
+        MsgData *md = (MsgData *) malloc(z);
+
+        if ( len <= ReadAhead ) {
+            if ( !fill(len) ) {
+                free(md);
                 m.reset();
                 return false;
             }
-            if ( x < 0 ) {
-                log() << "MessagingPort recv() error " << errno << ' ' << farEnd.toString() << endl;
-                m.reset();
-                return false;
+            memcpy(md, readBuf + readPos, len);
+            readPos += len;
+        }
+        else {
+            /* too big to stage in the read ahead buffer: take what we have, then read the
+               rest straight into the message */
+            int have = readEnd - readPos;
+            memcpy(md, readBuf + readPos, have);
+            readPos = readEnd = 0;
+            char *p = ((char *) md) + have;
+            int left = len - have;
+            while ( left > 0 ) {
+                int x = ::recv(sock, p, left, 0);
+                if ( x == 0 ) {
+                    DEV out() << "MessagingPort::recv(): conn closed? " << farEnd.toString() << endl;
+                    free(md);
+                    m.reset();
+                    return false;
+                }
+                if ( x < 0 ) {
+                    log() << "MessagingPort recv() error " << errno << ' ' << farEnd.toString() << endl;
+                    free(md);
+                    m.reset();
+                    return false;
+                }
+                left -= x;
+                p += x;
             }
-            left -= x;
-            p += x;
-            if ( left <= 0 )
-                break;
         }
 
         m.setData(md, true);
@@ -314,13 +358,62 @@ again:
     }
 
     void MessagingPort::reply(Message& received, Message& response) {
-        say(/*received.from, */response, received.data->id);
+        reply(received, response, received.data->id);
     }
 
     void MessagingPort::reply(Message& received, Message& response, MSGID responseTo) {
+        if ( haveBufferedMessage() ) {
+            response.data->id = nextMessageId();
+            response.data->responseTo = responseTo;
+            holdReply(response);
+            if ( replyLen >= MaxHeldReplies )
+                flushReplies();
+            return;
+        }
         say(/*received.from, */response, responseTo);
     }
 
+    void MessagingPort::holdReply(Message& m) {
+        int len = m.data->len;
+        if ( replyLen == 0 )
+            heldSince = curTimeMicros64();
+        if ( replyLen + len > replySize ) {
+            replySize = replySize ? replySize * 2 : 16 * 1024;
+            while ( replySize < replyLen + len )
+                replySize *= 2;
+            replyBuf = (char *) realloc(replyBuf, replySize);
+            assert( replyBuf );
+        }
+        memcpy(replyBuf + replyLen, m.data, len);
+        replyLen += len;
+    }
+
+    void MessagingPort::flushReplies() {
+        char *p = replyBuf;
+        while ( replyLen > 0 ) {
+            int x = ::send(sock, p, replyLen, portSendFlags);
+            if ( x <= 0 ) {
+                log() << "MessagingPort flushReplies send() error " << errno << ' ' << farEnd.toString() << endl;
+                replyLen = 0;
+                shutdown(); // the replies after these can't go out either
+                throw SocketException();
+            }
+            p += x;
+            replyLen -= x;
+        }
+    }
+
+    static MONGO_TLS MessagingPort *servingPort = 0;
+
+    void MessagingPort::serving(MessagingPort *p) {
+        servingPort = p;
+    }
+
+    void flushHeldReplies() {
+        if ( servingPort && servingPort->replyLen )
+            servingPort->flushReplies();
+    }
+
     bool MessagingPort::call(Message& toSend, Message& response) {
         mmm( out() << "*call()" << endl; )
         MSGID old = toSend.data->id;
@@ -351,6 +444,13 @@ again:
         toSend.data->id = msgid;
         toSend.data->responseTo = responseTo;
 
+        if ( replyLen ) {
+            /* held replies go first, and this can go in the same send() */
+            holdReply( toSend );
+            flushReplies();
+            return;
+        }
+
         int x = -100;
 
         if ( piggyBackData && piggyBackData->len() ) {
@@ -61,6 +61,8 @@ namespace mongo {
            also, the Message data will go out of scope on the subsequent recv call.
         */
         bool recv(Message& m);
+        /* a reply is held back while another request is already waiting, and goes out in the
+           same send() as the replies after it -- or sooner, see flushHeldReplies(). */
         void reply(Message& received, Message& response, MSGID responseTo);
         void reply(Message& received, Message& response);
         bool call(Message& toSend, Message& response);
@@ -68,15 +70,48 @@ namespace mongo {
 
         void piggyBack( Message& toSend , int responseTo = -1 );
 
+        /* true if a whole message has already been read off the socket: the peer is
+           pipelining requests. */
+        bool haveBufferedMessage() const;
+
+        /* the current thread answers the requests from p (0: none).  see flushHeldReplies(). */
+        static void serving(MessagingPort *p);
+
+        enum {
+            ReadAhead = 64 * 1024,          // most we read past the message being returned
+            MaxHeldReplies = 1024 * 1024,   // send held replies once they reach this size
+            MaxHoldMillis = 2               // or once the first has waited this long
+        };
+
     private:
+        bool fill(int n);
+        void holdReply(Message& m);
+        void flushReplies();
+        friend void flushHeldReplies();
+
         int sock;
         PiggyBackData * piggyBackData;
+
+        /* read ahead.  bytes past readPos are the start of messages not yet returned by recv.
+           we stop reading once the buffer is full, so a client that sends faster than we
+           process is held back by TCP flow control. */
+        char *readBuf;
+        int readPos, readEnd;
+
+        char *replyBuf;
+        int replyLen, replySize;
+        unsigned long long heldSince; // curTimeMicros64() when the first held reply was held
     public:
         SockAddr farEnd;
 
         friend class PiggyBackData;
     };
 
+    /* send the replies the current thread's port (MessagingPort::serving()) has held back.
+       called before the thread may wait for dbMutex, and after it yields dbMutex in a long
+       operation -- so the reply to a fast request doesn't wait on the slow one behind it. */
+    void flushHeldReplies();
+
     //#pragma pack()
 #pragma pack(1)
 
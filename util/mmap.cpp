@@ -18,20 +18,210 @@
 
 #include "stdafx.h"
 #include "mmap.h"
+#include <boost/thread/condition.hpp>
 
 namespace mongo {
 
+    /* files are opened by readers holding dbMutex shared too (Database::getFile() only
+       serializes per database), so mmfiles has its own mutex */
     set<MemoryMappedFile*> mmfiles;
+    static boost::mutex mmfilesMutex;
+
+    /* open views by start address.  written under viewsMutex; find() reads it without, which
+       is safe as long as nothing is being opened or closed (see mmap.h). */
+    typedef std::map<char*, MemoryMappedFile*> ViewMap; // MemoryMappedFile::map hides map
+    static ViewMap views;
+    static boost::mutex viewsMutex;
+    static boost::condition flushed; // some file's _flushing went down
+
+    void (*MemoryMappedFile::closing)(MemoryMappedFile *) = 0;
+    bool MemoryMappedFile::copyOnWrite = false;
 
     MemoryMappedFile::~MemoryMappedFile() {
         close();
+        boostlock lk(mmfilesMutex);
         mmfiles.erase(this);
     }
 
     void MemoryMappedFile::created(){
+        boostlock lk(mmfilesMutex);
         mmfiles.insert(this);
     }
 
+    void MemoryMappedFile::mapped(const char *filename) {
+        _filename = filename;
+        boostlock lk(viewsMutex);
+        views[(char *) view] = this;
+    }
+
+    void MemoryMappedFile::unmapping() {
+        if ( closing )
+            closing(this);
+        boostlock lk(viewsMutex);
+        while ( _flushing )
+            flushed.wait(lk);
+        views.erase((char *) view);
+    }
+
+    MemoryMappedFile* MemoryMappedFile::find(const void *p) {
+        ViewMap::iterator i = views.upper_bound((char *) p);
+        if ( i == views.begin() )
+            return 0;
+        --i;
+        MemoryMappedFile *f = i->second;
+        if ( (char *) p >= i->first + f->len )
+            return 0;
+        return f;
+    }
+
+    void MemoryMappedFile::flushAll(bool sync) {
+        flushAllPaced(sync, 0x7fffffff, 0);
+    }
+
+    void MemoryMappedFile::remapPrivateViews() {
+        if ( !copyOnWrite )
+            return;
+        boostlock lk(viewsMutex);
+        for ( ViewMap::iterator i = views.begin(); i != views.end(); ++i )
+            i->second->remapPrivateView();
+    }
+
+    long long MemoryMappedFile::findUnwrittenChanges(vector< pair< char *, unsigned > >& diffs) {
+        if ( !copyOnWrite )
+            return 0;
+        const int z = 1024 * 1024;
+        vector<char> buf(z);
+        boostlock lk(viewsMutex);
+        long long n = 0;
+        for ( ViewMap::iterator i = views.begin(); i != views.end(); ++i ) {
+            MemoryMappedFile *f = i->second;
+            vector< pair< int, int > > ranges;
+            if ( !f->copiedPages(ranges) ) {
+                ranges.clear();
+                ranges.push_back( make_pair( 0, f->len ) );
+            }
+            for ( vector< pair< int, int > >::iterator r = ranges.begin(); r != ranges.end(); ++r ) {
+                for ( int ofs = r->first; ofs < r->first + r->second; ofs += z ) {
+                    int len = min(z, r->first + r->second - ofs);
+                    f->compareWithFile(ofs, len, &buf[0], diffs);
+                    n += len;
+                }
+            }
+        }
+        return n;
+    }
+
+    /* by page, which is the unit copy-on-write works in anyway */
+    void MemoryMappedFile::compareWithFile(int ofs, int n, char *buf, vector< pair< char *, unsigned > >& diffs) {
+        char *v = (char *) view + ofs;
+        if ( !readFile(ofs, buf, n) ) {
+            problem() << "couldn't read " << _filename << " to check it" << endl;
+            return;
+        }
+        if ( memcmp(buf, v, n) == 0 )
+            return;
+        const int page = 4096;
+        for ( int i = 0; i < n; i += page ) {
+            int m = min(page, n - i);
+            if ( memcmp(buf + i, v + i, m) == 0 )
+                continue;
+            if ( !diffs.empty() && diffs.back().first + diffs.back().second == v + i )
+                diffs.back().second += m;
+            else
+                diffs.push_back( make_pair( v + i, (unsigned) m ) );
+        }
+    }
+
+    long long MemoryMappedFile::flushAllPaced(bool sync, int chunk, int pauseMillis) {
+        long long n = 0;
+        char *next = 0; // resume at the first view at or after next, ofs bytes in
+        int ofs = 0;
+        while ( 1 ) {
+            MemoryMappedFile *f;
+            int from, len;
+            {
+                boostlock lk(viewsMutex);
+                ViewMap::iterator i = views.lower_bound(next);
+                if ( i == views.end() )
+                    break;
+                if ( i->first != next )
+                    ofs = 0;
+                f = i->second;
+                from = ofs;
+                len = min(chunk, f->len - ofs);
+                f->_flushing++; // f can't be unmapped until we are done with it
+                ofs += len;
+                next = i->first;
+                if ( ofs >= f->len ) {
+                    next++;
+                    ofs = 0;
+                }
+            }
+            if ( len > 0 )
+                f->flush(sync, from, len);
+            n += len;
+            {
+                boostlock lk(viewsMutex);
+                f->_flushing--;
+                flushed.notify_all();
+            }
+            if ( pauseMillis )
+                sleepmillis(pauseMillis);
+        }
+        return n;
+    }
+
+    /* FileFlusher ------------------------------------------------------------ */
+
+    int FileFlusher::syncDelay = 60;
+    long long FileFlusher::dirtyThreshold = 256 * 1024 * 1024;
+    volatile long long FileFlusher::dirty = 0;
+    boost::mutex FileFlusher::statsMutex;
+    FileFlusher::Stats FileFlusher::stats_;
+    void (*FileFlusher::checkpoint)() = 0;
+
+    void FileFlusher::run() {
+        time_t last = time(0);
+        while ( 1 ) {
+            sleepmillis(100);
+            if ( time(0) - last < syncDelay && dirty < dirtyThreshold )
+                continue;
+            long long bytes = dirty;
+            dirty = 0;
+            try {
+                Timer t;
+                if ( checkpoint )
+                    checkpoint();
+                else
+                    bytes = MemoryMappedFile::flushAllPaced(true, Chunk, PauseMillis);
+                int ms = t.millis();
+                last = time(0);
+                boostlock lk(statsMutex);
+                stats_.flushes++;
+                stats_.totalMillis += ms;
+                stats_.lastMillis = ms;
+                stats_.lastBytes = bytes;
+                stats_.lastFinished = last;
+                log(1) << "flushed " << bytes / 1024 / 1024 << "MB of data files in " << ms << "ms" << endl;
+            }
+            catch ( std::exception& e ) {
+                problem() << "exception in FileFlusher: " << e.what() << endl;
+                last = time(0);
+            }
+        }
+    }
+
+    void FileFlusher::start() {
+        if ( syncDelay <= 0 )
+            return;
+        boost::thread t( run );
+    }
+
+    FileFlusher::Stats FileFlusher::stats() {
+        boostlock lk(statsMutex);
+        return stats_;
+    }
+
     /*static*/
     int closingAllFiles = 0;
     void MemoryMappedFile::closeAllFiles( stringstream &message ) {
@@ -40,6 +230,7 @@ namespace mongo {
             return;
         }
         ++closingAllFiles;
+        boostlock lk(mmfilesMutex);
         for ( set<MemoryMappedFile*>::iterator i = mmfiles.begin(); i != mmfiles.end(); i++ )
             (*i)->close();
         message << "  closeAllFiles() finished" << endl;
@@ -36,6 +36,9 @@ namespace mongo {
 
         void flush(bool sync);
 
+        /* flush [ofs, ofs+n) of the view.  ofs must be a multiple of the page size. */
+        void flush(bool sync, int ofs, int n);
+
         void* viewOfs() {
             return view;
         }
@@ -46,13 +49,105 @@ namespace mongo {
 
         void updateLength( const char *filename, int &length ) const;
 
+        const string& filename() const {
+            return _filename;
+        }
+
+        /* the open file whose view contains p, or 0.  files are only opened and closed with
+           dbMutex held, so with it held exclusively the answer can't change under you. */
+        static MemoryMappedFile* find(const void *p);
+
+        /* flush every open file */
+        static void flushAll(bool sync);
+
+        /* flush every open file chunk bytes at a time, sleeping pauseMillis between chunks
+           so the writeback doesn't starve reads.  returns the number of bytes covered.
+           viewsMutex is only held to pick the next chunk, so opening and closing files
+           (under dbMutex) never wait for more than one chunk's sync. */
+        static long long flushAllPaced(bool sync, int chunk, int pauseMillis);
+
+        /* if set, called just before a file is unmapped */
+        static void (*closing)(MemoryMappedFile *);
+
+        /* map files opened from now on copy-on-write: changes to a view are never written to
+           the file.  set by the journal, which writes them itself. */
+        static bool copyOnWrite;
+
+        /* map every copy-on-write view again at the same address, which drops the pages
+           copied so far.  the files must already hold what the views do.  dbMutex must be
+           held exclusively. */
+        static void remapPrivateViews();
+
+        /* compare the pages of the copy-on-write views that have been copied with their files,
+           and add the stretches of view that differ to diffs.  those are changes nothing will
+           write to the file.  a view whose copied pages the kernel won't tell us is compared
+           whole.  dbMutex must be held exclusively.  returns the number of bytes compared. */
+        static long long findUnwrittenChanges(vector< pair< char *, unsigned > >& diffs);
+
     private:
         void created();
+        void mapped(const char *filename);
+        void unmapping();
+        void remapPrivateView();
+        bool readFile(int ofs, char *buf, int n);
+        /* the pages of a copy-on-write view that have been copied since it was mapped, as
+           [ofs, ofs+len) stretches.  false if we can't tell. */
+        bool copiedPages(vector< pair< int, int > >& ranges);
+        void compareWithFile(int ofs, int n, char *buf, vector< pair< char *, unsigned > >& diffs);
         
         HANDLE fd;
         HANDLE maphandle;
         void *view;
         int len;
+        string _filename;
+        int _flushing; // flushAllPaced() calls syncing part of the view.  close waits for 0
+    };
+
+    /* flushes the data files in the background every syncDelay seconds, or sooner if an
+       estimate of what has been changed since the last pass passes dirtyThreshold.  left to
+       itself the kernel writes back in bursts that can stall us for seconds.
+
+       when checkpoint is set (by the journal) it is called instead of flushing the views:
+       they are then copy-on-write, and the data files may only be synced at journal commit
+       boundaries, which the journal's checkpoint takes care of. */
+    class FileFlusher {
+    public:
+        enum {
+            Chunk = 8 * 1024 * 1024,
+            PauseMillis = 5
+        };
+
+        static int syncDelay;               // secs, --syncdelay.  0 turns the flusher off
+        static long long dirtyThreshold;    // bytes
+
+        /* len bytes of a mapped file were changed.  callers hold dbMutex exclusively. */
+        static void noteDirty(unsigned len) {
+            dirty += len;
+        }
+
+        static void start();
+
+        static void (*checkpoint)();
+
+        struct Stats {
+            Stats() : flushes(), totalMillis(), lastMillis(), lastBytes(), lastFinished() { }
+            long long flushes;
+            long long totalMillis;
+            int lastMillis;
+            long long lastBytes;
+            time_t lastFinished;
+        };
+        static Stats stats();
+
+        static long long dirtyEstimate() {
+            return dirty;
+        }
+
+    private:
+        static void run();
+        static volatile long long dirty;
+        static boost::mutex statsMutex;
+        static Stats stats_;
     };
 
 
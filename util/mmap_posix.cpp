@@ -32,12 +32,15 @@ namespace mongo {
         maphandle = 0;
         view = 0;
         len = 0;
+        _flushing = 0;
         created();
     }
 
     void MemoryMappedFile::close() {
-        if ( view )
+        if ( view ) {
+            unmapping();
             munmap(view, len);
+        }
         view = 0;
 
         if ( fd )
@@ -89,19 +92,88 @@ namespace mongo {
                 write(fd, buf, z);
                 left -= z;
             }
+            /* the zeroes must be on disk before anything journaled against this file */
+            fsync(fd);
             l << "done " << ((double)t.millis())/1000.0 << " secs" << endl;
         }
 
-        view = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        view = mmap(NULL, length, PROT_READ|PROT_WRITE, copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
         if ( view == MAP_FAILED ) {
             out() << "  mmap() failed for " << filename << " len:" << length << " errno:" << errno << endl;
+            view = 0;
             return 0;
         }
+        mapped(filename);
         return view;
     }
 
+    bool MemoryMappedFile::readFile(int ofs, char *buf, int n) {
+        return pread(fd, buf, n, ofs) == n;
+    }
+
+#if defined(__linux__)
+    /* /proc/self/pagemap has 8 bytes per page of our address space.  a page of a private file
+       mapping that is present but no longer file backed (bit 61), or that is swapped out
+       (bit 62), is one we copied by writing to it. */
+    bool MemoryMappedFile::copiedPages(vector< pair< int, int > >& ranges) {
+        const int page = 4096;
+        if ( view == 0 || getpagesize() != page )
+            return false;
+        int pm = ::open("/proc/self/pagemap", O_RDONLY);
+        if ( pm < 0 )
+            return false;
+        const unsigned long long Present = 1ULL << 63, Swapped = 1ULL << 62, FileBacked = 1ULL << 61;
+        off_t first = ( (unsigned long) view / page ) * sizeof(unsigned long long);
+        int nPages = ( len + page - 1 ) / page;
+        const int chunk = 64 * 1024;
+        vector< unsigned long long > e( chunk );
+        bool ok = true;
+        for ( int p = 0; p < nPages && ok; p += chunk ) {
+            int n = min(chunk, nPages - p);
+            ssize_t want = n * sizeof(unsigned long long);
+            if ( pread(pm, &e[0], want, first + p * sizeof(unsigned long long)) != want ) {
+                ok = false;
+                break;
+            }
+            for ( int i = 0; i < n; i++ ) {
+                bool copied = ( ( e[i] & Present ) && !( e[i] & FileBacked ) ) || ( e[i] & Swapped );
+                if ( !copied )
+                    continue;
+                int ofs = ( p + i ) * page;
+                int m = min(page, len - ofs);
+                if ( !ranges.empty() && ranges.back().first + ranges.back().second == ofs )
+                    ranges.back().second += m;
+                else
+                    ranges.push_back( make_pair( ofs, m ) );
+            }
+        }
+        ::close(pm);
+        return ok;
+    }
+#else
+    bool MemoryMappedFile::copiedPages(vector< pair< int, int > >& ranges) {
+        return false;
+    }
+#endif
+
+    void MemoryMappedFile::remapPrivateView() {
+        void *p = mmap(view, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0);
+        if ( p != view ) {
+            /* the old view is gone either way, and there are pointers into it everywhere.
+               everything is in the journal, so just stop. */
+            problem() << "remapping " << _filename << " failed errno:" << errno << " terminating" << endl;
+            exit(-3);
+        }
+    }
+
     void MemoryMappedFile::flush(bool sync) {
-        if ( msync(view, len, sync ? MS_SYNC : MS_ASYNC) )
+        flush(sync, 0, len);
+    }
+
+    void MemoryMappedFile::flush(bool sync, int ofs, int n) {
+        if ( view == 0 )
+            return;
+        if ( msync((char *) view + ofs, n, sync ? MS_SYNC : MS_ASYNC) )
             problem() << "msync error " << errno << endl;
     }
     
@@ -26,12 +26,15 @@ namespace mongo {
         fd = 0;
         maphandle = 0;
         view = 0;
+        _flushing = 0;
         created();
     }
 
     void MemoryMappedFile::close() {
-        if ( view )
+        if ( view ) {
+            unmapping();
             UnmapViewOfFile(view);
+        }
         view = 0;
         if ( maphandle )
             CloseHandle(maphandle);
@@ -87,17 +90,54 @@ namespace mongo {
             return 0;
         }
 
-        view = MapViewOfFile(maphandle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        view = MapViewOfFile(maphandle, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_ALL_ACCESS, 0, 0, 0);
         if ( view == 0 ) {
             out() << "MapViewOfFile failed " << filename << " errno:";
             out() << GetLastError();
             out() << endl;
         }
+        else {
+            len = length;
+            mapped(filename);
+        }
 
         return view;
     }
 
-    void MemoryMappedFile::flush(bool) {
+    bool MemoryMappedFile::readFile(int ofs, char *buf, int n) {
+        OVERLAPPED o;
+        memset(&o, 0, sizeof(o));
+        o.Offset = ofs;
+        DWORD got;
+        return ReadFile(fd, buf, n, &got, &o) && got == (DWORD) n;
+    }
+
+    bool MemoryMappedFile::copiedPages(vector< pair< int, int > >& ranges) {
+        return false;
+    }
+
+    void MemoryMappedFile::remapPrivateView() {
+        /* there is no MAP_FIXED: unmap, then ask for the same address back */
+        UnmapViewOfFile(view);
+        void *p = MapViewOfFileEx(maphandle, FILE_MAP_COPY, 0, 0, 0, view);
+        if ( p != view ) {
+            problem() << "remapping " << _filename << " failed " << GetLastError() << " terminating" << endl;
+            exit(-3);
+        }
+    }
+
+    void MemoryMappedFile::flush(bool sync) {
+        flush(sync, 0, len);
+    }
+
+    void MemoryMappedFile::flush(bool sync, int ofs, int n) {
+        if ( view == 0 )
+            return;
+        if ( !FlushViewOfFile((char *) view + ofs, n) )
+            out() << "FlushViewOfFile failed " << GetLastError() << endl;
+        /* FlushViewOfFile only queues the writes */
+        if ( sync && ofs + n >= len && !FlushFileBuffers(fd) )
+            out() << "FlushFileBuffers failed " << GetLastError() << endl;
     }
 
 } 
@@ -17,27 +17,33 @@
  *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <boost/thread/tss.hpp>
+
 namespace mongo {
 
-// No two functions of this class may be called concurrently.
+// The namespace being timed is per thread, as readers holding dbMutex shared run
+// concurrently.  Usage totals are guarded by mutex_.
 class Top {
 public:
     typedef boost::posix_time::ptime T;
     typedef boost::posix_time::time_duration D;
     static void clientStart( const char *client ) {
         clientStop();
-        currentStart_ = currentTime();
-        current_ = client;
+        Current &c = current();
+        c.start = currentTime();
+        c.ns = client;
     }
     static void clientStop() {
-        if ( currentStart_ == T() )
+        Current &c = current();
+        if ( c.start == T() )
             return;
-        D d = currentTime() - currentStart_;
-        recordUsage( current_, d );
-        currentStart_ = T();
+        D d = currentTime() - c.start;
+        recordUsage( c.ns, d );
+        c.start = T();
     }
     struct Usage { string ns; D time; double pct; int calls; };
     static void usage( vector< Usage > &res ) {
+        boostlock lk( mutex_ );
         // Populate parent namespaces
         UsageMap snapshot;
         UsageMap totalUsage;
@@ -67,6 +73,7 @@ public:
         }
     }
     static void completeSnapshot() {
+        boostlock lk( mutex_ );
         if ( &snapshot_ == &snapshotA_ ) {
             snapshot_ = snapshotB_;
             nextSnapshot_ = snapshotA_;
@@ -84,6 +91,7 @@ private:
         return boost::posix_time::microsec_clock::universal_time();
     }
     static void recordUsage( const string &client, D duration ) {
+        boostlock lk( mutex_ );
         totalUsage_[ client ].first += duration;
         totalUsage_[ client ].second++;
         nextSnapshot_[ client ].first += duration;
@@ -93,7 +101,7 @@ private:
         for( UsageMap::const_iterator i = from.begin(); i != from.end(); ++i ) {
             string current = i->first;
             size_t dot = current.rfind( "." );
-            if ( dot == string::npos || dot != current_.length() - 1 ) {
+            if ( dot == string::npos || dot != current.length() - 1 ) {
                 to[ current ].first += i->second.first;
                 to[ current ].second += i->second.second;
             }
@@ -106,8 +114,17 @@ private:
         }        
     }
     struct more { bool operator()( const D &a, const D &b ) { return a > b; } };
-    static string current_;
-    static T currentStart_;
+    struct Current { string ns; T start; };
+    static Current &current() {
+        Current *c = current_.get();
+        if ( c == 0 ) {
+            c = new Current();
+            current_.reset( c );
+        }
+        return *c;
+    }
+    static boost::thread_specific_ptr< Current > current_;
+    static boost::mutex mutex_;
     static T snapshotStart_;
     static D snapshotDuration_;
     static UsageMap totalUsage_;
@@ -85,8 +85,8 @@ namespace mongo {
         }
     } utilTest;
     
-    string Top::current_;
-    Top::T Top::currentStart_;
+    boost::thread_specific_ptr< Top::Current > Top::current_;
+    boost::mutex Top::mutex_;
     Top::T Top::snapshotStart_ = Top::currentTime();
     Top::D Top::snapshotDuration_;
     Top::UsageMap Top::totalUsage_;